@@ -16,6 +16,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
 
@@ -23,6 +24,11 @@ static char * _argv_0;
 static char * _file;
 
 void doit(int fd) {
+	/* Have the kernel move the data if it can, and do it ourselves if not */
+	ssize_t s;
+	while ((s = sendfile(STDOUT_FILENO, fd, NULL, CHUNK_SIZE * 16)) > 0);
+	if (!s) return;
+
 	while (1) {
 		char buf[CHUNK_SIZE];
 		memset(buf, 0, CHUNK_SIZE);
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
 
@@ -46,6 +47,13 @@ static int copy_file(char * source, char * dest, int mode,int uid, int gid) {
 
 	//fprintf(stderr, "%d bytes to copy\n", length);
 
+	/* Have the kernel move the data if it can */
+	while (length > 0) {
+		ssize_t r = sendfile(d_fd, s_fd, NULL, length);
+		if (r <= 0) break;
+		length -= r;
+	}
+
 	char buf[CHUNK_SIZE];
 
 	while (length > 0) {
@@ -0,0 +1,123 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * exec-bench - Measure how long it takes to start programs.
+ *
+ * Runs each command repeatedly, waiting for it to exit each
+ * time, and reports the average and best wall-clock times.
+ * With no commands, runs bim and kuroko, which are large
+ * enough for loading costs to show.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static char * default_commands[] = {
+	"/bin/bim --version",
+	"/bin/kuroko --version",
+	NULL,
+};
+
+static long elapsed(struct timeval * start, struct timeval * end) {
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+static int run_once(char ** args, long * out) {
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	pid_t pid = fork();
+	if (pid < 0) return 1;
+	if (!pid) {
+		/* Keep the output from getting in the way of the results */
+		freopen("/dev/null", "w", stdout);
+		execvp(args[0], args);
+		_exit(127);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	gettimeofday(&end, NULL);
+
+	*out = elapsed(&start, &end);
+	return WEXITSTATUS(status) == 127;
+}
+
+static int bench(char * command, int count) {
+	char * copy = strdup(command);
+	char * args[32];
+	int argc = 0;
+	char * save;
+	for (char * tok = strtok_r(copy, " ", &save); tok && argc < 31; tok = strtok_r(NULL, " ", &save)) {
+		args[argc++] = tok;
+	}
+	args[argc] = NULL;
+
+	if (!argc) {
+		free(copy);
+		return 0;
+	}
+
+	long total = 0;
+	long best = -1;
+	for (int i = 0; i < count; ++i) {
+		long t;
+		if (run_once(args, &t)) {
+			fprintf(stderr, "exec-bench: failed to run '%s'\n", command);
+			free(copy);
+			return 1;
+		}
+		total += t;
+		if (best < 0 || t < best) best = t;
+	}
+
+	fprintf(stdout, "%-32s %6d runs  avg %8ldus  best %8ldus\n", command, count, total / count, best);
+	free(copy);
+	return 0;
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-n COUNT] [COMMAND...]\n"
+		"\n"
+		"Start each COMMAND (a quoted command line) COUNT times and\n"
+		"report how long it takes to run. Defaults to bim and kuroko.\n"
+		"\n"
+		" -n COUNT   number of runs per command (default 20)\n"
+		" -?         show this help text\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int count = 20;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:?")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = atoi(optarg);
+				if (count < 1) count = 1;
+				break;
+			case '?':
+				usage(argv);
+				return 1;
+		}
+	}
+
+	int ret = 0;
+	if (optind < argc) {
+		for (int i = optind; i < argc; ++i) {
+			ret |= bench(argv[i], count);
+		}
+	} else {
+		for (char ** c = default_commands; *c; ++c) {
+			ret |= bench(*c, count);
+		}
+	}
+
+	return ret;
+}
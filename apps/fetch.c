@@ -14,6 +14,8 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 
 #include <toaru/hashmap.h>
@@ -238,8 +240,8 @@ int http_fetch(FILE * f) {
 	gettimeofday(&fetch_options.start, NULL);
 
 	while (bytes_to_read > 0) {
-		char buf[1024];
-		size_t r = fread(buf, 1, bytes_to_read < 1024 ? bytes_to_read : 1024, f);
+		char buf[4096];
+		size_t r = fread(buf, 1, bytes_to_read < 4096 ? bytes_to_read : 4096, f);
 		fwrite(buf, 1, r, fetch_options.out);
 		fetch_options.size += r;
 		print_progress(0);
@@ -373,9 +375,9 @@ int main(int argc, char * argv[]) {
 
 		out_size += strlen(fetch_options.upload_file);
 
-		fseek(in_file, 0, SEEK_END);
-		out_size += ftell(in_file);
-		fseek(in_file, 0, SEEK_SET);
+		struct stat st;
+		fstat(fileno(in_file), &st);
+		out_size += st.st_size;
 
 		fprintf(f,
 			"POST /%s HTTP/1.0\r\n"
@@ -393,6 +395,12 @@ int main(int argc, char * argv[]) {
 				"Content-Type: application/octet-stream\r\n"
 				"\r\n", boundary_fuzz, fetch_options.upload_file);
 
+		/* Send the file straight from the kernel unless we're pacing the upload */
+		fflush(f);
+		if (!fetch_options.slow_upload) {
+			while (sendfile(fileno(f), fileno(in_file), NULL, 4096) > 0);
+		}
+
 		while (!feof(in_file)) {
 			char buf[1024];
 			size_t r = fread(buf, 1, 1024, in_file);
@@ -0,0 +1,220 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * http-bench - A minimal HTTP server, and a client to load it.
+ *
+ * With -l, listens on a port and answers every request with a small
+ * fixed page, one connection per request. Otherwise makes a number of
+ * requests to a server, each on a new connection, and reports how
+ * many it managed per second. Under QEMU user networking, forward a
+ * port to the guest with hostfwd=tcp::8080-:8080 and run something
+ * like
+ *
+ *     ab -n 10000 -c 16 http://localhost:8080/
+ *
+ * on the host against the server.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static char * host = "10.0.2.2";
+static int port = 8080;
+static int requests = 1000;
+static int page_size = 128;
+static int listening = 0;
+
+static long elapsed(struct timeval * start, struct timeval * end) {
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+/**
+ * Read until the blank line that ends a request's headers, or the
+ * connection closes. We never look at what was asked for.
+ */
+static int read_request(int sock) {
+	char buf[1024];
+	size_t have = 0;
+	while (1) {
+		ssize_t r = recv(sock, buf + have, sizeof(buf) - have - 1, 0);
+		if (r <= 0) return -1;
+		have += r;
+		buf[have] = '\0';
+		if (strstr(buf, "\r\n\r\n")) return 0;
+		if (have == sizeof(buf) - 1) {
+			/* Keep the tail in case the terminator straddles reads */
+			memmove(buf, buf + have - 3, 3);
+			have = 3;
+		}
+	}
+}
+
+static int send_all(int sock, const char * data, size_t len) {
+	while (len) {
+		ssize_t w = send(sock, data, len, 0);
+		if (w <= 0) return -1;
+		data += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static int serve(void) {
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if (bind(server, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) {
+		perror("bind");
+		return 1;
+	}
+
+	if (listen(server, 128) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	char * page = malloc(page_size);
+	memset(page, 'x', page_size);
+	char header[128];
+	size_t header_len = snprintf(header, sizeof(header),
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: %d\r\n"
+		"Connection: close\r\n"
+		"\r\n", page_size);
+
+	fprintf(stderr, "http-bench: listening on port %d\n", port);
+
+	unsigned long served = 0;
+	while (1) {
+		int client = accept(server, NULL, NULL);
+		if (client < 0) {
+			perror("accept");
+			break;
+		}
+		if (!read_request(client)) {
+			/* Header and page in one call, so they can share a segment */
+			struct iovec iov[2] = {
+				{ header, header_len },
+				{ page, page_size },
+			};
+			if (writev(client, iov, 2) == (ssize_t)(header_len + page_size)) served++;
+		}
+		close(client);
+	}
+
+	fprintf(stderr, "http-bench: served %lu requests\n", served);
+	close(server);
+	free(page);
+	return 0;
+}
+
+static int fetch(struct sockaddr_in * addr) {
+	static const char request[] = "GET / HTTP/1.0\r\nHost: bench\r\n\r\n";
+	char buf[4096];
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+
+	if (connect(sock, (struct sockaddr*)addr, sizeof(struct sockaddr_in)) < 0 || send_all(sock, request, sizeof(request) - 1)) {
+		close(sock);
+		return -1;
+	}
+
+	ssize_t r;
+	size_t total = 0;
+	while ((r = recv(sock, buf, sizeof(buf), 0)) > 0) total += r;
+	close(sock);
+
+	return (r < 0 || !total) ? -1 : 0;
+}
+
+static int load(char * argv[]) {
+	struct hostent * remote = gethostbyname(host);
+	if (!remote) {
+		fprintf(stderr, "%s: %s: could not resolve\n", argv[0], host);
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	memcpy(&addr.sin_addr.s_addr, remote->h_addr, remote->h_length);
+	addr.sin_port = htons(port);
+
+	struct timeval start, end;
+	int failures = 0;
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < requests; ++i) {
+		if (fetch(&addr)) failures++;
+	}
+	gettimeofday(&end, NULL);
+
+	long t = elapsed(&start, &end);
+	fprintf(stdout, "%d requests (%d failed) in %ldus, %ld requests/s\n", requests, failures,
+		t, t ? (long)((requests - failures) * 1000000L / t) : 0);
+
+	return failures ? 1 : 0;
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s -l [-p PORT] [-s SIZE]\n"
+		"       %s [-n REQUESTS] [-p PORT] [HOST]\n"
+		"\n"
+		"Serve a fixed page of SIZE bytes on PORT, or make REQUESTS\n"
+		"requests to HOST, one connection each, and report the rate.\n"
+		"\n"
+		" -l           serve instead of making requests\n"
+		" -n REQUESTS  how many requests to make (default 1000)\n"
+		" -s SIZE      bytes in the served page (default 128)\n"
+		" -p PORT      port to listen on or connect to (default 8080)\n"
+		" -?           show this help text\n"
+		"\n"
+		"HOST defaults to 10.0.2.2, the host under QEMU user networking.\n", argv[0], argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ln:s:p:?")) != -1) {
+		switch (opt) {
+			case 'l':
+				listening = 1;
+				break;
+			case 'n':
+				requests = atoi(optarg);
+				if (requests < 1) requests = 1;
+				break;
+			case 's':
+				page_size = atoi(optarg);
+				if (page_size < 0) page_size = 0;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case '?':
+				usage(argv);
+				return 1;
+		}
+	}
+
+	if (optind < argc) host = argv[optind];
+
+	return listening ? serve() : load(argv);
+}
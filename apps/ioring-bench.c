@@ -0,0 +1,200 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * ioring-bench - Compare a submission ring against plain system calls.
+ *
+ * Writes and then reads back a file in small blocks, first with one
+ * pwrite/pread per block and then by queueing the same blocks on an
+ * ioring and submitting them in batches, and reports how long each
+ * took. The data read back is checked both times.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/ioring.h>
+
+static char * path = "/tmp/ioring-bench";
+static int blocks = 10000;
+static int block_size = 512;
+static int batch = 32;
+
+static long elapsed(struct timeval * start, struct timeval * end) {
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+static void report(const char * name, struct timeval * start, struct timeval * end) {
+	long t = elapsed(start, end);
+	fprintf(stdout, "%-14s %8d blocks  %10ldus  %8ldns/block\n", name, blocks, t, t * 1000 / blocks);
+}
+
+static void fill(char * buf, int block) {
+	memset(buf, 'a' + block % 26, block_size);
+}
+
+static int check(char * buf, int block) {
+	for (int i = 0; i < block_size; ++i) {
+		if (buf[i] != 'a' + block % 26) return 1;
+	}
+	return 0;
+}
+
+static int plain(int fd, char * data) {
+	struct timeval start, end;
+	int failures = 0;
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < blocks; ++i) {
+		if (pwrite(fd, data + (size_t)i * block_size, block_size, (off_t)i * block_size) != block_size) failures++;
+	}
+	gettimeofday(&end, NULL);
+	report("pwrite", &start, &end);
+
+	memset(data, 0, (size_t)blocks * block_size);
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < blocks; ++i) {
+		if (pread(fd, data + (size_t)i * block_size, block_size, (off_t)i * block_size) != block_size) failures++;
+	}
+	gettimeofday(&end, NULL);
+	report("pread", &start, &end);
+
+	for (int i = 0; i < blocks; ++i) failures += check(data + (size_t)i * block_size, i);
+	return failures;
+}
+
+static int ring_pass(struct ioring * ring, int ringfd, int opcode, int fd, char * data) {
+	int failures = 0;
+	int queued = 0;
+	int done = 0;
+
+	while (done < blocks) {
+		int n = 0;
+		while (queued < blocks && n < batch) {
+			struct ioring_sqe * sqe = ioring_get_sqe(ring);
+			if (!sqe) break;
+			sqe->opcode = opcode;
+			sqe->fd = fd;
+			sqe->off = (int64_t)queued * block_size;
+			sqe->addr = (uintptr_t)(data + (size_t)queued * block_size);
+			sqe->len = block_size;
+			sqe->user_data = queued;
+			queued++;
+			n++;
+		}
+
+		if (ioring_enter(ringfd, n, n) < 0) return blocks - done;
+
+		struct ioring_cqe * cqe;
+		while ((cqe = ioring_peek_cqe(ring))) {
+			if (cqe->res != block_size) failures++;
+			ioring_cqe_seen(ring);
+			done++;
+		}
+	}
+
+	return failures;
+}
+
+static int ringed(int fd, char * data) {
+	struct timeval start, end;
+	int failures = 0;
+
+	struct ioring * ring = malloc(IORING_SIZE(batch));
+	int ringfd = ioring_setup(batch, ring);
+	if (ringfd < 0) {
+		fprintf(stderr, "ioring-bench: could not set up a ring of %d entries\n", batch);
+		return 1;
+	}
+
+	for (int i = 0; i < blocks; ++i) fill(data + (size_t)i * block_size, i);
+
+	gettimeofday(&start, NULL);
+	failures += ring_pass(ring, ringfd, IORING_OP_WRITE, fd, data);
+	gettimeofday(&end, NULL);
+	report("ioring write", &start, &end);
+
+	memset(data, 0, (size_t)blocks * block_size);
+
+	gettimeofday(&start, NULL);
+	failures += ring_pass(ring, ringfd, IORING_OP_READ, fd, data);
+	gettimeofday(&end, NULL);
+	report("ioring read", &start, &end);
+
+	for (int i = 0; i < blocks; ++i) failures += check(data + (size_t)i * block_size, i);
+
+	close(ringfd);
+	free(ring);
+	return failures;
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-n BLOCKS] [-s SIZE] [-b BATCH] [-f FILE]\n"
+		"\n"
+		"Write and read back BLOCKS blocks of SIZE bytes in FILE, one\n"
+		"system call per block and then BATCH blocks per ioring_enter,\n"
+		"and report how long each takes.\n"
+		"\n"
+		" -n BLOCKS  number of blocks (default 10000)\n"
+		" -s SIZE    bytes per block (default 512)\n"
+		" -b BATCH   blocks per submission, a power of two (default 32)\n"
+		" -f FILE    file to use (default /tmp/ioring-bench)\n"
+		" -?         show this help text\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:b:f:?")) != -1) {
+		switch (opt) {
+			case 'n':
+				blocks = atoi(optarg);
+				if (blocks < 1) blocks = 1;
+				break;
+			case 's':
+				block_size = atoi(optarg);
+				if (block_size < 1) block_size = 1;
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				if (batch < 1 || batch > IORING_MAX_ENTRIES || (batch & (batch - 1))) {
+					usage(argv);
+					return 1;
+				}
+				break;
+			case 'f':
+				path = optarg;
+				break;
+			case '?':
+				usage(argv);
+				return 1;
+		}
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: could not create file\n", argv[0], path);
+		return 1;
+	}
+
+	char * data = malloc((size_t)blocks * block_size);
+	for (int i = 0; i < blocks; ++i) fill(data + (size_t)i * block_size, i);
+
+	int failures = plain(fd, data);
+	failures += ringed(fd, data);
+
+	close(fd);
+	unlink(path);
+	free(data);
+
+	if (failures) {
+		fprintf(stderr, "%s: %d blocks did not transfer correctly\n", argv[0], failures);
+		return 1;
+	}
+	return 0;
+}
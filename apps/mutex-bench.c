@@ -0,0 +1,99 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * mutex-bench - Compare lock implementations under contention.
+ *
+ * Starts a number of threads that all increment a shared counter
+ * under a lock, first with pthread mutexes and then with the old
+ * test-and-set loop that yields when the lock is taken, and reports
+ * how long each took.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <syscall.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <toaru/spinlock.h>
+
+static int iterations = 100000;
+static volatile long counter = 0;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int volatile yield_lock = 0;
+
+static void * mutex_worker(void * arg) {
+	for (int i = 0; i < iterations; ++i) {
+		pthread_mutex_lock(&mutex);
+		counter++;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+static void * yield_worker(void * arg) {
+	for (int i = 0; i < iterations; ++i) {
+		spin_lock(&yield_lock);
+		counter++;
+		spin_unlock(&yield_lock);
+	}
+	return NULL;
+}
+
+static void run(const char * name, void *(*worker)(void *), int threads) {
+	pthread_t thread[threads];
+	struct timeval start, end;
+
+	counter = 0;
+	gettimeofday(&start, NULL);
+
+	for (int i = 0; i < threads; ++i) {
+		pthread_create(&thread[i], NULL, worker, NULL);
+	}
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+
+	gettimeofday(&end, NULL);
+
+	long usecs = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+	fprintf(stdout, "%-8s %2d threads  %8ldus  %s\n", name, threads, usecs,
+		counter == (long)threads * iterations ? "ok" : "COUNT MISMATCH");
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-t THREADS] [-n ITERATIONS]\n"
+		"\n"
+		" -t THREADS     number of competing threads (default 4)\n"
+		" -n ITERATIONS  lock acquisitions per thread (default 100000)\n"
+		" -?             show this help text\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int threads = 4;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:n:?")) != -1) {
+		switch (opt) {
+			case 't':
+				threads = atoi(optarg);
+				if (threads < 1) threads = 1;
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				if (iterations < 1) iterations = 1;
+				break;
+			case '?':
+				usage(argv);
+				return 1;
+		}
+	}
+
+	run("futex", mutex_worker, threads);
+	run("yield", yield_worker, threads);
+
+	return 0;
+}
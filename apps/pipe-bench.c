@@ -0,0 +1,110 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * pipe-bench - Measure pipe throughput.
+ *
+ * Forks a child that writes a fixed amount of data into a pipe
+ * in chunks of a given size while the parent reads it back out,
+ * and reports how long that took. Optionally changes the pipe's
+ * capacity first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static long elapsed(struct timeval * start, struct timeval * end) {
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-m MIB] [-b BYTES] [-s BYTES]\n"
+		"\n"
+		"Push MIB mebibytes through a pipe and report the throughput.\n"
+		"\n"
+		" -m MIB     how much to send (default 64)\n"
+		" -b BYTES   size of each read and write (default 4096)\n"
+		" -s BYTES   set the pipe capacity first\n"
+		" -?         show this help text\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	long total = 64;
+	int chunk = 4096;
+	int capacity = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:b:s:?")) != -1) {
+		switch (opt) {
+			case 'm':
+				total = atol(optarg);
+				if (total < 1) total = 1;
+				break;
+			case 'b':
+				chunk = atoi(optarg);
+				if (chunk < 1) chunk = 1;
+				break;
+			case 's':
+				capacity = atoi(optarg);
+				break;
+			case '?':
+				usage(argv);
+				return 1;
+		}
+	}
+
+	total *= 1024 * 1024;
+
+	int fds[2];
+	if (pipe(fds) < 0) {
+		fprintf(stderr, "%s: could not create pipe\n", argv[0]);
+		return 1;
+	}
+
+	if (capacity && fcntl(fds[1], F_SETPIPE_SZ, capacity) < 0) {
+		fprintf(stderr, "%s: could not set pipe capacity to %d\n", argv[0], capacity);
+		return 1;
+	}
+
+	char * buf = malloc(chunk);
+	memset(buf, 'x', chunk);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	pid_t pid = fork();
+	if (!pid) {
+		close(fds[0]);
+		long sent = 0;
+		while (sent < total) {
+			long n = total - sent < chunk ? total - sent : chunk;
+			ssize_t w = write(fds[1], buf, n);
+			if (w <= 0) _exit(1);
+			sent += w;
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	long received = 0;
+	ssize_t r;
+	while ((r = read(fds[0], buf, chunk)) > 0) {
+		received += r;
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	gettimeofday(&end, NULL);
+
+	long t = elapsed(&start, &end);
+	fprintf(stdout, "%ld bytes in %ldus, %ld KiB/s (chunk %d, capacity %d)\n",
+		received, t, t ? (long)((received / 1024) * 1000000.0 / t) : 0, chunk, fcntl(fds[0], F_GETPIPE_SZ));
+
+	return received != total;
+}
@@ -0,0 +1,140 @@
+/**
+ * @file  apps/route.c
+ * @brief Show and change the IPv4 routing table.
+ *
+ * With no arguments, lists routes, including those implied by
+ * interface configuration. Routes are added and removed with ioctls
+ * on a socket.
+ *
+ * All of the APIs used in this tool are temporary and subject to change.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+
+extern char * _argv_0;
+
+static int usage(void) {
+	fprintf(stderr,
+		"usage: %s\n"
+		"       %s add DEST[/LEN] [gw GATEWAY] dev IFACE\n"
+		"       %s del DEST[/LEN] [dev IFACE]\n"
+		"\n"
+		"DEST may be 'default' for 0.0.0.0/0. Without /LEN, DEST is a single host.\n",
+		_argv_0, _argv_0, _argv_0);
+	return 1;
+}
+
+static int parse_addr(const char * str, uint32_t * out) {
+	unsigned int a, b, c, d;
+	char extra;
+	if (sscanf(str, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4) return 1;
+	if (a > 255 || b > 255 || c > 255 || d > 255) return 1;
+	*out = htonl((a << 24) | (b << 16) | (c << 8) | d);
+	return 0;
+}
+
+static int parse_dest(const char * str, struct rtentry * rt) {
+	if (!strcmp(str, "default")) {
+		rt->rt_dst = 0;
+		rt->rt_genmask = 0;
+		return 0;
+	}
+
+	char addr[32];
+	int len = 32;
+	const char * slash = strchr(str, '/');
+	size_t n = slash ? (size_t)(slash - str) : strlen(str);
+	if (n >= sizeof(addr)) return 1;
+	memcpy(addr, str, n);
+	addr[n] = '\0';
+
+	if (slash) {
+		char * end;
+		len = strtol(slash + 1, &end, 10);
+		if (*end || len < 0 || len > 32) return 1;
+	}
+
+	if (parse_addr(addr, &rt->rt_dst)) return 1;
+	rt->rt_genmask = len ? htonl(0xFFFFFFFF << (32 - len)) : 0;
+	rt->rt_dst &= rt->rt_genmask;
+	return 0;
+}
+
+static int list_routes(void) {
+	FILE * f = fopen("/proc/route", "r");
+	if (!f) {
+		fprintf(stderr, "%s: /proc/route: %s\n", _argv_0, strerror(errno));
+		return 1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		fputs(line, stdout);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 2) return list_routes();
+	if (argc < 3) return usage();
+
+	unsigned long request;
+	if (!strcmp(argv[1], "add")) {
+		request = SIOCADDRT;
+	} else if (!strcmp(argv[1], "del")) {
+		request = SIOCDELRT;
+	} else {
+		return usage();
+	}
+
+	struct rtentry rt;
+	memset(&rt, 0, sizeof(rt));
+
+	if (parse_dest(argv[2], &rt)) {
+		fprintf(stderr, "%s: %s: not a destination\n", _argv_0, argv[2]);
+		return 1;
+	}
+
+	for (int i = 3; i < argc; i += 2) {
+		if (i + 1 >= argc) return usage();
+		if (!strcmp(argv[i], "gw")) {
+			if (parse_addr(argv[i+1], &rt.rt_gateway)) {
+				fprintf(stderr, "%s: %s: not an address\n", _argv_0, argv[i+1]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "dev")) {
+			if (strlen(argv[i+1]) >= sizeof(rt.rt_dev)) {
+				fprintf(stderr, "%s: %s: interface name too long\n", _argv_0, argv[i+1]);
+				return 1;
+			}
+			strcpy(rt.rt_dev, argv[i+1]);
+		} else {
+			return usage();
+		}
+	}
+
+	if (request == SIOCADDRT && !rt.rt_dev[0]) return usage();
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	if (ioctl(sock, request, &rt) < 0) {
+		fprintf(stderr, "%s: %s\n", _argv_0, strerror(errno));
+		return 1;
+	}
+
+	close(sock);
+	return 0;
+}
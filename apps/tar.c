@@ -150,8 +150,11 @@ static void write_file(struct ustar * file, FILE * f, FILE * mf, char * name) {
 }
 
 static void _seek_forward(FILE * f, size_t amount) {
-	for (size_t i = 0; i < amount; ++i) {
-		fgetc(f);
+	char buf[CHUNK_SIZE];
+	while (amount > 0) {
+		size_t r = fread(buf, 1, amount < CHUNK_SIZE ? amount : CHUNK_SIZE, f);
+		if (!r) break;
+		amount -= r;
 	}
 }
 
@@ -341,16 +344,18 @@ int main(int argc, char * argv[]) {
 						if (!mf) {
 							fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, strerror(errno));
 						} else {
-							FILE * source = fopen(tmp, "r");
-							if (!source) {
+							int source = open(tmp, O_RDONLY);
+							if (source < 0) {
 								fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, tmp, strerror(errno));
 							} else {
-								while (!feof(source)) {
-									char buf[4096];
-									ssize_t r = fread(buf, 1, 4096, source);
+								char buf[CHUNK_SIZE];
+								off_t offset = 0;
+								ssize_t r;
+								while ((r = pread(source, buf, CHUNK_SIZE, offset)) > 0) {
 									fwrite(buf, 1, r, mf);
+									offset += r;
 								}
-								fclose(source);
+								close(source);
 							}
 							fclose(mf);
 							chmod(name, interpret_mode(file));
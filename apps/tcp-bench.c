@@ -0,0 +1,223 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * tcp-bench - Measure bulk TCP throughput.
+ *
+ * Connects to a peer and either sends it a number of megabytes or
+ * reads from it until it closes the connection, and reports the rate.
+ * Under QEMU user networking the host is 10.0.2.2; something like
+ *
+ *     nc -l 5001 > /dev/null                 (for sending)
+ *     head -c 100M /dev/zero | nc -l 5001    (for -r)
+ *
+ * on the host makes a suitable peer. With -a, the send is repeated
+ * with 64 byte, 1 KiB and 64 KiB writes, one connection each, to show
+ * how well small writes are combined into full segments.
+ *
+ * With -l, it is the peer instead: it accepts connections and reads
+ * each one until it closes, so the loopback interface can be measured
+ * with no network at all:
+ *
+ *     tcp-bench -l &
+ *     tcp-bench -a 127.0.0.1
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+static char * host = "10.0.2.2";
+static int port = 5001;
+static int megabytes = 32;
+static int chunk = 65536;
+static int receiving = 0;
+static int nodelay = 0;
+static int sweep = 0;
+static int listening = 0;
+
+static long elapsed(struct timeval * start, struct timeval * end) {
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-r] [-a] [-D] [-n MEGABYTES] [-s SIZE] [-p PORT] [HOST]\n"
+		"       %s -l [-s SIZE] [-p PORT]\n"
+		"\n"
+		"Send MEGABYTES megabytes to PORT on HOST in writes of SIZE bytes,\n"
+		"or with -r read until the peer closes, and report the rate.\n"
+		"\n"
+		" -l           accept connections and read from them until they close\n"
+		" -r           receive instead of send\n"
+		" -a           send with 64, 1024 and 65536 byte writes in turn\n"
+		" -D           set TCP_NODELAY\n"
+		" -n MEGABYTES how much to send (default 32)\n"
+		" -s SIZE      bytes per read or write (default 65536)\n"
+		" -p PORT      port to connect to (default 5001)\n"
+		" -?           show this help text\n"
+		"\n"
+		"HOST defaults to 10.0.2.2, the host under QEMU user networking.\n", argv[0], argv[0]);
+}
+
+static int run(struct sockaddr_in * addr, int size) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	if (nodelay) {
+		int on = 1;
+		if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) perror("setsockopt");
+	}
+
+	if (connect(sock, (struct sockaddr*)addr, sizeof(struct sockaddr_in)) < 0) {
+		perror("connect");
+		return 1;
+	}
+
+	char * buf = malloc(size);
+	memset(buf, 'x', size);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	size_t total = 0;
+	if (receiving) {
+		ssize_t r;
+		while ((r = recv(sock, buf, size, 0)) > 0) total += r;
+		if (r < 0) perror("recv");
+	} else {
+		size_t target = (size_t)megabytes * 1024 * 1024;
+		while (total < target) {
+			size_t want = target - total < (size_t)size ? target - total : (size_t)size;
+			ssize_t w = send(sock, buf, want, 0);
+			if (w <= 0) {
+				perror("send");
+				break;
+			}
+			total += w;
+		}
+	}
+
+	close(sock);
+	gettimeofday(&end, NULL);
+
+	long t = elapsed(&start, &end);
+	fprintf(stdout, "%s %zu bytes in %d byte %ss in %ldus, %ld KiB/s\n", receiving ? "received" : "sent",
+		total, size, receiving ? "read" : "write", t, t ? (long)(total * 1000000 / 1024 / t) : 0);
+
+	free(buf);
+	return 0;
+}
+
+static int sink(void) {
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if (bind(server, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) {
+		perror("bind");
+		return 1;
+	}
+
+	if (listen(server, 4) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	char * buf = malloc(chunk);
+
+	while (1) {
+		int client = accept(server, NULL, NULL);
+		if (client < 0) {
+			perror("accept");
+			break;
+		}
+
+		struct timeval start, end;
+		gettimeofday(&start, NULL);
+		size_t total = 0;
+		ssize_t r;
+		while ((r = recv(client, buf, chunk, 0)) > 0) total += r;
+		gettimeofday(&end, NULL);
+		close(client);
+
+		long t = elapsed(&start, &end);
+		fprintf(stdout, "received %zu bytes in %ldus, %ld KiB/s\n",
+			total, t, t ? (long)(total * 1000000 / 1024 / t) : 0);
+	}
+
+	close(server);
+	free(buf);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "lraDn:s:p:?")) != -1) {
+		switch (opt) {
+			case 'l':
+				listening = 1;
+				break;
+			case 'r':
+				receiving = 1;
+				break;
+			case 'a':
+				sweep = 1;
+				break;
+			case 'D':
+				nodelay = 1;
+				break;
+			case 'n':
+				megabytes = atoi(optarg);
+				if (megabytes < 1) megabytes = 1;
+				break;
+			case 's':
+				chunk = atoi(optarg);
+				if (chunk < 1) chunk = 1;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case '?':
+				usage(argv);
+				return 1;
+		}
+	}
+
+	if (listening) return sink();
+	if (optind < argc) host = argv[optind];
+
+	struct hostent * remote = gethostbyname(host);
+	if (!remote) {
+		fprintf(stderr, "%s: %s: could not resolve\n", argv[0], host);
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	memcpy(&addr.sin_addr.s_addr, remote->h_addr, remote->h_length);
+	addr.sin_port = htons(port);
+
+	if (!sweep || receiving) return run(&addr, chunk);
+
+	static const int sizes[] = { 64, 1024, 65536 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+		if (run(&addr, sizes[i])) return 1;
+	}
+	return 0;
+}
@@ -34,7 +34,7 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/time.h>
-#include <sys/fswait.h>
+#include <sys/epoll.h>
 
 #define TRACE_APP_NAME "terminal"
 #include <toaru/trace.h>
@@ -2424,8 +2424,13 @@ int main(int argc, char ** argv) {
 		return 1;
 	} else {
 
-		/* Set up fswait to check Yutani and the PTY master */
-		int fds[2] = {fileno(yctx->sock), fd_master};
+		/* Watch Yutani and the PTY master; this is set up once, not on every wait. */
+		int epfd = epoll_create(2);
+		struct epoll_event ev = {.events = EPOLLIN};
+		ev.data.u32 = 0;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fileno(yctx->sock), &ev);
+		ev.data.u32 = 1;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd_master, &ev);
 
 		/* PTY read buffer */
 		unsigned char buf[4096];
@@ -2434,7 +2439,11 @@ int main(int argc, char ** argv) {
 
 			/* Wait for something to happen. */
 			int res[] = {0,0};
-			fswait3(2,fds,200,res);
+			struct epoll_event events[2];
+			int count = epoll_wait(epfd, events, 2, 200);
+			for (int i = 0; i < count; ++i) {
+				res[events[i].data.u32] = 1;
+			}
 
 			/* Check if the child application has closed. */
 			check_for_exit();
@@ -0,0 +1,155 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * tmpfs-bench - Measure how well tmpfs copes with lots of files.
+ *
+ * Starts a number of threads which between them create, look up,
+ * and remove a large number of small files in one directory, and
+ * reports how long each step took. The directory is also listed
+ * once while it is full.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+enum { CREATE, LOOKUP, REMOVE };
+
+static char * directory = "/tmp/tmpfs-bench";
+static int threads = 8;
+static int files = 100000;
+static int step;
+static int failures;
+
+static long elapsed(struct timeval * start, struct timeval * end) {
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+static void * worker(void * arg) {
+	int id = (int)(intptr_t)arg;
+	char path[256];
+	char data[64];
+	memset(data, 'x', sizeof(data));
+
+	for (int i = id; i < files; i += threads) {
+		snprintf(path, sizeof(path), "%s/file.%d", directory, i);
+		switch (step) {
+			case CREATE: {
+				int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+				if (fd < 0 || write(fd, data, sizeof(data)) != sizeof(data)) __sync_fetch_and_add(&failures, 1);
+				if (fd >= 0) close(fd);
+				break;
+			}
+			case LOOKUP: {
+				struct stat st;
+				if (stat(path, &st) < 0 || st.st_size != sizeof(data)) __sync_fetch_and_add(&failures, 1);
+				break;
+			}
+			case REMOVE:
+				if (unlink(path) < 0) __sync_fetch_and_add(&failures, 1);
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+static int run(const char * name) {
+	pthread_t thread[threads];
+	struct timeval start, end;
+
+	failures = 0;
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < threads; ++i) {
+		pthread_create(&thread[i], NULL, worker, (void *)(intptr_t)i);
+	}
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+	gettimeofday(&end, NULL);
+
+	long t = elapsed(&start, &end);
+	fprintf(stdout, "%-8s %8d files  %10ldus  %8ldns/file\n", name, files, t, t * 1000 / files);
+	if (failures) {
+		fprintf(stderr, "tmpfs-bench: %s failed for %d files\n", name, failures);
+		return 1;
+	}
+	return 0;
+}
+
+static int list(void) {
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	DIR * dir = opendir(directory);
+	if (!dir) return 1;
+	int count = 0;
+	while (readdir(dir)) count++;
+	closedir(dir);
+
+	gettimeofday(&end, NULL);
+
+	long t = elapsed(&start, &end);
+	fprintf(stdout, "%-8s %8d files  %10ldus  %8ldns/file\n", "readdir", count, t, t * 1000 / (count ? count : 1));
+	return count != files + 2;
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-t THREADS] [-n FILES] [-d DIRECTORY]\n"
+		"\n"
+		"Create, list, look up, and remove FILES files in DIRECTORY\n"
+		"using THREADS threads, and report how long each step takes.\n"
+		"\n"
+		" -t THREADS   number of threads (default 8)\n"
+		" -n FILES     number of files (default 100000)\n"
+		" -d DIRECTORY where to put them (default /tmp/tmpfs-bench)\n"
+		" -?           show this help text\n", argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:n:d:?")) != -1) {
+		switch (opt) {
+			case 't':
+				threads = atoi(optarg);
+				if (threads < 1) threads = 1;
+				break;
+			case 'n':
+				files = atoi(optarg);
+				if (files < 1) files = 1;
+				break;
+			case 'd':
+				directory = optarg;
+				break;
+			case '?':
+				usage(argv);
+				return 1;
+		}
+	}
+
+	if (mkdir(directory, 0755) < 0) {
+		fprintf(stderr, "%s: %s: could not create directory\n", argv[0], directory);
+		return 1;
+	}
+
+	int ret = 0;
+	step = CREATE;
+	ret |= run("create");
+	ret |= list();
+	step = LOOKUP;
+	ret |= run("lookup");
+	step = REMOVE;
+	ret |= run("remove");
+
+	rmdir(directory);
+	return ret;
+}
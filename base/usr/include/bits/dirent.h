@@ -2,6 +2,7 @@
 
 #include <_cheader.h>
 #include <stdint.h>
+#include <stddef.h>
 
 _Begin_C_Header
 
@@ -12,11 +13,14 @@ typedef struct dirent {
 
 typedef struct DIR {
 	int fd;
-	int cur_entry;
+	int cur_entry;          /* next entry to hand out from buffer */
+	int entries;            /* how many entries are in buffer */
+	struct dirent * buffer; /* filled by getdents */
 } DIR;
 
 DIR * opendir (const char * dirname);
 int closedir (DIR * dir);
 struct dirent * readdir (DIR * dirp);
+int getdents (int fd, struct dirent * entries, size_t size);
 
 _End_C_Header
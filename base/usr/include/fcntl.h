@@ -23,6 +23,10 @@ _Begin_C_Header
 #define F_GETFL 3
 #define F_SETFL 4
 
+/* Pipe capacity, in bytes */
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+
 /* Advisory locks are not currently supported;
  * these definitions are stubs. */
 #define F_GETLK  5
@@ -50,13 +50,17 @@ extern struct regs * _irq12(struct regs*);
 extern struct regs * _irq13(struct regs*);
 extern struct regs * _irq14(struct regs*);
 extern struct regs * _irq15(struct regs*);
-extern struct regs * _isr124(struct regs*); /* Does not actually take regs */
+extern struct regs * _isr123(struct regs*); /* Local APIC timer */
+extern struct regs * _isr124(struct regs*); /* TLB shootdown */
 extern struct regs * _isr125(struct regs*); /* Does not actually take regs */
 extern struct regs * _isr126(struct regs*); /* Does not actually take regs */
 extern struct regs * _isr127(struct regs*); /* Syscall entry point */
 
 typedef struct regs * (*interrupt_handler_t)(struct regs *);
 
+extern void lapic_timer_handler(struct regs * r);
+extern void arch_tlb_shootdown_handler(void);
+
 
 /**
  * Interrupt descriptor table
@@ -11,6 +11,12 @@
 
 #define MMU_GET_MAKE 0x01
 
+/* Addresses below this belong to the current address space. */
+#define USER_SPACE_END 0x0000800000000000UL
+
+/* Invalidating more pages than this flushes the whole TLB instead. */
+#define TLB_FLUSH_PAGES 32
+
 
 void mmu_frame_set(uintptr_t frame_addr);
 void mmu_frame_clear(uintptr_t frame_addr);
@@ -20,15 +26,23 @@ uintptr_t mmu_first_frame(void);
 void mmu_frame_allocate(union PML * page, unsigned int flags);
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr);
 void mmu_frame_free(union PML * page);
+int mmu_frame_ref(uintptr_t frame);
+void mmu_frame_unref(uintptr_t frame);
 uintptr_t mmu_map_to_physical(uintptr_t virtAddr);
 union PML * mmu_get_page(uintptr_t virtAddr, int flags);
 void mmu_set_directory(union PML * new_pml);
 void mmu_free(union PML * from);
 union PML * mmu_clone(union PML * from);
+int mmu_copy_on_write(uintptr_t address);
 void mmu_init(size_t memsize, uintptr_t firstFreePage);
+void mmu_enable_write_protect(void);
 void mmu_invalidate(uintptr_t addr);
+void mmu_invalidate_local(uintptr_t start, uintptr_t end);
+void mmu_invalidate_range(uintptr_t start, uintptr_t end);
 uintptr_t mmu_allocate_a_frame(void);
 uintptr_t mmu_allocate_n_frames(int n);
+uintptr_t mmu_allocate_frames_upto(size_t * n);
+void mmu_free_frames(uintptr_t index, size_t n);
 union PML * mmu_get_kernel_directory(void);
 void * mmu_map_from_physical(uintptr_t frameaddress);
 void * mmu_map_mmio_region(uintptr_t physical_address, size_t size);
@@ -40,3 +54,5 @@ size_t mmu_total_memory(void);
 size_t mmu_used_memory(void);
 
 void * sbrk(size_t);
+size_t mmu_heap_release(uintptr_t start, uintptr_t end);
+size_t mmu_heap_populate(uintptr_t start, uintptr_t end);
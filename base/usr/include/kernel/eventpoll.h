@@ -0,0 +1,13 @@
+#pragma once
+
+#include <kernel/vfs.h>
+#include <sys/epoll.h>
+
+fs_node_t * eventpoll_create(void);
+int eventpoll_is_set(fs_node_t * node);
+int eventpoll_ctl(fs_node_t * epnode, int op, int key, fs_node_t * target, struct epoll_event * event);
+int eventpoll_wait(fs_node_t * epnode, struct epoll_event * events, int maxevents, int timeout);
+int eventpoll_poll(fs_node_t ** nodes, struct pollfd * fds, int nfds, int timeout);
+int eventpoll_alert(void * waiter);
+int eventpoll_is_item(void * waiter);
+void eventpoll_forget(fs_node_t * node);
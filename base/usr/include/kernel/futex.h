@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+
+extern long futex_wait(uintptr_t addr, int val);
+extern long futex_wake(uintptr_t addr, int count);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <kernel/vfs.h>
+#include <sys/ioring.h>
+
+extern long ioring_setup(unsigned int entries, struct ioring * ring);
+extern long ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete);
+extern void ioring_close(fs_node_t * node);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+
+#define KHEAP_MAX_BINS 16
+
+struct kheap_bin_stats {
+	size_t size;    /* Size of objects in this bin */
+	size_t pages;   /* Pages holding objects of this size */
+	size_t used;    /* Objects that are allocated */
+	size_t free;    /* Free objects in those pages */
+	size_t cached;  /* Free objects held in per-CPU magazines */
+};
+
+struct kheap_stats {
+	size_t bins;
+	struct kheap_bin_stats bin[KHEAP_MAX_BINS];
+
+	size_t big_blocks;
+	size_t big_free_blocks;
+	size_t big_bytes;
+	size_t big_free_bytes;
+	size_t released_pages;
+
+	size_t magazine_hits;
+	size_t magazine_misses;
+	size_t lock_acquired;
+	size_t lock_contended;
+};
+
+extern void kheap_get_stats(struct kheap_stats * stats);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+#include <kernel/process.h>
+
+/* Where mmap places mappings that don't ask for a fixed address */
+#define USER_MMAP_LOW  0x0000000800000000UL
+#define USER_MMAP_HIGH 0x0000700000000000UL
+
+/* Fixed mappings can go anywhere below the stack, except under the kernel's
+ * low identity map or over the device and SHM regions, which are managed separately. */
+#define USER_FIXED_LOW      0x0000000004000000UL
+#define USER_RESERVED_LOW   0x0000000100000000UL
+#define USER_RESERVED_HIGH  0x0000000400000000UL
+
+/**
+ * @brief A range of an address space created by mmap.
+ *
+ * Pages in the range are only backed by frames once they are touched;
+ * the page fault handler fills them in from @c file, or with zeros
+ * for anonymous mappings.
+ */
+typedef struct mmap_region {
+	uintptr_t start;
+	uintptr_t end;
+	int prot;
+	int flags;
+	fs_node_t * file;
+	off_t offset;
+	uintptr_t file_end; /* Bytes at or past this address are zero rather than read from the file */
+	int cached; /* Read-only pages are mapped from the page cache */
+	int refcount;
+} mmap_region_t;
+
+extern long mmap_map(page_directory_t * dir, uintptr_t addr, size_t length, int prot, int flags, fs_node_t * file, off_t offset);
+extern long mmap_map_segment(page_directory_t * dir, uintptr_t vaddr, size_t memsz, int prot, fs_node_t * file, off_t offset, size_t filesz);
+extern long mmap_unmap(page_directory_t * dir, uintptr_t addr, size_t length);
+extern long mmap_protect(page_directory_t * dir, uintptr_t addr, size_t length, int prot);
+extern int  mmap_page_fault(uintptr_t address, int err_code);
+extern void mmap_clone(page_directory_t * from, page_directory_t * to);
+extern void mmap_release_all(page_directory_t * dir);
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <kernel/vfs.h>
 
 struct ipv4_packet {
 	uint8_t  version_ihl;
@@ -58,3 +59,6 @@ struct tcp_check_header {
 #define IPV4_PROT_UDP 17
 #define IPV4_PROT_TCP 6
 
+uint16_t calculate_ipv4_checksum(struct ipv4_packet * p);
+int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic);
+int net_loopback_send(fs_node_t * nic, struct ipv4_packet * packet);
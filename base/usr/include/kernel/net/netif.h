@@ -10,6 +10,10 @@
 
 int net_add_interface(const char * name, fs_node_t * deviceNode);
 fs_node_t * net_if_lookup(const char * name);
+fs_node_t * net_route(uint32_t dest, uint32_t * nexthop);
+long net_route_ioctl(unsigned long request, void * argp);
+
+extern fs_node_t * net_loopback;
 
 typedef struct SockData {
 	fs_node_t _fnode;
@@ -25,15 +29,20 @@ typedef struct SockData {
 	long (*sock_send)(struct SockData * sock, const struct msghdr *msg, int flags);
 	void (*sock_close)(struct SockData * sock);
 	long (*sock_connect)(struct SockData * sock, const struct sockaddr *addr, socklen_t addrlen);
+	long (*sock_bind)(struct SockData * sock, const struct sockaddr *addr, socklen_t addrlen);
+	long (*sock_listen)(struct SockData * sock, int backlog);
+	long (*sock_accept)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
+	long (*sock_setsockopt)(struct SockData * sock, int level, int optname, const void *optval, socklen_t optlen);
 
 	struct sockaddr dest;
 	uint32_t priv32[4];
 
-	size_t unread;
-	char * buf;
+	void * pcb; /* protocol control block, for protocols that need more than priv */
+	int stream; /* a byte stream, which takes a writev in one sock_send */
 } sock_t;
 
 void net_sock_alert(sock_t * sock);
 void net_sock_add(sock_t * sock, void * frame, size_t size);
 void * net_sock_get(sock_t * sock);
 sock_t * net_sock_create(void);
+long net_sock_writev(fs_node_t * node, const struct iovec * iov, int iovcnt);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <kernel/vfs.h>
+#include <kernel/net/ipv4.h>
+
+#define TCP_FLAGS_FIN (1 << 0)
+#define TCP_FLAGS_SYN (1 << 1)
+#define TCP_FLAGS_RST (1 << 2)
+#define TCP_FLAGS_PSH (1 << 3)
+#define TCP_FLAGS_ACK (1 << 4)
+#define TCP_FLAGS_URG (1 << 5)
+#define TCP_FLAGS_ECE (1 << 6)
+#define TCP_FLAGS_CWR (1 << 7)
+#define TCP_FLAGS_NS  (1 << 8)
+
+void net_tcp_install(void);
+void net_tcp_handle(struct ipv4_packet * packet, fs_node_t * nic);
+long net_tcp_socket(void);
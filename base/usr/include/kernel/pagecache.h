@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+
+struct pagecache_stats {
+	size_t pages;      /* Pages currently cached */
+	size_t max_pages;  /* Most pages the cache will hold */
+	size_t hits;       /* Page accesses served from the cache */
+	size_t misses;     /* Page accesses that had to read the file */
+	size_t readahead;  /* Pages read in ahead of time */
+	size_t evictions;  /* Pages dropped to make room or free memory */
+};
+
+extern ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+extern ssize_t pagecache_write(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+extern uintptr_t pagecache_frame(fs_node_t * node, off_t offset, size_t * valid);
+extern void pagecache_invalidate(void * device, uint64_t inode);
+extern size_t pagecache_reclaim(size_t pages);
+extern void pagecache_get_stats(struct pagecache_stats * stats);
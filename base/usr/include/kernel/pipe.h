@@ -20,6 +20,7 @@ typedef struct _pipe_device {
 	list_t * wait_queue_writers;
 	int dead;
 	list_t * alert_waiters;
+	list_t * space_waiters;
 
 	spin_lock_t lock_read;
 	spin_lock_t lock_write;
@@ -19,6 +19,8 @@ typedef struct {
 	intptr_t refcount;
 	union PML * directory;
 	spin_lock_t lock;
+	list_t * mappings; /* mmap regions, sorted by address; NULL if none */
+	volatile uint32_t cpu_mask; /* cores that have this directory loaded */
 } page_directory_t;
 
 typedef struct {
@@ -61,6 +63,23 @@ typedef struct file_descriptors {
 	spin_lock_t lock;
 } fd_table_t;
 
+/**
+ * @brief A pending timed wakeup.
+ *
+ * Each process has two of these embedded in it, one for plain
+ * sleeps and one for fswait timeouts, so arming and cancelling
+ * a timer never allocates. Armed timers are linked into a slot
+ * of the timer wheel in process.c; an unarmed timer has a NULL
+ * next pointer.
+ */
+typedef struct sleeper {
+	struct sleeper * next;
+	struct sleeper * prev;
+	uint64_t expires; /* in subticks since boot */
+	struct process * process;
+	int is_fswait;
+} sleeper_t;
+
 #define PROC_FLAG_IS_TASKLET 0x01
 #define PROC_FLAG_FINISHED   0x02
 #define PROC_FLAG_STARTED    0x04
@@ -100,8 +119,8 @@ typedef struct process {
 
 	node_t sched_node;
 	node_t sleep_node;
-	node_t * timed_sleep_node;
-	node_t * timeout_node;
+	sleeper_t timed_sleep;
+	sleeper_t timeout;
 
 	struct timeval start;
 	int awoken_index;
@@ -115,13 +134,6 @@ typedef struct process {
 	uintptr_t signals[NUMSIGNALS+1];
 } process_t;
 
-typedef struct {
-	uint64_t end_tick;
-	uint64_t end_subtick;
-	process_t * process;
-	int is_fswait;
-} sleeper_t;
-
 struct ProcessorLocal {
 	/**
 	 * @brief The running process on this core.
@@ -165,6 +177,64 @@ struct ProcessorLocal {
 	char cpu_model_name[48];
 	const char * cpu_manufacturer;
 #endif
+
+	/**
+	 * @brief Per-core scheduler ready queue.
+	 *
+	 * Processes that become ready are queued on the core they last ran
+	 * on, unless that core is noticeably busier than the rest. Cores
+	 * with nothing to do steal from the longest queue, and a periodic
+	 * balancing pass evens out the lengths.
+	 */
+	list_t * ready_queue;
+	spin_lock_t ready_lock;
+
+	/* Scheduler statistics, shown in /proc/smp */
+	size_t steal_count;
+	size_t balance_count;
+
+	/**
+	 * @brief Per-core one-shot timer state.
+	 *
+	 * Each core programs its own timer for the end of the current
+	 * timeslice, and the BSP also for the next timed wakeup; idle
+	 * cores with nothing to wait for don't tick at all. Times are
+	 * in subticks since boot, UINT64_MAX meaning never.
+	 */
+	uint64_t timer_deadline;
+	uint64_t timeslice_end;
+	size_t timer_irqs;
+
+	/**
+	 * @brief Address space loaded on this core.
+	 *
+	 * This core's bit is set in the directory's cpu_mask while it is
+	 * loaded, so TLB shootdowns for user addresses only interrupt the
+	 * cores that can actually have stale entries.
+	 */
+	page_directory_t * active_directory;
+
+	/**
+	 * @brief Pending TLB shootdown range.
+	 *
+	 * Other cores widen this range and send an IPI; it is cleared
+	 * when this core flushes it. An empty range means nothing is
+	 * pending, so requests that arrive in the meantime share an IPI.
+	 * Each request takes a ticket from tlb_requested, and the sender
+	 * waits until tlb_completed has caught up with it.
+	 */
+	spin_lock_t tlb_lock;
+	uintptr_t tlb_start;
+	uintptr_t tlb_end;
+	volatile size_t tlb_requested;
+	volatile size_t tlb_completed;
+
+	/* Set while the idle task is waiting for an interrupt. */
+	volatile int halted;
+
+	/* IPIs received, shown in /proc/smp */
+	size_t wakeup_ipis;
+	size_t tlb_ipis;
 };
 
 extern struct ProcessorLocal processor_local_data[32];
@@ -185,14 +255,18 @@ extern process_t * process_from_pid(pid_t pid);
 extern void process_delete(process_t * proc);
 extern void make_process_ready(volatile process_t * proc);
 extern volatile process_t * next_ready_process(void);
+extern void process_balance_queues(void);
 extern int wakeup_queue(list_t * queue);
 extern int wakeup_queue_interrupted(list_t * queue);
+extern int wakeup_queue_count(list_t * queue, int count);
 extern int sleep_on(list_t * queue);
 extern int sleep_on_unlocking(list_t * queue, spin_lock_t * release);
 extern int process_alert_node(process_t * process, void * value);
+extern void process_add_node_wait(void * waiter, void * value);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
 extern void switch_task(uint8_t reschedule);
 extern int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout);
+extern int process_timeout_sleep(process_t * process, int timeout);
 extern process_t * process_get_parent(process_t * process);
 extern int process_is_ready(process_t * proc);
 extern void wakeup_sleepers(unsigned long seconds, unsigned long subseconds);
@@ -201,6 +275,7 @@ extern __attribute__((noreturn)) void switch_next(void);
 extern int process_awaken_from_fswait(process_t * process, int index);
 extern void process_awaken_signal(process_t * process);
 extern void process_release_directory(page_directory_t * dir);
+extern void process_load_directory(page_directory_t * dir);
 extern process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * name, void * argp);
 extern pid_t fork(void);
 extern pid_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg);
@@ -209,8 +284,6 @@ extern int exec(const char * path, int argc, char *const argv[], char *const env
 
 extern tree_t * process_tree;  /* Parent->Children tree */
 extern list_t * process_list;  /* Flat storage */
-extern list_t * process_queue; /* Ready queue */
-extern list_t * sleep_queue;
 
 extern void arch_enter_tasklet(void);
 extern __attribute__((noreturn)) void arch_resume_user(void);
@@ -222,5 +295,10 @@ extern void arch_set_kernel_stack(uintptr_t);
 extern void arch_enter_user(uintptr_t entrypoint, int argc, char * argv[], char * envp[], uintptr_t stack);
 __attribute__((noreturn))
 extern void arch_enter_signal_handler(uintptr_t,int);
-extern void arch_wakeup_others(void);
+extern void arch_wakeup_core(int cpu);
+extern void arch_tlb_shootdown(uintptr_t start, uintptr_t end);
+extern void arch_tlb_shootdown_poll(void);
+extern void arch_timer_rearm(int new_slice);
+extern void arch_timer_notify(uint64_t expires);
+extern uint64_t timer_next_expiry(void);
 
@@ -7,14 +7,20 @@
 
 typedef struct {
 	unsigned char * buffer;
-	size_t write_ptr;
-	size_t read_ptr;
+	volatile size_t write_ptr; /* only moved by writers, under write_lock */
+	volatile size_t read_ptr;  /* only moved by readers, under read_lock */
 	size_t size;
-	spin_lock_t lock;
+	spin_lock_t lock;          /* held to go to sleep on, or wake, the wait queues */
+	spin_lock_t read_lock;
+	spin_lock_t write_lock;
 	list_t * wait_queue_readers;
 	list_t * wait_queue_writers;
+	volatile int readers_waiting;
+	volatile int writers_waiting;
 	int internal_stop;
-	list_t * alert_waiters;
+	spin_lock_t alert_lock;
+	list_t * alert_waiters;    /* told when there is something to read */
+	list_t * space_waiters;    /* told when there is room to write */
 	int discard;
 } ring_buffer_t;
 
@@ -23,10 +29,14 @@ size_t ring_buffer_size(fs_node_t * node);
 size_t ring_buffer_available(ring_buffer_t * ring_buffer);
 size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer);
 size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer);
+int ring_buffer_resize(ring_buffer_t * ring_buffer, size_t size);
 
 ring_buffer_t * ring_buffer_create(size_t size);
 void ring_buffer_destroy(ring_buffer_t * ring_buffer);
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer);
 void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer);
 void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process);
+void ring_buffer_space_wait(ring_buffer_t * ring_buffer, void * waiter);
+void ring_buffer_unwait(ring_buffer_t * ring_buffer, void * waiter);
+void ring_buffer_alert_space(ring_buffer_t * ring_buffer);
 
@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+ * Spinning reader/writer lock. Any number of readers may hold it
+ * at once; a writer waits for them to leave and holds off new ones
+ * in the meantime, so a stream of readers can't starve it.
+ */
+typedef volatile struct {
+	volatile int readers; /* -1 while a writer holds the lock */
+	volatile int writers; /* writers waiting for the lock */
+} rwlock_t;
+#define rwlock_init(lock) do { (lock).readers = 0; (lock).writers = 0; } while (0)
+
+#define rwlock_read_lock(lock) do { \
+	int _readers; \
+	do { \
+		while ((_readers = (lock).readers) < 0 || (lock).writers); \
+	} while (!__sync_bool_compare_and_swap(&(lock).readers, _readers, _readers + 1)); \
+} while (0)
+#define rwlock_read_unlock(lock) do { __sync_fetch_and_sub(&(lock).readers, 1); } while (0)
+
+#define rwlock_write_lock(lock) do { \
+	__sync_fetch_and_add(&(lock).writers, 1); \
+	while (!__sync_bool_compare_and_swap(&(lock).readers, 0, -1)); \
+	__sync_fetch_and_sub(&(lock).writers, 1); \
+} while (0)
+#define rwlock_write_unlock(lock) do { __sync_lock_release(&(lock).readers); } while (0)
@@ -7,12 +7,18 @@ typedef volatile struct {
 } spin_lock_t;
 #define spin_init(lock) do { (lock).owner = 0; (lock).latch[0] = 0; (lock).func = NULL; } while (0)
 
+/*
+ * The holder may be waiting for this core to answer a TLB shootdown,
+ * which can't arrive as an interrupt if we are spinning with them off.
+ */
+#define spin_lock_wait() arch_tlb_shootdown_poll()
+
 #define DEBUG_LOCKS
 #ifdef DEBUG_LOCKS
-#define spin_lock(lock) do { while (__sync_lock_test_and_set((lock).latch, 0x01)); (lock).owner = this_core->cpu_id+1; (lock).func = __func__; } while (0)
+#define spin_lock(lock) do { while (__sync_lock_test_and_set((lock).latch, 0x01)) spin_lock_wait(); (lock).owner = this_core->cpu_id+1; (lock).func = __func__; } while (0)
 #define spin_unlock(lock) do { (lock).func = NULL; (lock).owner = -1; __sync_lock_release((lock).latch); } while (0)
 #else
-#define spin_lock(lock) do { while (__sync_lock_test_and_set((lock).latch, 0x01)); } while(0)
+#define spin_lock(lock) do { while (__sync_lock_test_and_set((lock).latch, 0x01)) spin_lock_wait(); } while(0)
 #define spin_unlock(lock) __sync_lock_release((lock).latch);
 #endif
 
@@ -2,5 +2,8 @@
 
 #include <kernel/types.h>
 
+/* Subticks are microseconds; ticks are seconds. */
+#define SUBTICKS_PER_TICK 1000000
+
 extern void relative_time(unsigned long, unsigned long, unsigned long *, unsigned long *);
 extern uint64_t now(void);
@@ -1,10 +1,17 @@
 #pragma once
 #include <kernel/vfs.h>
-#include <kernel/list.h>
+#include <kernel/rwlock.h>
 #include <sys/types.h>
 
 fs_node_t * tmpfs_create(char * name);
 
+/* A run of physically contiguous pages holding part of a file */
+struct tmpfs_extent {
+	uintptr_t frame; /* first frame index */
+	size_t    start; /* first page of the file it holds */
+	size_t    pages;
+};
+
 struct tmpfs_file {
 	char * name;
 	int    type;
@@ -14,13 +21,24 @@ struct tmpfs_file {
 	unsigned int atime;
 	unsigned int mtime;
 	unsigned int ctime;
+	rwlock_t lock;
 	size_t length;
-	size_t block_count;
-	size_t pointers;
-	uintptr_t * blocks;
+	size_t pages;        /* pages allocated, across all extents */
+	size_t extent_count;
+	size_t extent_space;
+	struct tmpfs_extent * extents; /* sorted by start */
 	char * target;
 };
 
+/* A name in a directory; entries are hashed by name and also kept in creation order */
+struct tmpfs_dirent {
+	struct tmpfs_file * file; /* or a struct tmpfs_dir, going by file->type */
+	uint32_t hash;
+	struct tmpfs_dirent * chain;
+	struct tmpfs_dirent * prev;
+	struct tmpfs_dirent * next;
+};
+
 struct tmpfs_dir;
 
 struct tmpfs_dir {
@@ -32,7 +50,13 @@ struct tmpfs_dir {
 	unsigned int atime;
 	unsigned int mtime;
 	unsigned int ctime;
-	list_t * files;
+	rwlock_t lock;
+	size_t count;
+	size_t bucket_count; /* always a power of two */
+	struct tmpfs_dirent ** buckets;
+	struct tmpfs_dirent * first;
+	struct tmpfs_dirent * last;
+	unsigned long changes; /* bumped when an entry is removed, to invalidate readdir cursors */
 	struct tmpfs_dir * parent;
 };
 
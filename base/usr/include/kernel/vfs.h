@@ -30,6 +30,8 @@
 #define FS_PIPE        0x10
 #define FS_SYMLINK     0x20
 #define FS_MOUNTPOINT  0x40
+#define FS_DCACHE      0x80 /* Lookups in, or of, this node may be cached */
+#define FS_PAGECACHE   0x100 /* Reads and writes go through the page cache */
 
 #define _IFMT       0170000 /* type of file */
 #define     _IFDIR  0040000 /* directory */
@@ -58,6 +60,10 @@ typedef int (*symlink_type_t) (struct fs_node *, char * name, char * value);
 typedef ssize_t (*readlink_type_t) (struct fs_node *, char * buf, size_t size);
 typedef int (*selectcheck_type_t) (struct fs_node *);
 typedef int (*selectwait_type_t) (struct fs_node *, void * process);
+typedef int (*pollcheck_type_t) (struct fs_node *);
+typedef int (*pollwait_type_t) (struct fs_node *, void * waiter, int events);
+typedef void (*pollunwait_type_t) (struct fs_node *, void * waiter);
+typedef ssize_t (*getdents_type_t) (struct fs_node *, uint64_t * cursor, struct dirent * out, size_t count);
 typedef int (*chown_type_t) (struct fs_node *, uid_t, gid_t);
 typedef int (*truncate_type_t) (struct fs_node *);
 
@@ -103,6 +109,12 @@ typedef struct fs_node {
 	selectwait_type_t selectwait;
 
 	chown_type_t chown;
+
+	pollcheck_type_t pollcheck; /* POLLIN/POLLOUT/... for what wouldn't block right now */
+	pollwait_type_t pollwait;   /* like selectwait, but for any of the POLL* bits asked for */
+	pollunwait_type_t pollunwait; /* forget a waiter that was never alerted */
+
+	getdents_type_t getdents;   /* many readdirs at once, carrying on from *cursor */
 } fs_node_t;
 
 struct vfs_entry {
@@ -118,9 +130,11 @@ extern int pty_create(void *size, fs_node_t ** fs_master, fs_node_t ** fs_slave)
 int has_permission(fs_node_t *node, int permission_bit);
 ssize_t read_fs(fs_node_t *node,  off_t offset, size_t size, uint8_t *buffer);
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
+ssize_t splice_fs(fs_node_t * out, off_t * out_offset, fs_node_t * in, off_t * in_offset, size_t count);
 void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
 struct dirent *readdir_fs(fs_node_t *node, unsigned long index);
+ssize_t getdents_fs(fs_node_t *node, uint64_t * cursor, struct dirent * out, size_t count);
 fs_node_t *finddir_fs(fs_node_t *node, char *name);
 int mkdir_fs(char *name, mode_t permission);
 int create_file_fs(char *name, mode_t permission);
@@ -135,6 +149,9 @@ int symlink_fs(char * value, char * name);
 ssize_t readlink_fs(fs_node_t * node, char * buf, size_t size);
 int selectcheck_fs(fs_node_t * node);
 int selectwait_fs(fs_node_t * node, void * process);
+int pollcheck_fs(fs_node_t * node);
+int pollwait_fs(fs_node_t * node, void * waiter, int events);
+void pollunwait_fs(fs_node_t * node, void * waiter);
 int truncate_fs(fs_node_t * node);
 
 void vfs_install(void);
@@ -151,3 +168,17 @@ void map_vfs_directory(const char *);
 
 int make_unix_pipe(fs_node_t ** pipes);
 
+struct dcache_stats {
+	size_t entries;
+	size_t capacity;
+	size_t hits;
+	size_t negative_hits;
+	size_t misses;
+	size_t evictions;
+	size_t invalidations;
+};
+
+fs_node_t * dcache_lookup(fs_node_t * dir, char * name);
+void dcache_invalidate(void);
+void dcache_get_stats(struct dcache_stats * stats);
+
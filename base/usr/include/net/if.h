@@ -1,6 +1,7 @@
 #pragma once
 
 #include <_cheader.h>
+#include <stdint.h>
 
 _Begin_C_Header
 
@@ -20,6 +21,20 @@ _Begin_C_Header
 #define SIOCGIFGATEWAY  0x12340007
 #define SIOCSIFGATEWAY  0x12340017
 
+/* These two are made on a socket, not an interface */
+#define SIOCADDRT       0x12340030 /* Add a route */
+#define SIOCDELRT       0x12340031 /* Delete a route */
+
+/**
+ * A route for SIOCADDRT and SIOCDELRT; addresses are in network order.
+ */
+struct rtentry {
+	uint32_t rt_dst;
+	uint32_t rt_genmask;
+	uint32_t rt_gateway;  /* 0 if the destination is directly attached */
+	char     rt_dev[32];  /* interface name; may be empty for SIOCDELRT */
+};
+
 /**
  * Flags for interface status
  */
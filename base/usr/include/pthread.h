@@ -13,7 +13,7 @@ typedef struct {
 typedef unsigned int pthread_attr_t;
 
 typedef struct {
-	int volatile atomic_lock;
+	int volatile waiters;
 	int volatile readers;
 	int writerPid;
 } pthread_rwlock_t;
@@ -28,12 +28,28 @@ extern int gettid();
 extern void pthread_cleanup_push(void (*routine)(void *), void *arg);
 extern void pthread_cleanup_pop(int execute);
 
+/* 0 = unlocked, 1 = locked, 2 = locked with waiters */
 typedef int volatile pthread_mutex_t;
 typedef int pthread_mutexattr_t;
 
+typedef struct {
+	int volatile seq;
+} pthread_cond_t;
+typedef int pthread_condattr_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned int count;
+	unsigned int waiting;
+	int volatile generation;
+} pthread_barrier_t;
+typedef int pthread_barrierattr_t;
+
 extern int pthread_join(pthread_t thread, void **retval);
 
 #define PTHREAD_MUTEX_INITIALIZER 0
+#define PTHREAD_COND_INITIALIZER {0}
+#define PTHREAD_BARRIER_SERIAL_THREAD -1
 
 extern int pthread_mutex_lock(pthread_mutex_t *mutex);
 extern int pthread_mutex_trylock(pthread_mutex_t *mutex);
@@ -41,6 +57,16 @@ extern int pthread_mutex_unlock(pthread_mutex_t *mutex);
 extern int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
 extern int pthread_mutex_destroy(pthread_mutex_t *mutex);
 
+extern int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+extern int pthread_cond_destroy(pthread_cond_t *cond);
+extern int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+extern int pthread_cond_signal(pthread_cond_t *cond);
+extern int pthread_cond_broadcast(pthread_cond_t *cond);
+
+extern int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count);
+extern int pthread_barrier_destroy(pthread_barrier_t *barrier);
+extern int pthread_barrier_wait(pthread_barrier_t *barrier);
+
 extern int pthread_attr_init(pthread_attr_t *attr);
 extern int pthread_attr_destroy(pthread_attr_t *attr);
 
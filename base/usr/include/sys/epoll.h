@@ -0,0 +1,42 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <poll.h>
+
+_Begin_C_Header
+
+/* Readiness bits share their values with poll(). */
+#define EPOLLIN      POLLIN
+#define EPOLLOUT     POLLOUT
+#define EPOLLRDHUP   POLLRDHUP
+#define EPOLLERR     POLLERR
+#define EPOLLHUP     POLLHUP
+#define EPOLLPRI     POLLPRI
+
+#define EPOLLONESHOT (1U << 30) /* Stop reporting after one event, until EPOLL_CTL_MOD */
+#define EPOLLET      (1U << 31) /* Report each change once instead of for as long as it lasts */
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef union epoll_data {
+	void * ptr;
+	int fd;
+	uint32_t u32;
+	uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+	uint32_t events;
+	epoll_data_t data;
+};
+
+#ifndef _KERNEL_
+extern int epoll_create(int size);
+extern int epoll_ctl(int epfd, int op, int fd, struct epoll_event * event);
+extern int epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout);
+#endif
+
+_End_C_Header
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+/*
+ * A submission/completion ring shared with the kernel.
+ *
+ * The ring lives in memory the process provides: a struct ioring,
+ * then `entries` submission entries, then twice as many completion
+ * entries; IORING_SIZE gives the size. The process fills in
+ * submission entries and moves sq_tail; ioring_enter runs them and
+ * moves sq_head. The kernel posts completions and moves cq_tail; the
+ * process reads them and moves cq_head.
+ */
+
+#define IORING_OP_NOP      0
+#define IORING_OP_READ     1  /* read(fd, addr, len), at off, or the file position if off is -1 */
+#define IORING_OP_WRITE    2  /* write(fd, addr, len), likewise */
+#define IORING_OP_POLL_ADD 3  /* wait for any of events; completes with the POLL* bits that are set */
+#define IORING_OP_FSWAIT   4  /* wait for fd to be readable, as fswait() does; completes with 0 */
+#define IORING_OP_ACCEPT   5  /* accept(fd, addr, addr2) */
+#define IORING_OP_RECV     6  /* recvmsg(fd, addr, msg_flags) */
+#define IORING_OP_SEND     7  /* sendmsg(fd, addr, msg_flags) */
+#define IORING_OP_TIMEOUT  8  /* completes with -ETIME after off milliseconds */
+
+#define IORING_MAX_ENTRIES 4096
+
+struct ioring_sqe {
+	uint8_t  opcode;
+	uint8_t  flags;     /* must be 0 */
+	uint16_t events;    /* IORING_OP_POLL_ADD */
+	int32_t  fd;
+	int64_t  off;
+	uint64_t addr;
+	uint64_t addr2;
+	uint32_t len;
+	uint32_t msg_flags;
+	uint64_t user_data; /* handed back in the completion */
+};
+
+struct ioring_cqe {
+	uint64_t user_data;
+	int32_t  res;       /* what the call would have returned, or -errno */
+	uint32_t flags;
+};
+
+struct ioring {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	uint32_t entries;
+	uint32_t reserved;
+};
+
+#define IORING_SIZE(entries) \
+	(sizeof(struct ioring) + (entries) * sizeof(struct ioring_sqe) + 2 * (entries) * sizeof(struct ioring_cqe))
+#define IORING_SQES(ring) ((struct ioring_sqe *)((struct ioring *)(ring) + 1))
+#define IORING_CQES(ring) ((struct ioring_cqe *)(IORING_SQES(ring) + (ring)->entries))
+
+#ifndef _KERNEL_
+extern int ioring_setup(unsigned int entries, struct ioring * ring);
+extern int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete);
+
+/* Helpers for filling and draining a ring. */
+extern struct ioring_sqe * ioring_get_sqe(struct ioring * ring);
+extern struct ioring_cqe * ioring_peek_cqe(struct ioring * ring);
+extern void ioring_cqe_seen(struct ioring * ring);
+#endif
+
+_End_C_Header
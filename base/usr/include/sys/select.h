@@ -0,0 +1,18 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+_Begin_C_Header
+
+#define __FD_BITS (8 * sizeof(fd_mask))
+
+#define FD_ZERO(set)     do { for (unsigned int __i = 0; __i < FD_SETSIZE / __FD_BITS; ++__i) (set)->fds_bits[__i] = 0; } while (0)
+#define FD_SET(fd, set)   ((set)->fds_bits[(fd) / __FD_BITS] |= (1U << ((fd) % __FD_BITS)))
+#define FD_CLR(fd, set)   ((set)->fds_bits[(fd) / __FD_BITS] &= ~(1U << ((fd) % __FD_BITS)))
+#define FD_ISSET(fd, set) (!!((set)->fds_bits[(fd) / __FD_BITS] & (1U << ((fd) % __FD_BITS))))
+
+extern int select(int nfds, fd_set * readfds, fd_set * writefds, fd_set * exceptfds, struct timeval * timeout);
+
+_End_C_Header
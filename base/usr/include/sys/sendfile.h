@@ -0,0 +1,10 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+
+_Begin_C_Header
+
+extern ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count);
+
+_End_C_Header
@@ -29,7 +29,7 @@ typedef int pid_t;
 #define FD_SETSIZE 64 /* compatibility with newlib */
 typedef unsigned int fd_mask;
 typedef struct _fd_set {
-    fd_mask fds_bits[1]; /* should be 64 bits */
+    fd_mask fds_bits[FD_SETSIZE / (8 * sizeof(fd_mask))];
 } fd_set;
 
 _End_C_Header
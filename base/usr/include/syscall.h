@@ -124,6 +124,11 @@ DECL_SYSCALL0(setsid);
 DECL_SYSCALL2(setpgid,int,int);
 DECL_SYSCALL1(getpgid,int);
 DECL_SYSCALL4(fswait3, int, int*, int, int*);
+DECL_SYSCALL1(mmap, void *);
+DECL_SYSCALL2(munmap, void *, size_t);
+DECL_SYSCALL3(mprotect, void *, size_t, int);
+DECL_SYSCALL3(futex, volatile int *, int, int);
+DECL_SYSCALL2(nanosleep, const void *, void *);
 
 _End_C_Header
 
@@ -65,3 +65,20 @@
 #define SYS_SETPGID 63
 #define SYS_GETPGID 64
 #define SYS_FSWAIT3 65
+#define SYS_MMAP 66
+#define SYS_MUNMAP 67
+#define SYS_MPROTECT 68
+#define SYS_FUTEX 69
+#define SYS_NANOSLEEP 70
+#define SYS_PREAD 71
+#define SYS_PWRITE 72
+#define SYS_READV 73
+#define SYS_WRITEV 74
+#define SYS_SENDFILE 75
+#define SYS_EPOLL_CREATE 76
+#define SYS_EPOLL_CTL 77
+#define SYS_EPOLL_WAIT 78
+#define SYS_POLL 79
+#define SYS_GETDENTS 80
+#define SYS_IORING_SETUP 81
+#define SYS_IORING_ENTER 82
@@ -48,5 +48,6 @@ typedef int clockid_t;
 #define CLOCK_MONOTONIC 1
 
 extern int clock_gettime(clockid_t clk_id, struct timespec *tp);
+extern int nanosleep(const struct timespec *req, struct timespec *rem);
 
 _End_C_Header
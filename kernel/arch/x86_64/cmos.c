@@ -11,6 +11,7 @@
 #include <kernel/printf.h>
 #include <kernel/string.h>
 #include <kernel/process.h>
+#include <kernel/time.h>
 #include <kernel/arch/x86_64/ports.h>
 #include <kernel/arch/x86_64/irq.h>
 #include <sys/time.h>
@@ -201,7 +202,6 @@ void arch_clock_initialize(void) {
 	if (tsc_mhz == 0) tsc_mhz = 2000; /* uh oh */
 }
 
-#define SUBTICKS_PER_TICK 1000000
 static void update_ticks(void) {
 	uint64_t tsc = read_tsc();
 	timer_subticks = tsc / tsc_mhz;
@@ -235,8 +235,10 @@ void relative_time(unsigned long seconds, unsigned long subseconds, unsigned lon
 }
 
 int cmos_time_stuff(struct regs *r) {
+	this_core->timer_irqs++;
 	update_ticks();
 	wakeup_sleepers(timer_ticks, timer_subticks);
+	process_balance_queues();
 	irq_ack(0);
 	switch_task(1);
 	asm volatile (
@@ -6,6 +6,7 @@
 #include <kernel/process.h>
 #include <kernel/signal.h>
 #include <kernel/misc.h>
+#include <kernel/mmap.h>
 
 #include <sys/time.h>
 #include <sys/utsname.h>
@@ -86,7 +87,8 @@ void idt_install(void) {
 	idt_set_gate(46, _irq14, 0x08, 0x8E, 0);
 	idt_set_gate(47, _irq15, 0x08, 0x8E, 0);
 
-	idt_set_gate(124, _isr124, 0x08, 0x8E, 0); /* Bad TLB shootdown. */
+	idt_set_gate(123, _isr123, 0x08, 0x8E, 0); /* Local APIC timer, also sent as an IPI to move the BSP's deadline. */
+	idt_set_gate(124, _isr124, 0x08, 0x8E, 0); /* TLB shootdown, flushes the range requested by another core. */
 	idt_set_gate(125, _isr125, 0x08, 0x8E, 0); /* Halts everyone. */
 	idt_set_gate(126, _isr126, 0x08, 0x8E, 0); /* Does nothing, used to exit wait-for-interrupt sleep. */
 	idt_set_gate(127, _isr127, 0x08, 0x8E, 1); /* Legacy system call entry point, called by userspace. */
@@ -178,6 +180,14 @@ struct regs * isr_handler(struct regs * r) {
 		case 14: /* Page fault */ {
 			uintptr_t faulting_address;
 			asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
+			/* Faults in the user half may be for a page of an mmap'd region that
+			 * hasn't been touched yet, or for a copy-on-write page shared by fork.
+			 * Either can be hit by the kernel as well. */
+			if (faulting_address < 0x800000000000 && this_core->current_process) {
+				int mapped = mmap_page_fault(faulting_address, r->err_code);
+				if (mapped > 0) break;
+				if (!mapped && (r->err_code & 0x3) == 0x3 && mmu_copy_on_write(faulting_address)) break;
+			}
 			if (!this_core->current_process || r->cs == 0x08) {
 				arch_fatal();
 			}
@@ -224,6 +234,14 @@ struct regs * isr_handler(struct regs * r) {
 			arch_fatal();
 			break;
 		}
+		case 123: /* Local APIC timer */ {
+			lapic_timer_handler(r);
+			break;
+		}
+		case 124: /* TLB shootdown */ {
+			arch_tlb_shootdown_handler();
+			break;
+		}
 		case 127: /* syscall */ {
 			syscall_handler(r);
 			asm volatile("sti");
@@ -259,7 +277,7 @@ struct regs * isr_handler(struct regs * r) {
 
 done:
 
-	if (this_core->current_process == this_core->kernel_idle_task && process_queue && process_queue->head) {
+	if (this_core->current_process == this_core->kernel_idle_task && this_core->ready_queue && this_core->ready_queue->head) {
 		/* If this is kidle and we got here, instead of finishing the interrupt
 		 * we can just switch task and there will probably be something else
 		 * to run that was awoken by the interrupt. */
@@ -0,0 +1,214 @@
+/**
+ * @file  kernel/arch/x86_64/lapic_timer.c
+ * @brief Per-core one-shot timers using the local APIC.
+ *
+ * Replaces the PIT as the source of preemption and timed wakeups.
+ * Rather than ticking at a fixed rate, each core programs its own
+ * local APIC timer for the next thing it needs to do: the end of
+ * the current timeslice when something is running, and - on the
+ * BSP, which services the sleep queue - the next timed wakeup.
+ * An idle core with nothing to wait for doesn't take any timer
+ * interrupts at all.
+ *
+ * Where the CPU supports it, the timer runs in TSC-deadline mode,
+ * which takes an absolute TSC value and needs no calibration.
+ * Otherwise it runs in one-shot mode with a rate measured against
+ * the TSC at startup.
+ *
+ * If there is no local APIC, the PIT is still used instead.
+ */
+#include <stdint.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/time.h>
+#include <kernel/arch/x86_64/regs.h>
+#include <kernel/arch/x86_64/irq.h>
+
+#define LAPIC_TIMER_VECTOR 123
+
+#define LAPIC_EOI          0x0B0
+#define LAPIC_SVR          0x0F0
+#define LAPIC_LVT_TIMER    0x320
+#define LAPIC_INITIAL      0x380
+#define LAPIC_CURRENT      0x390
+#define LAPIC_DIVIDE       0x3E0
+
+#define LVT_MASKED         0x10000
+#define LVT_TSC_DEADLINE   0x40000
+
+#define MSR_TSC_DEADLINE   0x6E0
+
+/* Length of a timeslice, in subticks; the same as the old 100Hz tick */
+#define TIMESLICE 10000
+
+extern uintptr_t lapic_final;
+extern unsigned long tsc_mhz;
+extern void lapic_write(size_t addr, uint32_t value);
+extern uint32_t lapic_read(size_t addr);
+extern void lapic_send_ipi(int i, uint32_t val);
+extern void wakeup_sleepers(unsigned long seconds, unsigned long subseconds);
+
+static int lapic_timer_enabled = 0;
+static int tsc_deadline = 0;
+static uint64_t lapic_ticks_per_ms = 0;
+
+static inline uint64_t read_tsc(void) {
+	uint32_t lo, hi;
+	asm volatile ( "rdtsc" : "=a"(lo), "=d"(hi) );
+	return ((uint64_t)hi << 32) | (uint64_t)lo;
+}
+
+static inline uint64_t subticks_now(void) {
+	return read_tsc() / tsc_mhz;
+}
+
+/**
+ * @brief Program this core's timer to fire at @p deadline.
+ *
+ * A deadline of UINT64_MAX stops the timer.
+ */
+static void lapic_timer_program(uint64_t deadline) {
+	this_core->timer_deadline = deadline;
+
+	if (tsc_deadline) {
+		uint64_t tsc = deadline == UINT64_MAX ? 0 : deadline * tsc_mhz;
+		if (deadline != UINT64_MAX && !tsc) tsc = 1;
+		asm volatile ("wrmsr" : : "c"(MSR_TSC_DEADLINE), "d"((uint32_t)(tsc >> 32)), "a"((uint32_t)(tsc & 0xFFFFFFFF)));
+		return;
+	}
+
+	if (deadline == UINT64_MAX) {
+		lapic_write(LAPIC_INITIAL, 0);
+		return;
+	}
+
+	uint64_t now = subticks_now();
+	uint64_t count = deadline > now ? ((deadline - now) * lapic_ticks_per_ms) / 1000 : 0;
+	if (count < 1) count = 1;
+	if (count > 0xFFFFFFFF) count = 0xFFFFFFFF; /* we'll just come back and try again */
+	lapic_write(LAPIC_INITIAL, count);
+}
+
+/**
+ * @brief Point this core's timer at whatever it needs to do next.
+ *
+ * @param new_slice Start a new timeslice for the current process.
+ */
+void arch_timer_rearm(int new_slice) {
+	if (!lapic_timer_enabled) return;
+
+	uint64_t deadline = UINT64_MAX;
+
+	if (this_core->current_process != this_core->kernel_idle_task) {
+		if (new_slice) this_core->timeslice_end = subticks_now() + TIMESLICE;
+		deadline = this_core->timeslice_end;
+	}
+
+	if (this_core->cpu_id == 0) {
+		uint64_t next = timer_next_expiry();
+		if (next < deadline) deadline = next;
+	}
+
+	if (deadline != this_core->timer_deadline) {
+		lapic_timer_program(deadline);
+	}
+}
+
+/**
+ * @brief Called when a timed wakeup is armed earlier than any before it.
+ *
+ * If the BSP's timer won't go off in time, bring it forward; another
+ * core does that by sending the BSP a timer interrupt of its own.
+ */
+void arch_timer_notify(uint64_t expires) {
+	if (!lapic_timer_enabled) return;
+	if (expires >= processor_local_data[0].timer_deadline) return;
+
+	if (this_core->cpu_id == 0) {
+		arch_timer_rearm(0);
+	} else {
+		lapic_send_ipi(processor_local_data[0].lapic_id, LAPIC_TIMER_VECTOR);
+	}
+}
+
+/**
+ * @brief Handle a timer interrupt on this core.
+ *
+ * Runs any timed wakeups that are due, preempts the current process
+ * if its timeslice is up, and programs the next interrupt.
+ */
+void lapic_timer_handler(struct regs * r) {
+	this_core->timer_irqs++;
+	this_core->timer_deadline = UINT64_MAX;
+	lapic_write(LAPIC_EOI, 0);
+
+	unsigned long seconds, subseconds;
+	relative_time(0, 0, &seconds, &subseconds);
+	wakeup_sleepers(seconds, subseconds);
+
+	uint64_t now = (uint64_t)seconds * SUBTICKS_PER_TICK + subseconds;
+	if (this_core->current_process != this_core->kernel_idle_task && now >= this_core->timeslice_end) {
+		if (this_core->cpu_id == 0) process_balance_queues();
+		switch_task(1);
+	}
+
+	arch_timer_rearm(0);
+}
+
+/**
+ * @brief Set up the local APIC timer on this core.
+ *
+ * The first core to get here works out how the timer should be run.
+ */
+void lapic_timer_initialize(void) {
+	if (!lapic_final) return;
+
+	/* Enable the local APIC, with the same spurious vector the APs use */
+	lapic_write(LAPIC_SVR, 0x127);
+
+	if (!lapic_timer_enabled) {
+		uint32_t eax, ebx, ecx, edx;
+		asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+		tsc_deadline = !!(ecx & (1 << 24));
+
+		if (!tsc_deadline) {
+			/* Count down for 10ms and see how far we got */
+			lapic_write(LAPIC_DIVIDE, 0xB); /* divide by 1 */
+			lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+			lapic_write(LAPIC_INITIAL, 0xFFFFFFFF);
+			uint64_t end = read_tsc() + 10000 * tsc_mhz;
+			while (read_tsc() < end);
+			uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_CURRENT);
+			lapic_write(LAPIC_INITIAL, 0);
+			lapic_ticks_per_ms = elapsed / 10;
+			if (!lapic_ticks_per_ms) {
+				printf("lapic: timer did not count; falling back to the PIT\n");
+				return;
+			}
+		}
+
+		printf("lapic: using %s timers\n", tsc_deadline ? "TSC-deadline" : "one-shot");
+		lapic_timer_enabled = 1;
+	}
+
+	if (tsc_deadline) {
+		lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_TSC_DEADLINE);
+		asm volatile ("mfence" ::: "memory");
+	} else {
+		lapic_write(LAPIC_DIVIDE, 0xB);
+		lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+	}
+
+	this_core->timer_deadline = UINT64_MAX;
+	this_core->timeslice_end = UINT64_MAX;
+	arch_timer_rearm(1);
+}
+
+/**
+ * @brief Whether the local APIC timers are in use.
+ *
+ * Used at startup to decide if the PIT is still needed.
+ */
+int lapic_timer_active(void) {
+	return lapic_timer_enabled;
+}
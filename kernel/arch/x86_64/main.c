@@ -36,6 +36,8 @@ extern void gdt_install(void);
 extern void idt_install(void);
 extern void pic_initialize(void);
 extern void pit_initialize(void);
+extern void lapic_timer_initialize(void);
+extern int lapic_timer_active(void);
 extern void smp_initialize(void);
 extern void portio_initialize(void);
 extern void ps2hid_install(void);
@@ -284,8 +286,11 @@ int kmain(struct multiboot * mboot, uint32_t mboot_mag, void* esp) {
 	/* Decompress and mount all initial ramdisks. */
 	mount_multiboot_ramdisks(mboot);
 
-	/* Set up preempt source */
-	pit_initialize();
+	/* Set up preempt source; the PIT is only needed without local APIC timers. */
+	lapic_timer_initialize();
+	if (!lapic_timer_active()) {
+		pit_initialize();
+	}
 
 	/* Install generic PC device drivers. */
 	ps2hid_install();
@@ -10,17 +10,56 @@
 #include <kernel/process.h>
 #include <kernel/spinlock.h>
 #include <kernel/misc.h>
+#include <kernel/pagecache.h>
 #include <kernel/arch/x86_64/pml.h>
 #include <kernel/arch/x86_64/mmu.h>
 
-extern void arch_tlb_shootdown(void);
-
 /**
- * bitmap page allocator for 4KiB pages
+ * Physical frame allocator for 4KiB pages.
+ *
+ * The bitmap is the authority on whether a frame is in use. Free frames
+ * are also indexed by a binary buddy allocator so that single and
+ * contiguous allocations don't have to scan the bitmap: every free block
+ * of 2^n frames is linked into free_lists[n] through a header stored in
+ * its first frame, and frame_orders records the order of each frame that
+ * heads a free block. Allocations of single frames are further served
+ * from small per-core caches that are refilled in batches.
  */
 static volatile uint32_t *frames;
 static uint32_t nframes;
 
+/**
+ * Reference counts for frames shared between address spaces by a
+ * copy-on-write fork. Zero means the frame is not shared and belongs
+ * to whichever single page table entry maps it. Protected by the
+ * frame allocation lock.
+ */
+static volatile uint8_t * mem_refcounts;
+#define REFCOUNT_MAX 0xFF
+
+#define BUDDY_MAX_ORDER 16
+#define BUDDY_NOT_HEAD  0xFF
+
+struct buddy_block {
+	struct buddy_block * next;
+	struct buddy_block * prev;
+};
+
+static struct buddy_block * free_lists[BUDDY_MAX_ORDER+1];
+static volatile uint8_t * frame_orders;
+static size_t used_frames = 0;
+
+#define FRAME_CACHE_SIZE  32
+#define FRAME_CACHE_BATCH 16
+
+/* Below this many free frames, ask the page cache to give some back */
+#define RECLAIM_WATERMARK 1024
+
+static struct frame_cache {
+	uintptr_t frames[FRAME_CACHE_SIZE];
+	size_t count;
+} frame_caches[32];
+
 #define PAGE_SHIFT     12
 #define PAGE_SIZE      0x1000UL
 #define PAGE_SIZE_MASK 0xFFFFffffFFFFf000UL
@@ -53,58 +92,186 @@ static uint32_t nframes;
 #define INDEX_FROM_BIT(b)  ((b) >> 5)
 #define OFFSET_FROM_BIT(b) ((b) & 0x1F)
 
+static spin_lock_t frame_alloc_lock = { 0 };
+static spin_lock_t kheap_lock = { 0 };
+static spin_lock_t mmio_space_lock = { 0 };
+static spin_lock_t module_space_lock = { 0 };
+
+static inline int frame_bit_test(uintptr_t index) {
+	asm ("" ::: "memory");
+	return !!(frames[INDEX_FROM_BIT(index)] & ((uint32_t)1 << OFFSET_FROM_BIT(index)));
+}
+
+static inline void frame_bit_set(uintptr_t index) {
+	frames[INDEX_FROM_BIT(index)] |= ((uint32_t)1 << OFFSET_FROM_BIT(index));
+	asm ("" ::: "memory");
+}
+
+static inline void frame_bit_clear(uintptr_t index) {
+	frames[INDEX_FROM_BIT(index)] &= ~((uint32_t)1 << OFFSET_FROM_BIT(index));
+	asm ("" ::: "memory");
+}
+
+static inline uintptr_t buddy_index(struct buddy_block * block) {
+	return ((uintptr_t)block & PHYS_MASK) >> PAGE_SHIFT;
+}
+
+static void buddy_push(uintptr_t index, int order) {
+	struct buddy_block * block = mmu_map_from_physical(index << PAGE_SHIFT);
+	block->prev = NULL;
+	block->next = free_lists[order];
+	if (block->next) block->next->prev = block;
+	free_lists[order] = block;
+	frame_orders[index] = order;
+}
+
+static void buddy_remove(uintptr_t index, int order) {
+	struct buddy_block * block = mmu_map_from_physical(index << PAGE_SHIFT);
+	if (block->prev) block->prev->next = block->next;
+	else free_lists[order] = block->next;
+	if (block->next) block->next->prev = block->prev;
+	frame_orders[index] = BUDDY_NOT_HEAD;
+}
+
+/**
+ * @brief Add a range of free frames to the buddy lists as large aligned blocks.
+ */
+static void buddy_free_range(uintptr_t start, uintptr_t end) {
+	while (start < end) {
+		int order = BUDDY_MAX_ORDER;
+		while (order && ((start & ((1UL << order) - 1)) || start + (1UL << order) > end)) order--;
+		buddy_push(start, order);
+		start += 1UL << order;
+	}
+}
+
+/**
+ * @brief Allocate a block of 2^order frames and mark them as used.
+ *
+ * Must be called with the frame allocation lock held.
+ *
+ * @returns a frame index, or -1 if no block that large is free.
+ */
+static uintptr_t buddy_allocate(int order) {
+	int o = order;
+	while (o <= BUDDY_MAX_ORDER && !free_lists[o]) o++;
+	if (o > BUDDY_MAX_ORDER) return (uintptr_t)-1;
+
+	uintptr_t index = buddy_index(free_lists[o]);
+	buddy_remove(index, o);
+
+	/* Give back the upper halves we don't need */
+	while (o > order) {
+		o--;
+		buddy_push(index + (1UL << o), o);
+	}
+
+	for (uintptr_t i = 0; i < (1UL << order); ++i) {
+		frame_bit_set(index + i);
+	}
+	used_frames += 1UL << order;
+	return index;
+}
+
+/**
+ * @brief Mark an arbitrary frame as used.
+ *
+ * If the frame is free, the buddy block containing it is split
+ * until the frame is on its own. Must be called with the frame
+ * allocation lock held.
+ */
+static void frame_mark_used(uintptr_t index) {
+	if (index >= nframes || frame_bit_test(index)) return;
+
+	for (int order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+		uintptr_t head = index & ~((1UL << order) - 1);
+		if (frame_orders[head] != order) continue;
+		buddy_remove(head, order);
+		while (order) {
+			order--;
+			uintptr_t half = 1UL << order;
+			if (index >= head + half) {
+				buddy_push(head, order);
+				head += half;
+			} else {
+				buddy_push(head + half, order);
+			}
+		}
+		break;
+	}
+
+	frame_bit_set(index);
+	used_frames++;
+}
+
+/**
+ * @brief Return a frame to the buddy lists, merging it with free buddies.
+ *
+ * Must be called with the frame allocation lock held.
+ */
+static void frame_mark_free(uintptr_t index) {
+	if (index >= nframes || !frame_bit_test(index)) return;
+
+	frame_bit_clear(index);
+	used_frames--;
+
+	int order = 0;
+	while (order < BUDDY_MAX_ORDER) {
+		uintptr_t buddy = index ^ (1UL << order);
+		if (buddy + (1UL << order) > nframes || frame_orders[buddy] != order) break;
+		buddy_remove(buddy, order);
+		index &= ~(1UL << order);
+		order++;
+	}
+
+	buddy_push(index, order);
+}
+
 void mmu_frame_set(uintptr_t frame_addr) {
 	/* If the frame is within bounds... */
 	if (frame_addr < nframes * 4 * 0x400) {
-		uint64_t frame  = frame_addr >> 12;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		frames[index]  |= ((uint32_t)1 << offset);
-		asm ("" ::: "memory");
+		spin_lock(frame_alloc_lock);
+		frame_mark_used(frame_addr >> PAGE_SHIFT);
+		spin_unlock(frame_alloc_lock);
 	}
 }
 
 void mmu_frame_clear(uintptr_t frame_addr) {
 	/* If the frame is within bounds... */
 	if (frame_addr < nframes * 4 * 0x400) {
-		uint64_t frame  = frame_addr >> PAGE_SHIFT;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		frames[index]  &= ~((uint32_t)1 << offset);
-		asm ("" ::: "memory");
+		spin_lock(frame_alloc_lock);
+		frame_mark_free(frame_addr >> PAGE_SHIFT);
+		spin_unlock(frame_alloc_lock);
 	}
 }
 
 int mmu_frame_test(uintptr_t frame_addr) {
 	if (!(frame_addr < nframes * 4 * 0x400)) return 0;
-	uint64_t frame  = frame_addr >> PAGE_SHIFT;
-	uint64_t index  = INDEX_FROM_BIT(frame);
-	uint32_t offset = OFFSET_FROM_BIT(frame);
-	asm ("" ::: "memory");
-	return !!(frames[index] & ((uint32_t)1 << offset));
+	return frame_bit_test(frame_addr >> PAGE_SHIFT);
 }
 
-static spin_lock_t frame_alloc_lock = { 0 };
-static spin_lock_t kheap_lock = { 0 };
-static spin_lock_t mmio_space_lock = { 0 };
-static spin_lock_t module_space_lock = { 0 };
-
 /**
  * @brief Find the first range of @p n contiguous frames.
  *
- * If a large enough region could not be found, results are fatal.
+ * Scans the bitmap directly and does not mark the frames as used;
+ * this is the fallback for contiguous requests larger than the
+ * biggest buddy block. If a large enough region could not be found,
+ * results are fatal.
  */
 uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
+	uintptr_t i = 0;
+	while (i + n <= nframes) {
 		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (mmu_frame_test(i + PAGE_SIZE * j)) {
+		for (int j = n - 1; j >= 0; --j) {
+			if (frame_bit_test(i + j)) {
 				bad = j + 1;
+				break;
 			}
 		}
 		if (!bad) {
-			return i / PAGE_SIZE;
+			return i;
 		}
+		i += bad;
 	}
 
 	printf("failed to allocate %d contiguous frames\n", n);
@@ -113,17 +280,13 @@ uintptr_t mmu_first_n_frames(int n) {
 }
 
 /**
- * @brief Find the first available frame from the bitmap.
+ * @brief Find an available frame.
+ *
+ * Returns the head of the smallest free buddy block, without allocating it.
  */
 uintptr_t mmu_first_frame(void) {
-	uintptr_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		if (frames[i] != (uint32_t)-1) {
-			for (j = 0; j < (sizeof(uint32_t)*8); ++j) {
-				uint32_t testFrame = (uint32_t)1 << j;
-				if (!(frames[i] & testFrame)) return (i << 5) + j;
-			}
-		}
+	for (int o = 0; o <= BUDDY_MAX_ORDER; ++o) {
+		if (free_lists[o]) return buddy_index(free_lists[o]);
 	}
 
 	printf("error: out allocatable frames\n");
@@ -136,18 +299,17 @@ uintptr_t mmu_first_frame(void) {
  *
  * Sets the page bits based on the the value of @p flags.
  * If @p page->bits.page is unset, a new frame will be allocated.
+ * A page still waiting on a copy-on-write copy stays read-only;
+ * the write fault will make it writable once it has its own frame.
  */
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
-		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
-		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
+		page->bits.page = mmu_allocate_a_frame();
+		page->bits.cow_pending = 0;
 	}
 	page->bits.size     = 0;
 	page->bits.present  = 1;
-	page->bits.writable = (flags & MMU_FLAG_WRITABLE) ? 1 : 0;
+	page->bits.writable = (flags & MMU_FLAG_WRITABLE) && !page->bits.cow_pending ? 1 : 0;
 	page->bits.user     = (flags & MMU_FLAG_KERNEL)   ? 0 : 1;
 	page->bits.nocache  = (flags & MMU_FLAG_NOCACHE)  ? 1 : 0;
 	page->bits.writethrough  = (flags & MMU_FLAG_WRITETHROUGH)  ? 1 : 0;
@@ -161,6 +323,7 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr) {
 	mmu_frame_set(physAddr);
 	page->bits.page = physAddr >> PAGE_SHIFT;
+	page->bits.cow_pending = 0;
 	mmu_frame_allocate(page, flags);
 }
 
@@ -170,7 +333,8 @@ union PML init_page_region[3][512] _pagemap;
 union PML high_base_pml[512] _pagemap;
 union PML heap_base_pml[512] _pagemap;
 union PML heap_base_pd[512] _pagemap;
-union PML heap_base_pt[512] _pagemap;
+#define HEAP_BASE_PTS 8
+union PML heap_base_pt[HEAP_BASE_PTS][512] _pagemap;
 union PML low_base_pmls[34][512] _pagemap;
 union PML twom_high_pds[4][512] _pagemap;
 
@@ -250,10 +414,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	/* Get the PML4 entry for this address */
 	if (!root[pml4_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		root[pml4_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -263,10 +424,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 
 	if (!pdp[pdp_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pdp[pdp_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -281,10 +439,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 
 	if (!pd[pd_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pd[pd_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -299,17 +454,65 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	return (union PML *)&pt[pt_entry];
 
 _noentry:
-	printf("no entry for requested page\n");
 	return NULL;
 }
 
 /**
- * @brief Create a new address space with the same contents of an existing one.
+ * @brief Share a user page between two address spaces.
  *
- * Allocates all of the necessary intermediary directory levels for a new address space
- * and also copies data from the existing address space.
+ * Points @p out at the same frame as @p in and bumps the frame's
+ * reference count. Writable pages lose write access in both entries
+ * and are marked as waiting on a copy.
  *
- * TODO: This doesn't do any CoW and it's kinda complicated.
+ * @returns 1 if the page was shared and the source entry lost write access,
+ *          0 if it was shared as-is, -1 if the frame can not take any more
+ *          references and the caller should copy it instead.
+ */
+static int mmu_share_frame(union PML * in, union PML * out) {
+	uintptr_t frame = in->bits.page;
+	int downgraded = 0;
+
+	spin_lock(frame_alloc_lock);
+	if (mem_refcounts[frame] == REFCOUNT_MAX) {
+		spin_unlock(frame_alloc_lock);
+		return -1;
+	}
+	mem_refcounts[frame] = mem_refcounts[frame] ? mem_refcounts[frame] + 1 : 2;
+	if (in->bits.writable) {
+		in->bits.writable = 0;
+		in->bits.cow_pending = 1;
+		downgraded = 1;
+	}
+	out->raw = in->raw;
+	spin_unlock(frame_alloc_lock);
+
+	return downgraded;
+}
+
+/**
+ * @brief Drop a page table entry's reference to a user frame.
+ *
+ * Frames shared by copy-on-write are only returned to the allocator
+ * when their last reference goes away. Must be called with the frame
+ * allocation lock held.
+ */
+static void mmu_frame_release(uintptr_t frame) {
+	if (mem_refcounts[frame] > 1) {
+		mem_refcounts[frame]--;
+		return;
+	}
+	mem_refcounts[frame] = 0;
+	frame_mark_free(frame);
+}
+
+/**
+ * @brief Create a new address space with the same contents of an existing one.
+ *
+ * Allocates all of the necessary intermediary directory levels for a new address space.
+ * User pages are shared with the existing address space rather than copied: both
+ * sides lose write access and the first write from either one gets a private copy
+ * through @ref mmu_copy_on_write. Frames whose reference count is saturated are
+ * copied immediately instead.
  *
  * @param from The directory to clone, or NULL to clone the kernel map.
  * @returns a pointer to the new page directory, suitable for mapping to a physical address.
@@ -318,11 +521,11 @@ union PML * mmu_clone(union PML * from) {
 	/* Clone the current PMLs... */
 	if (!from) from = this_core->current_pml;
 
+	/* Set if we took write access away from any of the source's pages. */
+	int downgraded = 0;
+
 	/* First get a page for ourselves. */
-	spin_lock(frame_alloc_lock);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 	union PML * pml4_out = mmu_map_from_physical(newPage);
 
 	/* Zero bottom half */
@@ -335,10 +538,7 @@ union PML * mmu_clone(union PML * from) {
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
 			union PML * pdp_in = mmu_map_from_physical((uintptr_t)from[i].bits.page << PAGE_SHIFT);
-			spin_lock(frame_alloc_lock);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
-			spin_unlock(frame_alloc_lock);
+			uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 			union PML * pdp_out = mmu_map_from_physical(newPage);
 			memset(pdp_out, 0, 512 * sizeof(union PML));
 			pml4_out[i].raw = (newPage) | USER_PML_ACCESS;
@@ -347,10 +547,7 @@ union PML * mmu_clone(union PML * from) {
 			for (size_t j = 0; j < 512; ++j) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
-					spin_lock(frame_alloc_lock);
-					uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-					mmu_frame_set(newPage);
-					spin_unlock(frame_alloc_lock);
+					uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 					union PML * pd_out = mmu_map_from_physical(newPage);
 					memset(pd_out, 0, 512 * sizeof(union PML));
 					pdp_out[j].raw = (newPage) | USER_PML_ACCESS;
@@ -359,10 +556,7 @@ union PML * mmu_clone(union PML * from) {
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
-							spin_lock(frame_alloc_lock);
-							uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-							mmu_frame_set(newPage);
-							spin_unlock(frame_alloc_lock);
+							uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 							union PML * pt_out = mmu_map_from_physical(newPage);
 							memset(pt_out, 0, 512 * sizeof(union PML));
 							pd_out[k].raw = (newPage) | USER_PML_ACCESS;
@@ -373,22 +567,24 @@ union PML * mmu_clone(union PML * from) {
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
 									if (pt_in[l].bits.user) {
+										int shared = mmu_share_frame(&pt_in[l], &pt_out[l]);
+										if (shared >= 0) {
+											if (shared) downgraded = 1;
+											continue;
+										}
 										char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-										spin_lock(frame_alloc_lock);
-										uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-										mmu_frame_set(newPage);
-										spin_unlock(frame_alloc_lock);
+										uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 										char * page_out = mmu_map_from_physical(newPage);
 										memcpy(page_out,page_in,PAGE_SIZE);
 										pt_out[l].bits.page = newPage >> PAGE_SHIFT;
 										pt_out[l].bits.present = 1;
 										pt_out[l].bits.user = 1;
 										pt_out[l].bits.writable = pt_in[l].bits.writable;
-										pt_out[l].bits.writethrough = pt_out[l].bits.writethrough;
-										pt_out[l].bits.accessed = pt_out[l].bits.accessed;
-										pt_out[l].bits.size = pt_out[l].bits.size;
-										pt_out[l].bits.global = pt_out[l].bits.global;
-										pt_out[l].bits.nx = pt_out[l].bits.nx;
+										pt_out[l].bits.writethrough = pt_in[l].bits.writethrough;
+										pt_out[l].bits.accessed = pt_in[l].bits.accessed;
+										pt_out[l].bits.size = pt_in[l].bits.size;
+										pt_out[l].bits.global = pt_in[l].bits.global;
+										pt_out[l].bits.nx = pt_in[l].bits.nx;
 									} else {
 										/* If it's not a user page, just copy directly */
 										pt_out[l].raw = pt_in[l].raw;
@@ -402,37 +598,238 @@ union PML * mmu_clone(union PML * from) {
 		}
 	}
 
+	if (downgraded) {
+		/* The source may be live on this core and any other running one
+		 * of its threads; make sure nobody keeps a stale writable entry.
+		 * The shootdown waits for them, so once we return, no thread of
+		 * the parent can write to a frame it now shares with the child. */
+		if (from == this_core->current_pml) mmu_set_directory(from);
+		arch_tlb_shootdown(0, USER_SPACE_END);
+	}
+
 	return pml4_out;
 }
 
+/**
+ * @brief Resolve a write fault on a copy-on-write page.
+ *
+ * Called by the page fault handler for write faults on present pages.
+ * If the page at @p address is waiting on a copy and other address
+ * spaces still share its frame, the writer gets a fresh copy of its own;
+ * if it was the last one sharing it, the existing frame is simply made
+ * writable again.
+ *
+ * Another thread may have resolved the same page first, or this core may
+ * still have a stale read-only TLB entry for it; either way the page is
+ * already writable and only the local entry needs dropping.
+ *
+ * @param address Faulting virtual address in the current address space.
+ * @returns 1 if the fault was resolved, 0 if this was not a copy-on-write page.
+ */
+int mmu_copy_on_write(uintptr_t address) {
+	union PML * page = mmu_get_page(address, 0);
+	if (!page) return 0;
+
+	spin_lock(frame_alloc_lock);
+	if (!page->bits.present) {
+		spin_unlock(frame_alloc_lock);
+		return 0;
+	}
+
+	if (!page->bits.cow_pending) {
+		int resolved = page->bits.writable && page->bits.user;
+		spin_unlock(frame_alloc_lock);
+		if (resolved) mmu_invalidate_local(address & PAGE_SIZE_MASK, (address & PAGE_SIZE_MASK) + PAGE_SIZE);
+		return resolved;
+	}
+
+	int copied = 0;
+	uintptr_t frame = page->bits.page;
+	if (mem_refcounts[frame] > 1) {
+		uintptr_t index = buddy_allocate(0);
+		if (index == (uintptr_t)-1) {
+			printf("error: out allocatable frames\n");
+			arch_fatal();
+		}
+		memcpy(mmu_map_from_physical(index << PAGE_SHIFT), mmu_map_from_physical(frame << PAGE_SHIFT), PAGE_SIZE);
+		mem_refcounts[frame]--;
+		page->bits.page = index;
+		copied = 1;
+	} else {
+		mem_refcounts[frame] = 0;
+	}
+	page->bits.cow_pending = 0;
+	page->bits.writable = 1;
+	spin_unlock(frame_alloc_lock);
+
+	/* Threads on other cores running this directory may still have the
+	 * shared frame cached, and would keep reading it instead of the copy.
+	 * A frame that was only made writable again can be left to fault. */
+	address &= PAGE_SIZE_MASK;
+	mmu_invalidate_local(address, address + PAGE_SIZE);
+	if (copied) arch_tlb_shootdown(address, address + PAGE_SIZE);
+	return 1;
+}
+
+/**
+ * @brief Take an extra reference to a frame.
+ *
+ * Used to map the same frame in more than one place, such as
+ * read-only file pages shared between processes.
+ *
+ * @returns 1 on success, 0 if the frame can't take any more references.
+ */
+int mmu_frame_ref(uintptr_t frame) {
+	spin_lock(frame_alloc_lock);
+	if (mem_refcounts[frame] == REFCOUNT_MAX) {
+		spin_unlock(frame_alloc_lock);
+		return 0;
+	}
+	mem_refcounts[frame] = mem_refcounts[frame] ? mem_refcounts[frame] + 1 : 2;
+	spin_unlock(frame_alloc_lock);
+	return 1;
+}
+
+/**
+ * @brief Drop a reference to a frame, freeing it if it was the last.
+ */
+void mmu_frame_unref(uintptr_t frame) {
+	spin_lock(frame_alloc_lock);
+	mmu_frame_release(frame);
+	spin_unlock(frame_alloc_lock);
+}
+
+/**
+ * @brief Unmap a user page and release its frame.
+ *
+ * Frames shared copy-on-write with other address spaces are only
+ * freed once the last of them lets go. The caller is responsible
+ * for invalidating the old mapping.
+ */
+void mmu_frame_free(union PML * page) {
+	spin_lock(frame_alloc_lock);
+	if (page->bits.present && page->bits.user) {
+		mmu_frame_release(page->bits.page);
+	}
+	page->raw = 0;
+	spin_unlock(frame_alloc_lock);
+}
+
 /**
  * @brief Allocate one physical page.
  *
+ * Served from the current core's frame cache, which is refilled
+ * from the buddy allocator in batches when it runs dry so that most
+ * allocations don't need to take the frame allocation lock. When
+ * free frames are running low, the page cache is asked to give some
+ * back first.
+ *
  * @returns a frame index, not an address
  */
 uintptr_t mmu_allocate_a_frame(void) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_frame();
-	mmu_frame_set(index << PAGE_SHIFT);
-	spin_unlock(frame_alloc_lock);
-	return index;
+	struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+
+	if (!cache->count) {
+		if (nframes - used_frames < RECLAIM_WATERMARK) {
+			pagecache_reclaim(FRAME_CACHE_BATCH * 4);
+		}
+
+		spin_lock(frame_alloc_lock);
+		while (cache->count < FRAME_CACHE_BATCH) {
+			uintptr_t index = buddy_allocate(0);
+			if (index == (uintptr_t)-1) break;
+			cache->frames[cache->count++] = index;
+		}
+		spin_unlock(frame_alloc_lock);
+
+		if (!cache->count) {
+			printf("error: out allocatable frames\n");
+			arch_fatal();
+		}
+	}
+
+	return cache->frames[--cache->count];
 }
 
 /**
  * @brief Allocate a number of contiguous physical pages.
  *
+ * Takes the smallest buddy block that fits and gives back the
+ * unused tail. Requests larger than the biggest buddy block fall
+ * back to scanning the bitmap.
+ *
  * @returns a frame index, not an address
  */
 uintptr_t mmu_allocate_n_frames(int n) {
+	int order = 0;
+	while ((1 << order) < n) order++;
+
+	spin_lock(frame_alloc_lock);
+	uintptr_t index = (order <= BUDDY_MAX_ORDER) ? buddy_allocate(order) : (uintptr_t)-1;
+	if (index != (uintptr_t)-1) {
+		for (uintptr_t i = n; i < (1UL << order); ++i) {
+			frame_mark_free(index + i);
+		}
+	} else {
+		index = mmu_first_n_frames(n);
+		for (int i = 0; i < n; ++i) {
+			frame_mark_used(index + i);
+		}
+	}
+	spin_unlock(frame_alloc_lock);
+	return index;
+}
+
+/**
+ * @brief Allocate a run of up to *n contiguous physical pages.
+ *
+ * Takes the largest free buddy block that isn't bigger than the
+ * request, so unlike mmu_allocate_n_frames this can't fail just
+ * because memory is fragmented, but it may come back with fewer
+ * pages than were asked for.
+ *
+ * @param n Number of pages wanted; set to the number allocated.
+ * @returns a frame index, or -1 if there are no free frames at all
+ */
+uintptr_t mmu_allocate_frames_upto(size_t * n) {
+	int order = 0;
+	while (order < BUDDY_MAX_ORDER && (2UL << order) <= *n) order++;
+
+	if (nframes - used_frames < RECLAIM_WATERMARK) {
+		pagecache_reclaim(1UL << order);
+	}
+
 	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_n_frames(n);
-	for (int i = 0; i < n; ++i) {
-		mmu_frame_set((index+i) << PAGE_SHIFT);
+	uintptr_t index = (uintptr_t)-1;
+	for (; order >= 0; --order) {
+		index = buddy_allocate(order);
+		if (index != (uintptr_t)-1) break;
 	}
 	spin_unlock(frame_alloc_lock);
+
+	if (index == (uintptr_t)-1) {
+		*n = 0;
+		return index;
+	}
+
+	*n = 1UL << order;
 	return index;
 }
 
+/**
+ * @brief Free a run of contiguous physical pages.
+ *
+ * @param index First frame index
+ * @param n     Number of frames
+ */
+void mmu_free_frames(uintptr_t index, size_t n) {
+	spin_lock(frame_alloc_lock);
+	for (size_t i = 0; i < n; ++i) {
+		frame_mark_free(index + i);
+	}
+	spin_unlock(frame_alloc_lock);
+}
+
 /**
  * @brief Scans a directory to calculate how many user pages are in use.
  *
@@ -527,21 +924,16 @@ size_t mmu_total_memory(void) {
 /**
  * @brief Return the amount of used memory.
  *
- * Calculates the number of pages currently marked as allocated.
+ * Counts the frames currently marked as allocated, less those
+ * sitting idle in per-core frame caches.
  * Multiplies it by 4 because pages are 4KiB.
  *
  * @returns the amount of memory in use in KiB.
  */
 size_t mmu_used_memory(void) {
-	size_t ret = 0;
-	size_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
-		}
+	size_t ret = used_frames;
+	for (int i = 0; i < processor_count; ++i) {
+		ret -= frame_caches[i].count;
 	}
 	return ret * 4;
 }
@@ -577,21 +969,21 @@ void mmu_free(union PML * from) {
 								if (pt_in[l].bits.present) {
 									/* Free only user pages */
 									if (pt_in[l].bits.user) {
-										mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
+										mmu_frame_release(pt_in[l].bits.page);
 									}
 								}
 							}
-							mmu_frame_clear((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
+							frame_mark_free(pd_in[k].bits.page);
 						}
 					}
-					mmu_frame_clear((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
+					frame_mark_free(pdp_in[j].bits.page);
 				}
 			}
-			mmu_frame_clear((uintptr_t)from[i].bits.page << PAGE_SHIFT);
+			frame_mark_free(from[i].bits.page);
 		}
 	}
 
-	mmu_frame_clear((((uintptr_t)from) & PHYS_MASK));
+	frame_mark_free((((uintptr_t)from) & PHYS_MASK) >> PAGE_SHIFT);
 	spin_unlock(frame_alloc_lock);
 }
 
@@ -634,7 +1026,46 @@ void mmu_invalidate(uintptr_t addr) {
 	asm volatile (
 		"invlpg (%0)"
 		: : "r"(addr));
-	arch_tlb_shootdown();
+	arch_tlb_shootdown(addr, addr + PAGE_SIZE);
+}
+
+/**
+ * @brief Drop TLB entries for a range of addresses on this core only.
+ *
+ * Ranges longer than @c TLB_FLUSH_PAGES pages flush the whole TLB
+ * instead of invalidating each page.
+ *
+ * @param start First address in the range.
+ * @param end   Address after the end of the range.
+ */
+void mmu_invalidate_local(uintptr_t start, uintptr_t end) {
+	if (end <= start) return;
+	if (end - start > TLB_FLUSH_PAGES * PAGE_SIZE) {
+		asm volatile (
+			"movq %%cr3, %%rax\n"
+			"movq %%rax, %%cr3\n"
+			: : : "rax", "memory");
+		return;
+	}
+	for (uintptr_t addr = start & PAGE_SIZE_MASK; addr < end; addr += PAGE_SIZE) {
+		asm volatile (
+			"invlpg (%0)"
+			: : "r"(addr));
+	}
+}
+
+/**
+ * @brief Mark a range of virtual addresses as invalid in the TLB.
+ *
+ * Like @ref mmu_invalidate, but with a single shootdown for the
+ * whole range, for callers that change many pages at once.
+ *
+ * @param start First address in the current address space to invalidate.
+ * @param end   Address after the end of the range.
+ */
+void mmu_invalidate_range(uintptr_t start, uintptr_t end) {
+	mmu_invalidate_local(start, end);
+	arch_tlb_shootdown(start, end);
 }
 
 static char * heapStart = NULL;
@@ -696,23 +1127,28 @@ void mmu_init(size_t memsize, uintptr_t firstFreePage) {
 	/* Now map our new low base */
 	init_page_region[0][0].raw = (uintptr_t)&low_base_pmls[0] | USER_PML_ACCESS;
 
-	/* Set up the page allocator bitmap... */
+	/* Set up the page allocator bitmap, frame reference counts, and buddy orders... */
 	nframes = (memsize >> 12);
 	size_t bytesOfFrames = INDEX_FROM_BIT(nframes * 8);
 	bytesOfFrames = (bytesOfFrames + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	size_t bytesOfRefcounts = (nframes + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	size_t bytesOfOrders = (nframes + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	size_t bytesOfMetadata = bytesOfFrames + bytesOfRefcounts + bytesOfOrders;
 	firstFreePage = (firstFreePage + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
-	size_t pagesOfFrames = bytesOfFrames >> 12;
+	size_t pagesOfFrames = bytesOfMetadata >> 12;
 
 	/* Set up heap map for that... */
 	heap_base_pml[0].raw = (uintptr_t)&heap_base_pd | KERNEL_PML_ACCESS;
-	heap_base_pd[0].raw  = (uintptr_t)&heap_base_pt | KERNEL_PML_ACCESS;
+	for (size_t j = 0; j < HEAP_BASE_PTS; ++j) {
+		heap_base_pd[j].raw = (uintptr_t)&heap_base_pt[j] | KERNEL_PML_ACCESS;
+	}
 
-	if (pagesOfFrames > 512) {
+	if (pagesOfFrames > 512 * HEAP_BASE_PTS) {
 		printf("Warning: Too much available memory for current setup. Need %zu pages to represent allocation bitmap.\n", pagesOfFrames);
 	}
 
 	for (size_t i = 0; i < pagesOfFrames; i++) {
-		heap_base_pt[i].raw = (firstFreePage + (i << 12)) | KERNEL_PML_ACCESS;
+		heap_base_pt[i >> 9][i & ENTRY_MASK].raw = (firstFreePage + (i << 12)) | KERNEL_PML_ACCESS;
 	}
 
 	asm volatile ("" : : : "memory");
@@ -721,14 +1157,39 @@ void mmu_init(size_t memsize, uintptr_t firstFreePage) {
 
 	/* We are now in the new stuff. */
 	frames = (void*)((uintptr_t)KERNEL_HEAP_START);
-	memset((void*)frames, 0, bytesOfFrames);
-
-	/* Now mark everything up to (firstFreePage + bytesOfFrames) as in use */
-	for (uintptr_t i = 0; i < firstFreePage + bytesOfFrames; i += PAGE_SIZE) {
-		mmu_frame_set(i);
+	mem_refcounts = (void*)((uintptr_t)KERNEL_HEAP_START + bytesOfFrames);
+	frame_orders = (void*)((uintptr_t)KERNEL_HEAP_START + bytesOfFrames + bytesOfRefcounts);
+	memset((void*)frames, 0, bytesOfFrames + bytesOfRefcounts);
+	memset((void*)frame_orders, BUDDY_NOT_HEAD, bytesOfOrders);
+
+	/* Now mark everything up to (firstFreePage + bytesOfMetadata) as in use */
+	uintptr_t firstFreeFrame = (firstFreePage + bytesOfMetadata) >> 12;
+	for (uintptr_t i = 0; i < firstFreeFrame; ++i) {
+		frame_bit_set(i);
+		used_frames++;
 	}
 
-	heapStart = (char*)KERNEL_HEAP_START + bytesOfFrames;
+	/* And hand the rest to the buddy allocator */
+	buddy_free_range(firstFreeFrame, nframes);
+
+	heapStart = (char*)KERNEL_HEAP_START + bytesOfMetadata;
+
+	/* Enforce read-only mappings in kernel mode as well, so that kernel writes
+	 * to user buffers on copy-on-write pages fault and get their own copy. */
+	mmu_enable_write_protect();
+}
+
+/**
+ * @brief Make supervisor writes respect read-only page mappings.
+ *
+ * x86-64: Sets CR0.WP. Called on the BSP by @ref mmu_init and on each AP as it starts.
+ */
+void mmu_enable_write_protect(void) {
+	asm volatile (
+		"mov %%cr0, %%rax\n"
+		"or $0x10000, %%rax\n"
+		"mov %%rax, %%cr0\n"
+		: : : "rax");
 }
 
 /**
@@ -778,6 +1239,45 @@ void * sbrk(size_t bytes) {
 	return out;
 }
 
+/**
+ * @brief Give back the frames behind part of the kernel heap.
+ *
+ * Used by the heap allocator for large free blocks. The addresses
+ * stay part of the heap, and are mapped again with @ref mmu_heap_populate
+ * before they are used.
+ *
+ * @returns the number of pages that were released.
+ */
+size_t mmu_heap_release(uintptr_t start, uintptr_t end) {
+	size_t released = 0;
+	for (uintptr_t p = start; p < end; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, 0);
+		if (!page || !page->bits.present) continue;
+		mmu_frame_clear((uintptr_t)page->bits.page << PAGE_SHIFT);
+		page->raw = 0;
+		released++;
+	}
+	if (released) mmu_invalidate_range(start, end);
+	return released;
+}
+
+/**
+ * @brief Map fresh frames into any unbacked pages of part of the kernel heap.
+ *
+ * @returns the number of pages that had to be mapped.
+ */
+size_t mmu_heap_populate(uintptr_t start, uintptr_t end) {
+	size_t populated = 0;
+	for (uintptr_t p = start; p < end; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, MMU_GET_MAKE);
+		if (page->bits.present) continue;
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL);
+		populated++;
+	}
+	if (populated) mmu_invalidate_local(start, end);
+	return populated;
+}
+
 static uintptr_t mmio_base_address = MMIO_BASE_START;
 
 /**
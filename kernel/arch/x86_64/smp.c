@@ -81,7 +81,8 @@ extern void arch_set_core_base(uintptr_t base);
 extern void fpu_initialize(void);
 extern void idt_ap_install(void);
 extern void pat_initialize(void);
-extern process_t * spawn_kidle(int);
+extern process_t * spawn_kidle(void);
+extern void lapic_timer_initialize(void);
 extern union PML init_page_region[];
 
 uintptr_t _ap_stack_base = 0;
@@ -119,6 +120,7 @@ void ap_main(void) {
 	idt_ap_install();
 	fpu_initialize();
 	pat_initialize();
+	mmu_enable_write_protect();
 
 	/* Enable our spurious vector register */
 	*((volatile uint32_t*)(lapic_final + 0x0F0)) = 0x127;
@@ -127,10 +129,11 @@ void ap_main(void) {
 	this_core->current_pml = &init_page_region[0];
 
 	/* Spawn our kidle, make it our current process. */
-	this_core->kernel_idle_task = spawn_kidle(0);
+	this_core->kernel_idle_task = spawn_kidle();
 	this_core->current_process = this_core->kernel_idle_task;
 
 	load_processor_info();
+	lapic_timer_initialize();
 
 	/* Inform BSP it can continue. */
 	_ap_startup_flag = 1;
@@ -288,16 +291,151 @@ void smp_initialize(void) {
 	}
 }
 
-void arch_wakeup_others(void) {
+/**
+ * @brief Let a core know there is something new in its ready queue.
+ *
+ * Only a core that is halted in its idle loop needs to be woken up; a
+ * busy core will get to its queue when its timeslice ends. In that case
+ * one idle core is woken instead, so it can steal the work.
+ *
+ * The wakeup is a soft interrupt that does nothing but bring the core
+ * out of HLT.
+ */
+void arch_wakeup_core(int cpu) {
 	if (!lapic_final || processor_count < 2) return;
-	/* Send broadcast IPI to others; this is a soft interrupt
-	 * that just nudges idle cores out of their HLT states.
-	 * It should be gentle enough that busy cores dont't care. */
-	lapic_send_ipi(0, 0x7E | (3 << 18));
+
+	/* Pairs with the barrier in the idle loop between setting halted and checking its queue */
+	__sync_synchronize();
+
+	if (!processor_local_data[cpu].halted) {
+		cpu = -1;
+		for (int i = 0; i < processor_count; ++i) {
+			if (i != this_core->cpu_id && processor_local_data[i].halted) {
+				cpu = i;
+				break;
+			}
+		}
+		if (cpu < 0) return;
+	}
+
+	if (cpu == this_core->cpu_id) return;
+
+	__sync_fetch_and_add(&processor_local_data[cpu].wakeup_ipis, 1);
+	lapic_send_ipi(processor_local_data[cpu].lapic_id, 0x7E);
 }
 
-void arch_tlb_shootdown(void) {
-	if (!lapic_final || processor_count < 2) return;
+/*
+ * The shootdown locks are taken with plain loops rather than spin_lock,
+ * which polls for shootdowns itself while it waits.
+ */
+static void tlb_lock(struct ProcessorLocal * local) {
+	while (__sync_lock_test_and_set(local->tlb_lock.latch, 0x01));
+}
+
+static void tlb_unlock(struct ProcessorLocal * local) {
+	__sync_lock_release(local->tlb_lock.latch);
+}
+
+static int interrupts_enabled(void) {
+	uintptr_t flags;
+	asm volatile ("pushfq\npop %0" : "=r"(flags));
+	return flags & 0x200;
+}
+
+/**
+ * @brief Flush @p local's pending range and acknowledge every request
+ *        that was merged into it.
+ */
+static void tlb_flush_pending(struct ProcessorLocal * local) {
+	tlb_lock(local);
+	uintptr_t start = local->tlb_start;
+	uintptr_t end   = local->tlb_end;
+	size_t requested = local->tlb_requested;
+	local->tlb_start = 0;
+	local->tlb_end   = 0;
+	tlb_unlock(local);
+
+	mmu_invalidate_local(start, end);
+	__atomic_store_n(&local->tlb_completed, requested, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Have other cores drop their TLB entries for [start,end), and
+ *        wait until they have.
+ *
+ * User addresses only need to be flushed on cores that have the
+ * current address space loaded; changes to kernel mappings go to
+ * every core. The range is merged into each target's pending range,
+ * and a core that already has a flush pending isn't sent another IPI.
+ *
+ * This doesn't return until every target has flushed, so callers can
+ * free or reuse whatever the old mappings pointed at. A target may be
+ * spinning with interrupts off on a lock the caller holds, so lock
+ * loops poll for shootdowns (see @ref arch_tlb_shootdown_poll).
+ */
+void arch_tlb_shootdown(uintptr_t start, uintptr_t end) {
+	if (!lapic_final || processor_count < 2 || end <= start) return;
+
+	uint32_t mask = 0xFFFFFFFF;
+	if (end <= USER_SPACE_END && this_core->active_directory) {
+		mask = this_core->active_directory->cpu_mask;
+	}
+	mask &= ~(1U << this_core->cpu_id);
+
+	size_t tickets[32];
+	uint32_t waiting = 0;
+
+	for (int i = 0; mask && i < processor_count; ++i) {
+		if (!(mask & (1U << i))) continue;
+		struct ProcessorLocal * target = &processor_local_data[i];
+
+		tlb_lock(target);
+		int pending = target->tlb_start != target->tlb_end;
+		if (!pending || start < target->tlb_start) target->tlb_start = start;
+		if (!pending || end > target->tlb_end) target->tlb_end = end;
+		tickets[i] = ++target->tlb_requested;
+		tlb_unlock(target);
+
+		if (!pending) {
+			__sync_fetch_and_add(&target->tlb_ipis, 1);
+			lapic_send_ipi(target->lapic_id, 0x7C);
+		}
+		waiting |= (1U << i);
+	}
+
+	while (waiting) {
+		for (int i = 0; i < processor_count; ++i) {
+			if (!(waiting & (1U << i))) continue;
+			size_t completed = __atomic_load_n(&processor_local_data[i].tlb_completed, __ATOMIC_ACQUIRE);
+			if ((ssize_t)(completed - tickets[i]) >= 0) waiting &= ~(1U << i);
+		}
+		if (waiting) {
+			/* Whoever we're waiting on may be waiting on us */
+			arch_tlb_shootdown_poll();
+			asm volatile ("pause" : : : "memory");
+		}
+	}
+}
+
+/**
+ * @brief Flush this core's pending TLB shootdown range.
+ */
+void arch_tlb_shootdown_handler(void) {
+	lapic_write(0xB0, 0);
+	tlb_flush_pending(&processor_local_data[this_core->cpu_id]);
+}
 
-	lapic_send_ipi(0, 0x7C | (3 << 18));
+/**
+ * @brief Service a pending shootdown without waiting for its IPI.
+ *
+ * For loops that spin with interrupts off, where the IPI can't arrive
+ * and the core that sent it is waiting for an answer. With interrupts
+ * on, the IPI will get here by itself.
+ */
+void arch_tlb_shootdown_poll(void) {
+	if (!lapic_final || processor_count < 2) return;
+	struct ProcessorLocal * local = &processor_local_data[this_core->cpu_id];
+	if (local->tlb_completed == local->tlb_requested) return;
+	if (interrupts_enabled()) return;
+	tlb_flush_pending(local);
 }
@@ -20,6 +20,8 @@
 #include <kernel/ksym.h>
 #include <kernel/module.h>
 #include <kernel/hashmap.h>
+#include <kernel/mmap.h>
+#include <sys/mman.h>
 
 static hashmap_t * _modules_table = NULL;
 
@@ -172,6 +174,43 @@ int elf_module(const char * path) {
 	return moduleData->init(0,NULL);
 }
 
+/**
+ * @brief Eagerly load a segment into the current address space.
+ *
+ * Used when a segment can't be demand-paged, such as when it
+ * shares a page with another segment.
+ */
+static void elf_load_segment(fs_node_t * file, Elf64_Phdr * phdr) {
+	for (uintptr_t i = phdr->p_vaddr & ~0xFFFUL; i < phdr->p_vaddr + phdr->p_memsz; i += 0x1000) {
+		union PML * page = mmu_get_page(i, MMU_GET_MAKE);
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+		mmu_invalidate(i);
+	}
+
+	read_fs(file, phdr->p_offset, phdr->p_filesz, (void*)phdr->p_vaddr);
+	memset((void*)(phdr->p_vaddr + phdr->p_filesz), 0, phdr->p_memsz - phdr->p_filesz);
+}
+
+/**
+ * @brief Check whether any two loadable segments touch the same page.
+ *
+ * Demand-paged segments each get their own mmap region, which
+ * can't overlap, so a binary like this is loaded eagerly instead.
+ */
+static int elf_segments_share_pages(fs_node_t * file, Elf64_Header * header) {
+	uintptr_t last_end = 0;
+	for (int i = 0; i < header->e_phnum; ++i) {
+		Elf64_Phdr phdr;
+		read_fs(file, header->e_phoff + header->e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
+		if (phdr.p_type != PT_LOAD || !phdr.p_memsz) continue;
+		uintptr_t start = phdr.p_vaddr & ~0xFFFUL;
+		if (start < last_end) return 1;
+		if ((phdr.p_vaddr & 0xFFF) != (phdr.p_offset & 0xFFF)) return 1;
+		last_end = (phdr.p_vaddr + phdr.p_memsz + 0xFFF) & ~0xFFFUL;
+	}
+	return 0;
+}
+
 int elf_exec(const char * path, fs_node_t * file, int argc, const char *const argv[], const char *const env[], int interp) {
 	Elf64_Header header;
 
@@ -228,27 +267,33 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	uintptr_t execBase = -1;
 	uintptr_t heapBase = 0;
 
-	mmu_set_directory(NULL);
+	process_load_directory(NULL);
 	process_release_directory(this_core->current_process->thread.page_directory);
 	this_core->current_process->thread.page_directory = malloc(sizeof(page_directory_t));
 	this_core->current_process->thread.page_directory->refcount = 1;
 	spin_init(this_core->current_process->thread.page_directory->lock);
 	this_core->current_process->thread.page_directory->directory = mmu_clone(NULL);
-	mmu_set_directory(this_core->current_process->thread.page_directory->directory);
+	this_core->current_process->thread.page_directory->mappings = NULL;
+	this_core->current_process->thread.page_directory->cpu_mask = 0;
+	process_load_directory(this_core->current_process->thread.page_directory);
+
+	/* Segments are normally mapped as mmap regions and faulted in as they
+	 * are touched, with read-only pages shared between every process running
+	 * the same binary. Binaries with segments that share pages get loaded
+	 * the old way. */
+	int eager = elf_segments_share_pages(file, &header);
 
 	for (int i = 0; i < header.e_phnum; ++i) {
 		Elf64_Phdr phdr;
 		read_fs(file, header.e_phoff + header.e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
 		if (phdr.p_type == PT_LOAD) {
-			for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
-				union PML * page = mmu_get_page(i, MMU_GET_MAKE);
-				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
-				mmu_invalidate(i);
-			}
+			int prot = PROT_READ;
+			if (phdr.p_flags & PF_W) prot |= PROT_WRITE;
+			if (phdr.p_flags & PF_X) prot |= PROT_EXEC;
 
-			read_fs(file, phdr.p_offset, phdr.p_filesz, (void*)phdr.p_vaddr);
-			for (size_t i = phdr.p_filesz; i < phdr.p_memsz; ++i) {
-				*(char*)(phdr.p_vaddr + i) = 0;
+			if (eager || mmap_map_segment(this_core->current_process->thread.page_directory,
+				phdr.p_vaddr, phdr.p_memsz, prot, file, phdr.p_offset, phdr.p_filesz) < 0) {
+				elf_load_segment(file, &phdr);
 			}
 
 			if (phdr.p_vaddr + phdr.p_memsz > heapBase) {
@@ -6,13 +6,17 @@
  * Used in userspace and the kernel alike, this is a straightforward "slab"-
  * style allocator. It has a handful of fixed sizes to stick small objects
  * in and keeps several together in a single page. It's surprisingly fast,
- * needs only an 'sbrk', makes only page-multiple calls to that sbrk, and
- * throwing a big lock around the whole thing seems to have worked just fine
- * for making it thread-safe in userspace applications (not necessarily
- * tested in the kernel).
+ * needs only an 'sbrk', and makes only page-multiple calls to that sbrk.
  *
- * FIXME The heap allocator has long been lacking an ability to merge large
- *       freed blocks. There's #if 0'd code dating back over a decade in here.
+ * In the kernel, each core keeps a small magazine of free objects for each
+ * of the small bins, so most allocations and frees never touch the shared
+ * heap lock; it is only taken to refill or drain a magazine, and for big
+ * blocks. Big blocks are split when they are reused for something smaller,
+ * merged with free neighbors when they are freed, and free blocks large
+ * enough to be worth it give their pages back to the frame allocator until
+ * they are needed again.
+ *
+ * Statistics for all of this are available in /proc/kheap.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -35,6 +39,7 @@
 #include <kernel/printf.h>
 #include <kernel/spinlock.h>
 #include <kernel/mmu.h>
+#include <kernel/kheap.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -59,6 +64,9 @@
 
 #define BIN_MAGIC 0xDEFAD00D
 
+#define MAGAZINE_SIZE 32							/* Free objects each core may keep per small bin. */
+#define RELEASE_SIZE (256 * 1024)					/* Free big blocks at least this large release their pages. */
+
 #if 0
 #define assert(statement) ((statement) ? (void)0 : printf("assertion failed in %s:%d %s\n", __FILE__, __LINE__, __FUNCTION__, #statement))
 #else
@@ -72,50 +80,20 @@
  * Internal functions.
  */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size);
-static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
 
 static spin_lock_t mem_lock =  { 0 };
 
-void * __attribute__ ((malloc)) malloc(uintptr_t size) {
-	spin_lock(mem_lock);
-	void * out = klmalloc(size);
-	spin_unlock(mem_lock);
-	return out;
-}
-
-void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
-	spin_lock(mem_lock);
-	void * out = klrealloc(ptr, size);
-	spin_unlock(mem_lock);
-	return out;
-}
-
-void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(mem_lock);
-	void * out = klcalloc(nmemb, size);
-	spin_unlock(mem_lock);
-	return out;
-}
-
-void * __attribute__ ((malloc)) valloc(uintptr_t size) {
-	spin_lock(mem_lock);
-	void * out = klvalloc(size);
-	spin_unlock(mem_lock);
-	return out;
-}
-
-void free(void * ptr) {
-	spin_lock(mem_lock);
-	if (ptr < (void*)0xffffff0000000000) {
-		printf("Invalid free detected (%p)\n", ptr);
-		while (1) {};
-	}
-	klfree(ptr);
-	spin_unlock(mem_lock);
-}
+/*
+ * Heap statistics, for /proc/kheap.
+ * Everything but the magazine counters is protected by mem_lock.
+ */
+static size_t kheap_bin_pages[NUM_BINS - 1];	/* Pages given to each small bin */
+static size_t kheap_bin_free[NUM_BINS - 1];		/* Free cells in each small bin's pages */
+static size_t kheap_released_pages = 0;			/* Pages of free big blocks given back to the frame allocator */
+static size_t kheap_lock_acquired = 0;
+static size_t kheap_lock_contended = 0;
 
 /* Bin management {{{ */
 
@@ -161,14 +139,18 @@ typedef struct _klmalloc_bin_header {
 
 /*
  * A big bin header is basically the same as a regular bin header
- * only with a pointer to the previous (physically) instead of
- * a "next" and with a list of forward headers.
+ * only with next and prev pointing to the big bins physically
+ * after and before it, and with a list of forward headers.
+ *
+ * A free big bin with released set has given back the pages after
+ * its header; they must be mapped again before it is handed out.
  */
 typedef struct _klmalloc_big_bin_header {
 	struct _klmalloc_big_bin_header * next;
 	void * head;
 	uintptr_t size;
 	uint32_t bin_magic;
+	uint32_t released;
 	struct _klmalloc_big_bin_header * prev;
 	struct _klmalloc_big_bin_header * forward[SKIP_MAX_LEVEL+1];
 } klmalloc_big_bin_header;
@@ -272,6 +254,15 @@ static inline int __attribute__ ((pure, always_inline)) klmalloc_random_level(vo
 	return level;
 }
 
+/*
+ * Ordering for the skip list: by size, and by address for bins
+ * of the same size, so that any bin can be found again to be
+ * deleted, not just the first one of its size.
+ */
+static inline int klmalloc_skip_before(klmalloc_big_bin_header * node, klmalloc_big_bin_header * value) {
+	return node->size < value->size || (node->size == value->size && node < value);
+}
+
 /*
  * Find best fit for a given value.
  */
@@ -332,7 +323,7 @@ static void klmalloc_skip_list_insert(klmalloc_big_bin_header * value) {
 	 */
 	int i;
 	for (i = klmalloc_big_bins.level; i >= 0; --i) {
-		while (node->forward[i] && node->forward[i]->size < value->size) {
+		while (node->forward[i] && klmalloc_skip_before(node->forward[i], value)) {
 			node = node->forward[i];
 			if (node)
 				assert((node->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
@@ -403,7 +394,7 @@ static void klmalloc_skip_list_delete(klmalloc_big_bin_header * value) {
 	 */
 	int i;
 	for (i = klmalloc_big_bins.level; i >= 0; --i) {
-		while (node->forward[i] && node->forward[i]->size < value->size) {
+		while (node->forward[i] && klmalloc_skip_before(node->forward[i], value)) {
 			node = node->forward[i];
 			if (node)
 				assert((node->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
@@ -411,17 +402,6 @@ static void klmalloc_skip_list_delete(klmalloc_big_bin_header * value) {
 		update[i] = node;
 	}
 	node = node->forward[0];
-	while (node != value) {
-		node = node->forward[0];
-	}
-
-	if (node != value) {
-		node = klmalloc_big_bins.head.forward[0];
-		while (node->forward[0] && node->forward[0] != value) {
-			node = node->forward[0];
-		}
-		node = node->forward[0];
-	}
 	/*
 	 * If we found the node, delete it;
 	 * otherwise, we do nothing.
@@ -507,6 +487,101 @@ static inline int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_
 }
 
 /* }}} Stack */
+/* Big bins {{{ */
+
+/*
+ * Is @p after the big bin immediately following @p before in memory?
+ * Big bins are interleaved with small bin pages, so neighbors in the
+ * list are not always neighbors in memory.
+ */
+static inline int klmalloc_big_adjacent(klmalloc_big_bin_header * before, klmalloc_big_bin_header * after) {
+	return (uintptr_t)before + sizeof(klmalloc_big_bin_header) + before->size == (uintptr_t)after;
+}
+
+/*
+ * Merge the big bin @p after, which must be adjacent and
+ * already out of the skip list, into @p before.
+ */
+static void klmalloc_big_absorb(klmalloc_big_bin_header * before, klmalloc_big_bin_header * after) {
+	before->size += sizeof(klmalloc_big_bin_header) + after->size;
+	before->released |= after->released;
+	before->next = after->next;
+	if (after->next) {
+		after->next->prev = before;
+	} else {
+		klmalloc_newest_big = before;
+	}
+}
+
+/*
+ * Make a big bin available again, merging it with any free
+ * neighbors. If the result is large, or part of it had already
+ * been released, the pages after its header are given back.
+ */
+static void klmalloc_big_release(klmalloc_big_bin_header * bheader) {
+	klmalloc_big_bin_header * next = bheader->next;
+	if (next && next->head && klmalloc_big_adjacent(bheader, next)) {
+		klmalloc_skip_list_delete(next);
+		klmalloc_big_absorb(bheader, next);
+	}
+
+	klmalloc_big_bin_header * prev = bheader->prev;
+	if (prev && prev->head && klmalloc_big_adjacent(prev, bheader)) {
+		klmalloc_skip_list_delete(prev);
+		klmalloc_big_absorb(prev, bheader);
+		bheader = prev;
+	}
+
+	uintptr_t total = sizeof(klmalloc_big_bin_header) + bheader->size;
+	if (bheader->released || total >= RELEASE_SIZE) {
+		kheap_released_pages += mmu_heap_release((uintptr_t)bheader + PAGE_SIZE, (uintptr_t)bheader + total);
+		bheader->released = 1;
+	}
+
+	/*
+	 * Push new space back into the stack.
+	 */
+	bheader->head = NULL;
+	klmalloc_stack_push((klmalloc_bin_header *)bheader, (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header)));
+	assert(bheader->head != NULL);
+	/*
+	 * Insert the block into list of available slabs.
+	 */
+	klmalloc_skip_list_insert(bheader);
+}
+
+/*
+ * Cut a big bin that is being handed out for @p size bytes down
+ * to the pages it needs, and free the rest as a new big bin.
+ */
+static void klmalloc_big_split(klmalloc_big_bin_header * bheader, uintptr_t size) {
+	uintptr_t total  = sizeof(klmalloc_big_bin_header) + bheader->size;
+	uintptr_t needed = (sizeof(klmalloc_big_bin_header) + size + PAGE_MASK) & ~(uintptr_t)PAGE_MASK;
+	if (total - needed < PAGE_SIZE) return;
+
+	klmalloc_big_bin_header * tail = (klmalloc_big_bin_header *)((uintptr_t)bheader + needed);
+	if (bheader->released) {
+		/* The new header needs somewhere to live. */
+		kheap_released_pages -= mmu_heap_populate((uintptr_t)tail, (uintptr_t)tail + PAGE_SIZE);
+	}
+
+	tail->bin_magic = BIN_MAGIC;
+	tail->released = bheader->released;
+	tail->size = total - needed - sizeof(klmalloc_big_bin_header);
+	tail->prev = bheader;
+	tail->next = bheader->next;
+	if (bheader->next) {
+		bheader->next->prev = tail;
+	} else {
+		klmalloc_newest_big = tail;
+	}
+	bheader->next = tail;
+	bheader->size = needed - sizeof(klmalloc_big_bin_header);
+
+	klmalloc_big_release(tail);
+}
+
+/* }}} Big bins */
 
 /* malloc() {{{ */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
@@ -568,8 +643,11 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			}
 			base[available << bucket_id] = NULL;
 			bin_header->size = bucket_id;
+			kheap_bin_pages[bucket_id]++;
+			kheap_bin_free[bucket_id] += available + 1;
 		}
 		uintptr_t ** item = klmalloc_stack_pop(bin_header);
+		kheap_bin_free[bucket_id]--;
 		if (klmalloc_stack_empty(bin_header)) {
 			klmalloc_list_decouple(&(klmalloc_bin_head[bucket_id]),bin_header);
 		}
@@ -589,49 +667,17 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			 * Retreive the head of the block.
 			 */
 			uintptr_t ** item = klmalloc_stack_pop((klmalloc_bin_header *)bin_header);
-#if 0
 			/*
-			 * Resize block, if necessary
+			 * Give back whatever we don't need, and make
+			 * sure what we keep is backed by real memory.
 			 */
-			assert(bin_header->head == NULL);
-			uintptr_t old_size = bin_header->size;
-			//uintptr_t rsize = size;
-			/*
-			 * Round the requeste size to our full required size.
-			 */
-			size = ((size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1) * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
-			assert((size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			if (bin_header->size > size * 2) {
-				assert(old_size != size);
-				/*
-				 * If we have extra space, start splitting.
-				 */
-				bin_header->size = size;
-				assert(sbrk(0) >= bin_header->size + (uintptr_t)bin_header);
-				/*
-				 * Make a new block at the end of the needed space.
-				 */
-				klmalloc_big_bin_header * header_new = (klmalloc_big_bin_header *)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header) + size);
-				assert((uintptr_t)header_new % PAGE_SIZE == 0);
-				memset(header_new, 0, sizeof(klmalloc_big_bin_header) + sizeof(void *));
-				header_new->prev = bin_header;
-				if (bin_header->next) {
-					bin_header->next->prev = header_new;
-				}
-				header_new->next = bin_header->next;
-				bin_header->next = header_new;
-				if (klmalloc_newest_big == bin_header) {
-					klmalloc_newest_big = header_new;
-				}
-				header_new->size = old_size - (size + sizeof(klmalloc_big_bin_header));
-				assert(((uintptr_t)header_new->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-				fprintf(stderr, "Splitting %p [now %zx] at %p [%zx] from [%zx,%zx].\n", (void*)bin_header, bin_header->size, (void*)header_new, header_new->size, old_size, size);
-				/*
-				 * Free the new block.
-				 */
-				klfree((void *)((uintptr_t)header_new + sizeof(klmalloc_big_bin_header)));
+			klmalloc_big_split(bin_header, size);
+			if (bin_header->released) {
+				uintptr_t start = (uintptr_t)bin_header + PAGE_SIZE;
+				uintptr_t end = (uintptr_t)bin_header + sizeof(klmalloc_big_bin_header) + bin_header->size;
+				kheap_released_pages -= mmu_heap_populate(start, end);
+				bin_header->released = 0;
 			}
-#endif
 			return item;
 		} else {
 			/*
@@ -640,6 +686,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
 			bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
 			bin_header->bin_magic = BIN_MAGIC;
+			bin_header->released = 0;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
 			/*
 			 * Give the header the remaining space.
@@ -707,86 +754,7 @@ static void klfree(void *ptr) {
 		assert(bheader);
 		assert(bheader->head == NULL);
 		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-		/*
-		 * Coalesce forward blocks into us.
-		 */
-#if 0
-		if (bheader != klmalloc_newest_big) {
-			/*
-			 * If we are not the newest big bin, there is most definitely
-			 * something in front of us that we can read.
-			 */
-			assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			klmalloc_big_bin_header * next = (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header) + bheader->size);
-			assert((uintptr_t)next % PAGE_SIZE == 0);
-			if (next == bheader->next && next->head) { //next->size > NUM_BINS && next->head) {
-				/*
-				 * If that something is an available big bin, we can
-				 * coalesce it into us to form one larger bin.
-				 */
-
-				uintptr_t old_size = bheader->size;
-
-				klmalloc_skip_list_delete(next);
-				bheader->size = (uintptr_t)bheader->size + (uintptr_t)sizeof(klmalloc_big_bin_header) + next->size;
-				assert((bheader->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-
-				if (next == klmalloc_newest_big) {
-					/*
-					 * If the guy in front of us was the newest,
-					 * we are now the newest (as we are him).
-					 */
-					klmalloc_newest_big = bheader;
-				} else {
-					if (next->next) {
-						next->next->prev = bheader;
-					}
-				}
-				fprintf(stderr,"Coelesced (forwards)  %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader, old_size, (void*)next, next->size, bheader->size);
-			}
-		}
-#endif
-		/*
-		 * Coalesce backwards
-		 */
-#if 0
-		if (bheader->prev && bheader->prev->head) {
-			/*
-			 * If there is something behind us, it is available, and there is nothing between
-			 * it and us, we can coalesce ourselves into it to form a big block.
-			 */
-			if ((uintptr_t)bheader->prev + (bheader->prev->size + sizeof(klmalloc_big_bin_header)) == (uintptr_t)bheader) {
-
-				uintptr_t old_size = bheader->prev->size;
-
-				klmalloc_skip_list_delete(bheader->prev);
-				bheader->prev->size = (uintptr_t)bheader->prev->size + (uintptr_t)bheader->size + sizeof(klmalloc_big_bin_header);
-				assert((bheader->prev->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-				klmalloc_skip_list_insert(bheader->prev);
-				if (klmalloc_newest_big == bheader) {
-					klmalloc_newest_big = bheader->prev;
-				} else {
-					if (bheader->next) {
-						bheader->next->prev = bheader->prev;
-					}
-				}
-				fprintf(stderr,"Coelesced (backwards) %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader->prev, old_size, (void*)bheader, bheader->size, bheader->size);
-				/*
-				 * If we coalesced backwards, we are done.
-				 */
-				return;
-			}
-		}
-#endif
-		/*
-		 * Push new space back into the stack.
-		 */
-		klmalloc_stack_push((klmalloc_bin_header *)bheader, (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header)));
-		assert(bheader->head != NULL);
-		/*
-		 * Insert the block into list of available slabs.
-		 */
-		klmalloc_skip_list_insert(bheader);
+		klmalloc_big_release(bheader);
 	} else {
 		/*
 		 * If the stack is empty, we are freeing
@@ -800,6 +768,7 @@ static void klfree(void *ptr) {
 		 * Push new space back into the stack.
 		 */
 		klmalloc_stack_push(header, ptr);
+		kheap_bin_free[bucket_id]++;
 	}
 }
 /* }}} */
@@ -817,28 +786,106 @@ static void * __attribute__ ((malloc)) klvalloc(uintptr_t size) {
 	return out;
 }
 /* }}} */
-/* realloc() {{{ */
-static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
+/* Public interface {{{ */
+/*
+ * Per-CPU magazines.
+ *
+ * A stack of free objects for each small bin, linked through their
+ * first word. Kernel code runs with interrupts disabled, so nothing
+ * else can get at a core's magazines while it is using them.
+ */
+static struct kheap_magazine {
+	void * head[NUM_BINS - 1];
+	unsigned int count[NUM_BINS - 1];
+	size_t hits;
+	size_t misses;
+} kheap_magazines[32];
+
+static inline void kheap_lock(void) {
+	int contended = mem_lock.latch[0];
+	spin_lock(mem_lock);
+	kheap_lock_acquired++;
+	if (contended) kheap_lock_contended++;
+}
+
+static inline void kheap_unlock(void) {
+	spin_unlock(mem_lock);
+}
+
+/*
+ * Fill half of an empty magazine from the shared bins.
+ */
+static void kheap_magazine_refill(struct kheap_magazine * mag, unsigned int bin) {
+	uintptr_t size = 1UL << (SMALLEST_BIN_LOG + bin);
+	kheap_lock();
+	for (unsigned int i = 0; i < MAGAZINE_SIZE / 2; ++i) {
+		void ** item = klmalloc(size);
+		*item = mag->head[bin];
+		mag->head[bin] = item;
+	}
+	kheap_unlock();
+	mag->count[bin] += MAGAZINE_SIZE / 2;
+}
+
+/*
+ * Return the older half of an overfull magazine to the shared bins.
+ */
+static void kheap_magazine_drain(struct kheap_magazine * mag, unsigned int bin) {
+	kheap_lock();
+	while (mag->count[bin] > MAGAZINE_SIZE / 2) {
+		void ** item = mag->head[bin];
+		mag->head[bin] = *item;
+		mag->count[bin]--;
+		klfree(item);
+	}
+	kheap_unlock();
+}
+
+void * __attribute__ ((malloc)) malloc(uintptr_t size) {
+	if (__builtin_expect(size == 0, 0)) return NULL;
+
+	unsigned int bin = klmalloc_bin_size(size);
+	if (bin < BIG_BIN) {
+		struct kheap_magazine * mag = &kheap_magazines[this_core->cpu_id];
+		if (!mag->count[bin]) {
+			mag->misses++;
+			kheap_magazine_refill(mag, bin);
+		} else {
+			mag->hits++;
+		}
+		void ** item = mag->head[bin];
+		mag->head[bin] = *item;
+		mag->count[bin]--;
+		return item;
+	}
+
+	kheap_lock();
+	void * out = klmalloc(size);
+	kheap_unlock();
+	return out;
+}
+
+void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 	/*
 	 * C standard implementation: When NULL is passed to realloc,
 	 * simply malloc the requested size and return a pointer to that.
 	 */
 	if (__builtin_expect(ptr == NULL, 0))
-		return klmalloc(size);
+		return malloc(size);
 
 	/*
 	 * C standard implementation: For a size of zero, free the
 	 * pointer and return NULL, allocating no new memory.
 	 */
-	if (__builtin_expect(size == 0, 0))
-	{
+	if (__builtin_expect(size == 0, 0)) {
 		free(ptr);
 		return NULL;
 	}
 
 	/*
-	 * Find the bin for the given pointer
-	 * by aligning it to a page.
+	 * Find the bin for the given pointer by aligning it to a page.
+	 * Nothing else changes the header of an allocated block, so
+	 * this doesn't need the lock.
 	 */
 	klmalloc_bin_header * header_old = (void *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
 	if (header_old->bin_magic != BIN_MAGIC) {
@@ -857,60 +904,106 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	}
 
 	/*
-	 * (This will only happen for a big bin, mathematically speaking)
-	 * If we still have room in our bin for the additonal space,
+	 * If we still have room in our bin for the additional space,
 	 * we don't need to do anything.
 	 */
 	if (old_size >= size) {
-
-		/*
-		 * TODO: Break apart blocks here, which is far more important
-		 *       than breaking them up on allocations.
-		 */
 		return ptr;
 	}
 
-	/*
-	 * Reallocate more memory.
-	 */
-	void * newptr = klmalloc(size);
+	void * newptr = malloc(size);
 	if (__builtin_expect(newptr != NULL, 1)) {
-
-		/*
-		 * Copy the old value into the new value.
-		 * Be sure to only copy as much as was in
-		 * the old block.
-		 */
 		memcpy(newptr, ptr, old_size);
-		klfree(ptr);
-		return newptr;
+		free(ptr);
 	}
+	return newptr;
+}
 
-	/*
-	 * We failed to allocate more memory,
-	 * which means we're probably out.
-	 *
-	 * Bail and return NULL.
-	 */
-	return NULL;
+void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
+	void * ptr = malloc(nmemb * size);
+	if (__builtin_expect(ptr != NULL, 1))
+		memset(ptr, 0x00, nmemb * size);
+	return ptr;
 }
-/* }}} */
-/* calloc() {{{ */
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size) {
+
+void * __attribute__ ((malloc)) valloc(uintptr_t size) {
+	kheap_lock();
+	void * out = klvalloc(size);
+	kheap_unlock();
+	return out;
+}
+
+void free(void * ptr) {
+	if (ptr < (void*)0xffffff0000000000) {
+		printf("Invalid free detected (%p)\n", ptr);
+		while (1) {};
+	}
+
 	/*
-	 * Allocate memory and zero it before returning
-	 * a pointer to the newly allocated memory.
-	 * 
-	 * Implemented by way of a simple malloc followed
-	 * by a memset to 0x00 across the length of the
-	 * requested memory chunk.
+	 * Page-aligned pointers come from valloc and belong
+	 * to the (big) block that starts a page earlier.
 	 */
+	uintptr_t addr = (uintptr_t)ptr;
+	if (addr % PAGE_SIZE == 0) addr -= 1;
+	klmalloc_bin_header * header = (klmalloc_bin_header *)(addr & (uintptr_t)~PAGE_MASK);
+	if (header->bin_magic != BIN_MAGIC) return;
+
+	if (header->size < BIG_BIN) {
+		unsigned int bin = header->size;
+		struct kheap_magazine * mag = &kheap_magazines[this_core->cpu_id];
+		*(void **)ptr = mag->head[bin];
+		mag->head[bin] = ptr;
+		mag->count[bin]++;
+		if (mag->count[bin] > MAGAZINE_SIZE) {
+			kheap_magazine_drain(mag, bin);
+		}
+		return;
+	}
 
-	void *ptr = klmalloc(nmemb * size);
-	if (__builtin_expect(ptr != NULL, 1))
-		memset(ptr,0x00,nmemb * size);
-	return ptr;
+	kheap_lock();
+	klfree(ptr);
+	kheap_unlock();
 }
-/* }}} */
 
+/**
+ * @brief Collect heap statistics for /proc/kheap.
+ *
+ * Magazine counts are read without stopping the other cores,
+ * so they may be slightly out of date.
+ */
+void kheap_get_stats(struct kheap_stats * stats) {
+	memset(stats, 0, sizeof(struct kheap_stats));
+
+	kheap_lock();
+	stats->bins = NUM_BINS - 1;
+	for (unsigned int bin = 0; bin < NUM_BINS - 1; ++bin) {
+		stats->bin[bin].size  = 1UL << (SMALLEST_BIN_LOG + bin);
+		stats->bin[bin].pages = kheap_bin_pages[bin];
+		stats->bin[bin].free  = kheap_bin_free[bin];
+		for (int cpu = 0; cpu < processor_count; ++cpu) {
+			stats->bin[bin].cached += kheap_magazines[cpu].count[bin];
+		}
+		size_t per_page = (PAGE_SIZE - sizeof(klmalloc_bin_header)) >> (SMALLEST_BIN_LOG + bin);
+		stats->bin[bin].used = stats->bin[bin].pages * per_page - stats->bin[bin].free - stats->bin[bin].cached;
+	}
+
+	for (klmalloc_big_bin_header * big = klmalloc_newest_big; big; big = big->prev) {
+		stats->big_blocks++;
+		stats->big_bytes += sizeof(klmalloc_big_bin_header) + big->size;
+		if (big->head) {
+			stats->big_free_blocks++;
+			stats->big_free_bytes += sizeof(klmalloc_big_bin_header) + big->size;
+		}
+	}
+
+	stats->released_pages = kheap_released_pages;
+	stats->lock_acquired  = kheap_lock_acquired;
+	stats->lock_contended = kheap_lock_contended;
+	kheap_unlock();
 
+	for (int cpu = 0; cpu < processor_count; ++cpu) {
+		stats->magazine_hits   += kheap_magazines[cpu].hits;
+		stats->magazine_misses += kheap_magazines[cpu].misses;
+	}
+}
+/* }}} */
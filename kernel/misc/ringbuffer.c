@@ -11,6 +11,7 @@
  * Copyright (C) 2013-2021 K. Lange
  */
 #include <stdint.h>
+#include <errno.h>
 #include <stddef.h>
 #include <kernel/types.h>
 #include <kernel/ringbuffer.h>
@@ -20,15 +21,12 @@
 #include <kernel/vfs.h>
 #include <kernel/printf.h>
 
+static inline size_t ring_buffer_count(size_t read_ptr, size_t write_ptr, size_t size) {
+	return (read_ptr > write_ptr) ? (size - read_ptr) + write_ptr : write_ptr - read_ptr;
+}
+
 size_t ring_buffer_unread(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->read_ptr == ring_buffer->write_ptr) {
-		return 0;
-	}
-	if (ring_buffer->read_ptr > ring_buffer->write_ptr) {
-		return (ring_buffer->size - ring_buffer->read_ptr) + ring_buffer->write_ptr;
-	} else {
-		return (ring_buffer->write_ptr - ring_buffer->read_ptr);
-	}
+	return ring_buffer_count(ring_buffer->read_ptr, ring_buffer->write_ptr, ring_buffer->size);
 }
 
 size_t ring_buffer_size(fs_node_t * node) {
@@ -37,105 +35,231 @@ size_t ring_buffer_size(fs_node_t * node) {
 }
 
 size_t ring_buffer_available(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->read_ptr == ring_buffer->write_ptr) {
-		return ring_buffer->size - 1;
-	}
+	return ring_buffer->size - 1 - ring_buffer_unread(ring_buffer);
+}
 
-	if (ring_buffer->read_ptr > ring_buffer->write_ptr) {
-		return ring_buffer->read_ptr - ring_buffer->write_ptr - 1;
-	} else {
-		return (ring_buffer->size - ring_buffer->write_ptr) + ring_buffer->read_ptr - 1;
+/**
+ * @brief Wake anything waiting on @p queue, if anything is.
+ *
+ * The other side sets @p waiting and checks the buffer again
+ * with the buffer lock held before it goes to sleep, so checking
+ * the flag here, after the pointer it's waiting on has moved,
+ * is enough to not miss it.
+ */
+static void ring_buffer_wake(ring_buffer_t * ring_buffer, list_t * queue, volatile int * waiting) {
+	__sync_synchronize();
+	if (!*waiting) return;
+	spin_lock(ring_buffer->lock);
+	*waiting = 0;
+	wakeup_queue(queue);
+	spin_unlock(ring_buffer->lock);
+}
+
+static void ring_buffer_alert_list(ring_buffer_t * ring_buffer, list_t * list) {
+	spin_lock(ring_buffer->alert_lock);
+	while (list->head) {
+		node_t * node = list_dequeue(list);
+		process_t * p = node->value;
+		free(node);
+		spin_unlock(ring_buffer->alert_lock);
+
+		process_alert_node(p, ring_buffer);
+
+		spin_lock(ring_buffer->alert_lock);
 	}
+	spin_unlock(ring_buffer->alert_lock);
 }
 
-static inline void ring_buffer_increment_read(ring_buffer_t * ring_buffer) {
-	ring_buffer->read_ptr++;
-	if (ring_buffer->read_ptr == ring_buffer->size) {
-		ring_buffer->read_ptr = 0;
+void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
+	if (ring_buffer->alert_waiters->head) {
+		ring_buffer_alert_list(ring_buffer, ring_buffer->alert_waiters);
 	}
 }
 
-static inline void ring_buffer_increment_write(ring_buffer_t * ring_buffer) {
-	ring_buffer->write_ptr++;
-	if (ring_buffer->write_ptr == ring_buffer->size) {
-		ring_buffer->write_ptr = 0;
+void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process) {
+	spin_lock(ring_buffer->alert_lock);
+	if (!list_find(ring_buffer->alert_waiters, process)) {
+		list_insert(ring_buffer->alert_waiters, process);
 	}
+	spin_unlock(ring_buffer->alert_lock);
+	process_add_node_wait(process, ring_buffer);
 }
 
-void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->alert_waiters) {
-		while (ring_buffer->alert_waiters->head) {
-			node_t * node = list_dequeue(ring_buffer->alert_waiters);
-			process_t * p = node->value;
-			process_alert_node(p, ring_buffer);
-			free(node);
-		}
+/**
+ * @brief Have @p waiter alerted when a reader makes room.
+ *
+ * Only epoll interests wait for this; fswait only knows about
+ * readability, so these are kept apart from the alert_waiters.
+ */
+void ring_buffer_space_wait(ring_buffer_t * ring_buffer, void * waiter) {
+	spin_lock(ring_buffer->alert_lock);
+	if (!list_find(ring_buffer->space_waiters, waiter)) {
+		list_insert(ring_buffer->space_waiters, waiter);
 	}
+	spin_unlock(ring_buffer->alert_lock);
 }
 
-void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process) {
-	if (!ring_buffer->alert_waiters) {
-		ring_buffer->alert_waiters = list_create("ringbuffer alerts", ring_buffer);
+static void ring_buffer_list_remove(list_t * list, void * waiter) {
+	node_t * node = list_find(list, waiter);
+	if (node) {
+		list_delete(list, node);
+		free(node);
 	}
+}
 
-	if (!list_find(ring_buffer->alert_waiters, process)) {
-		list_insert(ring_buffer->alert_waiters, process);
+/**
+ * @brief Stop alerting @p waiter about anything.
+ */
+void ring_buffer_unwait(ring_buffer_t * ring_buffer, void * waiter) {
+	spin_lock(ring_buffer->alert_lock);
+	ring_buffer_list_remove(ring_buffer->alert_waiters, waiter);
+	ring_buffer_list_remove(ring_buffer->space_waiters, waiter);
+	spin_unlock(ring_buffer->alert_lock);
+}
+
+void ring_buffer_alert_space(ring_buffer_t * ring_buffer) {
+	if (ring_buffer->space_waiters->head) {
+		ring_buffer_alert_list(ring_buffer, ring_buffer->space_waiters);
 	}
-	list_insert(((process_t *)process)->node_waits, ring_buffer);
 }
 
+/**
+ * @brief Read up to @p size bytes, waiting until there is at least one.
+ *
+ * Readers and writers each have their own lock and only ever move
+ * their own pointer, so a reader and a writer never wait on each
+ * other; with one of each, neither lock is ever contended. Data is
+ * copied a contiguous run at a time, which is at most two runs for
+ * any read or write.
+ */
 size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
 	size_t collected = 0;
 	while (collected == 0) {
+		spin_lock(ring_buffer->read_lock);
+		size_t read_ptr = ring_buffer->read_ptr;
+		size_t write_ptr = __atomic_load_n(&ring_buffer->write_ptr, __ATOMIC_ACQUIRE);
+		size_t unread = ring_buffer_count(read_ptr, write_ptr, ring_buffer->size);
+		while (unread && collected < size) {
+			size_t run = ring_buffer->size - read_ptr;
+			if (run > unread) run = unread;
+			if (run > size - collected) run = size - collected;
+			memcpy(buffer + collected, ring_buffer->buffer + read_ptr, run);
+			read_ptr = (read_ptr + run == ring_buffer->size) ? 0 : read_ptr + run;
+			collected += run;
+			unread -= run;
+		}
+		__atomic_store_n(&ring_buffer->read_ptr, read_ptr, __ATOMIC_RELEASE);
+		spin_unlock(ring_buffer->read_lock);
+
+		if (collected) {
+			ring_buffer_wake(ring_buffer, ring_buffer->wait_queue_writers, &ring_buffer->writers_waiting);
+			ring_buffer_alert_space(ring_buffer);
+			break;
+		}
+
 		spin_lock(ring_buffer->lock);
-		while (ring_buffer_unread(ring_buffer) > 0 && collected < size) {
-			buffer[collected] = ring_buffer->buffer[ring_buffer->read_ptr];
-			ring_buffer_increment_read(ring_buffer);
-			collected++;
+		ring_buffer->readers_waiting = 1;
+		__sync_synchronize();
+		if (ring_buffer_unread(ring_buffer)) {
+			spin_unlock(ring_buffer->lock);
+			continue;
 		}
-		spin_unlock(ring_buffer->lock);
-		wakeup_queue(ring_buffer->wait_queue_writers);
-		if (collected == 0) {
-			if (sleep_on(ring_buffer->wait_queue_readers) && ring_buffer->internal_stop) {
-				ring_buffer->internal_stop = 0;
-				break;
-			}
+		if (sleep_on_unlocking(ring_buffer->wait_queue_readers, &ring_buffer->lock) && ring_buffer->internal_stop) {
+			ring_buffer->internal_stop = 0;
+			break;
 		}
 	}
-	wakeup_queue(ring_buffer->wait_queue_writers);
 	return collected;
 }
 
 size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
 	size_t written = 0;
 	while (written < size) {
-		spin_lock(ring_buffer->lock);
+		spin_lock(ring_buffer->write_lock);
+		size_t write_ptr = ring_buffer->write_ptr;
+		size_t read_ptr = __atomic_load_n(&ring_buffer->read_ptr, __ATOMIC_ACQUIRE);
+		size_t available = ring_buffer->size - 1 - ring_buffer_count(read_ptr, write_ptr, ring_buffer->size);
+		size_t before = written;
+		while (available && written < size) {
+			size_t run = ring_buffer->size - write_ptr;
+			if (run > available) run = available;
+			if (run > size - written) run = size - written;
+			memcpy(ring_buffer->buffer + write_ptr, buffer + written, run);
+			write_ptr = (write_ptr + run == ring_buffer->size) ? 0 : write_ptr + run;
+			written += run;
+			available -= run;
+		}
+		__atomic_store_n(&ring_buffer->write_ptr, write_ptr, __ATOMIC_RELEASE);
+		spin_unlock(ring_buffer->write_lock);
 
-		while (ring_buffer_available(ring_buffer) > 0 && written < size) {
-			ring_buffer->buffer[ring_buffer->write_ptr] = buffer[written];
-			ring_buffer_increment_write(ring_buffer);
-			written++;
+		if (written != before) {
+			ring_buffer_wake(ring_buffer, ring_buffer->wait_queue_readers, &ring_buffer->readers_waiting);
+			ring_buffer_alert_waiters(ring_buffer);
 		}
 
-		spin_unlock(ring_buffer->lock);
-		wakeup_queue(ring_buffer->wait_queue_readers);
-		ring_buffer_alert_waiters(ring_buffer);
 		if (written < size) {
 			if (ring_buffer->discard) {
 				break;
 			}
-			if (sleep_on(ring_buffer->wait_queue_writers) && ring_buffer->internal_stop) {
+			spin_lock(ring_buffer->lock);
+			ring_buffer->writers_waiting = 1;
+			__sync_synchronize();
+			if (ring_buffer_available(ring_buffer)) {
+				spin_unlock(ring_buffer->lock);
+				continue;
+			}
+			if (sleep_on_unlocking(ring_buffer->wait_queue_writers, &ring_buffer->lock) && ring_buffer->internal_stop) {
 				ring_buffer->internal_stop = 0;
 				break;
 			}
 		}
 	}
 
-	wakeup_queue(ring_buffer->wait_queue_readers);
-	ring_buffer_alert_waiters(ring_buffer);
 	return written;
 }
 
+/**
+ * @brief Change the capacity of a ring buffer.
+ *
+ * Anything unread is kept.
+ *
+ * @param size New capacity, in bytes.
+ * @returns 0, or -EBUSY if more than that is waiting to be read.
+ */
+int ring_buffer_resize(ring_buffer_t * ring_buffer, size_t size) {
+	unsigned char * new_buffer = malloc(size + 1);
+
+	spin_lock(ring_buffer->write_lock);
+	spin_lock(ring_buffer->read_lock);
+
+	size_t unread = ring_buffer_unread(ring_buffer);
+	if (unread > size) {
+		spin_unlock(ring_buffer->read_lock);
+		spin_unlock(ring_buffer->write_lock);
+		free(new_buffer);
+		return -EBUSY;
+	}
+
+	size_t first = ring_buffer->size - ring_buffer->read_ptr;
+	if (first > unread) first = unread;
+	memcpy(new_buffer, ring_buffer->buffer + ring_buffer->read_ptr, first);
+	memcpy(new_buffer + first, ring_buffer->buffer, unread - first);
+
+	unsigned char * old_buffer = ring_buffer->buffer;
+	ring_buffer->buffer = new_buffer;
+	ring_buffer->size = size + 1;
+	ring_buffer->read_ptr = 0;
+	ring_buffer->write_ptr = unread;
+
+	spin_unlock(ring_buffer->read_lock);
+	spin_unlock(ring_buffer->write_lock);
+
+	free(old_buffer);
+	ring_buffer_wake(ring_buffer, ring_buffer->wait_queue_writers, &ring_buffer->writers_waiting);
+	ring_buffer_alert_space(ring_buffer);
+	return 0;
+}
+
 ring_buffer_t * ring_buffer_create(size_t size) {
 	ring_buffer_t * out = malloc(sizeof(ring_buffer_t));
 
@@ -143,10 +267,16 @@ ring_buffer_t * ring_buffer_create(size_t size) {
 	out->write_ptr  = 0;
 	out->read_ptr   = 0;
 	out->size       = size;
-	out->alert_waiters = NULL;
+	out->alert_waiters = list_create("ringbuffer alerts", out);
+	out->space_waiters = list_create("ringbuffer space alerts", out);
 
 	spin_init(out->lock);
+	spin_init(out->alert_lock);
+	spin_init(out->read_lock);
+	spin_init(out->write_lock);
 
+	out->readers_waiting = 0;
+	out->writers_waiting = 0;
 	out->internal_stop = 0;
 	out->discard = 0;
 
@@ -162,6 +292,7 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
 	wakeup_queue(ring_buffer->wait_queue_writers);
 	wakeup_queue(ring_buffer->wait_queue_readers);
 	ring_buffer_alert_waiters(ring_buffer);
+	ring_buffer_alert_space(ring_buffer);
 
 	list_free(ring_buffer->wait_queue_writers);
 	list_free(ring_buffer->wait_queue_readers);
@@ -169,15 +300,17 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
 	free(ring_buffer->wait_queue_writers);
 	free(ring_buffer->wait_queue_readers);
 
-	if (ring_buffer->alert_waiters) {
-		list_free(ring_buffer->alert_waiters);
-		free(ring_buffer->alert_waiters);
-	}
+	list_free(ring_buffer->alert_waiters);
+	list_free(ring_buffer->space_waiters);
+	free(ring_buffer->alert_waiters);
+	free(ring_buffer->space_waiters);
 }
 
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer) {
+	spin_lock(ring_buffer->lock);
 	ring_buffer->internal_stop = 1;
 	wakeup_queue_interrupted(ring_buffer->wait_queue_readers);
 	wakeup_queue_interrupted(ring_buffer->wait_queue_writers);
+	spin_unlock(ring_buffer->lock);
 }
 
@@ -30,6 +30,12 @@ extern list_t * net_raw_sockets_list;
 extern void net_ipv4_handle(void * packet, fs_node_t * nic);
 extern void net_arp_handle(void * packet, fs_node_t * nic);
 
+/**
+ * @brief Handle a received Ethernet frame.
+ *
+ * The frame still belongs to the driver when this returns; anything
+ * that wants to keep part of it must copy it.
+ */
 void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic) {
 	spin_lock(net_raw_sockets_lock);
 	foreach(node, net_raw_sockets_list) {
@@ -59,8 +65,6 @@ void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic) {
 			}
 		}
 	}
-
-	free(frame);
 }
 
 void net_eth_send(struct EthernetDevice * nic, size_t len, void* data, uint16_t type, uint8_t * dest) {
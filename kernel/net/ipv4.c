@@ -18,6 +18,7 @@
 #include <kernel/net/netif.h>
 #include <kernel/net/eth.h>
 #include <kernel/net/ipv4.h>
+#include <kernel/net/tcp.h>
 
 #include <sys/socket.h>
 
@@ -26,8 +27,6 @@
 //#define printf(...)
 #endif
 
-#define DEFAULT_TCP_WINDOW_SIZE 8000
-
 static int _debug __attribute__((unused)) = 0;
 
 static void ip_ntoa(const uint32_t src_addr, char * out) {
@@ -66,65 +65,22 @@ uint16_t calculate_ipv4_checksum(struct ipv4_packet * p) {
 	return ~(sum & 0xFFFF) & 0xFFFF;
 }
 
-uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header * h, void * d, size_t payload_size) {
-	uint32_t sum = 0;
-	uint16_t * s = (uint16_t *)p;
-
-	/* TODO: Checksums for options? */
-	for (int i = 0; i < 6; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
-	}
-
-	s = (uint16_t *)h;
-	for (int i = 0; i < 10; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
-	}
-
-	uint16_t d_words = payload_size / 2;
-
-	s = (uint16_t *)d;
-	for (unsigned int i = 0; i < d_words; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic) {
+	/* where are we going, and through which interface? */
+	uint32_t ipdest;
+	fs_node_t * route = net_route(response->destination, &ipdest);
+	if (route) {
+		nic = route;
+	} else if (!nic) {
+		return -ENETUNREACH;
 	}
 
-	if (d_words * 2 != payload_size) {
-		uint8_t * t = (uint8_t *)d;
-		uint8_t tmp[2];
-		tmp[0] = t[d_words * sizeof(uint16_t)];
-		tmp[1] = 0;
-
-		uint16_t * f = (uint16_t *)tmp;
-
-		sum += ntohs(f[0]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+	if (nic == net_loopback) {
+		return net_loopback_send(nic, response);
 	}
 
-	return ~(sum & 0xFFFF) & 0xFFFF;
-}
-
-int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic) {
-	/* TODO: This should be routing, with a _hint_ about the interface, not the actual nic to send from! */
 	struct EthernetDevice * enic = nic->device;
 
-	/* where are we going? */
-	uint32_t ipdest = response->destination;
-
-	/* Is this local or should we send it to the gateway? */
-	if (!enic->ipv4_subnet || ((ipdest & enic->ipv4_subnet) != (enic->ipv4_addr & enic->ipv4_subnet))) {
-		ipdest = enic->ipv4_gateway;
-	}
-
 	/* Get the ethernet address of the destination */
 	struct ArpCacheEntry * resp = net_arp_cache_get(ipdest);
 
@@ -168,115 +124,10 @@ static void icmp_handle(struct ipv4_packet * packet, const char * src, const cha
 }
 
 static hashmap_t * udp_sockets = NULL;
-static hashmap_t * tcp_sockets = NULL;
 
 void ipv4_install(void) {
 	udp_sockets = hashmap_create_int(10);
-	tcp_sockets = hashmap_create_int(10);
-}
-
-#define TCP_FLAGS_FIN (1 << 0)
-#define TCP_FLAGS_SYN (1 << 1)
-#define TCP_FLAGS_RES (1 << 2)
-#define TCP_FLAGS_PSH (1 << 3)
-#define TCP_FLAGS_ACK (1 << 4)
-#define TCP_FLAGS_URG (1 << 5)
-#define TCP_FLAGS_ECE (1 << 6)
-#define TCP_FLAGS_CWR (1 << 7)
-#define TCP_FLAGS_NS  (1 << 8)
-#define DATA_OFFSET_5 (0x5 << 12)
-
-static int tcp_ack(fs_node_t * nic, sock_t * sock, struct ipv4_packet * packet, int isSynAck, size_t payload_len) {
-	struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
-	int retval = 1;
-	int window_size = DEFAULT_TCP_WINDOW_SIZE;
-	int send_thrice = 0;
-
-#if 0
-	/* XXX: This means the header is bigger than we expect... */
-	if ((ntohs(tcp->flags) & 0xF000) != 0x5000) {
-		int _debug __attribute__((unused)) = 1;
-		printf("tcp: uh, weird flags? %#4x\n", ntohs(tcp->flags));
-	}
-#endif
-
-	if (sock->priv32[1] != 0 && !isSynAck &&
-		sock->priv32[1] != ntohl(tcp->seq_number)) {
-#if 0
-		int _debug __attribute__((unused)) = 1;
-		printf("tcp: suspicious of their seq number?\n");
-		printf("tcp: their seq = %u our ack = %u\n",
-			ntohl(tcp->seq_number), sock->priv32[1]);
-#endif
-		window_size = 300;
-		retval = 0;
-		send_thrice = 1;
-	} else {
-		sock->priv32[0] = isSynAck ? 1 : sock->priv32[0];
-		sock->priv32[1] = (ntohl(tcp->seq_number) + payload_len) & 0xFFFFFFFF;
-		sock->priv[1] = 2;
-	}
-
-	sock->priv[2]++;
-
-#if 0
-	printf("tcp: their ack = %u our seq = %u\n",
-		ntohl(tcp->ack_number), sock->priv32[0]);
-	printf("tcp: their seq = %u our ack = %u\n",
-		ntohl(tcp->seq_number), sock->priv32[1]);
-#endif
-
-
-	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-
-	struct ipv4_packet * response = malloc(total_length);
-	response->length = htons(total_length);
-	response->destination = packet->source;
-	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-	response->ttl = 64;
-	response->protocol = IPV4_PROT_TCP;
-	response->ident = htons(sock->priv[2]);
-	response->flags_fragment = htons(0x0);
-	response->version_ihl = 0x45;
-	response->dscp_ecn = 0;
-	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
-
-	int flags = TCP_FLAGS_ACK;
-	if (ntohs(tcp->flags) & TCP_FLAGS_FIN) {
-		/* Other side is closed now */
-		sock->priv32[1]++;
-		sock->priv[1] = 3;
-	}
-
-	/* Stick TCP header into payload */
-	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-	tcp_header->source_port = htons(sock->priv[0]);
-	tcp_header->destination_port = tcp->source_port;
-	tcp_header->seq_number = htonl(sock->priv32[0]);
-	tcp_header->ack_number = htonl(sock->priv32[1]);
-	tcp_header->flags = htons(flags | 0x5000);
-	tcp_header->window_size = htons(window_size);
-	tcp_header->checksum = 0;
-	tcp_header->urgent = 0;
-
-	/* Calculate checksum */
-	struct tcp_check_header check_hd = {
-		.source = response->source,
-		.destination = response->destination,
-		.zeros = 0,
-		.protocol = IPV4_PROT_TCP,
-		.tcp_len = htons(sizeof(struct tcp_header)),
-	};
-
-	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, NULL, 0));
-	net_ipv4_send(response,nic);
-	if (send_thrice) {
-		net_ipv4_send(response,nic);
-		net_ipv4_send(response,nic);
-	}
-	free(response);
-	return retval;
+	net_tcp_install();
 }
 
 void net_ipv4_handle(struct ipv4_packet * packet, fs_node_t * nic) {
@@ -301,44 +152,12 @@ void net_ipv4_handle(struct ipv4_packet * packet, fs_node_t * nic) {
 			}
 			break;
 		}
-		case IPV4_PROT_TCP: {
-			uint16_t dest_port = ntohs(((uint16_t*)&packet->payload)[1]);
-			printf("net: ipv4: %s: %s -> %s tcp %d to %d\n", nic->name, src, dest, ntohs(((uint16_t*)&packet->payload)[0]), dest_port);
-			if (hashmap_has(tcp_sockets, (void*)(uintptr_t)dest_port)) {
-				printf("net: tcp: received and have a waiting endpoint!\n");
-				/* What kind of packet is this? Is it something we were expecting? */
-				sock_t * sock = hashmap_get(tcp_sockets, (void*)(uintptr_t)dest_port);
-				struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
-
-				if (sock->priv[1] == 1) {
-					/* Awaiting SYN ACK, is this one? */
-					if ((ntohs(tcp->flags) & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) == (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) {
-						printf("tcp: synack\n");
-						if (tcp_ack(nic, sock, packet, 1, 1)) {
-							net_sock_add(sock, packet, ntohs(packet->length));
-						}
-					}
-				} else if (sock->priv[1] == 2) {
-					size_t packet_len = ntohs(packet->length) - sizeof(struct ipv4_packet);
-					size_t hlen = ((ntohs(tcp->flags) & 0xF000) >> 12) * 4;
-					size_t payload_len = packet_len - hlen;
-					if (payload_len) {
-						printf("tcp: acking because payload_len = %zu (hlen=%zu, packet_len=%zu)\n", payload_len, hlen, packet_len);
-						if (tcp_ack(nic, sock, packet, 0, payload_len)) {
-							net_sock_add(sock, packet, ntohs(packet->length));
-						}
-					} else if (ntohs(tcp->flags) & TCP_FLAGS_FIN) {
-						tcp_ack(nic, sock, packet, 0, 0);
-					}
-				}
-			}
+		case IPV4_PROT_TCP:
+			net_tcp_handle(packet, nic);
 			break;
-		}
 	}
 }
 
-extern fs_node_t * net_if_any(void);
-
 static spin_lock_t udp_port_lock = {0};
 
 static int next_port = 12345;
@@ -374,8 +193,8 @@ static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	ip_ntoa(ntohl(name->sin_addr.s_addr), dest);
 	printf("udp: want to send to %s\n", dest);
 
-	/* Routing: We need a device to send this on... */
-	fs_node_t * nic = net_if_any();
+	fs_node_t * nic = net_route((uint32_t)name->sin_addr.s_addr, NULL);
+	if (!nic) return -ENETUNREACH;
 
 	size_t total_length = sizeof(struct ipv4_packet) + msg->msg_iov[0].iov_len + sizeof(struct udp_packet);
 
@@ -449,335 +268,13 @@ static int udp_socket(void) {
 	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock);
 }
 
-static spin_lock_t tcp_port_lock = {0};
-static void sock_tcp_close(sock_t * sock) {
-	if (sock->priv[0]) {
-		printf("tcp: removing port %d from bound map\n", sock->priv[0]);
-		spin_lock(tcp_port_lock);
-		hashmap_remove(tcp_sockets, (void*)(uintptr_t)sock->priv[0]);
-		spin_unlock(tcp_port_lock);
-
-		size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-		fs_node_t * nic = net_if_any();
-
-		struct ipv4_packet * response = malloc(total_length);
-		response->length = htons(total_length);
-		response->destination = ((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr;
-		response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-		response->ttl = 64;
-		response->protocol = IPV4_PROT_TCP;
-		sock->priv[2]++;
-		response->ident = htons(sock->priv[2]);
-		response->flags_fragment = htons(0x0);
-		response->version_ihl = 0x45;
-		response->dscp_ecn = 0;
-		response->checksum = 0;
-		response->checksum = htons(calculate_ipv4_checksum(response));
-
-		/* Stick TCP header into payload */
-		struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-		tcp_header->source_port = htons(sock->priv[0]);
-		tcp_header->destination_port = ((struct sockaddr_in*)&sock->dest)->sin_port;
-		tcp_header->seq_number = htonl(sock->priv32[0]);
-		tcp_header->ack_number = htonl(sock->priv32[1]);
-		tcp_header->flags = htons(TCP_FLAGS_FIN | TCP_FLAGS_ACK | 0x5000);
-		tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-		tcp_header->checksum = 0;
-		tcp_header->urgent = 0;
-
-		/* Calculate checksum */
-		struct tcp_check_header check_hd = {
-			.source = response->source,
-			.destination = response->destination,
-			.zeros = 0,
-			.protocol = IPV4_PROT_TCP,
-			.tcp_len = htons(sizeof(struct tcp_header)),
-		};
-
-		tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_header->payload, 0));
-		net_ipv4_send(response,nic);
-		free(response);
-	}
-}
-
-static int next_tcp_port = 49152;
-static int tcp_get_port(sock_t * sock) {
-	spin_lock(tcp_port_lock);
-	int out = next_tcp_port++;
-	hashmap_set(tcp_sockets, (void*)(uintptr_t)out, sock);
-	sock->priv[0] = out;
-	spin_unlock(tcp_port_lock);
-	return out;
-}
-
-static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
-	if (!sock->priv[0]) {
-		printf("tcp: recv() but socket has no port\n");
-		return -EINVAL;
-	}
-
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
-	if (msg->msg_iovlen == 0) return 0;
-
-	if (sock->unread) {
-		if (sock->unread > msg->msg_iov[0].iov_len) {
-			sock->unread = 0;
-			long out = msg->msg_iov[0].iov_len;
-			sock->unread -= out;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
-			char * x = malloc(sock->unread);
-			memcpy(x, sock->buf + out, sock->unread);
-			free(sock->buf);
-			sock->buf = x;
-			return out;
-		} else {
-			long out = sock->unread;
-			sock->unread = 0;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
-			free(sock->buf);
-			sock->buf = NULL;
-			return out;
-		}
-	}
-
-	if (!sock->rx_queue->length && sock->priv[1] == 3) {
-		return 0; /* EOF */
-	}
-
-	while (!sock->rx_queue->length) {
-		process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
-	}
-
-	struct ipv4_packet * data = net_sock_get(sock);
-	long resp = ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct tcp_header);
-
-	if (resp > (long)msg->msg_iov[0].iov_len) {
-		memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header),msg->msg_iov[0].iov_len);
-		resp -= msg->msg_iov[0].iov_len;
-		sock->unread = resp;
-		sock->buf = malloc(resp);
-		memcpy(sock->buf, data->payload + sizeof(struct tcp_header) + msg->msg_iov[0].iov_len, resp);
-		free(data);
-		return msg->msg_iov[0].iov_len;
-	}
-
-	memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header), resp);
-	free(data);
-	return resp;
-}
-
-extern uint32_t rand(void);
-
-static long sock_tcp_connect(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
-	const struct sockaddr_in * dest = (const struct sockaddr_in *)addr;
-	char deststr[16];
-	ip_ntoa(ntohl(dest->sin_addr.s_addr), deststr);
-	printf("tcp: connect requested to %s port %d\n", deststr, ntohs(dest->sin_port));
-
-	if (sock->priv[1] != 0) {
-		printf("tcp: socket is already connected?\n");
-		return -EINVAL;
-	}
-
-	/* Get a port */
-	tcp_get_port(sock);
-	printf("tcp: connecting from ephemeral port %d\n", (int)sock->priv[0]);
-
-	/* Mark as awaiting connection, send initial SYN */
-	sock->priv[1] = 1;
-
-	memcpy(&sock->dest, addr, addrlen);
-
-	fs_node_t * nic = net_if_any();
-
-	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-
-	struct ipv4_packet * response = malloc(total_length);
-	response->length = htons(total_length);
-	response->destination = dest->sin_addr.s_addr;
-	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-	response->ttl = 64;
-	response->protocol = IPV4_PROT_TCP;
-	sock->priv[2] = rand();
-	response->ident = htons(sock->priv[2]);
-	response->flags_fragment = htons(0x0);
-	response->version_ihl = 0x45;
-	response->dscp_ecn = 0;
-	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
-
-	/* Stick TCP header into payload */
-	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-	tcp_header->source_port = htons(sock->priv[0]);
-	tcp_header->destination_port = dest->sin_port;
-	tcp_header->seq_number = 0;
-	tcp_header->ack_number = 0;
-	tcp_header->flags = htons((1 << 1) | 0x5000);
-	tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-	tcp_header->checksum = 0;
-	tcp_header->urgent = 0;
-
-	/* Calculate checksum */
-	struct tcp_check_header check_hd = {
-		.source = response->source,
-		.destination = response->destination,
-		.zeros = 0,
-		.protocol = IPV4_PROT_TCP,
-		.tcp_len = htons(sizeof(struct tcp_header)),
-	};
-
-	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, NULL, 0));
-
-	net_ipv4_send(response,nic);
-
-	//int _debug __attribute__((unused)) = 1;
-	printf("tcp: waiting for connect to finish; queue = %ld\n", sock->rx_queue->length);
-
-	unsigned long s, ss;
-	unsigned long ns, nss;
-	relative_time(2,0,&s,&ss);
-	int attempts = 0;
-
-	while (!sock->rx_queue->length) {
-		int result = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
-		relative_time(0,0,&ns,&nss);
-		if (result != 0 && (ns > s || (ns == s && nss > ss))) {
-			if (attempts++ > 5) {
-				printf("tcp: connect timed out\n");
-				free(response);
-				return -ETIMEDOUT;
-			}
-			printf("tcp: retrying...\n");
-			net_ipv4_send(response,nic);
-			relative_time(2,0,&s,&ss);
-		}
-	}
-
-	free(response);
-
-	printf("tcp: queue should have data now (len = %lu), trying to read\n", sock->rx_queue->length);
-
-	/* wait for signal that we connected or timed out */
-	struct ipv4_packet * data = net_sock_get(sock);
-	printf("tcp: connect complete\n");
-	free(data);
-
-	return 0;
-}
-
-ssize_t sock_tcp_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	printf("tcp: read into buffer of %zu bytes\n", size);
-	struct iovec _iovec = {
-		buffer, size
-	};
-	struct msghdr _header = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = &_iovec,
-		.msg_iovlen = 1,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
-	};
-	return sock_tcp_recv((sock_t*)node, &_header, 0);
-}
-
-static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
-	printf("tcp: send called\n");
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
-	if (msg->msg_iovlen == 0) return 0;
-
-	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header) + msg->msg_iov[0].iov_len;
-
-	fs_node_t * nic = net_if_any();
-
-	struct ipv4_packet * response = malloc(total_length);
-	response->length = htons(total_length);
-	response->destination = ((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr;
-	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-	response->ttl = 64;
-	response->protocol = IPV4_PROT_TCP;
-	sock->priv[2]++;
-	response->ident = htons(sock->priv[2]);
-	response->flags_fragment = htons(0x0);
-	response->version_ihl = 0x45;
-	response->dscp_ecn = 0;
-	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
-
-	/* Stick TCP header into payload */
-	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-	tcp_header->source_port = htons(sock->priv[0]);
-	tcp_header->destination_port = ((struct sockaddr_in*)&sock->dest)->sin_port;
-	tcp_header->seq_number = htonl(sock->priv32[0]);
-	tcp_header->ack_number = htonl(sock->priv32[1]);
-	tcp_header->flags = htons(TCP_FLAGS_PSH | TCP_FLAGS_ACK | 0x5000);
-	tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-	tcp_header->checksum = 0;
-	tcp_header->urgent = 0;
-
-	sock->priv32[0] += msg->msg_iov[0].iov_len;
-
-	/* Calculate checksum */
-	struct tcp_check_header check_hd = {
-		.source = response->source,
-		.destination = response->destination,
-		.zeros = 0,
-		.protocol = IPV4_PROT_TCP,
-		.tcp_len = htons(sizeof(struct tcp_header) + msg->msg_iov[0].iov_len),
-	};
-
-	memcpy(tcp_header->payload, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
-	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_header->payload, msg->msg_iov[0].iov_len));
-	net_ipv4_send(response,nic);
-	free(response);
-	return msg->msg_iov[0].iov_len;
-}
-
-ssize_t sock_tcp_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	printf("tcp: write of %zu bytes\n", size);
-	struct iovec _iovec = {
-		(void*)buffer, size
-	};
-	struct msghdr _header = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = &_iovec,
-		.msg_iovlen = 1,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
-	};
-	return sock_tcp_send((sock_t*)node, &_header, 0);
-}
-
-static int tcp_socket(void) {
-	printf("tcp socket...\n");
-	sock_t * sock = net_sock_create();
-	sock->sock_recv = sock_tcp_recv;
-	sock->sock_send = sock_tcp_send;
-	sock->sock_close = sock_tcp_close;
-	sock->sock_connect = sock_tcp_connect;
-	sock->_fnode.read = sock_tcp_read;
-	sock->_fnode.write = sock_tcp_write;
-	int fd = process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock);
-	FD_MODE(fd) = 03;
-	return fd;
-}
-
 long net_ipv4_socket(int type, int protocol) {
 	/* Ignore protocol, make socket for 'type' only... */
 	switch (type) {
 		case SOCK_DGRAM:
 			return udp_socket();
 		case SOCK_STREAM:
-			return tcp_socket();
+			return net_tcp_socket();
 		default:
 			return -EINVAL;
 	}
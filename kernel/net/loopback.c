@@ -0,0 +1,157 @@
+/**
+ * @file  kernel/net/loopback.c
+ * @brief Loopback interface.
+ *
+ * Packets routed to lo never become Ethernet frames. They are queued
+ * and a kernel thread hands them back to the IPv4 input path. This
+ * can't happen directly from the sender, which may be holding locks
+ * (a TCP connection's, say) that the input path also needs.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+
+#include <kernel/net/netif.h>
+#include <kernel/net/eth.h>
+#include <kernel/net/ipv4.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+
+#define LOOPBACK_MTU       16384
+#define LOOPBACK_QUEUE_MAX 1024
+
+extern void net_ipv4_handle(struct ipv4_packet * packet, fs_node_t * nic);
+
+struct loopback_nic {
+	struct EthernetDevice eth;
+	spin_lock_t lock;
+	list_t * queue;
+	list_t * wait;
+	volatile int started;
+};
+
+fs_node_t * net_loopback = NULL;
+static struct loopback_nic * lo = NULL;
+
+static void loopback_process(void * data) {
+	while (1) {
+		spin_lock(lo->lock);
+		if (!lo->queue->length) {
+			sleep_on_unlocking(lo->wait, &lo->lock);
+			continue;
+		}
+		node_t * n = list_dequeue(lo->queue);
+		spin_unlock(lo->lock);
+
+		struct ipv4_packet * packet = n->value;
+		free(n);
+		net_ipv4_handle(packet, net_loopback);
+		free(packet);
+	}
+}
+
+/**
+ * @brief Send an IPv4 packet through the loopback interface.
+ *
+ * The packet is copied, so the caller still owns it.
+ * @returns 0, -ENODEV if @p nic is not the loopback interface, or
+ *          -ENOBUFS if the queue is full and the packet was dropped.
+ */
+int net_loopback_send(fs_node_t * nic, struct ipv4_packet * packet) {
+	if (!lo || nic != net_loopback) return -ENODEV;
+
+	if (!__sync_lock_test_and_set(&lo->started, 1)) {
+		spawn_worker_thread(loopback_process, "[lo]", NULL);
+	}
+
+	size_t len = ntohs(packet->length);
+	struct ipv4_packet * copy = malloc(len);
+	memcpy(copy, packet, len);
+
+	spin_lock(lo->lock);
+	if (lo->queue->length >= LOOPBACK_QUEUE_MAX) {
+		spin_unlock(lo->lock);
+		free(copy);
+		return -ENOBUFS;
+	}
+	list_insert(lo->queue, copy);
+	wakeup_queue(lo->wait);
+	spin_unlock(lo->lock);
+	return 0;
+}
+
+static int ioctl_loopback(fs_node_t * node, unsigned long request, void * argp) {
+	struct loopback_nic * nic = node->device;
+
+	switch (request) {
+		case SIOCGIFHWADDR:
+			memcpy(argp, nic->eth.mac, 6);
+			return 0;
+
+		case SIOCGIFADDR:
+			if (nic->eth.ipv4_addr == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_addr, sizeof(nic->eth.ipv4_addr));
+			return 0;
+		case SIOCSIFADDR:
+			memcpy(&nic->eth.ipv4_addr, argp, sizeof(nic->eth.ipv4_addr));
+			return 0;
+		case SIOCGIFNETMASK:
+			if (nic->eth.ipv4_subnet == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_subnet, sizeof(nic->eth.ipv4_subnet));
+			return 0;
+		case SIOCSIFNETMASK:
+			memcpy(&nic->eth.ipv4_subnet, argp, sizeof(nic->eth.ipv4_subnet));
+			return 0;
+		case SIOCGIFGATEWAY:
+			return -ENOENT;
+
+		case SIOCGIFADDR6:
+			return -ENOENT;
+
+		case SIOCGIFFLAGS: {
+			uint32_t * flags = argp;
+			*flags = IFF_UP | IFF_RUNNING | IFF_LOOPBACK;
+			return 0;
+		}
+
+		case SIOCGIFMTU: {
+			uint32_t * mtu = argp;
+			*mtu = nic->eth.mtu;
+			return 0;
+		}
+
+		default:
+			return -EINVAL;
+	}
+}
+
+void net_loopback_install(void) {
+	lo = calloc(sizeof(struct loopback_nic), 1);
+	snprintf(lo->eth.if_name, 31, "lo");
+	lo->eth.mtu = LOOPBACK_MTU;
+	lo->eth.ipv4_addr = htonl(0x7F000001);
+	lo->eth.ipv4_subnet = htonl(0xFF000000);
+	lo->queue = list_create("loopback queue", lo);
+	lo->wait = list_create("loopback wait", lo);
+
+	lo->eth.device_node = calloc(sizeof(fs_node_t),1);
+	snprintf(lo->eth.device_node->name, 100, "%s", lo->eth.if_name);
+	lo->eth.device_node->flags = FS_BLOCKDEVICE;
+	lo->eth.device_node->mask  = 0666;
+	lo->eth.device_node->ioctl = ioctl_loopback;
+	lo->eth.device_node->device = lo;
+
+	net_loopback = lo->eth.device_node;
+	net_add_interface(lo->eth.if_name, net_loopback);
+}
@@ -20,19 +20,24 @@
 #include <errno.h>
 
 static hashmap_t * interfaces = NULL;
+list_t * net_interfaces = NULL;
 extern list_t * net_raw_sockets_list;
-static fs_node_t * _if_first = NULL;
 
 extern void ipv4_install(void);
+extern void net_route_install(void);
+extern void net_loopback_install(void);
 extern hashmap_t * net_arp_cache;
 
 void net_install(void) {
 	/* Set up virtual devices */
 	map_vfs_directory("/dev/net");
 	interfaces = hashmap_create(10);
+	net_interfaces = list_create("network interfaces", NULL);
 	net_raw_sockets_list = list_create("raw sockets", NULL);
 	net_arp_cache = hashmap_create_int(10);
 	ipv4_install();
+	net_route_install();
+	net_loopback_install();
 }
 
 /* kinda temporary for now */
@@ -43,7 +48,7 @@ int net_add_interface(const char * name, fs_node_t * deviceNode) {
 	snprintf(tmp,100,"/dev/net/%s", name);
 	vfs_mount(tmp, deviceNode);
 
-	if (!_if_first) _if_first = deviceNode;
+	list_insert(net_interfaces, deviceNode);
 
 	return 0;
 }
@@ -51,7 +56,3 @@ int net_add_interface(const char * name, fs_node_t * deviceNode) {
 fs_node_t * net_if_lookup(const char * name) {
 	return hashmap_get(interfaces, name);
 }
-
-fs_node_t * net_if_any(void) {
-	return _if_first;
-}
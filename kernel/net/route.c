@@ -0,0 +1,236 @@
+/**
+ * @file  kernel/net/route.c
+ * @brief IPv4 routing table.
+ *
+ * The interface a packet leaves through is the one with the longest
+ * matching prefix. Besides the routes added with SIOCADDRT, each
+ * configured interface implies a route to its own subnet and a default
+ * route through its gateway, and its own address is reached through
+ * the loopback interface. Added routes win ties with implied ones.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/procfs.h>
+
+#include <kernel/net/netif.h>
+#include <kernel/net/eth.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+
+struct route {
+	uint32_t dest;      /* network order */
+	uint32_t netmask;
+	uint32_t gateway;   /* 0 if directly attached */
+	fs_node_t * nic;
+};
+
+extern list_t * net_interfaces;
+
+static spin_lock_t route_lock = {0};
+static list_t * routes = NULL;
+
+static int prefix_length(uint32_t netmask) {
+	return __builtin_popcount(netmask);
+}
+
+/**
+ * @brief Choose the interface to reach @p dest through.
+ *
+ * @param dest    destination address, in network order
+ * @param nexthop if not NULL, receives the address to deliver to on
+ *                that interface: @p dest itself or a gateway
+ * @returns the interface, or NULL if there are none
+ */
+fs_node_t * net_route(uint32_t dest, uint32_t * nexthop) {
+	fs_node_t * nic = NULL;
+	uint32_t via = 0;
+	int best = -1;
+
+	spin_lock(route_lock);
+	foreach(node, routes) {
+		struct route * r = node->value;
+		int len = prefix_length(r->netmask);
+		if (len > best && (dest & r->netmask) == r->dest) {
+			best = len;
+			nic = r->nic;
+			via = r->gateway;
+		}
+	}
+	spin_unlock(route_lock);
+
+	foreach(node, net_interfaces) {
+		fs_node_t * ifnode = node->value;
+		struct EthernetDevice * eth = ifnode->device;
+		if (!eth->ipv4_addr) continue;
+
+		if (dest == eth->ipv4_addr && net_loopback && best < 32) {
+			best = 32;
+			nic = net_loopback;
+			via = 0;
+			continue;
+		}
+
+		int len = prefix_length(eth->ipv4_subnet);
+		if (eth->ipv4_subnet && len > best && (dest & eth->ipv4_subnet) == (eth->ipv4_addr & eth->ipv4_subnet)) {
+			best = len;
+			nic = ifnode;
+			via = 0;
+		}
+
+		if (eth->ipv4_gateway && best < 0) {
+			best = 0;
+			nic = ifnode;
+			via = eth->ipv4_gateway;
+		}
+	}
+
+	if (!nic) {
+		/* Nothing is configured yet; try the first real interface */
+		foreach(node, net_interfaces) {
+			if (node->value != net_loopback) {
+				nic = node->value;
+				break;
+			}
+		}
+	}
+
+	if (nexthop) *nexthop = via ? via : dest;
+	return nic;
+}
+
+static long route_add(struct rtentry * rt, fs_node_t * nic) {
+	if (!nic) return -ENODEV;
+
+	spin_lock(route_lock);
+	foreach(node, routes) {
+		struct route * r = node->value;
+		if (r->dest == rt->rt_dst && r->netmask == rt->rt_genmask && r->nic == nic) {
+			spin_unlock(route_lock);
+			return -EEXIST;
+		}
+	}
+
+	struct route * r = malloc(sizeof(struct route));
+	r->dest = rt->rt_dst;
+	r->netmask = rt->rt_genmask;
+	r->gateway = rt->rt_gateway;
+	r->nic = nic;
+	list_insert(routes, r);
+	spin_unlock(route_lock);
+	return 0;
+}
+
+static long route_delete(struct rtentry * rt, fs_node_t * nic) {
+	spin_lock(route_lock);
+	foreach(node, routes) {
+		struct route * r = node->value;
+		if (r->dest == rt->rt_dst && r->netmask == rt->rt_genmask && (!nic || r->nic == nic)) {
+			list_delete(routes, node);
+			free(node);
+			free(r);
+			spin_unlock(route_lock);
+			return 0;
+		}
+	}
+	spin_unlock(route_lock);
+	return -ESRCH;
+}
+
+/**
+ * @brief SIOCADDRT and SIOCDELRT, which are made on sockets.
+ */
+long net_route_ioctl(unsigned long request, void * argp) {
+	struct rtentry * rt = argp;
+	if (!rt) return -EFAULT;
+	if (this_core->current_process->user != 0) return -EACCES;
+
+	/* The mask must be contiguous, and cover the whole destination */
+	uint32_t host_bits = ~ntohl(rt->rt_genmask);
+	if (host_bits & (host_bits + 1)) return -EINVAL;
+	if (rt->rt_dst & ~rt->rt_genmask) return -EINVAL;
+
+	fs_node_t * nic = NULL;
+	if (rt->rt_dev[0]) {
+		if (!memchr(rt->rt_dev, 0, sizeof(rt->rt_dev))) return -EINVAL;
+		nic = net_if_lookup(rt->rt_dev);
+		if (!nic) return -ENODEV;
+	}
+
+	switch (request) {
+		case SIOCADDRT:
+			return route_add(rt, nic);
+		case SIOCDELRT:
+			return route_delete(rt, nic);
+		default:
+			return -EINVAL;
+	}
+}
+
+static char * route_format(char * out, uint32_t dest, uint32_t netmask, uint32_t gateway, fs_node_t * nic, const char * flags) {
+	uint32_t d = ntohl(dest), m = ntohl(netmask), g = ntohl(gateway);
+	return out + snprintf(out, 100, "%d.%d.%d.%d/%d\t%d.%d.%d.%d\t%s\t%s\n",
+		d >> 24, (d >> 16) & 0xFF, (d >> 8) & 0xFF, d & 0xFF, prefix_length(m),
+		g >> 24, (g >> 16) & 0xFF, (g >> 8) & 0xFF, g & 0xFF,
+		((struct EthernetDevice *)nic->device)->if_name, flags);
+}
+
+static ssize_t route_func(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	spin_lock(route_lock);
+	size_t room = routes->length + net_interfaces->length * 3;
+	char * buf = malloc(100 * (room + 1));
+	char * o = buf;
+	o += snprintf(o, 100, "Destination\tGateway\tIface\tFlags\n");
+
+	foreach(n, routes) {
+		struct route * r = n->value;
+		o = route_format(o, r->dest, r->netmask, r->gateway, r->nic, r->gateway ? "UG" : "U");
+		room--;
+	}
+	spin_unlock(route_lock);
+
+	/* Implied by interface configuration */
+	foreach(n, net_interfaces) {
+		fs_node_t * ifnode = n->value;
+		struct EthernetDevice * eth = ifnode->device;
+		if (room < 3) break;
+		room -= 3;
+		if (!eth->ipv4_addr) continue;
+		if (net_loopback) o = route_format(o, eth->ipv4_addr, 0xFFFFFFFF, 0, net_loopback, "UH");
+		if (eth->ipv4_subnet) o = route_format(o, eth->ipv4_addr & eth->ipv4_subnet, eth->ipv4_subnet, 0, ifnode, "U");
+		if (eth->ipv4_gateway) o = route_format(o, 0, 0, eth->ipv4_gateway, ifnode, "UG");
+	}
+
+	size_t _bsize = strlen(buf);
+	if ((size_t)offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - (size_t)offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+static struct procfs_entry route_entry = {
+	0,
+	"route",
+	route_func,
+};
+
+void net_route_install(void) {
+	routes = list_create("ipv4 routes", NULL);
+	procfs_install(&route_entry);
+}
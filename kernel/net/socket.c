@@ -19,6 +19,8 @@
 #include <kernel/net/netif.h>
 
 #include <sys/socket.h>
+#include <poll.h>
+#include <net/if.h>
 
 #ifndef MISAKA_DEBUG_NET
 #define printf(...)
@@ -73,6 +75,12 @@ int sock_generic_check(fs_node_t *node) {
 	return sock->rx_queue->length ? 0 : 1;
 }
 
+/* Sends never block, so sockets are always writable. */
+int sock_generic_pollcheck(fs_node_t *node) {
+	sock_t * sock = (sock_t*)node;
+	return (sock->rx_queue->length ? POLLIN : 0) | POLLOUT;
+}
+
 int sock_generic_wait(fs_node_t *node, void * process) {
 	sock_t * sock = (sock_t*)node;
 
@@ -80,17 +88,39 @@ int sock_generic_wait(fs_node_t *node, void * process) {
 	if (!list_find(sock->alert_wait, process)) {
 		list_insert(sock->alert_wait, process);
 	}
-	list_insert(((process_t *)process)->node_waits, sock);
+	process_add_node_wait(process, sock);
 	spin_unlock(sock->alert_lock);
 	return 0;
 }
 
+static void sock_generic_unwait(fs_node_t *node, void * waiter) {
+	sock_t * sock = (sock_t*)node;
+
+	spin_lock(sock->alert_lock);
+	node_t * n = list_find(sock->alert_wait, waiter);
+	if (n) {
+		list_delete(sock->alert_wait, n);
+		free(n);
+	}
+	spin_unlock(sock->alert_lock);
+}
+
 void sock_generic_close(fs_node_t *node) {
 	sock_t * sock = (sock_t*)node;
 	sock->sock_close(sock);
 	printf("net: socket closed\n");
 }
 
+static int sock_generic_ioctl(fs_node_t * node, unsigned long request, void * argp) {
+	switch (request) {
+		case SIOCADDRT:
+		case SIOCDELRT:
+			return net_route_ioctl(request, argp);
+		default:
+			return -EINVAL;
+	}
+}
+
 sock_t * net_sock_create(void) {
 	sock_t * sock = calloc(sizeof(struct SockData),1);
 	sock->_fnode.flags = FS_PIPE; /* uh, FS_SOCKET? */
@@ -98,7 +128,10 @@ sock_t * net_sock_create(void) {
 	sock->_fnode.device = NULL;
 	sock->_fnode.selectcheck = sock_generic_check;
 	sock->_fnode.selectwait = sock_generic_wait;
+	sock->_fnode.pollunwait = sock_generic_unwait;
+	sock->_fnode.pollcheck = sock_generic_pollcheck;
 	sock->_fnode.close = sock_generic_close;
+	sock->_fnode.ioctl = sock_generic_ioctl;
 	sock->alert_wait = list_create("socket alert wait", sock);
 	sock->rx_wait    = list_create("socket rx wait", sock);
 	sock->rx_queue   = list_create("socket rx queue", sock);
@@ -194,7 +227,8 @@ long net_setsockopt(int sockfd, int level, int optname, const void *optval, sock
 		case SOL_SOCKET:
 			return net_so_socket(node,optname,optval,optlen);
 		default:
-			return -ENOPROTOOPT;
+			if (!node->sock_setsockopt) return -ENOPROTOOPT;
+			return node->sock_setsockopt(node,level,optname,optval,optlen);
 	}
 	return -EINVAL;
 }
@@ -206,40 +240,96 @@ long net_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t
 
 long net_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
-	return -EINVAL;
+	PTR_VALIDATE(addr);
+	if (!addr) return -EFAULT;
+	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+	if (!node->sock_bind) return -EINVAL;
+	return node->sock_bind(node,addr,addrlen);
 }
 
 long net_accept(int sockfd, struct sockaddr * addr, socklen_t * addrlen) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
-	return -EINVAL;
+	PTR_VALIDATE(addr);
+	PTR_VALIDATE(addrlen);
+	if (addr && !addrlen) return -EFAULT;
+	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+	if (!node->sock_accept) return -EINVAL;
+	return node->sock_accept(node,addr,addrlen);
 }
 
 long net_listen(int sockfd, int backlog) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
-	return -EINVAL;
+	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+	if (!node->sock_listen) return -EINVAL;
+	return node->sock_listen(node,backlog);
 }
 
 long net_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
+	PTR_VALIDATE(addr);
+	if (!addr) return -EFAULT;
 	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
 	if (!node->sock_connect) return -EINVAL;
 	return node->sock_connect(node,addr,addrlen);
 }
 
+/**
+ * @brief Check a message header and the buffers it points to.
+ *
+ * Protocols are also called from inside the kernel with kernel
+ * buffers, so this is done here and not by them.
+ */
+static long msghdr_validate(const struct msghdr * msg) {
+	PTR_VALIDATE(msg);
+	if (!msg) return -EFAULT;
+	PTR_VALIDATE(msg->msg_name);
+	PTR_VALIDATE(msg->msg_iov);
+	if (msg->msg_iovlen && !msg->msg_iov) return -EFAULT;
+	for (size_t i = 0; i < msg->msg_iovlen; ++i) {
+		PTR_VALIDATE(msg->msg_iov[i].iov_base);
+	}
+	return 0;
+}
+
 long net_recv(int sockfd, struct msghdr * msg, int flags) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
-	PTR_VALIDATE(msg);
+	long err = msghdr_validate(msg);
+	if (err) return err;
 	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
 	return node->sock_recv(node,msg,flags);
 }
 
 long net_send(int sockfd, const struct msghdr * msg, int flags) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
-	PTR_VALIDATE(msg);
+	long err = msghdr_validate(msg);
+	if (err) return err;
 	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
 	return node->sock_send(node,msg,flags);
 }
 
+/**
+ * @brief Send a vector of buffers with a single call into the protocol,
+ *        so a stream protocol can put them in the same segments.
+ *
+ * The caller has already validated the buffers.
+ * @returns bytes sent, or -ENOTSOCK if @p node is not a stream socket.
+ */
+long net_sock_writev(fs_node_t * node, const struct iovec * iov, int iovcnt) {
+	if (node->close != sock_generic_close) return -ENOTSOCK;
+	sock_t * sock = (sock_t*)node;
+	if (!sock->stream) return -ENOTSOCK;
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock->sock_send(sock,&_header,0);
+}
+
 long net_shutdown(int sockfd, int how) {
 	return -EINVAL;
 }
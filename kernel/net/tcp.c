@@ -0,0 +1,1814 @@
+/**
+ * @file  kernel/net/tcp.c
+ * @brief Transmission Control Protocol.
+ *
+ * Each connection has a control block holding its sequence state,
+ * a send buffer of data the peer has not acknowledged yet, and a
+ * receive buffer of data the socket has not read yet.
+ *
+ * Data is sent in segments no larger than the MSS both ends agreed on
+ * in their SYNs, and small writes are held back while earlier data is
+ * unacknowledged so they can go out together (Nagle, RFC 896), unless
+ * the socket has TCP_NODELAY set.
+ *
+ * How much may be in flight is the smaller of the peer's window,
+ * with window scaling (RFC 7323), and the congestion window, which
+ * is managed with slow start, congestion avoidance, and NewReno fast
+ * retransmit and recovery after three duplicate ACKs (RFC 5681,
+ * RFC 6582). The retransmission timeout comes from round-trip
+ * samples as in RFC 6298. Segments that arrive after a gap are kept
+ * until the gap is filled instead of being dropped.
+ *
+ * Connections are found by their address and port pairs in a hash
+ * table, and ports by who holds them. A listening socket answers
+ * SYNs with connections of its own that wait in SYN_RECEIVED and then
+ * on its accept queue; when its backlog is full it instead answers
+ * with a SYN cookie (RFC 4987), an initial sequence number from which
+ * the final ACK of the handshake can be checked without having kept
+ * anything for it.
+ *
+ * Timers are run by a kernel thread that wakes every few milliseconds
+ * while any connections exist. Control blocks outlive their sockets,
+ * so a closed connection still gets its FIN delivered, and they are
+ * freed by that thread once the connection is fully closed.
+ *
+ * @copyright This file is part of ToaruOS and is released under the terms
+ *            of the NCSA / University of Illinois License - see LICENSE.md
+ * @author    2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/syscall.h>
+#include <kernel/hashmap.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/time.h>
+
+#include <kernel/net/netif.h>
+#include <kernel/net/eth.h>
+#include <kernel/net/ipv4.h>
+#include <kernel/net/tcp.h>
+
+#include <sys/socket.h>
+#include <poll.h>
+
+#ifndef MISAKA_DEBUG_NET
+#define printf(...)
+#endif
+
+#define TCP_SNDBUF_SIZE     (64 * 1024)
+#define TCP_RCVBUF_SIZE     (128 * 1024)
+#define TCP_MAX_WINDOW      (65535U << 14)
+#define TCP_DEFAULT_MSS     536
+#define TCP_MIN_MSS         88
+#define TCP_INITIAL_WINDOW  10      /* segments (RFC 6928) */
+
+/* Times are in microseconds */
+#define TCP_RTO_INITIAL     1000000
+#define TCP_RTO_MIN         200000
+#define TCP_RTO_MAX         60000000
+#define TCP_CLOCK_GRANULARITY 10000
+#define TCP_TIME_WAIT_LENGTH 60000000
+
+#define TCP_SYN_RETRIES     6
+#define TCP_SYNACK_RETRIES  5
+#define TCP_RETRIES         12
+
+#define TCP_TABLE_SIZE      1024
+#define TCP_MAX_BACKLOG     128
+#define TCP_COOKIE_PERIOD   64      /* seconds per SYN cookie time slot */
+
+#define TCP_EPHEMERAL_FIRST 49152
+#define TCP_EPHEMERAL_LAST  65535
+
+#define SEQ_LT(a,b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a,b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a,b) ((int32_t)((a) - (b)) >= 0)
+
+enum tcp_state {
+	TCP_CLOSED,
+	TCP_LISTEN,
+	TCP_SYN_SENT,
+	TCP_SYN_RECEIVED,
+	TCP_ESTABLISHED,
+	TCP_FIN_WAIT_1,
+	TCP_FIN_WAIT_2,
+	TCP_CLOSING,
+	TCP_TIME_WAIT,
+	TCP_CLOSE_WAIT,
+	TCP_LAST_ACK,
+};
+
+/* A segment that arrived ahead of rcv_nxt */
+struct tcp_ooo {
+	uint32_t seq;
+	size_t len;
+	int fin;
+	uint8_t data[];
+};
+
+struct tcp_cb {
+	spin_lock_t lock;
+	sock_t * sock;           /* NULL until accepted, and once the socket is closed */
+	list_t * wait;           /* threads waiting for a change of state, data, or buffer space */
+	int state;
+	int error;               /* why the connection failed, once it has */
+	int closed;              /* nobody will read from it again */
+
+	fs_node_t * nic;
+	uint32_t local_addr;     /* network order */
+	uint32_t remote_addr;    /* network order */
+	uint16_t local_port;
+	uint16_t remote_port;
+	uint16_t ident;
+	uint16_t mss;            /* largest segment we send */
+	uint16_t adv_mss;        /* largest segment we offered to take */
+	int nodelay;
+
+	/* Send side; the send buffer holds everything from snd_una on. */
+	uint32_t iss;
+	uint32_t snd_una;
+	uint32_t snd_nxt;
+	uint32_t snd_max;        /* highest snd_nxt, as a timeout winds snd_nxt back */
+	uint32_t snd_wnd;
+	uint32_t snd_wl1;
+	uint32_t snd_wl2;
+	uint8_t  snd_wscale;
+	uint8_t  rcv_wscale;
+	uint8_t * snd_buf;
+	size_t snd_start;
+	size_t snd_len;
+	int fin_queued;          /* nothing more to send; a FIN follows the buffered data */
+	int fin_sent;
+	uint32_t fin_seq;
+
+	/* Receive side; the receive buffer holds what has not been read. */
+	uint32_t irs;
+	uint32_t rcv_nxt;
+	uint32_t rcv_adv;        /* right edge of the last window we advertised */
+	uint8_t * rcv_buf;
+	size_t rcv_start;
+	size_t rcv_len;
+	list_t * ooo;
+	size_t ooo_len;
+	int fin_received;
+
+	/* Congestion control */
+	uint32_t cwnd;
+	uint32_t ssthresh;
+	int dupacks;
+	int in_recovery;
+	uint32_t recover;
+
+	/* Timers */
+	uint64_t rto;
+	uint64_t srtt;
+	uint64_t rttvar;
+	uint64_t rto_deadline;   /* 0 when not armed */
+	uint64_t rtt_start;      /* 0 when no segment is being timed */
+	uint32_t rtt_seq;
+	int retries;
+	uint64_t close_deadline; /* for TIME_WAIT, and FIN_WAIT_2 after the socket is gone */
+
+	/* Listening */
+	struct tcp_cb * listener; /* for connections that have not been accepted yet */
+	list_t * accept_queue;
+	int backlog;
+	int half_open;            /* connections still in SYN_RECEIVED */
+};
+
+/* What a connection is looked up by */
+struct tcp_tuple {
+	uint32_t local_addr;
+	uint32_t remote_addr;
+	uint16_t local_port;
+	uint16_t remote_port;
+};
+
+extern uint32_t rand(void);
+
+/*
+ * Guards the tables and connection list; take it before any control
+ * block's lock. A connection's lock may be taken before its listener's,
+ * but not the other way around.
+ */
+static spin_lock_t tcp_lock = {0};
+static hashmap_t * tcp_table = NULL;       /* tuple -> connection */
+static hashmap_t * tcp_bound = NULL;       /* local port -> the control block holding it */
+static list_t * tcp_connections = NULL;    /* everything holding a port, for the timer */
+static volatile int tcp_timer_started = 0;
+static int next_tcp_port = TCP_EPHEMERAL_FIRST;
+static uint32_t tcp_cookie_secret;
+
+static uint64_t tcp_now(void) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	return (uint64_t)s * SUBTICKS_PER_TICK + ss;
+}
+
+/*
+ * The timer thread sleeps until the earliest deadline it saw on its
+ * last pass. Anything that arms an earlier one, or leaves a connection
+ * to be freed, kicks it; a kick during a pass makes it go around again.
+ */
+static spin_lock_t tcp_timer_lock = {0};
+static process_t * tcp_timer_process = NULL;
+static uint64_t tcp_timer_next = UINT64_MAX;
+static int tcp_timer_kicked = 0;
+
+/**
+ * @brief Have the timer thread look at the connections by @p when.
+ */
+static void tcp_timer_kick(uint64_t when) {
+	/* The timer thread works out its own deadlines after each tick */
+	if ((process_t *)this_core->current_process == tcp_timer_process) return;
+
+	process_t * timer = NULL;
+	spin_lock(tcp_timer_lock);
+	if (when < tcp_timer_next) {
+		tcp_timer_next = when;
+		tcp_timer_kicked = 1;
+		timer = tcp_timer_process;
+	}
+	spin_unlock(tcp_timer_lock);
+
+	if (timer) process_alert_node(timer, &tcp_timer_kicked);
+}
+
+static unsigned int tcp_tuple_hash(const void * key) {
+	const struct tcp_tuple * tuple = key;
+	uint32_t h = tuple->remote_addr ^ tuple->local_addr;
+	h ^= ((uint32_t)tuple->remote_port << 16) | tuple->local_port;
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	return h;
+}
+
+static int tcp_tuple_comp(const void * a, const void * b) {
+	return !memcmp(a, b, sizeof(struct tcp_tuple));
+}
+
+static void * tcp_tuple_dup(const void * key) {
+	struct tcp_tuple * out = malloc(sizeof(struct tcp_tuple));
+	memcpy(out, key, sizeof(struct tcp_tuple));
+	return out;
+}
+
+static void tcp_tuple_of(struct tcp_cb * tcb, struct tcp_tuple * tuple) {
+	memset(tuple, 0, sizeof(struct tcp_tuple));
+	tuple->local_addr = tcb->local_addr;
+	tuple->remote_addr = tcb->remote_addr;
+	tuple->local_port = tcb->local_port;
+	tuple->remote_port = tcb->remote_port;
+}
+
+static uint32_t tcp_cookie_slot(uint64_t now) {
+	return (now / SUBTICKS_PER_TICK / TCP_COOKIE_PERIOD) & 0x1F;
+}
+
+/* Segment sizes a SYN cookie can remember, by the two bits it has for them */
+static const uint16_t tcp_cookie_mss[] = { 536, 1220, 1440, 1460 };
+
+static uint32_t tcp_cookie_hash(struct tcp_tuple * tuple, uint32_t irs, uint32_t slot, uint32_t mss_index) {
+	uint32_t words[] = {
+		tuple->local_addr, tuple->remote_addr,
+		((uint32_t)tuple->local_port << 16) | tuple->remote_port,
+		irs, (slot << 2) | mss_index,
+	};
+	uint32_t h = tcp_cookie_secret;
+	for (size_t i = 0; i < sizeof(words) / sizeof(*words); ++i) {
+		h ^= words[i];
+		h *= 0x9E3779B1;
+		h ^= h >> 15;
+		h *= 0x85EBCA77;
+		h ^= h >> 13;
+	}
+	return h & 0x01FFFFFF;
+}
+
+/**
+ * @brief An initial sequence number that remembers a connection request for us.
+ *
+ * The top five bits are a coarse timestamp, the next two the segment
+ * size, and the rest a keyed hash of all that, the connection, and the
+ * peer's initial sequence number, so the ACK that completes the
+ * handshake can be recognized by itself.
+ */
+static uint32_t tcp_cookie(struct tcp_tuple * tuple, uint32_t irs, uint16_t mss) {
+	uint32_t slot = tcp_cookie_slot(tcp_now());
+	uint32_t mss_index = 0;
+	while (mss_index < 3 && tcp_cookie_mss[mss_index + 1] <= mss) mss_index++;
+	return (slot << 27) | (mss_index << 25) | tcp_cookie_hash(tuple, irs, slot, mss_index);
+}
+
+/**
+ * @returns the segment size remembered by @p cookie, or 0 if it is not one of ours.
+ */
+static uint16_t tcp_cookie_check(struct tcp_tuple * tuple, uint32_t irs, uint32_t cookie) {
+	uint32_t slot = cookie >> 27;
+	uint32_t mss_index = (cookie >> 25) & 3;
+	uint32_t current = tcp_cookie_slot(tcp_now());
+	if (slot != current && slot != ((current - 1) & 0x1F)) return 0;
+	if (tcp_cookie_hash(tuple, irs, slot, mss_index) != (cookie & 0x01FFFFFF)) return 0;
+	return tcp_cookie_mss[mss_index];
+}
+
+static uint16_t tcp_checksum(uint32_t source, uint32_t destination, void * segment, size_t len) {
+	uint64_t sum = 0;
+	sum += (ntohl(source) >> 16) + (ntohl(source) & 0xFFFF);
+	sum += (ntohl(destination) >> 16) + (ntohl(destination) & 0xFFFF);
+	sum += IPV4_PROT_TCP;
+	sum += len;
+
+	uint16_t * s = segment;
+	for (size_t i = 0; i < len / 2; ++i) {
+		sum += ntohs(s[i]);
+	}
+	if (len & 1) {
+		sum += ((uint8_t *)segment)[len - 1] << 8;
+	}
+
+	while (sum >> 16) {
+		sum = (sum >> 16) + (sum & 0xFFFF);
+	}
+	return ~sum & 0xFFFF;
+}
+
+static struct ipv4_packet * tcp_packet(uint32_t source, uint32_t destination, size_t tcp_len, uint16_t ident) {
+	size_t total_length = sizeof(struct ipv4_packet) + tcp_len;
+	struct ipv4_packet * packet = malloc(total_length);
+	packet->length = htons(total_length);
+	packet->destination = destination;
+	packet->source = source;
+	packet->ttl = 64;
+	packet->protocol = IPV4_PROT_TCP;
+	packet->ident = htons(ident);
+	packet->flags_fragment = htons(0x4000);
+	packet->version_ihl = 0x45;
+	packet->dscp_ecn = 0;
+	packet->checksum = 0;
+	packet->checksum = htons(calculate_ipv4_checksum(packet));
+	return packet;
+}
+
+static void tcp_packet_send(struct ipv4_packet * packet, fs_node_t * nic) {
+	struct tcp_header * tcp = (struct tcp_header *)&packet->payload;
+	size_t tcp_len = ntohs(packet->length) - sizeof(struct ipv4_packet);
+	tcp->checksum = 0;
+	uint16_t checksum = tcp_checksum(packet->source, packet->destination, tcp, tcp_len);
+	tcp->checksum = htons(checksum);
+	net_ipv4_send(packet, nic);
+	free(packet);
+}
+
+/**
+ * @brief The receive window to advertise, in the units the peer expects.
+ */
+static uint16_t tcp_rcv_window(struct tcp_cb * tcb, int syn) {
+	size_t space = TCP_RCVBUF_SIZE - tcb->rcv_len;
+	if (!syn) space >>= tcb->rcv_wscale;
+	return space > 65535 ? 65535 : space;
+}
+
+static void tcp_snd_copy(struct tcp_cb * tcb, size_t offset, uint8_t * out, size_t len) {
+	size_t pos = (tcb->snd_start + offset) % TCP_SNDBUF_SIZE;
+	size_t first = TCP_SNDBUF_SIZE - pos;
+	if (first > len) first = len;
+	memcpy(out, tcb->snd_buf + pos, first);
+	memcpy(out + first, tcb->snd_buf, len - first);
+}
+
+/**
+ * @brief Send a segment starting at @p seq, with @p len bytes of data
+ *        from the send buffer.
+ */
+static void tcp_transmit(struct tcp_cb * tcb, int flags, uint32_t seq, size_t len) {
+	uint8_t options[8];
+	size_t optlen = 0;
+
+	if (flags & TCP_FLAGS_SYN) {
+		/* Maximum segment size */
+		options[0] = 2;
+		options[1] = 4;
+		options[2] = tcb->adv_mss >> 8;
+		options[3] = tcb->adv_mss & 0xFF;
+		optlen = 4;
+	}
+
+	if ((flags & TCP_FLAGS_SYN) && (tcb->state == TCP_SYN_SENT || tcb->rcv_wscale)) {
+		/* NOP, window scale; in a SYN-ACK only if the peer offered it */
+		options[4] = 1;
+		options[5] = 3;
+		options[6] = 3;
+		options[7] = tcb->rcv_wscale;
+		optlen = 8;
+	}
+
+	size_t hlen = sizeof(struct tcp_header) + optlen;
+	uint16_t ident = tcb->ident++;
+	struct ipv4_packet * packet = tcp_packet(tcb->local_addr, tcb->remote_addr, hlen + len, ident);
+
+	struct tcp_header * tcp = (struct tcp_header *)&packet->payload;
+	uint16_t window = tcp_rcv_window(tcb, flags & TCP_FLAGS_SYN);
+	uint32_t ack = (flags & TCP_FLAGS_ACK) ? tcb->rcv_nxt : 0;
+	tcp->source_port = htons(tcb->local_port);
+	tcp->destination_port = htons(tcb->remote_port);
+	tcp->seq_number = htonl(seq);
+	tcp->ack_number = htonl(ack);
+	tcp->flags = htons(flags | ((hlen / 4) << 12));
+	tcp->window_size = htons(window);
+	tcp->urgent = 0;
+
+	memcpy(tcp->payload, options, optlen);
+	if (len) tcp_snd_copy(tcb, seq - tcb->snd_una, tcp->payload + optlen, len);
+
+	if (flags & TCP_FLAGS_ACK) {
+		tcb->rcv_adv = tcb->rcv_nxt + ((uint32_t)window << tcb->rcv_wscale);
+	}
+
+	tcp_packet_send(packet, tcb->nic);
+}
+
+static void tcp_send_ack(struct tcp_cb * tcb) {
+	tcp_transmit(tcb, TCP_FLAGS_ACK, tcb->snd_nxt, 0);
+}
+
+/**
+ * @brief Answer a segment that belongs to no connection.
+ */
+static void tcp_send_reset(struct ipv4_packet * packet, struct tcp_header * tcp, size_t len, fs_node_t * nic) {
+	int flags = ntohs(tcp->flags);
+	if (flags & TCP_FLAGS_RST) return;
+
+	struct ipv4_packet * response = tcp_packet(packet->destination, packet->source, sizeof(struct tcp_header), 0);
+	struct tcp_header * reset = (struct tcp_header *)&response->payload;
+	reset->source_port = tcp->destination_port;
+	reset->destination_port = tcp->source_port;
+	if (flags & TCP_FLAGS_ACK) {
+		reset->seq_number = tcp->ack_number;
+		reset->ack_number = 0;
+		reset->flags = htons(TCP_FLAGS_RST | 0x5000);
+	} else {
+		uint32_t ack = ntohl(tcp->seq_number) + len + !!(flags & TCP_FLAGS_SYN) + !!(flags & TCP_FLAGS_FIN);
+		reset->seq_number = 0;
+		reset->ack_number = htonl(ack);
+		reset->flags = htons(TCP_FLAGS_RST | TCP_FLAGS_ACK | 0x5000);
+	}
+	reset->window_size = 0;
+	reset->urgent = 0;
+	tcp_packet_send(response, nic);
+}
+
+/**
+ * @brief Answer a SYN with a cookie instead of a connection.
+ *
+ * Nothing is kept, so the only option is the segment size, which
+ * the cookie itself remembers.
+ */
+static void tcp_send_cookie(struct ipv4_packet * packet, struct tcp_header * tcp, fs_node_t * nic, uint32_t iss, uint16_t mss) {
+	struct ipv4_packet * response = tcp_packet(packet->destination, packet->source, sizeof(struct tcp_header) + 4, 0);
+	struct tcp_header * synack = (struct tcp_header *)&response->payload;
+	synack->source_port = tcp->destination_port;
+	synack->destination_port = tcp->source_port;
+	synack->seq_number = htonl(iss);
+	synack->ack_number = htonl(ntohl(tcp->seq_number) + 1);
+	synack->flags = htons(TCP_FLAGS_SYN | TCP_FLAGS_ACK | 0x6000);
+	synack->window_size = htons(65535);
+	synack->urgent = 0;
+	synack->payload[0] = 2;
+	synack->payload[1] = 4;
+	synack->payload[2] = mss >> 8;
+	synack->payload[3] = mss & 0xFF;
+	tcp_packet_send(response, nic);
+}
+
+static void tcp_wake(struct tcp_cb * tcb) {
+	wakeup_queue(tcb->wait);
+	if (tcb->sock) net_sock_alert(tcb->sock);
+}
+
+static void tcp_arm(struct tcp_cb * tcb) {
+	tcb->rto_deadline = tcp_now() + tcb->rto;
+	tcp_timer_kick(tcb->rto_deadline);
+}
+
+/**
+ * @brief Account for @p len sequence numbers sent from snd_nxt.
+ */
+static void tcp_sent(struct tcp_cb * tcb, uint32_t len) {
+	/* Only time segments that are not being sent again (Karn) */
+	if (!tcb->rtt_start && tcb->snd_nxt == tcb->snd_max) {
+		tcb->rtt_start = tcp_now();
+		tcb->rtt_seq = tcb->snd_nxt;
+	}
+	tcb->snd_nxt += len;
+	if (SEQ_GT(tcb->snd_nxt, tcb->snd_max)) tcb->snd_max = tcb->snd_nxt;
+	if (!tcb->rto_deadline) tcp_arm(tcb);
+}
+
+static int tcp_can_send(struct tcp_cb * tcb) {
+	switch (tcb->state) {
+		case TCP_ESTABLISHED:
+		case TCP_CLOSE_WAIT:
+		case TCP_FIN_WAIT_1:
+		case TCP_CLOSING:
+		case TCP_LAST_ACK:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Send whatever the windows allow.
+ */
+static void tcp_output(struct tcp_cb * tcb) {
+	if (!tcp_can_send(tcb)) return;
+
+	uint32_t window = tcb->snd_wnd < tcb->cwnd ? tcb->snd_wnd : tcb->cwnd;
+
+	while (1) {
+		uint32_t sent = tcb->snd_nxt - tcb->snd_una;
+		if (sent < tcb->snd_len) {
+			if (sent >= window) break;
+			size_t len = tcb->snd_len - sent;
+			if (len > tcb->mss) len = tcb->mss;
+			if (len > window - sent) len = window - sent;
+			/* Hold a short segment until what is in flight is acknowledged, to add to it */
+			if (len < tcb->mss && tcb->snd_nxt != tcb->snd_una && !tcb->nodelay && !tcb->fin_queued) break;
+			int flags = TCP_FLAGS_ACK;
+			if (sent + len == tcb->snd_len) flags |= TCP_FLAGS_PSH;
+			tcp_transmit(tcb, flags, tcb->snd_nxt, len);
+			tcp_sent(tcb, len);
+		} else if (tcb->fin_queued && !tcb->fin_sent) {
+			tcp_transmit(tcb, TCP_FLAGS_FIN | TCP_FLAGS_ACK, tcb->snd_nxt, 0);
+			tcb->fin_sent = 1;
+			tcp_sent(tcb, 1);
+			break;
+		} else {
+			break;
+		}
+	}
+
+	/* With a closed window, the timer is what sends probes. */
+	if (!tcb->rto_deadline && tcb->snd_len > tcb->snd_nxt - tcb->snd_una) {
+		tcp_arm(tcb);
+	}
+}
+
+/**
+ * @brief Send the oldest unacknowledged segment again.
+ */
+static void tcp_retransmit(struct tcp_cb * tcb) {
+	if (tcb->state == TCP_SYN_SENT) {
+		tcp_transmit(tcb, TCP_FLAGS_SYN, tcb->iss, 0);
+	} else if (tcb->state == TCP_SYN_RECEIVED) {
+		tcp_transmit(tcb, TCP_FLAGS_SYN | TCP_FLAGS_ACK, tcb->iss, 0);
+	} else if (tcb->snd_len) {
+		size_t len = tcb->snd_len < tcb->mss ? tcb->snd_len : tcb->mss;
+		tcp_transmit(tcb, TCP_FLAGS_ACK | (len == tcb->snd_len ? TCP_FLAGS_PSH : 0), tcb->snd_una, len);
+	} else if (tcb->fin_sent) {
+		tcp_transmit(tcb, TCP_FLAGS_FIN | TCP_FLAGS_ACK, tcb->snd_una, 0);
+	}
+}
+
+static void tcp_fail(struct tcp_cb * tcb, int error) {
+	tcb->error = error;
+	tcb->state = TCP_CLOSED;
+	tcb->rto_deadline = 0;
+	if (tcb->closed) tcp_timer_kick(0);
+	tcp_wake(tcb);
+}
+
+/**
+ * @brief Put a connection on its listener's accept queue.
+ *
+ * Called with the listener's lock held.
+ */
+static void tcp_accept_ready(struct tcp_cb * listener, struct tcp_cb * tcb) {
+	list_insert(listener->accept_queue, tcb);
+	tcp_wake(listener);
+}
+
+/**
+ * @brief Forget a connection that never finished its handshake.
+ */
+static void tcp_abort_embryonic(struct tcp_cb * tcb) {
+	struct tcp_cb * listener = tcb->listener;
+	if (listener) {
+		spin_lock(listener->lock);
+		listener->half_open--;
+		spin_unlock(listener->lock);
+	}
+	tcb->listener = NULL;
+	tcb->state = TCP_CLOSED;
+	tcb->closed = 1;
+	tcb->rto_deadline = 0;
+	tcp_timer_kick(0);
+}
+
+static void tcp_time_wait(struct tcp_cb * tcb) {
+	tcb->state = TCP_TIME_WAIT;
+	tcb->rto_deadline = 0;
+	tcb->close_deadline = tcp_now() + TCP_TIME_WAIT_LENGTH;
+	tcp_timer_kick(tcb->close_deadline);
+	tcp_wake(tcb);
+}
+
+static uint32_t tcp_loss_threshold(struct tcp_cb * tcb) {
+	uint32_t flight = tcb->snd_max - tcb->snd_una;
+	return flight / 2 > 2U * tcb->mss ? flight / 2 : 2U * tcb->mss;
+}
+
+static void tcp_rtt_sample(struct tcp_cb * tcb, uint64_t rtt) {
+	if (!rtt) rtt = 1;
+	if (!tcb->srtt) {
+		tcb->srtt = rtt;
+		tcb->rttvar = rtt / 2;
+	} else {
+		uint64_t delta = tcb->srtt > rtt ? tcb->srtt - rtt : rtt - tcb->srtt;
+		tcb->rttvar = (3 * tcb->rttvar + delta) / 4;
+		tcb->srtt = (7 * tcb->srtt + rtt) / 8;
+	}
+	uint64_t var = 4 * tcb->rttvar;
+	tcb->rto = tcb->srtt + (var > TCP_CLOCK_GRANULARITY ? var : TCP_CLOCK_GRANULARITY);
+	if (tcb->rto < TCP_RTO_MIN) tcb->rto = TCP_RTO_MIN;
+	if (tcb->rto > TCP_RTO_MAX) tcb->rto = TCP_RTO_MAX;
+}
+
+static void tcp_duplicate_ack(struct tcp_cb * tcb) {
+	tcb->dupacks++;
+	if (tcb->in_recovery) {
+		/* Each duplicate means a segment left the network */
+		tcb->cwnd += tcb->mss;
+		tcp_output(tcb);
+	} else if (tcb->dupacks == 3 && SEQ_GT(tcb->snd_una, tcb->recover)) {
+		tcb->ssthresh = tcp_loss_threshold(tcb);
+		tcb->recover = tcb->snd_max;
+		tcb->in_recovery = 1;
+		tcb->rtt_start = 0;
+		tcp_retransmit(tcb);
+		tcb->cwnd = tcb->ssthresh + 3 * tcb->mss;
+		tcp_output(tcb);
+	}
+}
+
+/**
+ * @brief Process the acknowledgement and window in a segment.
+ *
+ * @returns 0, or -1 if the segment acknowledges something never sent
+ *          and should be dropped.
+ */
+static int tcp_ack(struct tcp_cb * tcb, uint32_t seq, uint32_t ack, uint16_t window, size_t len, int flags) {
+	if (SEQ_GT(ack, tcb->snd_max)) {
+		tcp_send_ack(tcb);
+		return -1;
+	}
+
+	uint32_t wnd = (uint32_t)window << tcb->snd_wscale;
+	int window_changed = 0;
+	if (SEQ_LT(tcb->snd_wl1, seq) || (tcb->snd_wl1 == seq && SEQ_LEQ(tcb->snd_wl2, ack))) {
+		window_changed = wnd != tcb->snd_wnd;
+		tcb->snd_wnd = wnd;
+		tcb->snd_wl1 = seq;
+		tcb->snd_wl2 = ack;
+	}
+
+	if (SEQ_LEQ(ack, tcb->snd_una)) {
+		if (ack == tcb->snd_una && !len && !(flags & TCP_FLAGS_FIN) && !window_changed && tcb->snd_max != tcb->snd_una) {
+			tcp_duplicate_ack(tcb);
+		}
+		return 0;
+	}
+
+	uint32_t acked = ack - tcb->snd_una;
+
+	if (tcb->rtt_start && SEQ_GT(ack, tcb->rtt_seq)) {
+		tcp_rtt_sample(tcb, tcp_now() - tcb->rtt_start);
+		tcb->rtt_start = 0;
+	}
+
+	size_t data = acked < tcb->snd_len ? acked : tcb->snd_len;
+	tcb->snd_start = (tcb->snd_start + data) % TCP_SNDBUF_SIZE;
+	tcb->snd_len -= data;
+	tcb->snd_una = ack;
+	if (SEQ_LT(tcb->snd_nxt, tcb->snd_una)) tcb->snd_nxt = tcb->snd_una;
+
+	if (tcb->in_recovery) {
+		if (SEQ_GEQ(ack, tcb->recover)) {
+			tcb->in_recovery = 0;
+			tcb->dupacks = 0;
+			tcb->cwnd = tcb->ssthresh;
+		} else {
+			/* Partial ACK: the next hole is lost too */
+			tcp_retransmit(tcb);
+			tcb->cwnd = tcb->cwnd > acked ? tcb->cwnd - acked : 0;
+			tcb->cwnd += tcb->mss;
+		}
+	} else {
+		tcb->dupacks = 0;
+		if (tcb->cwnd < tcb->ssthresh) {
+			tcb->cwnd += acked < tcb->mss ? acked : tcb->mss;
+		} else {
+			uint32_t increase = (uint32_t)tcb->mss * tcb->mss / tcb->cwnd;
+			tcb->cwnd += increase ? increase : 1;
+		}
+		if (tcb->cwnd > TCP_MAX_WINDOW) tcb->cwnd = TCP_MAX_WINDOW;
+	}
+
+	tcb->retries = 0;
+	if (tcb->snd_una == tcb->snd_max) {
+		tcb->rto_deadline = 0;
+	} else {
+		tcp_arm(tcb);
+	}
+
+	if (tcb->fin_sent && SEQ_GT(ack, tcb->fin_seq)) {
+		switch (tcb->state) {
+			case TCP_FIN_WAIT_1:
+				tcb->state = TCP_FIN_WAIT_2;
+				tcb->close_deadline = tcp_now() + TCP_TIME_WAIT_LENGTH;
+				tcp_timer_kick(tcb->close_deadline);
+				break;
+			case TCP_CLOSING:
+				tcp_time_wait(tcb);
+				break;
+			case TCP_LAST_ACK:
+				tcb->state = TCP_CLOSED;
+				tcb->rto_deadline = 0;
+				tcp_timer_kick(0);
+				break;
+		}
+	}
+
+	tcp_wake(tcb);
+	return 0;
+}
+
+static void tcp_rcv_append(struct tcp_cb * tcb, uint8_t * data, size_t len) {
+	/* Nobody will read it if the socket is gone. */
+	if (tcb->closed) return;
+
+	size_t pos = (tcb->rcv_start + tcb->rcv_len) % TCP_RCVBUF_SIZE;
+	size_t first = TCP_RCVBUF_SIZE - pos;
+	if (first > len) first = len;
+	memcpy(tcb->rcv_buf + pos, data, first);
+	memcpy(tcb->rcv_buf, data + first, len - first);
+	tcb->rcv_len += len;
+}
+
+static void tcp_rcv_fin(struct tcp_cb * tcb) {
+	tcb->rcv_nxt++;
+	tcb->fin_received = 1;
+	switch (tcb->state) {
+		case TCP_ESTABLISHED:
+			tcb->state = TCP_CLOSE_WAIT;
+			break;
+		case TCP_FIN_WAIT_1:
+			tcb->state = TCP_CLOSING;
+			break;
+		case TCP_FIN_WAIT_2:
+			tcp_time_wait(tcb);
+			break;
+	}
+}
+
+static size_t tcp_rcv_space(struct tcp_cb * tcb) {
+	return tcb->closed ? TCP_RCVBUF_SIZE : TCP_RCVBUF_SIZE - tcb->rcv_len;
+}
+
+static void tcp_ooo_insert(struct tcp_cb * tcb, uint32_t seq, uint8_t * data, size_t len, int fin) {
+	if (tcb->ooo_len + len > TCP_RCVBUF_SIZE) return;
+
+	node_t * before = NULL;
+	foreach(n, tcb->ooo) {
+		struct tcp_ooo * seg = n->value;
+		if (seg->seq == seq && seg->len >= len && (seg->fin || !fin)) return; /* already have it */
+		if (SEQ_GT(seg->seq, seq)) {
+			before = n;
+			break;
+		}
+	}
+
+	struct tcp_ooo * seg = malloc(sizeof(struct tcp_ooo) + len);
+	seg->seq = seq;
+	seg->len = len;
+	seg->fin = fin;
+	memcpy(seg->data, data, len);
+	tcb->ooo_len += len;
+
+	if (before) {
+		list_insert_before(tcb->ooo, before, seg);
+	} else {
+		list_insert(tcb->ooo, seg);
+	}
+}
+
+/**
+ * @brief Move segments that no longer follow a gap into the receive buffer.
+ */
+static void tcp_ooo_drain(struct tcp_cb * tcb) {
+	while (tcb->ooo->head) {
+		struct tcp_ooo * seg = tcb->ooo->head->value;
+		if (SEQ_GT(seg->seq, tcb->rcv_nxt)) break;
+
+		node_t * n = list_dequeue(tcb->ooo);
+		free(n);
+		tcb->ooo_len -= seg->len;
+
+		uint32_t skip = tcb->rcv_nxt - seg->seq;
+		if (!tcb->fin_received && (skip < seg->len || (skip == seg->len && seg->fin))) {
+			size_t len = seg->len - skip;
+			int fin = seg->fin;
+			size_t space = tcp_rcv_space(tcb);
+			if (len > space) {
+				len = space;
+				fin = 0;
+			}
+			tcp_rcv_append(tcb, seg->data + skip, len);
+			tcb->rcv_nxt += len;
+			if (fin) tcp_rcv_fin(tcb);
+		}
+		free(seg);
+	}
+}
+
+/**
+ * @brief Take the data and FIN from a segment.
+ */
+static void tcp_receive(struct tcp_cb * tcb, uint32_t seq, uint8_t * data, size_t len, int fin) {
+	if (tcb->fin_received) return;
+
+	if (SEQ_LT(seq, tcb->rcv_nxt)) {
+		uint32_t dup = tcb->rcv_nxt - seq;
+		if (dup > len) {
+			return;
+		}
+		data += dup;
+		len -= dup;
+		seq = tcb->rcv_nxt;
+	}
+
+	size_t space = tcp_rcv_space(tcb);
+
+	if (seq == tcb->rcv_nxt) {
+		if (len > space) {
+			len = space;
+			fin = 0;
+		}
+		tcp_rcv_append(tcb, data, len);
+		tcb->rcv_nxt += len;
+		if (fin) tcp_rcv_fin(tcb);
+		tcp_ooo_drain(tcb);
+	} else {
+		uint32_t offset = seq - tcb->rcv_nxt;
+		if (offset >= space) return;
+		if (len > space - offset) {
+			len = space - offset;
+			fin = 0;
+		}
+		if (len || fin) tcp_ooo_insert(tcb, seq, data, len, fin);
+	}
+
+	tcp_wake(tcb);
+}
+
+/**
+ * @brief Find the options we understand in a SYN.
+ *
+ * @p mss and @p wscale are left alone for options that are not there.
+ */
+static void tcp_parse_options(struct tcp_header * tcp, size_t hlen, int * mss, int * wscale) {
+	uint8_t * opt = tcp->payload;
+	uint8_t * end = (uint8_t *)tcp + hlen;
+
+	while (opt < end) {
+		if (opt[0] == 0) break;
+		if (opt[0] == 1) {
+			opt++;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) break;
+		if (opt[0] == 2 && opt[1] == 4) *mss = (opt[2] << 8) | opt[3];
+		if (opt[0] == 3 && opt[1] == 3) *wscale = opt[2];
+		opt += opt[1];
+	}
+}
+
+/**
+ * @brief Settle on a segment size, and the congestion window that goes with it.
+ */
+static void tcp_set_mss(struct tcp_cb * tcb, int mss) {
+	if (mss > tcb->adv_mss) mss = tcb->adv_mss;
+	if (mss < TCP_MIN_MSS) mss = TCP_MIN_MSS;
+	tcb->mss = mss;
+	tcb->cwnd = TCP_INITIAL_WINDOW * tcb->mss;
+}
+
+static void tcp_options(struct tcp_cb * tcb, struct tcp_header * tcp, size_t hlen) {
+	int mss = TCP_DEFAULT_MSS;
+	int wscale = -1;
+
+	tcp_parse_options(tcp, hlen, &mss, &wscale);
+	tcp_set_mss(tcb, mss);
+
+	if (wscale >= 0) {
+		tcb->snd_wscale = wscale > 14 ? 14 : wscale;
+	} else {
+		/* Scaling is only used if both ends offer it */
+		tcb->snd_wscale = 0;
+		tcb->rcv_wscale = 0;
+	}
+}
+
+static void tcp_segment(struct tcp_cb * tcb, struct tcp_header * tcp, size_t hlen, size_t len) {
+	int flags = ntohs(tcp->flags);
+	uint32_t seq = ntohl(tcp->seq_number);
+	uint32_t ack = ntohl(tcp->ack_number);
+	uint8_t * data = (uint8_t *)tcp + hlen;
+
+	if (tcb->state == TCP_CLOSED) return;
+
+	if (tcb->state == TCP_SYN_SENT) {
+		if ((flags & TCP_FLAGS_ACK) && ack != tcb->snd_nxt) return;
+		if (flags & TCP_FLAGS_RST) {
+			if (flags & TCP_FLAGS_ACK) tcp_fail(tcb, ECONNREFUSED);
+			return;
+		}
+		if ((flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) != (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) return;
+
+		tcb->irs = seq;
+		tcb->rcv_nxt = seq + 1;
+		tcp_options(tcb, tcp, hlen);
+		tcb->snd_wnd = ntohs(tcp->window_size);
+		tcb->snd_wl1 = seq;
+		tcb->snd_wl2 = ack;
+		if (tcb->rtt_start) {
+			tcp_rtt_sample(tcb, tcp_now() - tcb->rtt_start);
+			tcb->rtt_start = 0;
+		}
+		tcb->snd_una = ack;
+		tcb->rto_deadline = 0;
+		tcb->retries = 0;
+		tcb->state = TCP_ESTABLISHED;
+		tcp_send_ack(tcb);
+		tcp_wake(tcb);
+		return;
+	}
+
+	if (tcb->state == TCP_SYN_RECEIVED) {
+		if (flags & TCP_FLAGS_RST) {
+			if (seq == tcb->rcv_nxt) tcp_abort_embryonic(tcb);
+			return;
+		}
+		if (flags & TCP_FLAGS_SYN) {
+			/* Our SYN-ACK was lost */
+			if (seq == tcb->irs) tcp_retransmit(tcb);
+			return;
+		}
+		if (!(flags & TCP_FLAGS_ACK)) return;
+		if (ack != tcb->iss + 1) {
+			tcp_transmit(tcb, TCP_FLAGS_RST, ack, 0);
+			return;
+		}
+
+		if (tcb->rtt_start) {
+			tcp_rtt_sample(tcb, tcp_now() - tcb->rtt_start);
+			tcb->rtt_start = 0;
+		}
+		tcb->snd_una = ack;
+		tcb->snd_wnd = (uint32_t)ntohs(tcp->window_size) << tcb->snd_wscale;
+		tcb->snd_wl1 = seq;
+		tcb->snd_wl2 = ack;
+		tcb->rto_deadline = 0;
+		tcb->retries = 0;
+		tcb->state = TCP_ESTABLISHED;
+
+		struct tcp_cb * listener = tcb->listener;
+		if (listener) {
+			spin_lock(listener->lock);
+			listener->half_open--;
+			tcp_accept_ready(listener, tcb);
+			spin_unlock(listener->lock);
+		}
+		/* and take whatever came with the ACK */
+	}
+
+	if (flags & TCP_FLAGS_RST) {
+		if (seq == tcb->rcv_nxt) {
+			if (tcb->state == TCP_TIME_WAIT) {
+				tcb->state = TCP_CLOSED;
+				if (tcb->closed) tcp_timer_kick(0);
+			} else {
+				tcp_fail(tcb, tcb->state == TCP_CLOSE_WAIT ? EPIPE : ECONNRESET);
+			}
+		} else if (SEQ_GT(seq, tcb->rcv_nxt) && SEQ_LT(seq, tcb->rcv_adv)) {
+			/* In the window but not exact: make them prove it (RFC 5961) */
+			tcp_send_ack(tcb);
+		}
+		return;
+	}
+
+	if (flags & TCP_FLAGS_SYN) {
+		tcp_send_ack(tcb);
+		return;
+	}
+
+	if (!(flags & TCP_FLAGS_ACK)) return;
+
+	if (tcp_ack(tcb, seq, ack, ntohs(tcp->window_size), len, flags) < 0) return;
+	if (tcb->state == TCP_CLOSED) return;
+
+	int fin = flags & TCP_FLAGS_FIN;
+	if (len || fin) {
+		switch (tcb->state) {
+			case TCP_ESTABLISHED:
+			case TCP_FIN_WAIT_1:
+			case TCP_FIN_WAIT_2:
+				tcp_receive(tcb, seq, data, len, fin);
+				break;
+			case TCP_TIME_WAIT:
+				/* Our last ACK was lost */
+				if (fin) tcb->close_deadline = tcp_now() + TCP_TIME_WAIT_LENGTH;
+				break;
+		}
+		tcp_send_ack(tcb);
+	}
+
+	tcp_output(tcb);
+}
+
+static struct tcp_cb * tcp_cb_create(void) {
+	struct tcp_cb * tcb = calloc(sizeof(struct tcp_cb), 1);
+	tcb->wait = list_create("tcp waiters", tcb);
+	tcb->ooo = list_create("tcp out-of-order segments", tcb);
+	tcb->snd_buf = malloc(TCP_SNDBUF_SIZE);
+	tcb->rcv_buf = malloc(TCP_RCVBUF_SIZE);
+	tcb->mss = TCP_DEFAULT_MSS;
+	tcb->adv_mss = TCP_DEFAULT_MSS;
+	tcb->rto = TCP_RTO_INITIAL;
+	tcb->ssthresh = TCP_MAX_WINDOW;
+	while ((65535U << tcb->rcv_wscale) < TCP_RCVBUF_SIZE) tcb->rcv_wscale++;
+	return tcb;
+}
+
+static uint16_t tcp_nic_mss(fs_node_t * nic) {
+	struct EthernetDevice * eth = nic->device;
+	return eth->mtu > 40 + TCP_DEFAULT_MSS ? eth->mtu - 40 : TCP_DEFAULT_MSS;
+}
+
+static void tcp_set_nic(struct tcp_cb * tcb, fs_node_t * nic) {
+	tcb->nic = nic;
+	tcb->adv_mss = tcp_nic_mss(nic);
+	tcp_set_mss(tcb, TCP_DEFAULT_MSS);
+}
+
+/**
+ * @brief Make a connection on behalf of a listener.
+ *
+ * Called with tcp_lock and the listener's lock held.
+ */
+static struct tcp_cb * tcp_spawn(struct tcp_cb * listener, struct tcp_tuple * tuple, fs_node_t * nic) {
+	struct tcp_cb * tcb = tcp_cb_create();
+	tcb->listener = listener;
+	tcb->nodelay = listener->nodelay;
+	tcb->local_addr = tuple->local_addr;
+	tcb->remote_addr = tuple->remote_addr;
+	tcb->local_port = tuple->local_port;
+	tcb->remote_port = tuple->remote_port;
+	tcp_set_nic(tcb, nic);
+	hashmap_set(tcp_table, tuple, tcb);
+	list_insert(tcp_connections, tcb);
+	return tcb;
+}
+
+/**
+ * @brief Handle a segment for a listening socket that belongs to no connection yet.
+ *
+ * Called with tcp_lock and the listener's lock held.
+ * @returns a connection that should go on to process the segment, or NULL.
+ */
+static struct tcp_cb * tcp_listen_segment(struct tcp_cb * listener, struct tcp_tuple * tuple,
+		struct ipv4_packet * packet, struct tcp_header * tcp, size_t hlen, size_t len, fs_node_t * nic) {
+	int flags = ntohs(tcp->flags);
+	uint32_t seq = ntohl(tcp->seq_number);
+	uint32_t ack = ntohl(tcp->ack_number);
+
+	if (flags & TCP_FLAGS_RST) return NULL;
+
+	if ((flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) == TCP_FLAGS_SYN) {
+		if (listener->half_open + (int)listener->accept_queue->length >= listener->backlog) {
+			/* Full; let the ACK bring the connection back if it is real */
+			int mss = TCP_DEFAULT_MSS;
+			int wscale = -1;
+			tcp_parse_options(tcp, hlen, &mss, &wscale);
+			uint16_t adv_mss = tcp_nic_mss(nic);
+			tcp_send_cookie(packet, tcp, nic, tcp_cookie(tuple, seq, mss < adv_mss ? mss : adv_mss), adv_mss);
+			return NULL;
+		}
+
+		struct tcp_cb * tcb = tcp_spawn(listener, tuple, nic);
+		tcb->irs = seq;
+		tcb->rcv_nxt = seq + 1;
+		tcp_options(tcb, tcp, hlen);
+		tcb->snd_wnd = ntohs(tcp->window_size);
+		tcb->iss = rand();
+		tcb->snd_una = tcb->iss;
+		tcb->snd_nxt = tcb->iss;
+		tcb->snd_max = tcb->iss;
+		tcb->recover = tcb->iss;
+		tcb->state = TCP_SYN_RECEIVED;
+		listener->half_open++;
+		tcp_transmit(tcb, TCP_FLAGS_SYN | TCP_FLAGS_ACK, tcb->iss, 0);
+		tcp_sent(tcb, 1);
+		return NULL;
+	}
+
+	uint16_t cookie_mss;
+	if ((flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) == TCP_FLAGS_ACK
+			&& (int)listener->accept_queue->length < listener->backlog
+			&& (cookie_mss = tcp_cookie_check(tuple, seq - 1, ack - 1))) {
+		struct tcp_cb * tcb = tcp_spawn(listener, tuple, nic);
+		tcp_set_mss(tcb, cookie_mss);
+		tcb->irs = seq - 1;
+		tcb->rcv_nxt = seq;
+		tcb->snd_wscale = 0;
+		tcb->rcv_wscale = 0;
+		tcb->snd_wnd = ntohs(tcp->window_size);
+		tcb->snd_wl1 = seq;
+		tcb->snd_wl2 = ack;
+		tcb->iss = ack - 1;
+		tcb->snd_una = ack;
+		tcb->snd_nxt = ack;
+		tcb->snd_max = ack;
+		tcb->recover = ack;
+		tcb->state = TCP_ESTABLISHED;
+		tcp_accept_ready(listener, tcb);
+		return tcb;
+	}
+
+	tcp_send_reset(packet, tcp, len, nic);
+	return NULL;
+}
+
+void net_tcp_handle(struct ipv4_packet * packet, fs_node_t * nic) {
+	size_t ip_hlen = (packet->version_ihl & 0xF) * 4;
+	size_t total = ntohs(packet->length);
+	if (total < ip_hlen + sizeof(struct tcp_header)) return;
+
+	struct tcp_header * tcp = (struct tcp_header *)((uint8_t *)packet + ip_hlen);
+	size_t tcp_len = total - ip_hlen;
+	size_t hlen = (ntohs(tcp->flags) >> 12) * 4;
+	if (hlen < sizeof(struct tcp_header) || hlen > tcp_len) return;
+	if (tcp_checksum(packet->source, packet->destination, tcp, tcp_len) != 0) {
+		printf("tcp: dropping segment with bad checksum\n");
+		return;
+	}
+
+	struct tcp_tuple tuple;
+	memset(&tuple, 0, sizeof(struct tcp_tuple));
+	tuple.local_addr = packet->destination;
+	tuple.remote_addr = packet->source;
+	tuple.local_port = ntohs(tcp->destination_port);
+	tuple.remote_port = ntohs(tcp->source_port);
+
+	spin_lock(tcp_lock);
+	struct tcp_cb * tcb = hashmap_get(tcp_table, &tuple);
+	if (!tcb) {
+		struct tcp_cb * listener = hashmap_get(tcp_bound, (void *)(uintptr_t)tuple.local_port);
+		if (listener && (listener->local_addr == 0 || listener->local_addr == tuple.local_addr)) {
+			spin_lock(listener->lock);
+			if (listener->state == TCP_LISTEN) {
+				tcb = tcp_listen_segment(listener, &tuple, packet, tcp, hlen, tcp_len - hlen, nic);
+				spin_unlock(listener->lock);
+				if (!tcb) {
+					spin_unlock(tcp_lock);
+					return;
+				}
+			} else {
+				spin_unlock(listener->lock);
+			}
+		}
+	}
+	if (!tcb) {
+		spin_unlock(tcp_lock);
+		tcp_send_reset(packet, tcp, tcp_len - hlen, nic);
+		return;
+	}
+	spin_lock(tcb->lock);
+	spin_unlock(tcp_lock);
+
+	tcp_segment(tcb, tcp, hlen, tcp_len - hlen);
+	spin_unlock(tcb->lock);
+}
+
+/**
+ * @brief Run a connection's timers.
+ */
+static void tcp_tick(struct tcp_cb * tcb, uint64_t now) {
+	if ((tcb->state == TCP_TIME_WAIT || (tcb->state == TCP_FIN_WAIT_2 && tcb->closed)) && now >= tcb->close_deadline) {
+		tcb->state = TCP_CLOSED;
+		return;
+	}
+
+	if (!tcb->rto_deadline || now < tcb->rto_deadline) return;
+	tcb->rto_deadline = 0;
+
+	if (tcb->state == TCP_SYN_RECEIVED && ++tcb->retries > TCP_SYNACK_RETRIES) {
+		tcp_abort_embryonic(tcb);
+		return;
+	}
+
+	int handshake = tcb->state == TCP_SYN_SENT || tcb->state == TCP_SYN_RECEIVED;
+	int probing = !handshake && !tcb->snd_wnd && tcb->snd_len;
+	if (!probing && tcb->state != TCP_SYN_RECEIVED && ++tcb->retries > (tcb->state == TCP_SYN_SENT ? TCP_SYN_RETRIES : TCP_RETRIES)) {
+		printf("tcp: connection timed out\n");
+		tcp_fail(tcb, ETIMEDOUT);
+		return;
+	}
+
+	tcb->rto = tcb->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : tcb->rto * 2;
+	tcb->rtt_start = 0;
+
+	if (handshake) {
+		tcp_retransmit(tcb);
+		tcp_arm(tcb);
+		return;
+	}
+
+	if (probing) {
+		/* One byte past a closed window, to learn when it opens */
+		tcb->snd_nxt = tcb->snd_una;
+		tcp_transmit(tcb, TCP_FLAGS_ACK, tcb->snd_una, 1);
+		tcp_sent(tcb, 1);
+		return;
+	}
+
+	/* Everything outstanding is presumed lost; start again from snd_una with one segment. */
+	tcb->ssthresh = tcp_loss_threshold(tcb);
+	tcb->cwnd = tcb->mss;
+	tcb->in_recovery = 0;
+	tcb->dupacks = 0;
+	tcb->recover = tcb->snd_max;
+	tcb->snd_nxt = tcb->snd_una;
+	tcb->fin_sent = 0;
+	tcp_output(tcb);
+	if (!tcb->rto_deadline) tcp_arm(tcb);
+}
+
+void net_tcp_install(void) {
+	tcp_table = hashmap_create(TCP_TABLE_SIZE);
+	tcp_table->hash_func = tcp_tuple_hash;
+	tcp_table->hash_comp = tcp_tuple_comp;
+	tcp_table->hash_key_dup = tcp_tuple_dup;
+	tcp_bound = hashmap_create_int(64);
+	tcp_cookie_secret = rand();
+	tcp_connections = list_create("tcp connections", NULL);
+}
+
+static void tcp_free(struct tcp_cb * tcb) {
+	foreach(n, tcb->ooo) {
+		free(n->value);
+	}
+	list_free(tcb->ooo);
+	free(tcb->ooo);
+	list_free(tcb->wait);
+	free(tcb->wait);
+	if (tcb->accept_queue) {
+		list_free(tcb->accept_queue);
+		free(tcb->accept_queue);
+	}
+	free(tcb->snd_buf);
+	free(tcb->rcv_buf);
+	free(tcb);
+}
+
+/**
+ * @brief When the timer next has anything to do for @p tcb; UINT64_MAX for never.
+ */
+static uint64_t tcp_deadline(struct tcp_cb * tcb) {
+	uint64_t out = tcb->rto_deadline ? tcb->rto_deadline : UINT64_MAX;
+	if ((tcb->state == TCP_TIME_WAIT || (tcb->state == TCP_FIN_WAIT_2 && tcb->closed)) && tcb->close_deadline < out) {
+		out = tcb->close_deadline;
+	}
+	return out;
+}
+
+/**
+ * @brief Sleep until @p deadline, unless kicked first.
+ */
+static void tcp_timer_sleep(uint64_t deadline) {
+	process_t * self = (process_t *)this_core->current_process;
+
+	spin_lock(self->sched_lock);
+	spin_lock(tcp_timer_lock);
+	uint64_t now = tcp_now();
+	if (tcp_timer_kicked || deadline <= now) {
+		spin_unlock(tcp_timer_lock);
+		spin_unlock(self->sched_lock);
+		return;
+	}
+	tcp_timer_next = deadline;
+	spin_unlock(tcp_timer_lock);
+
+	/* A kick from here on waits for sched_lock, and then finds us waiting */
+	self->node_waits = list_create("tcp timer waits", self);
+	process_add_node_wait(self, &tcp_timer_kicked);
+	if (deadline != UINT64_MAX) {
+		process_timeout_sleep(self, (deadline - now + 999) / 1000);
+	}
+	self->awoken_index = -1;
+	spin_unlock(self->sched_lock);
+
+	switch_task(0);
+}
+
+static void tcp_timer(void * unused) {
+	spin_lock(tcp_timer_lock);
+	tcp_timer_process = (process_t *)this_core->current_process;
+	spin_unlock(tcp_timer_lock);
+
+	while (1) {
+		spin_lock(tcp_timer_lock);
+		tcp_timer_kicked = 0;
+		tcp_timer_next = UINT64_MAX;
+		spin_unlock(tcp_timer_lock);
+
+		spin_lock(tcp_lock);
+		uint64_t now = tcp_now();
+		uint64_t earliest = UINT64_MAX;
+		node_t * n = tcp_connections->head;
+		while (n) {
+			struct tcp_cb * tcb = n->value;
+			node_t * next = n->next;
+
+			spin_lock(tcb->lock);
+			tcp_tick(tcb, now);
+			if (tcb->state == TCP_CLOSED && tcb->closed) {
+				if (tcb->remote_port) {
+					struct tcp_tuple tuple;
+					tcp_tuple_of(tcb, &tuple);
+					if (hashmap_get(tcp_table, &tuple) == tcb) hashmap_remove(tcp_table, &tuple);
+				}
+				if (hashmap_get(tcp_bound, (void *)(uintptr_t)tcb->local_port) == tcb) {
+					hashmap_remove(tcp_bound, (void *)(uintptr_t)tcb->local_port);
+				}
+				list_delete(tcp_connections, n);
+				free(n);
+				spin_unlock(tcb->lock);
+				tcp_free(tcb);
+			} else {
+				uint64_t deadline = tcp_deadline(tcb);
+				if (deadline < earliest) earliest = deadline;
+				spin_unlock(tcb->lock);
+			}
+
+			n = next;
+		}
+		spin_unlock(tcp_lock);
+
+		tcp_timer_sleep(earliest);
+	}
+}
+
+/**
+ * @brief Claim @p port for a control block, or an ephemeral port if it is 0.
+ *
+ * Called with tcp_lock held.
+ */
+static int tcp_bind_port(struct tcp_cb * tcb, int port) {
+	if (!port) {
+		for (int i = TCP_EPHEMERAL_FIRST; i <= TCP_EPHEMERAL_LAST; ++i) {
+			int candidate = next_tcp_port++;
+			if (next_tcp_port > TCP_EPHEMERAL_LAST) next_tcp_port = TCP_EPHEMERAL_FIRST;
+			if (!hashmap_has(tcp_bound, (void *)(uintptr_t)candidate)) {
+				port = candidate;
+				break;
+			}
+		}
+		if (!port) return -EADDRINUSE;
+	} else if (hashmap_has(tcp_bound, (void *)(uintptr_t)port)) {
+		return -EADDRINUSE;
+	}
+
+	tcb->local_port = port;
+	hashmap_set(tcp_bound, (void *)(uintptr_t)port, tcb);
+	list_insert(tcp_connections, tcb);
+	return 0;
+}
+
+static void tcp_timer_start(void) {
+	if (!__sync_lock_test_and_set(&tcp_timer_started, 1)) {
+		spawn_worker_thread(tcp_timer, "[tcp]", NULL);
+	}
+}
+
+static long sock_tcp_bind(sock_t * sock, const struct sockaddr * addr, socklen_t addrlen) {
+	struct tcp_cb * tcb = sock->pcb;
+	const struct sockaddr_in * local = (const struct sockaddr_in *)addr;
+
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+	if (tcb->local_port) return -EINVAL;
+
+	spin_lock(tcp_lock);
+	tcb->local_addr = (uint32_t)local->sin_addr.s_addr;
+	long out = tcp_bind_port(tcb, ntohs(local->sin_port));
+	spin_unlock(tcp_lock);
+
+	if (!out) tcp_timer_start();
+	return out;
+}
+
+static long sock_tcp_listen(sock_t * sock, int backlog) {
+	struct tcp_cb * tcb = sock->pcb;
+
+	if (backlog < 1) backlog = 1;
+	if (backlog > TCP_MAX_BACKLOG) backlog = TCP_MAX_BACKLOG;
+
+	if (tcb->state == TCP_LISTEN) {
+		spin_lock(tcb->lock);
+		tcb->backlog = backlog;
+		spin_unlock(tcb->lock);
+		return 0;
+	}
+	if (tcb->state != TCP_CLOSED || tcb->remote_port) return -EINVAL;
+
+	if (!tcb->local_port) {
+		spin_lock(tcp_lock);
+		long out = tcp_bind_port(tcb, 0);
+		spin_unlock(tcp_lock);
+		if (out) return out;
+		tcp_timer_start();
+	}
+
+	spin_lock(tcb->lock);
+	tcb->accept_queue = list_create("tcp accept queue", tcb);
+	tcb->backlog = backlog;
+	tcb->state = TCP_LISTEN;
+	spin_unlock(tcb->lock);
+	return 0;
+}
+
+static void tcp_sock_attach(sock_t * sock, struct tcp_cb * tcb);
+
+static long sock_tcp_accept(sock_t * sock, struct sockaddr * addr, socklen_t * addrlen) {
+	struct tcp_cb * listener = sock->pcb;
+
+	spin_lock(listener->lock);
+	while (1) {
+		if (listener->state != TCP_LISTEN) {
+			spin_unlock(listener->lock);
+			return -EINVAL;
+		}
+		if (listener->accept_queue->length) break;
+		if (sleep_on_unlocking(listener->wait, &listener->lock)) return -EINTR;
+		spin_lock(listener->lock);
+	}
+	node_t * n = list_dequeue(listener->accept_queue);
+	struct tcp_cb * tcb = n->value;
+	free(n);
+	spin_unlock(listener->lock);
+
+	sock_t * child = net_sock_create();
+
+	spin_lock(tcb->lock);
+	tcb->listener = NULL;
+	tcp_sock_attach(child, tcb);
+	if (addr) {
+		struct sockaddr_in remote;
+		memset(&remote, 0, sizeof(struct sockaddr_in));
+		remote.sin_family = AF_INET;
+		remote.sin_port = htons(tcb->remote_port);
+		remote.sin_addr.s_addr = tcb->remote_addr;
+		memcpy(addr, &remote, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
+		*addrlen = sizeof(struct sockaddr_in);
+	}
+	spin_unlock(tcb->lock);
+
+	int fd = process_append_fd((process_t *)this_core->current_process, (fs_node_t *)child);
+	FD_MODE(fd) = 03;
+	return fd;
+}
+
+/**
+ * @brief Close a listening socket, and reset whatever it had not accepted yet.
+ */
+static void tcp_listen_close(struct tcp_cb * listener) {
+	spin_lock(tcp_lock);
+	foreach(n, tcp_connections) {
+		struct tcp_cb * tcb = n->value;
+		if (tcb == listener) continue;
+		spin_lock(tcb->lock);
+		if (tcb->listener == listener) {
+			tcb->listener = NULL;
+			if (tcb->state != TCP_CLOSED) tcp_transmit(tcb, TCP_FLAGS_RST | TCP_FLAGS_ACK, tcb->snd_nxt, 0);
+			tcb->state = TCP_CLOSED;
+			tcb->closed = 1;
+			tcb->rto_deadline = 0;
+		}
+		spin_unlock(tcb->lock);
+	}
+
+	/* The port is free for another listener right away */
+	if (hashmap_get(tcp_bound, (void *)(uintptr_t)listener->local_port) == listener) {
+		hashmap_remove(tcp_bound, (void *)(uintptr_t)listener->local_port);
+	}
+
+	spin_lock(listener->lock);
+	while (listener->accept_queue->length) {
+		free(list_dequeue(listener->accept_queue));
+	}
+	listener->sock = NULL;
+	listener->state = TCP_CLOSED;
+	listener->closed = 1;
+	tcp_wake(listener);
+	spin_unlock(listener->lock);
+	spin_unlock(tcp_lock);
+
+	tcp_timer_kick(0);
+}
+
+static long sock_tcp_connect(sock_t * sock, const struct sockaddr * addr, socklen_t addrlen) {
+	struct tcp_cb * tcb = sock->pcb;
+	const struct sockaddr_in * dest = (const struct sockaddr_in *)addr;
+
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+	if (tcb->remote_port) return -EISCONN;
+	if (tcb->state != TCP_CLOSED) return -EINVAL;
+
+	fs_node_t * nic = net_route((uint32_t)dest->sin_addr.s_addr, NULL);
+	if (!nic) return -ENETUNREACH;
+	struct EthernetDevice * eth = nic->device;
+
+	tcp_set_nic(tcb, nic);
+	if (!tcb->local_addr) tcb->local_addr = eth->ipv4_addr;
+
+	spin_lock(tcp_lock);
+	long out = tcb->local_port ? 0 : tcp_bind_port(tcb, 0);
+	if (!out) {
+		struct tcp_tuple tuple;
+		tcb->remote_addr = (uint32_t)dest->sin_addr.s_addr;
+		tcb->remote_port = ntohs(dest->sin_port);
+		tcp_tuple_of(tcb, &tuple);
+		if (hashmap_has(tcp_table, &tuple)) {
+			tcb->remote_port = 0;
+			out = -EADDRINUSE;
+		} else {
+			hashmap_set(tcp_table, &tuple, tcb);
+		}
+	}
+	spin_unlock(tcp_lock);
+
+	if (out) return out;
+	tcp_timer_start();
+	printf("tcp: connecting from port %d\n", tcb->local_port);
+
+	spin_lock(tcb->lock);
+	tcb->iss = rand();
+	tcb->snd_una = tcb->iss;
+	tcb->snd_nxt = tcb->iss;
+	tcb->snd_max = tcb->iss;
+	tcb->recover = tcb->iss;
+	tcb->state = TCP_SYN_SENT;
+	tcp_transmit(tcb, TCP_FLAGS_SYN, tcb->iss, 0);
+	tcp_sent(tcb, 1);
+
+	while (tcb->state == TCP_SYN_SENT) {
+		if (sleep_on_unlocking(tcb->wait, &tcb->lock)) return -EINTR;
+		spin_lock(tcb->lock);
+	}
+
+	out = tcb->state == TCP_CLOSED ? -tcb->error : 0;
+	spin_unlock(tcb->lock);
+	return out;
+}
+
+static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
+	struct tcp_cb * tcb = sock->pcb;
+
+	if (msg->msg_iovlen == 0) return 0;
+	if (!tcb->remote_port) return -ENOTCONN;
+
+	spin_lock(tcb->lock);
+	while (!tcb->rcv_len) {
+		if (tcb->fin_received || tcb->state == TCP_CLOSED) {
+			long out = tcb->fin_received ? 0 : -tcb->error;
+			spin_unlock(tcb->lock);
+			return out;
+		}
+		if (sleep_on_unlocking(tcb->wait, &tcb->lock)) return -EINTR;
+		spin_lock(tcb->lock);
+	}
+
+	size_t total = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && tcb->rcv_len; ++i) {
+		size_t len = msg->msg_iov[i].iov_len < tcb->rcv_len ? msg->msg_iov[i].iov_len : tcb->rcv_len;
+		size_t first = TCP_RCVBUF_SIZE - tcb->rcv_start;
+		if (first > len) first = len;
+		memcpy(msg->msg_iov[i].iov_base, tcb->rcv_buf + tcb->rcv_start, first);
+		memcpy((uint8_t *)msg->msg_iov[i].iov_base + first, tcb->rcv_buf, len - first);
+		tcb->rcv_start = (tcb->rcv_start + len) % TCP_RCVBUF_SIZE;
+		tcb->rcv_len -= len;
+		total += len;
+	}
+
+	/* Tell the peer about the room we made if it has been holding back for lack of it */
+	if (tcb->state == TCP_ESTABLISHED || tcb->state == TCP_FIN_WAIT_1 || tcb->state == TCP_FIN_WAIT_2) {
+		uint32_t advertised = tcb->rcv_adv - tcb->rcv_nxt;
+		uint32_t now_free = TCP_RCVBUF_SIZE - tcb->rcv_len;
+		if (now_free > advertised && (now_free - advertised >= 2U * tcb->mss || now_free - advertised >= TCP_RCVBUF_SIZE / 2)) {
+			tcp_send_ack(tcb);
+		}
+	}
+
+	spin_unlock(tcb->lock);
+	return total;
+}
+
+static void tcp_snd_append(struct tcp_cb * tcb, const uint8_t * data, size_t len) {
+	size_t pos = (tcb->snd_start + tcb->snd_len) % TCP_SNDBUF_SIZE;
+	size_t first = TCP_SNDBUF_SIZE - pos;
+	if (first > len) first = len;
+	memcpy(tcb->snd_buf + pos, data, first);
+	memcpy(tcb->snd_buf, data + first, len - first);
+	tcb->snd_len += len;
+}
+
+static long sock_tcp_send(sock_t * sock, const struct msghdr * msg, int flags) {
+	struct tcp_cb * tcb = sock->pcb;
+	size_t written = 0;
+	size_t iov = 0;
+	size_t offset = 0;
+
+	spin_lock(tcb->lock);
+	while (1) {
+		while (iov < msg->msg_iovlen && offset == msg->msg_iov[iov].iov_len) {
+			iov++;
+			offset = 0;
+		}
+		if (iov == msg->msg_iovlen) break;
+
+		if (tcb->state != TCP_ESTABLISHED && tcb->state != TCP_CLOSE_WAIT) {
+			long out = tcb->error ? -tcb->error : (tcb->remote_port ? -EPIPE : -ENOTCONN);
+			spin_unlock(tcb->lock);
+			return written ? (long)written : out;
+		}
+
+		size_t space = TCP_SNDBUF_SIZE - tcb->snd_len;
+		if (!space) {
+			if (sleep_on_unlocking(tcb->wait, &tcb->lock)) return written ? (long)written : -EINTR;
+			spin_lock(tcb->lock);
+			continue;
+		}
+
+		/* Take as much as fits from as many buffers as we were given before sending any of it */
+		while (space && iov < msg->msg_iovlen) {
+			size_t n = msg->msg_iov[iov].iov_len - offset;
+			if (n > space) n = space;
+			tcp_snd_append(tcb, (const uint8_t *)msg->msg_iov[iov].iov_base + offset, n);
+			offset += n;
+			written += n;
+			space -= n;
+			if (offset == msg->msg_iov[iov].iov_len) {
+				iov++;
+				offset = 0;
+			}
+		}
+
+		tcp_output(tcb);
+	}
+	spin_unlock(tcb->lock);
+
+	return written;
+}
+
+static long sock_tcp_setsockopt(sock_t * sock, int level, int optname, const void * optval, socklen_t optlen) {
+	struct tcp_cb * tcb = sock->pcb;
+
+	if (level != IPPROTO_TCP) return -ENOPROTOOPT;
+
+	switch (optname) {
+		case TCP_NODELAY:
+			if (!optval || optlen < sizeof(int)) return -EINVAL;
+			spin_lock(tcb->lock);
+			tcb->nodelay = !!*(const int *)optval;
+			/* Anything being held back can go now */
+			if (tcb->nodelay) tcp_output(tcb);
+			spin_unlock(tcb->lock);
+			return 0;
+		default:
+			return -ENOPROTOOPT;
+	}
+}
+
+static void sock_tcp_close(sock_t * sock) {
+	struct tcp_cb * tcb = sock->pcb;
+
+	if (tcb->state == TCP_LISTEN) {
+		tcp_listen_close(tcb);
+		return;
+	}
+
+	spin_lock(tcb->lock);
+	tcb->sock = NULL;
+	tcb->closed = 1;
+	tcb->rcv_len = 0;
+	switch (tcb->state) {
+		case TCP_ESTABLISHED:
+		case TCP_CLOSE_WAIT:
+			tcb->state = tcb->state == TCP_ESTABLISHED ? TCP_FIN_WAIT_1 : TCP_LAST_ACK;
+			tcb->fin_queued = 1;
+			tcb->fin_seq = tcb->snd_una + tcb->snd_len;
+			tcp_output(tcb);
+			break;
+		case TCP_SYN_SENT:
+			tcb->state = TCP_CLOSED;
+			tcb->rto_deadline = 0;
+			break;
+	}
+	int registered = tcb->local_port != 0;
+	spin_unlock(tcb->lock);
+
+	/* Otherwise the timer thread frees it once it is done with it */
+	if (!registered) tcp_free(tcb);
+	else tcp_timer_kick(0);
+}
+
+static int sock_tcp_pollcheck(fs_node_t * node) {
+	struct tcp_cb * tcb = ((sock_t *)node)->pcb;
+	int out = 0;
+	if (tcb->state == TCP_LISTEN) return tcb->accept_queue->length ? POLLIN : 0;
+	if (tcb->rcv_len || tcb->fin_received) out |= POLLIN;
+	if ((tcb->state == TCP_ESTABLISHED || tcb->state == TCP_CLOSE_WAIT) && tcb->snd_len < TCP_SNDBUF_SIZE) out |= POLLOUT;
+	if (tcb->state == TCP_CLOSED && tcb->remote_port) out |= POLLIN | POLLHUP | (tcb->error ? POLLERR : 0);
+	return out;
+}
+
+static int sock_tcp_selectcheck(fs_node_t * node) {
+	return (sock_tcp_pollcheck(node) & (POLLIN | POLLHUP | POLLERR)) ? 0 : 1;
+}
+
+static ssize_t sock_tcp_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct iovec _iovec = {
+		buffer, size
+	};
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = &_iovec,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_recv((sock_t *)node, &_header, 0);
+}
+
+static ssize_t sock_tcp_write(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct iovec _iovec = {
+		(void *)buffer, size
+	};
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = &_iovec,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_send((sock_t *)node, &_header, 0);
+}
+
+static void tcp_sock_attach(sock_t * sock, struct tcp_cb * tcb) {
+	tcb->sock = sock;
+	sock->pcb = tcb;
+	sock->sock_recv = sock_tcp_recv;
+	sock->sock_send = sock_tcp_send;
+	sock->sock_close = sock_tcp_close;
+	sock->sock_connect = sock_tcp_connect;
+	sock->sock_bind = sock_tcp_bind;
+	sock->sock_listen = sock_tcp_listen;
+	sock->sock_accept = sock_tcp_accept;
+	sock->sock_setsockopt = sock_tcp_setsockopt;
+	sock->stream = 1;
+	sock->_fnode.read = sock_tcp_read;
+	sock->_fnode.write = sock_tcp_write;
+	sock->_fnode.selectcheck = sock_tcp_selectcheck;
+	sock->_fnode.pollcheck = sock_tcp_pollcheck;
+}
+
+long net_tcp_socket(void) {
+	sock_t * sock = net_sock_create();
+	tcp_sock_attach(sock, tcp_cb_create());
+
+	int fd = process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock);
+	FD_MODE(fd) = 03;
+	return fd;
+}
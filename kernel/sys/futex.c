@@ -0,0 +1,151 @@
+/**
+ * @file  kernel/sys/futex.c
+ * @brief Userspace wait queues keyed on memory addresses.
+ *
+ * A futex is an int in userspace memory that threads can sleep on.
+ * Waiting only happens if the word still holds the value the caller
+ * expects, which is checked under the same lock that wakers take, so
+ * a wakeup that races with a waiter that is about to sleep can't be
+ * lost. Everything else about the lock built on top of the word is
+ * up to userspace, which only needs to enter the kernel when there
+ * is contention.
+ *
+ * Futexes are private to an address space: the key is the page
+ * directory of the calling thread and the virtual address of the
+ * word. Wait queues are created on demand in a small hash table and
+ * freed once they have no more waiters.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/string.h>
+#include <kernel/list.h>
+#include <kernel/futex.h>
+
+#define FUTEX_BUCKETS 64
+
+struct futex_queue {
+	page_directory_t * dir;
+	uintptr_t addr;
+	list_t * waiters;
+};
+
+static struct futex_bucket {
+	spin_lock_t lock;
+	list_t * queues;
+} futex_buckets[FUTEX_BUCKETS];
+
+static struct futex_bucket * futex_bucket_for(page_directory_t * dir, uintptr_t addr) {
+	uintptr_t hash = (addr >> 2) ^ ((uintptr_t)dir >> 6);
+	hash ^= hash >> 12;
+	return &futex_buckets[hash % FUTEX_BUCKETS];
+}
+
+/**
+ * @brief Find the wait queue for a futex.
+ *
+ * Must be called with the bucket lock held.
+ *
+ * @param create Make a new queue if there isn't one already.
+ */
+static struct futex_queue * futex_queue_find(struct futex_bucket * bucket, page_directory_t * dir, uintptr_t addr, int create) {
+	if (bucket->queues) {
+		foreach(node, bucket->queues) {
+			struct futex_queue * queue = node->value;
+			if (queue->dir == dir && queue->addr == addr) return queue;
+		}
+	}
+
+	if (!create) return NULL;
+
+	if (!bucket->queues) {
+		bucket->queues = list_create("futex wait queues", bucket);
+	}
+
+	struct futex_queue * queue = malloc(sizeof(struct futex_queue));
+	queue->dir = dir;
+	queue->addr = addr;
+	queue->waiters = list_create("futex waiters", queue);
+	list_insert(bucket->queues, queue);
+	return queue;
+}
+
+/**
+ * @brief Free a wait queue if nothing is waiting on it anymore.
+ *
+ * Must be called with the bucket lock held.
+ */
+static void futex_queue_prune(struct futex_bucket * bucket, struct futex_queue * queue) {
+	if (!queue || queue->waiters->length) return;
+	node_t * node = list_find(bucket->queues, queue);
+	if (node) {
+		list_delete(bucket->queues, node);
+		free(node);
+	}
+	free(queue->waiters);
+	free(queue);
+}
+
+/**
+ * @brief Sleep on the futex at @p addr if it still holds @p val.
+ *
+ * @p addr must already have been validated as a user address.
+ *
+ * @returns 0 when woken, -EAGAIN if the value had already changed,
+ *          or -EINTR if the sleep was interrupted by a signal.
+ */
+long futex_wait(uintptr_t addr, int val) {
+	if (addr & 3) return -EINVAL;
+
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	struct futex_bucket * bucket = futex_bucket_for(dir, addr);
+
+	spin_lock(bucket->lock);
+
+	if (*(volatile int *)addr != val) {
+		spin_unlock(bucket->lock);
+		return -EAGAIN;
+	}
+
+	struct futex_queue * queue = futex_queue_find(bucket, dir, addr, 1);
+	int interrupted = sleep_on_unlocking(queue->waiters, &bucket->lock);
+
+	/* The queue may have been freed by a waker while we slept. */
+	spin_lock(bucket->lock);
+	futex_queue_prune(bucket, futex_queue_find(bucket, dir, addr, 0));
+	spin_unlock(bucket->lock);
+
+	return interrupted ? -EINTR : 0;
+}
+
+/**
+ * @brief Wake up to @p count threads sleeping on the futex at @p addr.
+ *
+ * @returns the number of threads that were woken.
+ */
+long futex_wake(uintptr_t addr, int count) {
+	if (addr & 3) return -EINVAL;
+	if (count <= 0) return 0;
+
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	struct futex_bucket * bucket = futex_bucket_for(dir, addr);
+
+	spin_lock(bucket->lock);
+	struct futex_queue * queue = futex_queue_find(bucket, dir, addr, 0);
+	if (!queue) {
+		spin_unlock(bucket->lock);
+		return 0;
+	}
+	int woken = wakeup_queue_count(queue->waiters, count);
+	futex_queue_prune(bucket, queue);
+	spin_unlock(bucket->lock);
+
+	return woken;
+}
@@ -0,0 +1,421 @@
+/**
+ * @file  kernel/sys/ioring.c
+ * @brief Batched I/O through a submission/completion ring.
+ *
+ * A process hands the kernel a ring in its own memory (see sys/ioring.h)
+ * and fills it with operations; one ioring_enter call then runs as many
+ * of them as were queued and posts their results, so a batch of reads,
+ * writes and waits costs one kernel entry instead of one each.
+ *
+ * Operations run in the calling thread, inside ioring_enter: the ring and
+ * the buffers it points to are in the caller's address space, which
+ * kernel worker threads can't see. Anything that would block - a read from
+ * an empty pipe, an accept with nothing waiting, a poll - is parked on an
+ * eventpoll set owned by the ring instead, and run again when the set says
+ * its file is ready, either later in the same call if it is waiting for
+ * completions or in a later call. Timeouts are parked the same way and
+ * bound how long a waiting ioring_enter sleeps.
+ *
+ * A parked operation holds a reference to its file, so the file can't go
+ * away under the set. If its descriptor is closed (or now refers to
+ * something else) the operation is completed with -EBADF the next time
+ * the ring looks at its parked operations.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/process.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/list.h>
+#include <kernel/time.h>
+#include <kernel/vfs.h>
+#include <kernel/syscall.h>
+#include <kernel/eventpoll.h>
+#include <kernel/ioring.h>
+#include <sys/ioring.h>
+#include <sys/socket.h>
+
+extern long net_accept(int sockfd, struct sockaddr * addr, socklen_t * addrlen);
+extern long net_recv(int sockfd, struct msghdr * msg, int flags);
+extern long net_send(int sockfd, const struct msghdr * msg, int flags);
+
+/* How many parked operations to look at per pass over the set */
+#define IORING_REAP_BATCH 32
+
+struct ioring_op {
+	struct ioring_sqe sqe;
+	fs_node_t * node;        /* what it is parked on, if it is waiting for a file; we hold a reference */
+	int key;                 /* and its key in the set */
+	unsigned long s, ss;     /* when a timeout expires */
+};
+
+struct ioring_ctx {
+	struct ioring * ring;
+	struct ioring_sqe * sqes;
+	struct ioring_cqe * cqes;
+	uint32_t entries;          /* our copy; the one in the ring can be scribbled on */
+	page_directory_t * directory;
+	fs_node_t * set;
+	list_t * pending;          /* parked operations */
+	int next_key;
+	volatile int busy;
+};
+
+static void ioring_complete(struct ioring_ctx * ctx, uint64_t user_data, long res) {
+	uint32_t tail = ctx->ring->cq_tail;
+	struct ioring_cqe * cqe = &ctx->cqes[tail & (ctx->entries * 2 - 1)];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	cqe->flags = 0;
+	__atomic_store_n(&ctx->ring->cq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Completions not yet taken by the process, plus those still to come. */
+static uint32_t ioring_cq_committed(struct ioring_ctx * ctx) {
+	uint32_t used = ctx->ring->cq_tail - __atomic_load_n(&ctx->ring->cq_head, __ATOMIC_ACQUIRE);
+	if (used > ctx->entries * 2) used = ctx->entries * 2;
+	return used + ctx->pending->length;
+}
+
+/**
+ * @brief Try to run @p sqe without blocking.
+ *
+ * @returns 1 with @p res set if it finished, or 0 with @p events set to
+ *          what it needs from @p sqe->fd before it is worth trying again.
+ */
+static int ioring_try(struct ioring_sqe * sqe, long * res, int * events) {
+	if (sqe->opcode == IORING_OP_NOP) {
+		*res = 0;
+		return 1;
+	}
+
+	if (sqe->opcode == IORING_OP_TIMEOUT) {
+		*events = 0;
+		return 0;
+	}
+
+	if (sqe->flags) {
+		*res = -EINVAL;
+		return 1;
+	}
+
+	int fd = sqe->fd;
+	if (!FD_CHECK(fd)) {
+		*res = -EBADF;
+		return 1;
+	}
+	fs_node_t * node = FD_ENTRY(fd);
+	void * addr = (void *)(uintptr_t)sqe->addr;
+	if (addr && !PTR_INRANGE(addr)) {
+		*res = -EFAULT;
+		return 1;
+	}
+
+	/* Only things that can block are worth asking first */
+	int ready = (node->flags & (FS_PIPE | FS_CHARDEVICE)) ? pollcheck_fs(node) : (POLLIN | POLLOUT);
+
+	switch (sqe->opcode) {
+		case IORING_OP_READ:
+		case IORING_OP_WRITE: {
+			int writing = sqe->opcode == IORING_OP_WRITE;
+			if (!(FD_MODE(fd) & (writing ? 02 : 01))) {
+				*res = -EBADF;
+				return 1;
+			}
+			if (!addr || (sqe->len && !PTR_INRANGE((uintptr_t)addr + sqe->len - 1))) {
+				*res = -EFAULT;
+				return 1;
+			}
+			if (!(ready & (writing ? POLLOUT : POLLIN) || ready & (POLLHUP | POLLERR))) {
+				*events = writing ? POLLOUT : POLLIN;
+				return 0;
+			}
+			uint64_t offset = sqe->off < 0 ? FD_OFFSET(fd) : (uint64_t)sqe->off;
+			*res = writing ? write_fs(node, offset, sqe->len, addr) : read_fs(node, offset, sqe->len, addr);
+			if (sqe->off < 0 && *res > 0) FD_OFFSET(fd) += *res;
+			return 1;
+		}
+		case IORING_OP_POLL_ADD: {
+			int revents = ready & (sqe->events | POLLHUP | POLLERR);
+			if (!revents) {
+				*events = sqe->events;
+				return 0;
+			}
+			*res = revents;
+			return 1;
+		}
+		case IORING_OP_FSWAIT:
+			if (selectcheck_fs(node) != 0) {
+				*events = POLLIN;
+				return 0;
+			}
+			*res = 0;
+			return 1;
+		case IORING_OP_ACCEPT:
+		case IORING_OP_RECV:
+			if (!(ready & (POLLIN | POLLHUP | POLLERR))) {
+				*events = POLLIN;
+				return 0;
+			}
+			if (sqe->opcode == IORING_OP_ACCEPT) {
+				void * addr2 = (void *)(uintptr_t)sqe->addr2;
+				if (addr2 && !PTR_INRANGE(addr2)) {
+					*res = -EFAULT;
+					return 1;
+				}
+				*res = net_accept(fd, addr, addr2);
+			} else {
+				*res = addr ? net_recv(fd, addr, sqe->msg_flags) : -EFAULT;
+			}
+			return 1;
+		case IORING_OP_SEND:
+			if (!(ready & (POLLOUT | POLLHUP | POLLERR))) {
+				*events = POLLOUT;
+				return 0;
+			}
+			*res = addr ? net_send(fd, addr, sqe->msg_flags) : -EFAULT;
+			return 1;
+		default:
+			*res = -EINVAL;
+			return 1;
+	}
+}
+
+static void ioring_park(struct ioring_ctx * ctx, struct ioring_sqe * sqe, int events) {
+	struct ioring_op * op = malloc(sizeof(struct ioring_op));
+	memcpy(&op->sqe, sqe, sizeof(struct ioring_sqe));
+	op->node = NULL;
+	op->key = ctx->next_key++;
+
+	if (sqe->opcode == IORING_OP_TIMEOUT) {
+		int64_t ms = sqe->off > 0 ? sqe->off : 0;
+		relative_time(0, ms * 1000, &op->s, &op->ss);
+	} else {
+		struct epoll_event ev = { .events = events | EPOLLET };
+		ev.data.ptr = op;
+		op->node = FD_ENTRY(sqe->fd);
+		open_fs(op->node, 0);
+		eventpoll_ctl(ctx->set, EPOLL_CTL_ADD, op->key, op->node, &ev);
+	}
+
+	list_insert(ctx->pending, op);
+}
+
+static void ioring_finish(struct ioring_ctx * ctx, struct ioring_op * op, long res) {
+	if (op->node) {
+		eventpoll_ctl(ctx->set, EPOLL_CTL_DEL, op->key, op->node, NULL);
+		close_fs(op->node);
+	}
+	node_t * n = list_find(ctx->pending, op);
+	list_delete(ctx->pending, n);
+	free(n);
+	ioring_complete(ctx, op->sqe.user_data, res);
+	free(op);
+}
+
+/**
+ * @brief Run parked operations whose files became ready.
+ *
+ * Waits up to @p timeout milliseconds for one to.
+ *
+ * @returns how many finished, or -EINTR.
+ */
+static int ioring_reap(struct ioring_ctx * ctx, int timeout) {
+	struct epoll_event events[IORING_REAP_BATCH];
+	int count = eventpoll_wait(ctx->set, events, IORING_REAP_BATCH, timeout);
+	if (count < 0) return count;
+
+	int finished = 0;
+	for (int i = 0; i < count; ++i) {
+		struct ioring_op * op = events[i].data.ptr;
+		long res;
+		int wanted;
+		if (ioring_try(&op->sqe, &res, &wanted)) {
+			ioring_finish(ctx, op, res);
+			finished++;
+		} else {
+			/* Edge-triggered, so if it turned out not to be ready after all, look again on the next change */
+			struct epoll_event ev = { .events = wanted | EPOLLET };
+			ev.data.ptr = op;
+			eventpoll_ctl(ctx->set, EPOLL_CTL_MOD, op->key, op->node, &ev);
+		}
+	}
+	return finished;
+}
+
+/**
+ * @brief Complete operations whose descriptor was closed while they
+ *        were parked.
+ *
+ * @returns how many were completed.
+ */
+static int ioring_orphans(struct ioring_ctx * ctx) {
+	int finished = 0;
+
+	node_t * n = ctx->pending->head;
+	while (n) {
+		struct ioring_op * op = n->value;
+		n = n->next;
+		if (!op->node) continue;
+		if (!FD_CHECK(op->sqe.fd) || FD_ENTRY(op->sqe.fd) != op->node) {
+			ioring_finish(ctx, op, -EBADF);
+			finished++;
+		}
+	}
+	return finished;
+}
+
+/**
+ * @brief Complete expired timeouts.
+ *
+ * @returns how many were completed; @p next is set to how many
+ *          milliseconds until the next one, or -1 if there are none.
+ */
+static int ioring_expire(struct ioring_ctx * ctx, int * next) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+
+	int finished = 0;
+	*next = -1;
+
+	node_t * n = ctx->pending->head;
+	while (n) {
+		struct ioring_op * op = n->value;
+		n = n->next;
+		if (op->sqe.opcode != IORING_OP_TIMEOUT) continue;
+		if (s > op->s || (s == op->s && ss >= op->ss)) {
+			ioring_finish(ctx, op, -ETIME);
+			finished++;
+		} else {
+			unsigned long ms = ((op->s - s) * 1000000 + op->ss - ss + 999) / 1000;
+			if (*next == -1 || ms < (unsigned long)*next) *next = ms;
+		}
+	}
+	return finished;
+}
+
+/**
+ * @brief Run up to @p to_submit queued operations, then wait until at
+ *        least @p min_complete of them (or of earlier ones) finish.
+ *
+ * Submission stops early if the completion queue couldn't hold the
+ * results of everything in flight.
+ *
+ * @returns how many operations were taken off the submission queue.
+ */
+long ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	fs_node_t * node = FD_ENTRY(fd);
+	if (node->close != ioring_close) return -EINVAL;
+
+	struct ioring_ctx * ctx = node->device;
+	if (ctx->directory != this_core->current_process->thread.page_directory) return -EINVAL;
+	if (__sync_lock_test_and_set(&ctx->busy, 1)) return -EBUSY;
+
+	unsigned int submitted = 0;
+	unsigned int completed = 0;
+
+	uint32_t head = ctx->ring->sq_head;
+	uint32_t tail = __atomic_load_n(&ctx->ring->sq_tail, __ATOMIC_ACQUIRE);
+	if (tail - head > ctx->entries) tail = head + ctx->entries;
+
+	while (submitted < to_submit && head != tail && ioring_cq_committed(ctx) < ctx->entries * 2) {
+		struct ioring_sqe sqe;
+		memcpy(&sqe, &ctx->sqes[head & (ctx->entries - 1)], sizeof(struct ioring_sqe));
+		head++;
+		__atomic_store_n(&ctx->ring->sq_head, head, __ATOMIC_RELEASE);
+		submitted++;
+
+		long res;
+		int events;
+		if (ioring_try(&sqe, &res, &events)) {
+			ioring_complete(ctx, sqe.user_data, res);
+			completed++;
+		} else {
+			ioring_park(ctx, &sqe, events);
+		}
+	}
+
+	long out = submitted;
+	int next;
+	completed += ioring_orphans(ctx);
+	completed += ioring_expire(ctx, &next);
+	int reaped = ioring_reap(ctx, 0);
+	if (reaped > 0) completed += reaped;
+
+	while (completed < min_complete && ctx->pending->length) {
+		reaped = ioring_reap(ctx, next);
+		if (reaped < 0) {
+			if (!submitted) out = reaped;
+			break;
+		}
+		completed += reaped;
+		completed += ioring_orphans(ctx);
+		completed += ioring_expire(ctx, &next);
+	}
+
+	__sync_lock_release(&ctx->busy);
+	return out;
+}
+
+void ioring_close(fs_node_t * node) {
+	struct ioring_ctx * ctx = node->device;
+
+	close_fs(ctx->set);
+	foreach(n, ctx->pending) {
+		struct ioring_op * op = n->value;
+		if (op->node) close_fs(op->node);
+		free(op);
+	}
+	list_free(ctx->pending);
+	free(ctx->pending);
+	free(ctx);
+}
+
+/**
+ * @brief Set up a ring of @p entries submission entries in the memory
+ *        at @p ring, which must be IORING_SIZE(entries) bytes.
+ *
+ * @returns a file descriptor to pass to ioring_enter.
+ */
+long ioring_setup(unsigned int entries, struct ioring * ring) {
+	if (!entries || entries > IORING_MAX_ENTRIES || (entries & (entries - 1))) return -EINVAL;
+	if (!ring || !PTR_INRANGE(ring) || !PTR_INRANGE((uintptr_t)ring + IORING_SIZE(entries) - 1)) return -EFAULT;
+
+	ring->sq_head = 0;
+	ring->sq_tail = 0;
+	ring->cq_head = 0;
+	ring->cq_tail = 0;
+	ring->entries = entries;
+
+	struct ioring_ctx * ctx = malloc(sizeof(struct ioring_ctx));
+	ctx->ring = ring;
+	ctx->sqes = IORING_SQES(ring);
+	ctx->cqes = (struct ioring_cqe *)(ctx->sqes + entries);
+	ctx->entries = entries;
+	ctx->directory = this_core->current_process->thread.page_directory;
+	ctx->set = eventpoll_create();
+	open_fs(ctx->set, 0);
+	ctx->pending = list_create("ioring pending", ctx);
+	ctx->next_key = 0;
+	ctx->busy = 0;
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0, sizeof(fs_node_t));
+	snprintf(fnode->name, 100, "[ioring]");
+	fnode->mask = 0600;
+	fnode->flags = FS_PIPE;
+	fnode->device = ctx;
+	fnode->close = ioring_close;
+	open_fs(fnode, 0);
+
+	int fd = process_append_fd((process_t *)this_core->current_process, fnode);
+	FD_MODE(fd) = 03;
+	return fd;
+}
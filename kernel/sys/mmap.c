@@ -0,0 +1,524 @@
+/**
+ * @file  kernel/sys/mmap.c
+ * @brief Memory mappings for userspace.
+ *
+ * Implements mmap, munmap, and mprotect for anonymous private
+ * mappings and read-only file mappings. A mapping is recorded as a
+ * region of its address space and costs nothing until it is touched;
+ * the page fault handler allocates each page on first access and,
+ * for file mappings, reads its contents in through the VFS.
+ *
+ * Pages of a mapping are ordinary user pages once they are faulted
+ * in, so fork shares them copy-on-write and mmu_free releases them
+ * along with the rest of the address space.
+ *
+ * The same mechanism backs the segments of executables loaded by
+ * exec. Pages of read-only mappings of files that are in the page
+ * cache are mapped straight from it, so that processes running the
+ * same binary share the frames for its text.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <kernel/types.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/string.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/mmap.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/pagecache.h>
+
+static mmap_region_t * region_create(uintptr_t start, uintptr_t end, int prot, int flags, fs_node_t * file, off_t offset) {
+	mmap_region_t * region = malloc(sizeof(mmap_region_t));
+	region->start = start;
+	region->end = end;
+	region->prot = prot;
+	region->flags = flags;
+	region->file = file ? clone_fs(file) : NULL;
+	region->offset = offset;
+	region->file_end = end;
+	region->cached = 0;
+	region->refcount = 1;
+	return region;
+}
+
+static mmap_region_t * region_copy(mmap_region_t * region, uintptr_t start, uintptr_t end) {
+	mmap_region_t * copy = region_create(start, end, region->prot, region->flags,
+		region->file, region->offset + (start - region->start));
+	copy->file_end = region->file_end;
+	copy->cached = region->cached;
+	return copy;
+}
+
+/**
+ * @brief Drop a reference to a region, freeing it if it was the last.
+ *
+ * Regions are referenced by their address space's list and, briefly,
+ * by page faults that are reading in a page without holding the lock.
+ * Must be called with the directory lock held.
+ */
+static void region_release(mmap_region_t * region) {
+	if (--region->refcount) return;
+	if (region->file) close_fs(region->file);
+	free(region);
+}
+
+/**
+ * @brief Split a region in two at @p address.
+ *
+ * The original region keeps the lower half.
+ *
+ * @returns the list node of the new upper half.
+ */
+static node_t * region_split(list_t * list, node_t * node, uintptr_t address) {
+	mmap_region_t * region = node->value;
+	mmap_region_t * upper = region_copy(region, address, region->end);
+	region->end = address;
+	return list_insert_after(list, node, upper);
+}
+
+static void region_insert(list_t * list, mmap_region_t * region) {
+	foreach(node, list) {
+		mmap_region_t * other = node->value;
+		if (other->start > region->start) {
+			list_insert_before(list, node, region);
+			return;
+		}
+	}
+	list_insert(list, region);
+}
+
+/**
+ * @brief Check whether [start,end) is somewhere a fixed mapping may go.
+ */
+static int range_is_fixable(uintptr_t start, uintptr_t end) {
+	if (start < USER_FIXED_LOW || end > USER_MMAP_HIGH || end <= start) return 0;
+	if (start < USER_RESERVED_HIGH && end > USER_RESERVED_LOW) return 0;
+	return 1;
+}
+
+static mmap_region_t * region_find(page_directory_t * dir, uintptr_t address) {
+	foreach(node, dir->mappings) {
+		mmap_region_t * region = node->value;
+		if (address < region->start) break;
+		if (address < region->end) return region;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Find a free range of @p length bytes for a new mapping.
+ *
+ * Uses @p hint if the range starting there is free, and
+ * otherwise the lowest gap between existing regions.
+ *
+ * @returns the start of the range, or 0 if there is no room.
+ */
+static uintptr_t region_find_gap(page_directory_t * dir, uintptr_t hint, size_t length) {
+	if (hint >= USER_MMAP_LOW && hint + length <= USER_MMAP_HIGH && hint + length > hint) {
+		int available = 1;
+		foreach(node, dir->mappings) {
+			mmap_region_t * region = node->value;
+			if (region->start < hint + length && region->end > hint) {
+				available = 0;
+				break;
+			}
+		}
+		if (available) return hint;
+	}
+
+	uintptr_t last = USER_MMAP_LOW;
+	foreach(node, dir->mappings) {
+		mmap_region_t * region = node->value;
+		if (region->start >= last + length) return last;
+		if (region->end > last) last = region->end;
+	}
+
+	if (last + length <= USER_MMAP_HIGH) return last;
+	return 0;
+}
+
+/**
+ * @brief Remove [start,end) from the regions of @p dir and release its pages.
+ *
+ * Must be called with the directory lock held, and @p dir must be
+ * the current address space.
+ *
+ * @returns 1 if any pages were unmapped and the range needs to be invalidated.
+ */
+static int region_unmap_range(page_directory_t * dir, uintptr_t start, uintptr_t end) {
+	int flush = 0;
+	node_t * node = dir->mappings->head;
+	while (node) {
+		mmap_region_t * region = node->value;
+		if (region->start >= end) break;
+		if (region->end <= start) {
+			node = node->next;
+			continue;
+		}
+
+		/* Cut the region down until this node covers only what we are removing */
+		if (region->start < start) {
+			node = region_split(dir->mappings, node, start);
+			region = node->value;
+		}
+		if (region->end > end) {
+			region_split(dir->mappings, node, end);
+		}
+
+		for (uintptr_t i = region->start; i < region->end; i += 0x1000) {
+			union PML * page = mmu_get_page(i, 0);
+			if (page && page->bits.present) {
+				mmu_frame_free(page);
+				flush = 1;
+			}
+		}
+
+		node_t * next = node->next;
+		list_delete(dir->mappings, node);
+		free(node);
+		region_release(region);
+		node = next;
+	}
+	return flush;
+}
+
+/**
+ * @brief Create a new mapping in @p dir.
+ *
+ * @param dir    Address space to map into; must be the current one.
+ * @param addr   Where to place the mapping. Required with @c MAP_FIXED,
+ *               otherwise a hint.
+ * @param length Size of the mapping in bytes.
+ * @param prot   @c PROT_ flags for the new pages.
+ * @param flags  @c MAP_ flags.
+ * @param file   File to map, or NULL for an anonymous mapping.
+ * @param offset Offset into @p file of the first page.
+ * @returns the address of the mapping, or a negative error code.
+ */
+long mmap_map(page_directory_t * dir, uintptr_t addr, size_t length, int prot, int flags, fs_node_t * file, off_t offset) {
+	if (!length || (offset & 0xFFF) || offset < 0) return -EINVAL;
+
+	int type = flags & (MAP_SHARED | MAP_PRIVATE);
+	if (type != MAP_SHARED && type != MAP_PRIVATE) return -EINVAL;
+
+	/* Every page of a mapping is a private copy, so shared mappings
+	 * are only possible where the difference can't be observed. */
+	if (type == MAP_SHARED && (prot & PROT_WRITE)) return -ENOTSUP;
+
+	if (length > USER_MMAP_HIGH - USER_MMAP_LOW) return -ENOMEM;
+	length = (length + 0xFFF) & 0xFFFFffffFFFFf000UL;
+
+	spin_lock(dir->lock);
+
+	if (!dir->mappings) {
+		dir->mappings = list_create("mmap regions", dir);
+	}
+
+	uintptr_t start;
+	if (flags & MAP_FIXED) {
+		if ((addr & 0xFFF) || !range_is_fixable(addr, addr + length)) {
+			spin_unlock(dir->lock);
+			return -EINVAL;
+		}
+		start = addr;
+		int flush = region_unmap_range(dir, start, start + length);
+
+		/* Replace whatever else was mapped there, such as pages from sbrk */
+		for (uintptr_t i = start; i < start + length; i += 0x1000) {
+			union PML * page = mmu_get_page(i, 0);
+			if (page && page->bits.present && page->bits.user) {
+				mmu_frame_free(page);
+				flush = 1;
+			}
+		}
+
+		if (flush) mmu_invalidate_range(start, start + length);
+	} else {
+		start = region_find_gap(dir, addr & 0xFFFFffffFFFFf000UL, length);
+		if (!start) {
+			spin_unlock(dir->lock);
+			return -ENOMEM;
+		}
+	}
+
+	mmap_region_t * region = region_create(start, start + length, prot, flags, file, offset);
+	if (file && (file->flags & FS_PAGECACHE) && !(prot & PROT_WRITE)) {
+		region->cached = 1;
+	}
+	region_insert(dir->mappings, region);
+
+	spin_unlock(dir->lock);
+	return start;
+}
+
+/**
+ * @brief Map a loadable segment of an executable.
+ *
+ * Used by exec in place of reading segments in up front. Unlike
+ * mmap, segments may be placed anywhere below the stack, and only the
+ * first @p filesz bytes come from the file; the rest is zero-filled.
+ * Read-only segments share their pages with every other process
+ * running the same file.
+ *
+ * @returns 0 on success, or -EINVAL if the segment is malformed or
+ *          shares a page with a segment that was already mapped.
+ */
+long mmap_map_segment(page_directory_t * dir, uintptr_t vaddr, size_t memsz, int prot, fs_node_t * file, off_t offset, size_t filesz) {
+	uintptr_t start = vaddr & 0xFFFFffffFFFFf000UL;
+	uintptr_t end = (vaddr + memsz + 0xFFF) & 0xFFFFffffFFFFf000UL;
+	if (!range_is_fixable(start, end) || filesz > memsz) return -EINVAL;
+	if (offset < (off_t)(vaddr - start)) return -EINVAL;
+
+	spin_lock(dir->lock);
+
+	if (!dir->mappings) {
+		dir->mappings = list_create("mmap regions", dir);
+	}
+
+	foreach(node, dir->mappings) {
+		mmap_region_t * other = node->value;
+		if (other->start < end && other->end > start) {
+			spin_unlock(dir->lock);
+			return -EINVAL;
+		}
+	}
+
+	mmap_region_t * region = region_create(start, end, prot, MAP_PRIVATE | MAP_FIXED, file, offset - (vaddr - start));
+	if (memsz > filesz) {
+		region->file_end = vaddr + filesz;
+	}
+	if ((file->flags & FS_PAGECACHE) && !(prot & PROT_WRITE) && !(region->offset & 0xFFF)) {
+		region->cached = 1;
+	}
+	region_insert(dir->mappings, region);
+
+	spin_unlock(dir->lock);
+	return 0;
+}
+
+/**
+ * @brief Remove mappings in a range of @p dir.
+ *
+ * Any part of the range that isn't mapped is ignored.
+ */
+long mmap_unmap(page_directory_t * dir, uintptr_t addr, size_t length) {
+	if ((addr & 0xFFF) || !length) return -EINVAL;
+	length = (length + 0xFFF) & 0xFFFFffffFFFFf000UL;
+	if (addr + length < addr) return -EINVAL;
+
+	spin_lock(dir->lock);
+	if (dir->mappings && region_unmap_range(dir, addr, addr + length)) {
+		mmu_invalidate_range(addr, addr + length);
+	}
+	spin_unlock(dir->lock);
+	return 0;
+}
+
+/**
+ * @brief Change the protection of mapped pages.
+ *
+ * The whole range must be mapped. Pages that have been touched are
+ * updated in place; pages still waiting on a copy-on-write stay
+ * read-only until they are copied.
+ *
+ * Revoking all access to pages that have already been faulted in
+ * is not supported, as there is no way to keep their frames while
+ * leaving them unmapped.
+ */
+long mmap_protect(page_directory_t * dir, uintptr_t addr, size_t length, int prot) {
+	if ((addr & 0xFFF) || !length) return -EINVAL;
+	length = (length + 0xFFF) & 0xFFFFffffFFFFf000UL;
+	uintptr_t end = addr + length;
+	if (end < addr) return -EINVAL;
+
+	spin_lock(dir->lock);
+
+	if (!dir->mappings) {
+		spin_unlock(dir->lock);
+		return -ENOMEM;
+	}
+
+	/* Check the range first so that failures leave everything as it was */
+	uintptr_t covered = addr;
+	foreach(node, dir->mappings) {
+		mmap_region_t * region = node->value;
+		if (region->end <= covered) continue;
+		if (region->start > covered || covered >= end) break;
+		if ((region->flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+			spin_unlock(dir->lock);
+			return -EACCES;
+		}
+		covered = region->end;
+	}
+	if (covered < end) {
+		spin_unlock(dir->lock);
+		return -ENOMEM;
+	}
+
+	if (prot == PROT_NONE) {
+		for (uintptr_t i = addr; i < end; i += 0x1000) {
+			union PML * page = mmu_get_page(i, 0);
+			if (page && page->bits.present) {
+				spin_unlock(dir->lock);
+				return -ENOTSUP;
+			}
+		}
+	}
+
+	int flush = 0;
+	node_t * node = dir->mappings->head;
+	while (node) {
+		mmap_region_t * region = node->value;
+		if (region->start >= end) break;
+		if (region->end <= addr) {
+			node = node->next;
+			continue;
+		}
+		if (region->start < addr) {
+			node = region_split(dir->mappings, node, addr);
+			region = node->value;
+		}
+		if (region->end > end) {
+			region_split(dir->mappings, node, end);
+		}
+
+		region->prot = prot;
+		for (uintptr_t i = region->start; i < region->end; i += 0x1000) {
+			union PML * page = mmu_get_page(i, 0);
+			if (!page || !page->bits.present) continue;
+			int writable = (prot & PROT_WRITE) && !page->bits.cow_pending;
+			if (page->bits.writable != writable) flush = 1;
+			page->bits.writable = writable;
+		}
+
+		node = node->next;
+	}
+
+	if (flush) mmu_invalidate_range(addr, end);
+
+	spin_unlock(dir->lock);
+	return 0;
+}
+
+/**
+ * @brief Resolve a page fault in a mapped region.
+ *
+ * Called by the page fault handler for faults in the user half of
+ * the address space, before copy-on-write handling.
+ *
+ * @param address  Faulting virtual address.
+ * @param err_code Page fault error code.
+ * @returns 1 if the page was filled in, -1 if the access is not permitted
+ *          by the mapping, and 0 if the fault is not for a populated mapping
+ *          and should be handled elsewhere.
+ */
+int mmap_page_fault(uintptr_t address, int err_code) {
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	if (!dir->mappings) return 0;
+
+	uintptr_t page_addr = address & 0xFFFFffffFFFFf000UL;
+
+	spin_lock(dir->lock);
+	mmap_region_t * region = region_find(dir, address);
+	if (!region) {
+		spin_unlock(dir->lock);
+		return 0;
+	}
+
+	if ((err_code & 0x2) ? !(region->prot & PROT_WRITE) : !(region->prot & (PROT_READ | PROT_WRITE | PROT_EXEC))) {
+		spin_unlock(dir->lock);
+		return -1;
+	}
+
+	if (err_code & 0x1) {
+		/* Permitted write to a present page; this is copy-on-write. */
+		spin_unlock(dir->lock);
+		return 0;
+	}
+
+	region->refcount++;
+	spin_unlock(dir->lock);
+
+	/* Fill the new frame without holding the lock, as reading the file may block. */
+	off_t file_offset = region->offset + (page_addr - region->start);
+	uintptr_t frame = 0;
+	int shared = 0;
+
+	if (region->cached && !(err_code & 0x2) && page_addr + 0x1000 <= region->file_end) {
+		frame = pagecache_frame(region->file, file_offset, NULL);
+		shared = !!frame;
+	}
+
+	if (!frame) {
+		frame = mmu_allocate_a_frame();
+		uint8_t * data = mmu_map_from_physical(frame << 12);
+		memset(data, 0, 0x1000);
+		if (region->file && page_addr < region->file_end) {
+			size_t size = region->file_end - page_addr;
+			read_fs(region->file, file_offset, size < 0x1000 ? size : 0x1000, data);
+		}
+	}
+
+	spin_lock(dir->lock);
+	union PML * page = mmu_get_page(page_addr, MMU_GET_MAKE);
+	if (page->bits.present || region_find(dir, page_addr) != region) {
+		/* Raced with another thread faulting the same page, or with munmap */
+		mmu_frame_unref(frame);
+	} else {
+		/* Shared pages stay read-only; writing to them after an mprotect makes a private copy. */
+		page->bits.page = frame;
+		mmu_frame_allocate(page, ((region->prot & PROT_WRITE) && !shared) ? MMU_FLAG_WRITABLE : 0);
+		page->bits.cow_pending = shared;
+		mmu_invalidate(page_addr);
+	}
+	region_release(region);
+	spin_unlock(dir->lock);
+
+	return 1;
+}
+
+/**
+ * @brief Copy the regions of @p from into a freshly cloned address space.
+ *
+ * The pages themselves are shared by mmu_clone.
+ */
+void mmap_clone(page_directory_t * from, page_directory_t * to) {
+	to->mappings = NULL;
+
+	spin_lock(from->lock);
+	if (from->mappings && from->mappings->length) {
+		to->mappings = list_create("mmap regions", to);
+		foreach(node, from->mappings) {
+			mmap_region_t * region = node->value;
+			list_insert(to->mappings, region_copy(region, region->start, region->end));
+		}
+	}
+	spin_unlock(from->lock);
+}
+
+/**
+ * @brief Release the regions of an address space that is being destroyed.
+ *
+ * The pages are freed along with the rest of the directory by mmu_free.
+ */
+void mmap_release_all(page_directory_t * dir) {
+	if (!dir->mappings) return;
+
+	node_t * node;
+	while ((node = list_pop(dir->mappings)) != NULL) {
+		region_release(node->value);
+		free(node);
+	}
+
+	free(dir->mappings);
+	dir->mappings = NULL;
+}
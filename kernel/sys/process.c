@@ -31,10 +31,12 @@
 #include <kernel/list.h>
 #include <kernel/mmu.h>
 #include <kernel/shm.h>
+#include <kernel/mmap.h>
 #include <kernel/signal.h>
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/syscall.h>
+#include <kernel/eventpoll.h>
 #include <sys/wait.h>
 #include <sys/signal_defs.h>
 
@@ -43,8 +45,6 @@
 
 tree_t * process_tree;  /* Stores the parent-child process relationships; the root of this graph is 'init'. */
 list_t * process_list;  /* Stores all existing processes. Mostly used for sanity checking or for places where iterating over all processes is useful. */
-list_t * process_queue; /* Scheduler ready queue. This the round-robin source. The head is the next process to run. */
-list_t * sleep_queue;   /* Ordered list of processes waiting to be awoken by timeouts. The head is the earliest thread to awaken. */
 list_t * reap_queue;    /* Processes that could not be cleaned up and need to be deleted. */
 
 struct ProcessorLocal processor_local_data[32] = {0};
@@ -53,11 +53,107 @@ int processor_count = 1;
 /* The following locks protect access to the process tree, scheduler queue,
  * sleeping, and the very special wait queue... */
 static spin_lock_t tree_lock = { 0 };
-static spin_lock_t process_queue_lock = { 0 };
 static spin_lock_t wait_lock_tmp = { 0 };
 static spin_lock_t sleep_lock = { 0 };
 static spin_lock_t reap_lock = { 0 };
 
+/**
+ * Timed wakeups live in a hashed timing wheel: a ring of slots, each
+ * covering TIMER_WHEEL_RESOLUTION subticks, holding a doubly-linked
+ * list of the timers that expire in that slot on any turn of the
+ * wheel. Timers store their full expiry time, so ones that are more
+ * than a turn away simply get skipped until their turn comes up.
+ * Arming and cancelling are constant time; each wakeup pass only
+ * looks at the slots that have elapsed since the last one.
+ * Protected by the sleep lock.
+ */
+#define TIMER_WHEEL_SLOTS      256
+#define TIMER_WHEEL_RESOLUTION 1000
+
+static sleeper_t timer_wheel[TIMER_WHEEL_SLOTS];
+static uint64_t timer_wheel_slot = 0; /* the next slot to check, in units of the resolution */
+static uint64_t timer_wheel_next = UINT64_MAX; /* no later than the earliest armed timer */
+
+/* Stands in as the owner of sleep_node for a process in a timed sleep. */
+static list_t timed_sleepers;
+
+/**
+ * @brief Arm a timer to go off at @p expires.
+ *
+ * Must be called with the sleep lock held, and the timer must not
+ * already be armed. A time that has already passed goes into the
+ * slot for the next wakeup pass.
+ */
+static void timer_arm(sleeper_t * timer, uint64_t expires) {
+	uint64_t slot = expires / TIMER_WHEEL_RESOLUTION;
+	if (slot < timer_wheel_slot) slot = timer_wheel_slot;
+
+	sleeper_t * head = &timer_wheel[slot % TIMER_WHEEL_SLOTS];
+	timer->expires = expires;
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+
+	if (expires < timer_wheel_next) {
+		timer_wheel_next = expires;
+		arch_timer_notify(expires);
+	}
+}
+
+/**
+ * @brief Find when the next armed timer expires.
+ *
+ * Walks the wheel from the current slot until it finds a slot with a
+ * timer due on this turn. If nothing is due within a whole turn, the
+ * end of the turn is returned so the wheel gets looked at again then.
+ * Must be called with the sleep lock held.
+ */
+static uint64_t timer_wheel_scan(void) {
+	int armed = 0;
+	for (uint64_t i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+		uint64_t slot_end = (timer_wheel_slot + i + 1) * TIMER_WHEEL_RESOLUTION;
+		sleeper_t * head = &timer_wheel[(timer_wheel_slot + i) % TIMER_WHEEL_SLOTS];
+		uint64_t earliest = UINT64_MAX;
+		for (sleeper_t * timer = head->next; timer != head; timer = timer->next) {
+			armed = 1;
+			if (timer->expires < earliest) earliest = timer->expires;
+		}
+		if (earliest < slot_end) return earliest;
+	}
+	return armed ? (timer_wheel_slot + TIMER_WHEEL_SLOTS) * TIMER_WHEEL_RESOLUTION : UINT64_MAX;
+}
+
+/**
+ * @brief Get the time of the next timed wakeup, in subticks.
+ *
+ * May be earlier than any armed timer if one was cancelled, but
+ * never later. Used to program the hardware timers.
+ */
+uint64_t timer_next_expiry(void) {
+	return timer_wheel_next;
+}
+
+/**
+ * @brief Disarm a timer; does nothing if it wasn't armed.
+ *
+ * Must be called with the sleep lock held.
+ */
+static void timer_cancel(sleeper_t * timer) {
+	if (!timer->next) return;
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+/* How much longer than the shortest queue a process's previous core may be
+ * before we give up on affinity and send it somewhere else. */
+#define SCHED_AFFINITY_SLACK 2
+
+/* Number of preemption ticks between load balancing passes. */
+#define SCHED_BALANCE_INTERVAL 4
+
 #define must_have_lock(lck) if (lck.owner != this_core->cpu_id+1) { printf("Failed lock check.\n"); arch_fatal(); }
 
 /**
@@ -86,6 +182,7 @@ static spin_lock_t reap_lock = { 0 };
  */
 void switch_next(void) {
 	this_core->previous_process = this_core->current_process;
+	this_core->halted = 0;
 
 	/* Get the next available process, discarded anything in the queue
 	 * marked as finished. */
@@ -94,7 +191,7 @@ void switch_next(void) {
 	} while (this_core->current_process->flags & PROC_FLAG_FINISHED);
 
 	/* Restore paging and task switch context. */
-	mmu_set_directory(this_core->current_process->thread.page_directory->directory);
+	process_load_directory(this_core->current_process->thread.page_directory);
 	arch_set_kernel_stack(this_core->current_process->image.stack);
 
 	if ((this_core->current_process->flags & PROC_FLAG_FINISHED) ||  (!this_core->current_process->signal_queue)) {
@@ -120,6 +217,9 @@ void switch_next(void) {
 	/* Mark the process as running and started. */
 	__sync_or_and_fetch(&this_core->current_process->flags, PROC_FLAG_STARTED);
 
+	/* Start a new timeslice, or stop ticking if we're going idle. */
+	arch_timer_rearm(1);
+
 	/* Jump to next */
 	arch_restore_context(&this_core->current_process->thread);
 	__builtin_unreachable();
@@ -200,8 +300,14 @@ void switch_task(uint8_t reschedule) {
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create("global process list",NULL);
-	process_queue = list_create("global scheduler queue",NULL);
-	sleep_queue = list_create("global timed sleep queue",NULL);
+	for (int i = 0; i < 32; ++i) {
+		processor_local_data[i].ready_queue = list_create("core scheduler queue",&processor_local_data[i]);
+		spin_init(processor_local_data[i].ready_lock);
+	}
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+		timer_wheel[i].next = &timer_wheel[i];
+		timer_wheel[i].prev = &timer_wheel[i];
+	}
 	reap_queue = list_create("processes awaiting later cleanup",NULL);
 
 	/* TODO: PID bitset? */
@@ -287,21 +393,41 @@ pid_t get_next_pid(void) {
 /**
  * @brief The idle task.
  *
- * Sits in a loop forever. Scheduled whenever there is nothing
- * else to do. Actually always enters from the top of the function
- * whenever scheduled, as we don't both to save its state.
+ * Halts until an interrupt arrives, then goes looking for something
+ * to run. Scheduled whenever there is nothing else to do. Actually
+ * always enters from the top of the function whenever scheduled, as
+ * we don't both to save its state.
+ *
+ * Idle cores don't get a periodic tick, so this can't rely on being
+ * preempted; a wakeup IPI is enough to get it to check the queues.
  */
 static void _kidle(void) {
 	while (1) {
-		arch_pause();
+		/* Other cores only send us a wakeup while this is set; see arch_wakeup_core */
+		this_core->halted = 1;
+		__sync_synchronize();
+		if (!this_core->ready_queue->length) arch_pause();
+		switch_next();
 	}
 }
 
-static void _kburn(void) {
-	while (1) {
-		arch_pause();
-		switch_next();
+/**
+ * @brief Switch this core to another address space.
+ *
+ * Keeps track of which cores have each directory loaded, for
+ * targeted TLB shootdowns. Passing NULL loads the kernel's own
+ * directory, which should be done before releasing the current
+ * one while it is still in use.
+ */
+void process_load_directory(page_directory_t * dir) {
+	page_directory_t * old = this_core->active_directory;
+	if (old != dir) {
+		uint32_t bit = 1U << this_core->cpu_id;
+		if (old) __sync_and_and_fetch(&old->cpu_mask, ~bit);
+		if (dir) __sync_or_and_fetch(&dir->cpu_mask, bit);
+		this_core->active_directory = dir;
 	}
+	mmu_set_directory(dir ? dir->directory : NULL);
 }
 
 /**
@@ -319,6 +445,7 @@ void process_release_directory(page_directory_t * dir) {
 	spin_lock(dir->lock);
 	dir->refcount--;
 	if (dir->refcount < 1) {
+		mmap_release_all(dir);
 		mmu_free(dir->directory);
 		free(dir);
 	} else {
@@ -326,7 +453,7 @@ void process_release_directory(page_directory_t * dir) {
 	}
 }
 
-process_t * spawn_kidle(int bsp) {
+process_t * spawn_kidle(void) {
 	process_t * idle = calloc(1,sizeof(process_t));
 	idle->id = -1;
 	idle->name = strdup("[kidle]");
@@ -337,7 +464,7 @@ process_t * spawn_kidle(int bsp) {
 		MMU_FLAG_KERNEL);
 
 	/* TODO arch_initialize_context(uintptr_t) ? */
-	idle->thread.context.ip = bsp ? (uintptr_t)&_kidle : (uintptr_t)&_kburn;
+	idle->thread.context.ip = (uintptr_t)&_kidle;
 	idle->thread.context.sp = idle->image.stack;
 	idle->thread.context.bp = idle->image.stack;
 
@@ -350,6 +477,8 @@ process_t * spawn_kidle(int bsp) {
 	idle->thread.page_directory = malloc(sizeof(page_directory_t));
 	idle->thread.page_directory->refcount = 1;
 	idle->thread.page_directory->directory = mmu_clone(this_core->current_pml);
+	idle->thread.page_directory->mappings = NULL;
+	idle->thread.page_directory->cpu_mask = 0;
 	spin_init(idle->thread.page_directory->lock);
 	return idle;
 }
@@ -404,11 +533,11 @@ process_t * spawn_init(void) {
 	init->sleep_node.next = NULL;
 	init->sleep_node.value = init;
 
-	init->timed_sleep_node = NULL;
-
 	init->thread.page_directory = malloc(sizeof(page_directory_t));
 	init->thread.page_directory->refcount = 1;
 	init->thread.page_directory->directory = this_core->current_pml;
+	init->thread.page_directory->mappings = NULL;
+	init->thread.page_directory->cpu_mask = 0;
 	spin_init(init->thread.page_directory->lock);
 	init->description = strdup("[init]");
 	list_insert(process_list, (void*)init);
@@ -572,6 +701,12 @@ void process_delete(process_t * proc) {
 	// FIXME bitset_clear(&pid_set, proc->id);
 	proc->tree_entry = NULL;
 
+	/* Timers are embedded in the process, so make sure none are left armed. */
+	spin_lock(sleep_lock);
+	timer_cancel(&proc->timed_sleep);
+	timer_cancel(&proc->timeout);
+	spin_unlock(sleep_lock);
+
 	shm_release_all(proc);
 	free(proc->shm_mappings);
 
@@ -588,6 +723,33 @@ void process_delete(process_t * proc) {
 	process_reap(proc);
 }
 
+/**
+ * @brief Choose which core's ready queue a process should join.
+ *
+ * A process that is still marked as running is being switched away from
+ * on the core that owns it, and must go back to that core. Otherwise we
+ * prefer the core the process last ran on to keep its caches warm, but
+ * only while that core's queue is not much longer than the shortest one.
+ * New processes go to the shortest queue, preferring the current core.
+ */
+static int sched_select_core(volatile process_t * proc) {
+	if (proc->flags & PROC_FLAG_RUNNING) return proc->owner;
+
+	int best = this_core->cpu_id;
+	for (int i = 0; i < processor_count; ++i) {
+		if (processor_local_data[i].ready_queue->length < processor_local_data[best].ready_queue->length) {
+			best = i;
+		}
+	}
+
+	if ((proc->flags & PROC_FLAG_STARTED) && proc->owner < processor_count &&
+		processor_local_data[proc->owner].ready_queue->length <= processor_local_data[best].ready_queue->length + SCHED_AFFINITY_SLACK) {
+		return proc->owner;
+	}
+
+	return best;
+}
+
 /**
  * @brief Place an available process in the ready queue.
  *
@@ -597,18 +759,16 @@ void process_delete(process_t * proc) {
  * owning queue before being moved.
  *
  * The process must not otherwise have been in a scheduling
- * queue before it is placed in the ready queue.
+ * queue before it is placed in a ready queue. See
+ * @ref sched_select_core for how the target core is chosen.
  */
 void make_process_ready(volatile process_t * proc) {
 	if (proc->sleep_node.owner != NULL) {
 		spin_lock(sleep_lock);
-		if (proc->sleep_node.owner == sleep_queue) {
-			/* The sleep queue is slightly special... */
-			if (proc->timed_sleep_node) {
-				list_delete(sleep_queue, proc->timed_sleep_node);
-				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
-			}
+		if (proc->sleep_node.owner == &timed_sleepers) {
+			/* Timed sleeps aren't in a list; cancel the timer instead. */
+			timer_cancel((sleeper_t *)&proc->timed_sleep);
+			proc->sleep_node.owner = NULL;
 			spin_unlock(sleep_lock);
 		} else {
 			/* This was blocked on a semaphore we can interrupt. */
@@ -619,39 +779,85 @@ void make_process_ready(volatile process_t * proc) {
 	}
 
 	if (proc->sched_node.owner) {
-		/* There's only one ready queue, so this means the process was already ready, which
-		 * is indicative of a bug somewhere as we shouldn't be added processes to the ready
-		 * queue multiple times. */
+		/* A process should only ever be in one ready queue at a time, so this
+		 * means the process was already ready, which is indicative of a bug
+		 * somewhere as we shouldn't be adding processes to the ready queues
+		 * multiple times. */
 		printf("Can't make process ready without removing it from owner list: %d\n", proc->id);
-		printf("  (This is a bug) Current owner list is %s@%p (ready queue is %p)\n",
-			proc->sched_node.owner->name, (void *)proc->sched_node.owner, (void*)process_queue);
+		printf("  (This is a bug) Current owner list is %s@%p\n",
+			proc->sched_node.owner->name, (void *)proc->sched_node.owner);
 		return;
 	}
 
-	spin_lock(process_queue_lock);
-	list_append(process_queue, (node_t*)&proc->sched_node);
-	spin_unlock(process_queue_lock);
+	struct ProcessorLocal * target = &processor_local_data[sched_select_core(proc)];
+	spin_lock(target->ready_lock);
+	list_append(target->ready_queue, (node_t*)&proc->sched_node);
+	spin_unlock(target->ready_lock);
 
-	arch_wakeup_others();
+	arch_wakeup_core(target->cpu_id);
 }
 
 /**
- * @brief Pop the next available process from the queue.
+ * @brief Take a process from the longest ready queue of another core.
  *
- * Gets the next available process from the round-robin scheduling
- * queue. If there is no process to run, the idle task is returned.
+ * Called when the current core has nothing left in its own queue.
+ * Processes that are still marked as running are in the middle of
+ * being switched away from on their owning core and are skipped.
+ *
+ * @returns the scheduler node of the stolen process, or NULL if there was nothing to steal.
+ */
+static node_t * sched_steal(void) {
+	int victim = -1;
+	size_t longest = 0;
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == this_core->cpu_id) continue;
+		if (processor_local_data[i].ready_queue->length > longest) {
+			longest = processor_local_data[i].ready_queue->length;
+			victim = i;
+		}
+	}
+
+	if (victim == -1) return NULL;
+
+	node_t * out = NULL;
+	spin_lock(processor_local_data[victim].ready_lock);
+	foreach(node, processor_local_data[victim].ready_queue) {
+		process_t * candidate = node->value;
+		if (!(candidate->flags & PROC_FLAG_RUNNING)) {
+			list_delete(processor_local_data[victim].ready_queue, node);
+			out = node;
+			break;
+		}
+	}
+	spin_unlock(processor_local_data[victim].ready_lock);
+
+	if (out) processor_local_data[this_core->cpu_id].steal_count++;
+	return out;
+}
+
+/**
+ * @brief Pop the next available process from this core's queue.
  *
- * TODO This needs more locking for SMP...
+ * Gets the next available process from the round-robin scheduling
+ * queue of the current core. If that queue is empty, we try to steal
+ * work from another core. If there is no process to run, the idle
+ * task is returned.
  */
 volatile process_t * next_ready_process(void) {
-	spin_lock(process_queue_lock);
+	struct ProcessorLocal * local = &processor_local_data[this_core->cpu_id];
+	node_t * np = NULL;
 
-	if (!process_queue->head) {
-		spin_unlock(process_queue_lock);
-		return this_core->kernel_idle_task;
+	spin_lock(local->ready_lock);
+	if (local->ready_queue->head) {
+		np = list_dequeue(local->ready_queue);
 	}
+	spin_unlock(local->ready_lock);
 
-	node_t * np = list_dequeue(process_queue);
+	if (!np) {
+		np = sched_steal();
+		if (!np) return this_core->kernel_idle_task;
+	}
 
 	if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
 		printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
@@ -660,21 +866,73 @@ volatile process_t * next_ready_process(void) {
 	volatile process_t * next = np->value;
 
 	if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
-		/* We pulled a process too soon, switch to idle for a bit so the
-		 * core that marked this process as ready can finish switching away from it. */
-		list_append(process_queue, (node_t*)&next->sched_node);
-		spin_unlock(process_queue_lock);
+		/* This should have been queued on the core that is still switching away
+		 * from it; send it back there and idle for a bit. */
+		struct ProcessorLocal * owner = &processor_local_data[next->owner];
+		spin_lock(owner->ready_lock);
+		list_append(owner->ready_queue, (node_t*)&next->sched_node);
+		spin_unlock(owner->ready_lock);
 		return this_core->kernel_idle_task;
 	}
 
-	spin_unlock(process_queue_lock);
-
 	__sync_or_and_fetch(&next->flags, PROC_FLAG_RUNNING);
 	next->owner = this_core->cpu_id;
 
 	return next;
 }
 
+/**
+ * @brief Even out the lengths of the per-core ready queues.
+ *
+ * Called from the preemption timer. Every few ticks, moves half of
+ * the difference between the longest and shortest queues from the
+ * tail of the longest queue to the shortest one. Stealing already
+ * covers cores that are completely idle; this catches cores that
+ * are busy but have a much shorter backlog than their neighbours.
+ */
+void process_balance_queues(void) {
+	static unsigned long ticks = 0;
+	if (processor_count < 2) return;
+	if (++ticks % SCHED_BALANCE_INTERVAL) return;
+
+	int busiest = 0, idlest = 0;
+	for (int i = 1; i < processor_count; ++i) {
+		if (processor_local_data[i].ready_queue->length > processor_local_data[busiest].ready_queue->length) busiest = i;
+		if (processor_local_data[i].ready_queue->length < processor_local_data[idlest].ready_queue->length) idlest = i;
+	}
+
+	size_t difference = processor_local_data[busiest].ready_queue->length - processor_local_data[idlest].ready_queue->length;
+	if (difference < 2) return;
+
+	list_t moving = {0};
+	size_t count = difference / 2;
+
+	spin_lock(processor_local_data[busiest].ready_lock);
+	node_t * node = processor_local_data[busiest].ready_queue->tail;
+	while (node && count) {
+		node_t * prev = node->prev;
+		process_t * candidate = node->value;
+		if (!(candidate->flags & PROC_FLAG_RUNNING)) {
+			list_delete(processor_local_data[busiest].ready_queue, node);
+			list_append(&moving, node);
+			count--;
+		}
+		node = prev;
+	}
+	spin_unlock(processor_local_data[busiest].ready_lock);
+
+	if (!moving.length) return;
+
+	spin_lock(processor_local_data[idlest].ready_lock);
+	while (moving.head) {
+		list_append(processor_local_data[idlest].ready_queue, list_dequeue(&moving));
+		processor_local_data[idlest].balance_count++;
+	}
+	spin_unlock(processor_local_data[idlest].ready_lock);
+
+	arch_wakeup_core(idlest);
+}
+
 /**
  * @brief Signal a semaphore.
  *
@@ -707,6 +965,29 @@ int wakeup_queue(list_t * queue) {
 	return awoken_processes;
 }
 
+/**
+ * @brief Signal a semaphore, waking at most @p count waiters.
+ *
+ * Same as @ref wakeup_queue, but processes beyond the first
+ * @p count stay in the queue. Waiters are awoken in the order
+ * they started waiting.
+ *
+ * @returns the number of processes removed from the queue
+ */
+int wakeup_queue_count(list_t * queue, int count) {
+	int awoken_processes = 0;
+	spin_lock(wait_lock_tmp);
+	while (queue->length > 0 && awoken_processes < count) {
+		node_t * node = list_dequeue(queue);
+		if (!(((process_t *)node->value)->flags & PROC_FLAG_FINISHED)) {
+			make_process_ready(node->value);
+		}
+		awoken_processes++;
+	}
+	spin_unlock(wait_lock_tmp);
+	return awoken_processes;
+}
+
 /**
  * @brief Signal a semaphore, exceptionally.
  *
@@ -783,33 +1064,45 @@ int process_alert_node_locked(process_t * process, void * value);
  * as timed out before the process is rescheduled.
  */
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
+	uint64_t now = (uint64_t)seconds * SUBTICKS_PER_TICK + subseconds;
+	uint64_t now_slot = now / TIMER_WHEEL_RESOLUTION;
+
 	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node_locked(proc->process,proc);
-			} else {
-				process_t * process = proc->process;
-				process->sleep_node.owner = NULL;
-				process->timed_sleep_node = NULL;
-				if (!process_is_ready(process)) {
-					spin_lock(wait_lock_tmp);
-					make_process_ready(process);
-					spin_unlock(wait_lock_tmp);
+
+	/* Look at every slot that has come up since the last pass, but
+	 * no more than once each if we've gone all the way around. */
+	uint64_t slots = now_slot - timer_wheel_slot + 1;
+	if (now_slot < timer_wheel_slot) slots = 0;
+	if (slots > TIMER_WHEEL_SLOTS) slots = TIMER_WHEEL_SLOTS;
+
+	for (uint64_t i = 0; i < slots; ++i) {
+		sleeper_t * head = &timer_wheel[(timer_wheel_slot + i) % TIMER_WHEEL_SLOTS];
+		sleeper_t * timer = head->next;
+		while (timer != head) {
+			sleeper_t * next = timer->next;
+			if (timer->expires <= now) {
+				timer_cancel(timer);
+				process_t * process = timer->process;
+				if (timer->is_fswait) {
+					timer->is_fswait = -1;
+					process_alert_node_locked(process, timer);
+				} else {
+					process->sleep_node.owner = NULL;
+					if (!process_is_ready(process)) {
+						spin_lock(wait_lock_tmp);
+						make_process_ready(process);
+						spin_unlock(wait_lock_tmp);
+					}
 				}
 			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
-			}
+			timer = next;
 		}
 	}
+
+	/* The current slot may still hold timers due later in it. */
+	if (now_slot > timer_wheel_slot) timer_wheel_slot = now_slot;
+	timer_wheel_next = timer_wheel_scan();
+
 	spin_unlock(sleep_lock);
 }
 
@@ -827,26 +1120,11 @@ void sleep_until(process_t * process, unsigned long seconds, unsigned long subse
 		/* Can't sleep, sleeping already */
 		return;
 	}
-	process->sleep_node.owner = sleep_queue;
-
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (!candidate) {
-			printf("null candidate?\n");
-			continue;
-		}
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+	process->sleep_node.owner = &timed_sleepers;
+
+	process->timed_sleep.process = process;
+	process->timed_sleep.is_fswait = 0;
+	timer_arm(&process->timed_sleep, (uint64_t)seconds * SUBTICKS_PER_TICK + subseconds);
 	spin_unlock(sleep_lock);
 }
 
@@ -889,7 +1167,7 @@ long process_move_fd(process_t * proc, long src, long dest) {
 
 void tasking_start(void) {
 	this_core->current_process = spawn_init();
-	this_core->kernel_idle_task = spawn_kidle(1);
+	this_core->kernel_idle_task = spawn_kidle();
 }
 
 static int wait_candidate(volatile process_t * parent, int pid, int options, volatile process_t * proc) {
@@ -978,21 +1256,11 @@ int process_timeout_sleep(process_t * process, int timeout) {
 	relative_time(0, timeout * 1000, &s, &ss);
 
 	spin_lock(sleep_lock);
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = s;
-	proc->end_subtick = ss;
-	proc->is_fswait = 1;
-	list_insert(((process_t *)process)->node_waits, proc);
-	process->timeout_node = list_insert_after(sleep_queue, before, proc);
+	timer_cancel(&process->timeout);
+	process->timeout.process = process;
+	process->timeout.is_fswait = 1;
+	list_insert(((process_t *)process)->node_waits, &process->timeout);
+	timer_arm(&process->timeout, (uint64_t)s * SUBTICKS_PER_TICK + ss);
 	spin_unlock(sleep_lock);
 
 	return 0;
@@ -1034,8 +1302,6 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 
 	if (timeout > 0) {
 		process_timeout_sleep(process, timeout);
-	} else {
-		process->timeout_node = NULL;
 	}
 
 	process->awoken_index = -1;
@@ -1055,15 +1321,7 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	free(process->node_waits);
 	process->node_waits = NULL;
 
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
-	}
-	process->timeout_node = NULL;
+	timer_cancel(&process->timeout);
 
 	spin_lock(wait_lock_tmp);
 	make_process_ready(process);
@@ -1083,12 +1341,23 @@ void process_awaken_signal(process_t * process) {
 	}
 }
 
+/**
+ * @brief Record that @p waiter was put on the alert list for @p value.
+ *
+ * selectwait implementations call this after adding @p waiter to their
+ * alert list, so that a process can tell which of the nodes it was
+ * waiting on woke it up.
+ */
+void process_add_node_wait(void * waiter, void * value) {
+	if (eventpoll_is_item(waiter)) return;
+	list_insert(((process_t *)waiter)->node_waits, value);
+}
+
 int process_alert_node_locked(process_t * process, void * value) {
 	must_have_lock(sleep_lock);
 
 	if (!is_valid_process(process)) {
-		printf("invalid process\n");
-		return 0;
+		return 0; /* Exited since it was put on the list. */
 	}
 
 	spin_lock(process->sched_lock);
@@ -1110,7 +1379,15 @@ int process_alert_node_locked(process_t * process, void * value) {
 	return -1;
 }
 
+/**
+ * @brief Let something on a node's alert list know the node is ready.
+ *
+ * Alert lists hold both processes sleeping in fswait and epoll
+ * interests, which stay registered between waits.
+ */
 int process_alert_node(process_t * process, void * value) {
+	if (eventpoll_alert(process)) return 0;
+
 	spin_lock(sleep_lock);
 	int result = process_alert_node_locked(process, value);
 	spin_unlock(sleep_lock);
@@ -1187,7 +1464,9 @@ pid_t fork(void) {
 	new_proc->thread.page_directory = malloc(sizeof(page_directory_t));
 	new_proc->thread.page_directory->refcount = 1;
 	new_proc->thread.page_directory->directory = directory;
+	new_proc->thread.page_directory->cpu_mask = 0;
 	spin_init(new_proc->thread.page_directory->lock);
+	mmap_clone(parent->thread.page_directory, new_proc->thread.page_directory);
 
 	struct regs r;
 	memcpy(&r, parent->syscall_registers, sizeof(struct regs));
@@ -1266,6 +1545,8 @@ process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * na
 	proc->thread.page_directory = malloc(sizeof(page_directory_t));
 	proc->thread.page_directory->refcount = 1;
 	proc->thread.page_directory->directory = mmu_clone(mmu_get_kernel_directory());
+	proc->thread.page_directory->mappings = NULL;
+	proc->thread.page_directory->cpu_mask = 0;
 	spin_init(proc->thread.page_directory->lock);
 
 	proc->image.stack       = (uintptr_t)valloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
@@ -4,6 +4,10 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/futex.h>
+#include <sys/uio.h>
 #include <syscall_nums.h>
 #include <kernel/printf.h>
 #include <kernel/process.h>
@@ -11,6 +15,8 @@
 #include <kernel/version.h>
 #include <kernel/pipe.h>
 #include <kernel/shm.h>
+#include <kernel/mmap.h>
+#include <kernel/futex.h>
 #include <kernel/mmu.h>
 #include <kernel/pty.h>
 #include <kernel/spinlock.h>
@@ -18,6 +24,9 @@
 #include <kernel/time.h>
 #include <kernel/syscall.h>
 #include <kernel/misc.h>
+#include <kernel/eventpoll.h>
+#include <kernel/ioring.h>
+#include <kernel/net/netif.h>
 
 static char   hostname[256];
 static size_t hostname_len = 0;
@@ -390,6 +399,147 @@ static long sys_read(int fd, char * ptr, unsigned long len) {
 	return -EBADF;
 }
 
+static long sys_pread(int fd, char * ptr, unsigned long len, off_t offset) {
+	if (FD_CHECK(fd)) {
+		PTR_VALIDATE(ptr);
+		fs_node_t * node = FD_ENTRY(fd);
+		if (!(FD_MODE(fd) & 01)) return -EACCES;
+		if ((node->flags & FS_PIPE) || (node->flags & FS_CHARDEVICE)) return -ESPIPE;
+		if (offset < 0) return -EINVAL;
+		return read_fs(node, offset, len, (uint8_t *)ptr);
+	}
+	return -EBADF;
+}
+
+static long sys_pwrite(int fd, char * ptr, unsigned long len, off_t offset) {
+	if (FD_CHECK(fd)) {
+		PTR_VALIDATE(ptr);
+		fs_node_t * node = FD_ENTRY(fd);
+		if (!(FD_MODE(fd) & 2)) return -EACCES;
+		if ((node->flags & FS_PIPE) || (node->flags & FS_CHARDEVICE)) return -ESPIPE;
+		if (offset < 0) return -EINVAL;
+		return write_fs(node, offset, len, (uint8_t *)ptr);
+	}
+	return -EBADF;
+}
+
+/**
+ * @brief Copy data between two descriptors inside the kernel.
+ *
+ * Reads from @p in_fd at @p offset if one is given, updating it and
+ * leaving the descriptor's own offset alone, and at the descriptor's
+ * offset otherwise. Works between any pair of files, pipes and sockets.
+ */
+static long sys_sendfile(int out_fd, int in_fd, off_t * offset, size_t count) {
+	if (!FD_CHECK(out_fd) || !FD_CHECK(in_fd)) return -EBADF;
+	if (!(FD_MODE(in_fd) & 01) || !(FD_MODE(out_fd) & 2)) return -EBADF;
+	PTR_VALIDATE(offset);
+
+	off_t in_offset = offset ? *offset : (off_t)FD_OFFSET(in_fd);
+	off_t out_offset = FD_OFFSET(out_fd);
+	if (in_offset < 0) return -EINVAL;
+
+	ssize_t out = splice_fs(FD_ENTRY(out_fd), &out_offset, FD_ENTRY(in_fd), &in_offset, count);
+	if (out > 0) {
+		FD_OFFSET(out_fd) = out_offset;
+		if (offset) *offset = in_offset;
+		else FD_OFFSET(in_fd) = in_offset;
+	}
+	return out;
+}
+
+/**
+ * @brief Copy an iovec array into the kernel and check what it points to.
+ *
+ * Only the copy is used afterwards, so another thread can't swap in
+ * different buffers once they have been checked.
+ *
+ * @returns 0 with @p out set to a copy for the caller to free, or an
+ *          error for sys_readv/sys_writev to return.
+ */
+static long iovec_copy(const struct iovec * iov, int iovcnt, struct iovec ** out) {
+	if (iovcnt < 0 || iovcnt > IOV_MAX) return -EINVAL;
+	PTR_VALIDATE(iov);
+	if (iovcnt && !iov) return -EFAULT;
+	if (iovcnt) PTR_VALIDATE((uintptr_t)iov + iovcnt * sizeof(struct iovec) - 1);
+
+	struct iovec * copy = malloc(sizeof(struct iovec) * (iovcnt ? iovcnt : 1));
+	memcpy(copy, iov, sizeof(struct iovec) * iovcnt);
+
+	for (int i = 0; i < iovcnt; ++i) {
+		if (!copy[i].iov_len) continue;
+		uintptr_t base = (uintptr_t)copy[i].iov_base;
+		uintptr_t last = base + copy[i].iov_len - 1;
+		if (last < base || ptr_validate((void *)base, __func__) || ptr_validate((void *)last, __func__)) {
+			free(copy);
+			return -EINVAL;
+		}
+	}
+
+	*out = copy;
+	return 0;
+}
+
+static long sys_readv(int fd, struct iovec * user_iov, int iovcnt) {
+	if (FD_CHECK(fd)) {
+		if (!(FD_MODE(fd) & 01)) return -EACCES;
+		struct iovec * iov;
+		long err = iovec_copy(user_iov, iovcnt, &iov);
+		if (err) return err;
+		fs_node_t * node = FD_ENTRY(fd);
+
+		long total = 0;
+		for (int i = 0; i < iovcnt; ++i) {
+			if (!iov[i].iov_len) continue;
+			ssize_t out = read_fs(node, FD_OFFSET(fd), iov[i].iov_len, iov[i].iov_base);
+			if (out < 0) {
+				if (!total) total = out;
+				break;
+			}
+			FD_OFFSET(fd) += out;
+			total += out;
+			/* A short read means there's nothing more to have right now */
+			if ((size_t)out < iov[i].iov_len) break;
+		}
+		free(iov);
+		return total;
+	}
+	return -EBADF;
+}
+
+static long sys_writev(int fd, struct iovec * user_iov, int iovcnt) {
+	if (FD_CHECK(fd)) {
+		if (!(FD_MODE(fd) & 2)) return -EACCES;
+		struct iovec * iov;
+		long err = iovec_copy(user_iov, iovcnt, &iov);
+		if (err) return err;
+		fs_node_t * node = FD_ENTRY(fd);
+
+		/* Sockets take the whole vector at once */
+		long total = net_sock_writev(node, iov, iovcnt);
+		if (total != -ENOTSOCK) {
+			free(iov);
+			return total;
+		}
+
+		total = 0;
+		for (int i = 0; i < iovcnt; ++i) {
+			if (!iov[i].iov_len) continue;
+			ssize_t out = write_fs(node, FD_OFFSET(fd), iov[i].iov_len, iov[i].iov_base);
+			if (out < 0) {
+				if (!total) total = out;
+				break;
+			}
+			FD_OFFSET(fd) += out;
+			total += out;
+			if ((size_t)out < iov[i].iov_len) break;
+		}
+		free(iov);
+		return total;
+	}
+	return -EBADF;
+}
+
 static long sys_ioctl(int fd, int request, void * argp) {
 	if (FD_CHECK(fd)) {
 		PTR_VALIDATE(argp);
@@ -413,6 +563,27 @@ static long sys_readdir(int fd, long index, struct dirent * entry) {
 	return -EBADF;
 }
 
+/**
+ * @brief Read as many directory entries as fit in @p size bytes.
+ *
+ * The file offset is the directory cursor, so reads carry on
+ * from where the last one stopped.
+ *
+ * @returns bytes written to @p entries, 0 at the end of the directory.
+ */
+static long sys_getdents(int fd, struct dirent * entries, size_t size) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	PTR_VALIDATE(entries);
+	size_t count = size / sizeof(struct dirent);
+	if (!count || !entries) return -EINVAL;
+
+	uint64_t cursor = FD_OFFSET(fd);
+	ssize_t n = getdents_fs(FD_ENTRY(fd), &cursor, entries, count);
+	if (n < 0) return n;
+	FD_OFFSET(fd) = cursor;
+	return n * sizeof(struct dirent);
+}
+
 static long sys_mkdir(char * path, uint64_t mode) {
 	return mkdir_fs(path, mode);
 }
@@ -752,6 +923,29 @@ static long sys_sleep(unsigned long seconds, unsigned long subseconds) {
 	return sys_sleepabs(s, ss);
 }
 
+static long sys_nanosleep(const struct timespec * req, struct timespec * rem) {
+	PTR_VALIDATE(req);
+	PTR_VALIDATE(rem);
+	if (!req) return -EFAULT;
+	if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) return -EINVAL;
+
+	unsigned long s, ss;
+	relative_time(req->tv_sec, (req->tv_nsec + 999) / 1000, &s, &ss);
+	if (!sys_sleepabs(s, ss)) return 0;
+
+	/* Woken early, probably by a signal */
+	if (rem) {
+		unsigned long now_s, now_ss;
+		relative_time(0, 0, &now_s, &now_ss);
+		uint64_t deadline = (uint64_t)s * SUBTICKS_PER_TICK + ss;
+		uint64_t now = (uint64_t)now_s * SUBTICKS_PER_TICK + now_ss;
+		uint64_t left = now < deadline ? deadline - now : 0;
+		rem->tv_sec  = left / SUBTICKS_PER_TICK;
+		rem->tv_nsec = (left % SUBTICKS_PER_TICK) * 1000;
+	}
+	return -EINTR;
+}
+
 static long sys_pipe(int pipes[2]) {
 	if (pipes && !PTR_INRANGE(pipes)) {
 		return -EFAULT;
@@ -836,6 +1030,66 @@ static long sys_fswait_multi(int c, int fds[], int timeout, int out[]) {
 	return result;
 }
 
+static long sys_epoll_create(int size) {
+	fs_node_t * node = eventpoll_create();
+	open_fs(node, 0);
+	int fd = process_append_fd((process_t *)this_core->current_process, node);
+	FD_MODE(fd) = 03;
+	return fd;
+}
+
+static long sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event * event) {
+	if (!FD_CHECK(epfd) || !FD_CHECK(fd)) return -EBADF;
+	if (!eventpoll_is_set(FD_ENTRY(epfd))) return -EINVAL;
+	if (op != EPOLL_CTL_DEL) {
+		PTR_VALIDATE(event);
+		if (!event) return -EFAULT;
+	}
+	return eventpoll_ctl(FD_ENTRY(epfd), op, fd, FD_ENTRY(fd), event);
+}
+
+static long sys_epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout) {
+	if (!FD_CHECK(epfd)) return -EBADF;
+	if (!eventpoll_is_set(FD_ENTRY(epfd))) return -EINVAL;
+	if (maxevents <= 0) return -EINVAL;
+	PTR_VALIDATE(events);
+	if (!events) return -EFAULT;
+	return eventpoll_wait(FD_ENTRY(epfd), events, maxevents, timeout);
+}
+
+static long sys_poll(struct pollfd * fds, nfds_t nfds, int timeout) {
+	if (nfds > 65536) return -EINVAL;
+	PTR_VALIDATE(fds);
+	if (nfds && !fds) return -EFAULT;
+
+	fs_node_t ** nodes = malloc(sizeof(fs_node_t *) * (nfds ? nfds : 1));
+	int invalid = 0;
+	for (nfds_t i = 0; i < nfds; ++i) {
+		fds[i].revents = 0;
+		nodes[i] = NULL;
+		if (fds[i].fd < 0) continue;
+		if (!FD_CHECK(fds[i].fd)) {
+			fds[i].revents = POLLNVAL;
+			invalid++;
+			continue;
+		}
+		nodes[i] = FD_ENTRY(fds[i].fd);
+	}
+
+	int result = eventpoll_poll(nodes, fds, nfds, invalid ? 0 : timeout);
+	free(nodes);
+	return result < 0 ? result : result + invalid;
+}
+
+static long sys_ioring_setup(unsigned int entries, struct ioring * ring) {
+	PTR_VALIDATE(ring);
+	return ioring_setup(entries, ring);
+}
+
+static long sys_ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete) {
+	return ioring_enter(fd, to_submit, min_complete);
+}
+
 static long sys_shm_obtain(char * path, size_t * size) {
 	PTR_VALIDATE(path);
 	PTR_VALIDATE(size);
@@ -847,6 +1101,41 @@ static long sys_shm_release(char * path) {
 	return shm_release(path);
 }
 
+static long sys_mmap(struct mmap_args * args) {
+	PTR_VALIDATE(args);
+	if (!args) return -EFAULT;
+	fs_node_t * file = NULL;
+	if (!(args->flags & MAP_ANONYMOUS)) {
+		if (!FD_CHECK(args->fd)) return -EBADF;
+		if (!(FD_MODE(args->fd) & 01)) return -EACCES;
+		file = FD_ENTRY(args->fd);
+		if (!(file->flags & FS_FILE)) return -ENODEV;
+	}
+	return mmap_map(this_core->current_process->thread.page_directory,
+		(uintptr_t)args->addr, args->length, args->prot, args->flags, file, args->offset);
+}
+
+static long sys_munmap(void * addr, size_t length) {
+	return mmap_unmap(this_core->current_process->thread.page_directory, (uintptr_t)addr, length);
+}
+
+static long sys_mprotect(void * addr, size_t length, int prot) {
+	return mmap_protect(this_core->current_process->thread.page_directory, (uintptr_t)addr, length, prot);
+}
+
+static long sys_futex(volatile int * uaddr, int op, int val) {
+	PTR_VALIDATE(uaddr);
+	if (!uaddr) return -EFAULT;
+	switch (op) {
+		case FUTEX_WAIT:
+			return futex_wait((uintptr_t)uaddr, val);
+		case FUTEX_WAKE:
+			return futex_wake((uintptr_t)uaddr, val);
+		default:
+			return -EINVAL;
+	}
+}
+
 static long sys_openpty(int * master, int * slave, char * name, void * _ign0, void * size) {
 	/* We require a place to put these when we are done. */
 	if (!master || !slave) return -EINVAL;
@@ -959,6 +1248,23 @@ static long (*syscalls[])() = {
 	[SYS_SIGNAL]       = sys_signal,
 	[SYS_KILL]         = sys_kill,
 	[SYS_REBOOT]       = sys_reboot,
+	[SYS_MMAP]         = sys_mmap,
+	[SYS_MUNMAP]       = sys_munmap,
+	[SYS_MPROTECT]     = sys_mprotect,
+	[SYS_FUTEX]        = sys_futex,
+	[SYS_NANOSLEEP]    = sys_nanosleep,
+	[SYS_PREAD]        = sys_pread,
+	[SYS_PWRITE]       = sys_pwrite,
+	[SYS_READV]        = sys_readv,
+	[SYS_WRITEV]       = sys_writev,
+	[SYS_SENDFILE]     = sys_sendfile,
+	[SYS_EPOLL_CREATE] = sys_epoll_create,
+	[SYS_EPOLL_CTL]    = sys_epoll_ctl,
+	[SYS_EPOLL_WAIT]   = sys_epoll_wait,
+	[SYS_POLL]         = sys_poll,
+	[SYS_GETDENTS]     = sys_getdents,
+	[SYS_IORING_SETUP] = sys_ioring_setup,
+	[SYS_IORING_ENTER] = sys_ioring_enter,
 
 	[SYS_SOCKET]       = net_socket,
 	[SYS_SETSOCKOPT]   = net_setsockopt,
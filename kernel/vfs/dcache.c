@@ -0,0 +1,224 @@
+/**
+ * @file  kernel/vfs/dcache.c
+ * @brief Directory entry cache.
+ *
+ * Remembers the results of finddir calls so that opening the same
+ * paths over and over doesn't have to ask the filesystem about every
+ * component every time. Entries are keyed on the directory a name
+ * was looked up in and the name itself, and names that weren't
+ * found are remembered too.
+ *
+ * Filesystems opt in by marking directories with FS_DCACHE. Only
+ * lookups in marked directories are cached, and a node that was
+ * found is only kept if it is marked as well, since the cached copy
+ * is handed out in place of whatever the filesystem would have built.
+ * A filesystem that changes its namespace, or the attributes of a
+ * marked node, must call dcache_invalidate().
+ *
+ * The cache holds a fixed number of entries; when it is full, the
+ * one that was used least recently makes way for the new one.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+
+#define DCACHE_BUCKETS 256
+#define DCACHE_ENTRIES 1024
+
+struct dcache_entry {
+	/* The directory, as identified by its filesystem */
+	finddir_type_t finddir;
+	void * device;
+	uint64_t inode;
+
+	char * name;
+	uint32_t hash;
+
+	/* What was found, or NULL if the name doesn't exist */
+	fs_node_t * node;
+
+	struct dcache_entry * chain;
+	struct dcache_entry * lru_prev;
+	struct dcache_entry * lru_next;
+};
+
+static spin_lock_t dcache_lock = { 0 };
+static struct dcache_entry * dcache_buckets[DCACHE_BUCKETS];
+static struct dcache_entry * lru_head = NULL; /* most recently used */
+static struct dcache_entry * lru_tail = NULL; /* next to be evicted */
+static unsigned long dcache_generation = 0;
+static struct dcache_stats dcache_counters = { 0 };
+
+static uint32_t dcache_hash(fs_node_t * dir, const char * name) {
+	uint32_t hash = 2166136261u;
+	for (const char * c = name; *c; ++c) {
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+	uintptr_t key = (uintptr_t)dir->device ^ (uintptr_t)dir->inode ^ ((uintptr_t)dir->finddir >> 4);
+	hash ^= (uint32_t)(key ^ (key >> 32));
+	return hash ^ (hash >> 16);
+}
+
+/**
+ * @brief Find the entry for @p name in @p dir.
+ *
+ * Must be called with the cache lock held.
+ */
+static struct dcache_entry * dcache_find(fs_node_t * dir, const char * name, uint32_t hash) {
+	for (struct dcache_entry * e = dcache_buckets[hash % DCACHE_BUCKETS]; e; e = e->chain) {
+		if (e->hash == hash && e->finddir == dir->finddir && e->device == dir->device &&
+			e->inode == dir->inode && !strcmp(e->name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void lru_unlink(struct dcache_entry * e) {
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else lru_head = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else lru_tail = e->lru_prev;
+}
+
+static void lru_push(struct dcache_entry * e) {
+	e->lru_prev = NULL;
+	e->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = e;
+	lru_head = e;
+	if (!lru_tail) lru_tail = e;
+}
+
+static void dcache_entry_free(struct dcache_entry * e) {
+	free(e->name);
+	if (e->node) free(e->node);
+	free(e);
+}
+
+/**
+ * @brief Drop the least recently used entry.
+ *
+ * Must be called with the cache lock held.
+ */
+static void dcache_evict(void) {
+	struct dcache_entry * e = lru_tail;
+	lru_unlink(e);
+
+	struct dcache_entry ** link = &dcache_buckets[e->hash % DCACHE_BUCKETS];
+	while (*link != e) link = &(*link)->chain;
+	*link = e->chain;
+
+	dcache_counters.entries--;
+	dcache_counters.evictions++;
+	dcache_entry_free(e);
+}
+
+/**
+ * @brief Look up @p name in the directory @p dir, using the cache.
+ *
+ * Behaves like finddir_fs: the result, if any, is a new node
+ * that belongs to the caller.
+ */
+fs_node_t * dcache_lookup(fs_node_t * dir, char * name) {
+	if (!(dir->flags & FS_DCACHE) || !dir->finddir) {
+		return finddir_fs(dir, name);
+	}
+
+	uint32_t hash = dcache_hash(dir, name);
+
+	spin_lock(dcache_lock);
+	struct dcache_entry * e = dcache_find(dir, name, hash);
+	if (e) {
+		lru_unlink(e);
+		lru_push(e);
+		fs_node_t * out = NULL;
+		if (e->node) {
+			dcache_counters.hits++;
+			out = malloc(sizeof(fs_node_t));
+			memcpy(out, e->node, sizeof(fs_node_t));
+		} else {
+			dcache_counters.negative_hits++;
+		}
+		spin_unlock(dcache_lock);
+		return out;
+	}
+	dcache_counters.misses++;
+	unsigned long generation = dcache_generation;
+	spin_unlock(dcache_lock);
+
+	fs_node_t * out = finddir_fs(dir, name);
+	if (out && !(out->flags & FS_DCACHE)) return out;
+
+	e = malloc(sizeof(struct dcache_entry));
+	e->finddir = dir->finddir;
+	e->device  = dir->device;
+	e->inode   = dir->inode;
+	e->name    = strdup(name);
+	e->hash    = hash;
+	e->node    = NULL;
+	if (out) {
+		e->node = malloc(sizeof(fs_node_t));
+		memcpy(e->node, out, sizeof(fs_node_t));
+	}
+
+	spin_lock(dcache_lock);
+	/* Don't keep what we found if the cache was invalidated while we were looking */
+	if (generation != dcache_generation || dcache_find(dir, name, hash)) {
+		spin_unlock(dcache_lock);
+		dcache_entry_free(e);
+		return out;
+	}
+
+	if (dcache_counters.entries >= DCACHE_ENTRIES) {
+		dcache_evict();
+	}
+
+	e->chain = dcache_buckets[hash % DCACHE_BUCKETS];
+	dcache_buckets[hash % DCACHE_BUCKETS] = e;
+	lru_push(e);
+	dcache_counters.entries++;
+	spin_unlock(dcache_lock);
+
+	return out;
+}
+
+/**
+ * @brief Forget everything in the cache.
+ *
+ * Called when a filesystem changes in a way that could make
+ * cached lookups wrong, and when something is mounted.
+ */
+void dcache_invalidate(void) {
+	spin_lock(dcache_lock);
+
+	struct dcache_entry * e = lru_head;
+	while (e) {
+		struct dcache_entry * next = e->lru_next;
+		dcache_entry_free(e);
+		e = next;
+	}
+
+	memset(dcache_buckets, 0, sizeof(dcache_buckets));
+	lru_head = NULL;
+	lru_tail = NULL;
+	dcache_generation++;
+	dcache_counters.entries = 0;
+	dcache_counters.invalidations++;
+
+	spin_unlock(dcache_lock);
+}
+
+void dcache_get_stats(struct dcache_stats * stats) {
+	spin_lock(dcache_lock);
+	memcpy(stats, &dcache_counters, sizeof(struct dcache_stats));
+	stats->capacity = DCACHE_ENTRIES;
+	spin_unlock(dcache_lock);
+}
@@ -0,0 +1,511 @@
+/**
+ * @file kernel/vfs/eventpoll.c
+ * @brief Persistent readiness interest sets (epoll).
+ *
+ * An eventpoll object holds a set of interests, each a node and the
+ * POLL* conditions wanted from it. An interest is put on its node's
+ * alert list once, when it is added, and stays there until the node
+ * alerts it; the alert moves it onto the object's ready list, and it
+ * is only put back on the node's alert list when a wait looks at it
+ * again. A wait therefore costs something for each interest that was
+ * alerted, not for each interest in the set, and returns everything
+ * that is ready in one go.
+ *
+ * Interests go on alert lists in place of a process, so alert lists
+ * can hold both; process_alert_node sends interests here, and
+ * process_add_node_wait knows not to treat them as processes.
+ *
+ * poll() is an eventpoll object that only lives as long as the call.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/hashmap.h>
+#include <kernel/list.h>
+#include <kernel/time.h>
+#include <kernel/eventpoll.h>
+
+struct eventpoll;
+
+struct eventpoll_item {
+	struct eventpoll * ep;
+	fs_node_t * node;  /* NULL once the node has been closed */
+	int key;           /* file descriptor, or index into a poll() array */
+	uint32_t events;
+	uint64_t data;
+	int armed;         /* on the node's alert list */
+	int ready;         /* on the ready list */
+};
+
+struct eventpoll {
+	spin_lock_t ctl_lock;   /* held by ctl and wait, never by alerts */
+	spin_lock_t lock;       /* protects the ready list and item flags */
+	int refs;
+	hashmap_t * items;      /* key -> item */
+	list_t * ready;
+
+	spin_lock_t alert_lock;
+	list_t * alert_waiters; /* processes sleeping on this object */
+};
+
+/*
+ * Every live interest, so an alert list entry can be told apart
+ * from a process, and every watched node, so closing one can drop
+ * the interests in it.
+ */
+static spin_lock_t eventpoll_lock = { 0 };
+static hashmap_t * eventpoll_items = NULL;
+static hashmap_t * eventpoll_nodes = NULL;
+static volatile int eventpoll_count = 0;
+
+static void eventpoll_close(fs_node_t * node);
+
+static void eventpoll_put(struct eventpoll * ep) {
+	if (__sync_sub_and_fetch(&ep->refs, 1)) return;
+	hashmap_free(ep->items);
+	free(ep->items);
+	list_free(ep->ready);
+	free(ep->ready);
+	list_free(ep->alert_waiters);
+	free(ep->alert_waiters);
+	free(ep);
+}
+
+static void eventpoll_alert_waiters(struct eventpoll * ep) {
+	spin_lock(ep->alert_lock);
+	while (ep->alert_waiters->head) {
+		node_t * node = list_dequeue(ep->alert_waiters);
+		process_t * p = node->value;
+		free(node);
+		spin_unlock(ep->alert_lock);
+
+		process_alert_node(p, ep);
+
+		spin_lock(ep->alert_lock);
+	}
+	spin_unlock(ep->alert_lock);
+}
+
+int eventpoll_is_item(void * waiter) {
+	if (!eventpoll_count) return 0;
+	spin_lock(eventpoll_lock);
+	int out = hashmap_has(eventpoll_items, waiter);
+	spin_unlock(eventpoll_lock);
+	return out;
+}
+
+/**
+ * @brief Called for every alert list entry when its node is ready.
+ *
+ * @returns 1 if @p waiter was an interest, 0 if it should be
+ *          treated as a process.
+ */
+int eventpoll_alert(void * waiter) {
+	if (!eventpoll_count) return 0;
+
+	spin_lock(eventpoll_lock);
+	struct eventpoll_item * item = hashmap_get(eventpoll_items, waiter);
+	if (!item) {
+		spin_unlock(eventpoll_lock);
+		return 0;
+	}
+
+	struct eventpoll * ep = item->ep;
+	spin_lock(ep->lock);
+	item->armed = 0;
+	if (!item->ready) {
+		item->ready = 1;
+		list_insert(ep->ready, item);
+	}
+	spin_unlock(ep->lock);
+	__sync_fetch_and_add(&ep->refs, 1);
+	spin_unlock(eventpoll_lock);
+
+	eventpoll_alert_waiters(ep);
+	eventpoll_put(ep);
+	return 1;
+}
+
+static void eventpoll_register(struct eventpoll_item * item) {
+	spin_lock(eventpoll_lock);
+	if (!eventpoll_items) {
+		eventpoll_items = hashmap_create_int(1021);
+		eventpoll_nodes = hashmap_create_int(1021);
+	}
+	hashmap_set(eventpoll_items, item, item);
+	list_t * watching = hashmap_get(eventpoll_nodes, item->node);
+	if (!watching) {
+		watching = list_create("eventpoll node interests", item->node);
+		hashmap_set(eventpoll_nodes, item->node, watching);
+	}
+	list_insert(watching, item);
+	eventpoll_count++;
+	spin_unlock(eventpoll_lock);
+}
+
+/**
+ * @brief Take @p item out of everything and free it.
+ *
+ * It is taken off its node's alert list if the node knows how; if it
+ * is still on one, the entry is ignored when it is alerted, as it is
+ * no longer in eventpoll_items.
+ */
+static void eventpoll_unregister(struct eventpoll_item * item) {
+	struct eventpoll * ep = item->ep;
+
+	/* Not under eventpoll_lock: nodes take their own locks to alert us */
+	spin_lock(ep->lock);
+	fs_node_t * armed_on = item->armed ? item->node : NULL;
+	spin_unlock(ep->lock);
+	if (armed_on) pollunwait_fs(armed_on, item);
+
+	spin_lock(eventpoll_lock);
+	hashmap_remove(eventpoll_items, item);
+	if (item->node) {
+		list_t * watching = hashmap_get(eventpoll_nodes, item->node);
+		node_t * n = list_find(watching, item);
+		list_delete(watching, n);
+		free(n);
+		if (!watching->length) {
+			hashmap_remove(eventpoll_nodes, item->node);
+			free(watching);
+		}
+	}
+	eventpoll_count--;
+
+	spin_lock(ep->lock);
+	if (item->ready) {
+		node_t * n = list_find(ep->ready, item);
+		list_delete(ep->ready, n);
+		free(n);
+	}
+	spin_unlock(ep->lock);
+	spin_unlock(eventpoll_lock);
+
+	free(item);
+}
+
+/**
+ * @brief Drop the node from any interests in it; it's being freed.
+ *
+ * Called by close_fs. The interests themselves stay in their sets
+ * until they are removed or the set is closed, as that's where
+ * their memory belongs, but they will never be reported again.
+ */
+void eventpoll_forget(fs_node_t * node) {
+	if (!eventpoll_count) return;
+
+	spin_lock(eventpoll_lock);
+	list_t * watching = hashmap_remove(eventpoll_nodes, node);
+	if (watching) {
+		foreach(n, watching) {
+			struct eventpoll_item * item = n->value;
+			spin_lock(item->ep->lock);
+			item->node = NULL;
+			spin_unlock(item->ep->lock);
+		}
+		list_free(watching);
+		free(watching);
+	}
+	spin_unlock(eventpoll_lock);
+}
+
+/**
+ * @brief Put @p item on its node's alert list if it isn't there,
+ *        and work out what it should report right now.
+ *
+ * Arming before checking means a change after the check can't be
+ * missed: it will alert the item.
+ */
+static int eventpoll_check(struct eventpoll * ep, struct eventpoll_item * item) {
+	spin_lock(ep->lock);
+	fs_node_t * node = item->node;
+	int arm = node && !item->armed;
+	if (arm) item->armed = 1;
+	spin_unlock(ep->lock);
+
+	if (!node) return 0;
+	if (arm) pollwait_fs(node, item, item->events);
+
+	return pollcheck_fs(node) & (item->events | POLLERR | POLLHUP);
+}
+
+static void eventpoll_make_ready(struct eventpoll * ep, struct eventpoll_item * item) {
+	spin_lock(ep->lock);
+	if (!item->ready) {
+		item->ready = 1;
+		list_insert(ep->ready, item);
+	}
+	spin_unlock(ep->lock);
+}
+
+/**
+ * @brief Collect up to @p maxevents ready interests into @p events.
+ *
+ * Everything on the ready list is checked again, as being alerted
+ * only means something changed. Level-triggered interests that are
+ * still ready go back on the list for next time; edge-triggered ones
+ * wait for their next alert.
+ */
+static int eventpoll_harvest(struct eventpoll * ep, struct epoll_event * events, int maxevents) {
+	int count = 0;
+
+	spin_lock(ep->ctl_lock);
+	spin_lock(ep->lock);
+	size_t pending = ep->ready->length;
+	spin_unlock(ep->lock);
+
+	while (pending-- && count < maxevents) {
+		spin_lock(ep->lock);
+		node_t * n = list_dequeue(ep->ready);
+		if (!n) {
+			spin_unlock(ep->lock);
+			break;
+		}
+		struct eventpoll_item * item = n->value;
+		item->ready = 0;
+		spin_unlock(ep->lock);
+		free(n);
+
+		int revents = eventpoll_check(ep, item);
+		if (!revents) continue;
+
+		events[count].events = revents;
+		events[count].data.u64 = item->data;
+		count++;
+
+		if (item->events & EPOLLONESHOT) {
+			item->events = 0;
+		} else if (!(item->events & EPOLLET)) {
+			eventpoll_make_ready(ep, item);
+		}
+	}
+	spin_unlock(ep->ctl_lock);
+
+	return count;
+}
+
+static int eventpoll_add(struct eventpoll * ep, int key, fs_node_t * target, struct epoll_event * event) {
+	struct eventpoll_item * item = hashmap_get(ep->items, (void*)(intptr_t)key);
+	if (item) {
+		if (item->node) return -EEXIST;
+		/* The file this was for is gone, and the descriptor was reused. */
+		eventpoll_unregister(item);
+	}
+
+	item = malloc(sizeof(struct eventpoll_item));
+	item->ep = ep;
+	item->node = target;
+	item->key = key;
+	item->events = event->events;
+	item->data = event->data.u64;
+	item->armed = 0;
+	item->ready = 0;
+
+	hashmap_set(ep->items, (void*)(intptr_t)key, item);
+	eventpoll_register(item);
+
+	if (eventpoll_check(ep, item)) {
+		eventpoll_make_ready(ep, item);
+		eventpoll_alert_waiters(ep);
+	}
+
+	return 0;
+}
+
+int eventpoll_ctl(fs_node_t * epnode, int op, int key, fs_node_t * target, struct epoll_event * event) {
+	struct eventpoll * ep = epnode->device;
+	int out = 0;
+
+	if (eventpoll_is_set(target)) {
+		/* Sets inside sets could be made to contain themselves. */
+		return -EINVAL;
+	}
+
+	spin_lock(ep->ctl_lock);
+	struct eventpoll_item * item = hashmap_get(ep->items, (void*)(intptr_t)key);
+	switch (op) {
+		case EPOLL_CTL_ADD:
+			out = eventpoll_add(ep, key, target, event);
+			break;
+		case EPOLL_CTL_DEL:
+			if (!item || item->node != target) {
+				out = -ENOENT;
+				break;
+			}
+			hashmap_remove(ep->items, (void*)(intptr_t)key);
+			eventpoll_unregister(item);
+			break;
+		case EPOLL_CTL_MOD:
+			if (!item || item->node != target) {
+				out = -ENOENT;
+				break;
+			}
+			item->events = event->events;
+			item->data = event->data.u64;
+			if (eventpoll_check(ep, item)) {
+				eventpoll_make_ready(ep, item);
+				eventpoll_alert_waiters(ep);
+			}
+			break;
+		default:
+			out = -EINVAL;
+			break;
+	}
+	spin_unlock(ep->ctl_lock);
+
+	return out;
+}
+
+/**
+ * @brief Wait up to @p timeout milliseconds for something in the set
+ *        to be ready, and report up to @p maxevents things that are.
+ *
+ * @returns how many were reported, 0 on timeout, or -EINTR.
+ */
+int eventpoll_wait(fs_node_t * epnode, struct epoll_event * events, int maxevents, int timeout) {
+	struct eventpoll * ep = epnode->device;
+	unsigned long s, ss;
+	if (timeout > 0) relative_time(0, (unsigned long)timeout * 1000, &s, &ss);
+
+	fs_node_t * nodes[] = { epnode, NULL };
+
+	while (1) {
+		int count = eventpoll_harvest(ep, events, maxevents);
+		if (count || timeout == 0) return count;
+
+		int wait = -1;
+		if (timeout > 0) {
+			/* Being alerted about something that turned out not to be ready doesn't restart the clock */
+			unsigned long ns, nss;
+			relative_time(0, 0, &ns, &nss);
+			if (ns > s || (ns == s && nss >= ss)) return 0;
+			wait = ((s - ns) * 1000000 + ss - nss) / 1000;
+			if (!wait) wait = 1;
+		}
+
+		int result = process_wait_nodes((process_t *)this_core->current_process, nodes, wait);
+		if (result == -1) return -EINTR;
+		if (result == 1) return eventpoll_harvest(ep, events, maxevents);
+	}
+}
+
+/**
+ * @brief poll(), as a set that only lasts as long as the call.
+ *
+ * @param nodes What each of @p fds refers to, or NULL to skip it.
+ * @returns how many entries in @p fds have revents set, 0 on timeout,
+ *          or -EINTR.
+ */
+int eventpoll_poll(fs_node_t ** nodes, struct pollfd * fds, int nfds, int timeout) {
+	fs_node_t * epnode = eventpoll_create();
+	struct eventpoll * ep = epnode->device;
+	open_fs(epnode, 0);
+
+	spin_lock(ep->ctl_lock);
+	for (int i = 0; i < nfds; ++i) {
+		if (!nodes[i]) continue;
+		struct epoll_event event = { .events = (unsigned short)fds[i].events, .data.u64 = i };
+		eventpoll_add(ep, i, nodes[i], &event);
+	}
+	spin_unlock(ep->ctl_lock);
+
+	struct epoll_event * events = malloc(sizeof(struct epoll_event) * (nfds ? nfds : 1));
+	int count = eventpoll_wait(epnode, events, nfds, timeout);
+	for (int i = 0; i < count; ++i) {
+		fds[events[i].data.u64].revents = events[i].events;
+	}
+	free(events);
+
+	close_fs(epnode);
+	return count;
+}
+
+static int eventpoll_selectcheck(fs_node_t * node) {
+	struct eventpoll * ep = node->device;
+	return ep->ready->length ? 0 : 1;
+}
+
+static int eventpoll_selectwait(fs_node_t * node, void * process) {
+	struct eventpoll * ep = node->device;
+
+	spin_lock(ep->alert_lock);
+	if (!list_find(ep->alert_waiters, process)) {
+		list_insert(ep->alert_waiters, process);
+	}
+	spin_unlock(ep->alert_lock);
+	process_add_node_wait(process, ep);
+
+	return 0;
+}
+
+static void eventpoll_pollunwait(fs_node_t * node, void * waiter) {
+	struct eventpoll * ep = node->device;
+
+	spin_lock(ep->alert_lock);
+	node_t * n = list_find(ep->alert_waiters, waiter);
+	if (n) {
+		list_delete(ep->alert_waiters, n);
+		free(n);
+	}
+	spin_unlock(ep->alert_lock);
+}
+
+static int eventpoll_pollcheck(fs_node_t * node) {
+	return eventpoll_selectcheck(node) ? 0 : POLLIN;
+}
+
+static void eventpoll_close(fs_node_t * node) {
+	struct eventpoll * ep = node->device;
+
+	spin_lock(ep->ctl_lock);
+	list_t * items = hashmap_values(ep->items);
+	foreach(n, items) {
+		struct eventpoll_item * item = n->value;
+		hashmap_remove(ep->items, (void*)(intptr_t)item->key);
+		eventpoll_unregister(item);
+	}
+	list_free(items);
+	free(items);
+	spin_unlock(ep->ctl_lock);
+
+	eventpoll_put(ep);
+}
+
+int eventpoll_is_set(fs_node_t * node) {
+	return node->close == eventpoll_close;
+}
+
+fs_node_t * eventpoll_create(void) {
+	struct eventpoll * ep = malloc(sizeof(struct eventpoll));
+	spin_init(ep->ctl_lock);
+	spin_init(ep->lock);
+	spin_init(ep->alert_lock);
+	ep->refs = 1;
+	ep->items = hashmap_create_int(64);
+	ep->ready = list_create("eventpoll ready", ep);
+	ep->alert_waiters = list_create("eventpoll alert waiters", ep);
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0, sizeof(fs_node_t));
+	snprintf(fnode->name, 100, "[eventpoll]");
+	fnode->mask = 0600;
+	fnode->flags = FS_PIPE;
+	fnode->device = ep;
+	fnode->close = eventpoll_close;
+	fnode->selectcheck = eventpoll_selectcheck;
+	fnode->selectwait = eventpoll_selectwait;
+	fnode->pollcheck = eventpoll_pollcheck;
+	fnode->pollunwait = eventpoll_pollunwait;
+
+	return fnode;
+}
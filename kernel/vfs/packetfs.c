@@ -277,6 +277,10 @@ static int wait_server(fs_node_t * node, void * process) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
 	return selectwait_fs(p->server_pipe, process);
 }
+static void unwait_server(fs_node_t * node, void * waiter) {
+	pex_ex_t * p = (pex_ex_t *)node->device;
+	pollunwait_fs(p->server_pipe, waiter);
+}
 static int check_server(fs_node_t * node) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
 	return selectcheck_fs(p->server_pipe);
@@ -286,6 +290,10 @@ static int wait_client(fs_node_t * node, void * process) {
 	pex_client_t * c = (pex_client_t *)node->inode;
 	return selectwait_fs(c->pipe, process);
 }
+static void unwait_client(fs_node_t * node, void * waiter) {
+	pex_client_t * c = (pex_client_t *)node->inode;
+	pollunwait_fs(c->pipe, waiter);
+}
 static int check_client(fs_node_t * node) {
 	pex_client_t * c = (pex_client_t *)node->inode;
 	return selectcheck_fs(c->pipe);
@@ -305,6 +313,7 @@ static void open_pex(fs_node_t * node, unsigned int flags) {
 		node->ioctl  = ioctl_server;
 		node->selectcheck = check_server;
 		node->selectwait  = wait_server;
+		node->pollunwait  = unwait_server;
 		debug_print(INFO, "[pex] Server launched: %s", t->name);
 		debug_print(INFO, "fs_node = %p", (void*)node);
 	} else if (!(flags & O_CREAT)) {
@@ -318,6 +327,7 @@ static void open_pex(fs_node_t * node, unsigned int flags) {
 
 		node->selectcheck = check_client;
 		node->selectwait  = wait_client;
+		node->pollunwait  = unwait_client;
 
 		list_insert(t->clients, client);
 
@@ -0,0 +1,561 @@
+/**
+ * @file  kernel/vfs/pagecache.c
+ * @brief Page cache for file contents.
+ *
+ * Keeps recently used pages of files in memory so that reading the
+ * same file again - a library every process links against, a font
+ * every application loads, a binary that is run over and over -
+ * doesn't need to go back to the filesystem. The same frames back
+ * read-only file mappings, so processes mapping a file share them.
+ *
+ * Filesystems opt in by marking file nodes with FS_PAGECACHE; reads
+ * and writes of those nodes through read_fs and write_fs come here.
+ * Pages are keyed on the device and inode of the node, which must
+ * identify the file for as long as it exists. Writes go straight to
+ * the filesystem and drop the pages they overlap; a filesystem that
+ * frees or truncates a file must call pagecache_invalidate.
+ *
+ * Sequential readers get pages ahead of where they are reading, in
+ * a window that grows as long as they keep reading in order.
+ *
+ * The cache is limited to a quarter of memory, and gives up its
+ * least recently used pages when it is full or when free memory
+ * runs low. The frame allocator also calls pagecache_reclaim when
+ * it is running out of frames; for that reason, nothing here
+ * allocates memory with the cache lock held.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/pagecache.h>
+
+#define FILE_BUCKETS 256
+#define PAGE_BUCKETS 4096
+
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 32
+
+/* Pages dropped at a time when memory is low */
+#define RECLAIM_BATCH 16
+
+/* Writes covering more pages than this scan the whole file */
+#define INVALIDATE_LOOKUPS 16
+
+#define MIN(l,r) ((l) < (r) ? (l) : (r))
+#define MAX(l,r) ((l) > (r) ? (l) : (r))
+
+struct pagecache_page;
+
+struct pagecache_file {
+	void * device;
+	uint64_t inode;
+	unsigned long generation; /* Changes whenever pages are invalidated */
+	struct pagecache_page * pages;
+	struct pagecache_page * partial; /* The cached page holding the end of the file, if any */
+
+	/* Read-ahead state */
+	off_t last_end;   /* Where the last read finished */
+	uint64_t ra_next; /* First page that hasn't been read ahead */
+	size_t window;    /* Pages to read ahead of the next read */
+
+	struct pagecache_file * chain;
+};
+
+struct pagecache_page {
+	struct pagecache_file * file;
+	uint64_t index;
+	uintptr_t frame;  /* Holds a reference of its own */
+	size_t valid;     /* Bytes of the page that came from the file; the rest is zero */
+
+	struct pagecache_page * chain;
+	struct pagecache_page * lru_prev;
+	struct pagecache_page * lru_next;
+	struct pagecache_page * file_prev;
+	struct pagecache_page * file_next;
+};
+
+static spin_lock_t pagecache_lock = { 0 };
+static struct pagecache_file * file_buckets[FILE_BUCKETS];
+static struct pagecache_page * page_buckets[PAGE_BUCKETS];
+static struct pagecache_page * lru_head = NULL; /* most recently used */
+static struct pagecache_page * lru_tail = NULL; /* next to be evicted */
+static struct pagecache_page * dead_pages = NULL; /* evicted, waiting to be freed */
+static unsigned long pagecache_generation = 0;
+static struct pagecache_stats pagecache_counters = { 0 };
+
+static inline size_t file_bucket(void * device, uint64_t inode) {
+	uintptr_t hash = ((uintptr_t)device >> 4) ^ (inode * 0x9E3779B1UL);
+	return (hash ^ (hash >> 17)) % FILE_BUCKETS;
+}
+
+static inline size_t page_bucket(struct pagecache_file * file, uint64_t index) {
+	uintptr_t hash = ((uintptr_t)file >> 5) + index * 0x9E3779B1UL;
+	return (hash ^ (hash >> 15)) % PAGE_BUCKETS;
+}
+
+/* The functions below must be called with the cache lock held. */
+
+static struct pagecache_file * file_find(void * device, uint64_t inode) {
+	for (struct pagecache_file * file = file_buckets[file_bucket(device, inode)]; file; file = file->chain) {
+		if (file->device == device && file->inode == inode) return file;
+	}
+	return NULL;
+}
+
+static struct pagecache_page * page_find(fs_node_t * node, uint64_t index) {
+	struct pagecache_file * file = file_find(node->device, node->inode);
+	if (!file) return NULL;
+	for (struct pagecache_page * page = page_buckets[page_bucket(file, index)]; page; page = page->chain) {
+		if (page->file == file && page->index == index) return page;
+	}
+	return NULL;
+}
+
+static void lru_unlink(struct pagecache_page * page) {
+	if (page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+	else lru_head = page->lru_next;
+	if (page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+	else lru_tail = page->lru_prev;
+}
+
+static void lru_push(struct pagecache_page * page) {
+	page->lru_prev = NULL;
+	page->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = page;
+	lru_head = page;
+	if (!lru_tail) lru_tail = page;
+}
+
+/**
+ * @brief Take a page out of the cache and release its frame.
+ *
+ * The page itself goes on the dead list, as this may be called
+ * from the frame allocator where the heap can't be used.
+ */
+static void page_remove(struct pagecache_page * page) {
+	struct pagecache_page ** link = &page_buckets[page_bucket(page->file, page->index)];
+	while (*link != page) link = &(*link)->chain;
+	*link = page->chain;
+
+	lru_unlink(page);
+
+	if (page->file_prev) page->file_prev->file_next = page->file_next;
+	else page->file->pages = page->file_next;
+	if (page->file_next) page->file_next->file_prev = page->file_prev;
+	if (page->file->partial == page) page->file->partial = NULL;
+
+	mmu_frame_unref(page->frame);
+	pagecache_counters.pages--;
+
+	page->chain = dead_pages;
+	dead_pages = page;
+}
+
+static int memory_low(void) {
+	size_t total = mmu_total_memory();
+	return total - mmu_used_memory() < total / 32;
+}
+
+/* The functions below must be called without the cache lock held. */
+
+static void pagecache_free_dead(void) {
+	spin_lock(pagecache_lock);
+	struct pagecache_page * page = dead_pages;
+	dead_pages = NULL;
+	spin_unlock(pagecache_lock);
+
+	while (page) {
+		struct pagecache_page * next = page->chain;
+		free(page);
+		page = next;
+	}
+}
+
+/**
+ * @brief Start tracking pages for @p node.
+ *
+ * @returns the file's current generation; pages read from the file
+ *          after this are only cached if it hasn't changed since.
+ */
+static unsigned long file_acquire(fs_node_t * node) {
+	spin_lock(pagecache_lock);
+	struct pagecache_file * file = file_find(node->device, node->inode);
+	if (file) {
+		unsigned long generation = file->generation;
+		spin_unlock(pagecache_lock);
+		return generation;
+	}
+	spin_unlock(pagecache_lock);
+
+	struct pagecache_file * new_file = malloc(sizeof(struct pagecache_file));
+	memset(new_file, 0, sizeof(struct pagecache_file));
+	new_file->device = node->device;
+	new_file->inode  = node->inode;
+
+	spin_lock(pagecache_lock);
+	file = file_find(node->device, node->inode);
+	if (!file) {
+		size_t bucket = file_bucket(node->device, node->inode);
+		new_file->generation = ++pagecache_generation;
+		new_file->chain = file_buckets[bucket];
+		file_buckets[bucket] = new_file;
+		file = new_file;
+		new_file = NULL;
+	}
+	unsigned long generation = file->generation;
+	spin_unlock(pagecache_lock);
+
+	if (new_file) free(new_file);
+	return generation;
+}
+
+/**
+ * @brief Read a page of @p node into a new frame.
+ *
+ * @returns how many bytes came from the file, 0 past the end of
+ *          the file, or a negative error code. Only if it's positive
+ *          does @p frame_out hold a frame.
+ */
+static ssize_t page_fill(fs_node_t * node, uint64_t index, uintptr_t * frame_out) {
+	uintptr_t frame = mmu_allocate_a_frame();
+	uint8_t * data = mmu_map_from_physical(frame << 12);
+	memset(data, 0, 0x1000);
+
+	ssize_t valid = node->read(node, index << 12, 0x1000, data);
+	if (valid <= 0) {
+		mmu_frame_unref(frame);
+		return valid;
+	}
+
+	*frame_out = frame;
+	return valid;
+}
+
+/**
+ * @brief Add a page that was just read in to the cache.
+ *
+ * Takes over the caller's reference to @p frame. The page is dropped
+ * instead if the file has been written to since @p generation.
+ */
+static void page_insert(fs_node_t * node, uint64_t index, uintptr_t frame, size_t valid, unsigned long generation, int readahead) {
+	struct pagecache_page * page = malloc(sizeof(struct pagecache_page));
+
+	spin_lock(pagecache_lock);
+	struct pagecache_file * file = file_find(node->device, node->inode);
+	if (!file || file->generation != generation || page_find(node, index)) {
+		spin_unlock(pagecache_lock);
+		mmu_frame_unref(frame);
+		free(page);
+		return;
+	}
+
+	if (!pagecache_counters.max_pages) {
+		pagecache_counters.max_pages = mmu_total_memory() / 4 / 4;
+	}
+
+	size_t evict = pagecache_counters.pages >= pagecache_counters.max_pages ? 1 : 0;
+	if (memory_low()) evict = RECLAIM_BATCH;
+	while (evict-- && lru_tail) {
+		page_remove(lru_tail);
+		pagecache_counters.evictions++;
+	}
+
+	page->file  = file;
+	page->index = index;
+	page->frame = frame;
+	page->valid = valid;
+
+	size_t bucket = page_bucket(file, index);
+	page->chain = page_buckets[bucket];
+	page_buckets[bucket] = page;
+
+	lru_push(page);
+
+	page->file_prev = NULL;
+	page->file_next = file->pages;
+	if (file->pages) file->pages->file_prev = page;
+	file->pages = page;
+	if (valid < 0x1000) file->partial = page;
+
+	pagecache_counters.pages++;
+	if (readahead) pagecache_counters.readahead++;
+	spin_unlock(pagecache_lock);
+
+	pagecache_free_dead();
+}
+
+/**
+ * @brief Take a reference to the frame of a cached page.
+ *
+ * @returns the frame index, or 0 if the page isn't cached.
+ */
+static uintptr_t page_lookup(fs_node_t * node, uint64_t index, size_t * valid) {
+	spin_lock(pagecache_lock);
+	struct pagecache_page * page = page_find(node, index);
+	if (!page || !mmu_frame_ref(page->frame)) {
+		pagecache_counters.misses++;
+		spin_unlock(pagecache_lock);
+		return 0;
+	}
+	pagecache_counters.hits++;
+	lru_unlink(page);
+	lru_push(page);
+	uintptr_t frame = page->frame;
+	*valid = page->valid;
+	spin_unlock(pagecache_lock);
+	return frame;
+}
+
+/**
+ * @brief Read ahead of a sequential reader.
+ *
+ * Called after each read of @p node with the range that was read.
+ */
+static void pagecache_readahead(fs_node_t * node, off_t offset, size_t size) {
+	if (!size) return;
+
+	uint64_t last = (offset + size - 1) >> 12;
+
+	spin_lock(pagecache_lock);
+	struct pagecache_file * file = file_find(node->device, node->inode);
+	if (!file) {
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	if (offset != file->last_end) {
+		/* Not sequential; don't read ahead until it is again */
+		file->last_end = offset + size;
+		file->window = 0;
+		file->ra_next = 0;
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	file->last_end = offset + size;
+	file->window = file->window ? MIN(file->window * 2, READAHEAD_MAX) : READAHEAD_MIN;
+
+	uint64_t start = MAX(last + 1, file->ra_next);
+	uint64_t end = last + file->window;
+	if (end > (node->length + 0xFFF) >> 12) end = (node->length + 0xFFF) >> 12;
+	if (start < end) file->ra_next = end;
+	unsigned long generation = file->generation;
+	spin_unlock(pagecache_lock);
+
+	for (uint64_t index = start; index < end; ++index) {
+		spin_lock(pagecache_lock);
+		int cached = page_find(node, index) != NULL;
+		spin_unlock(pagecache_lock);
+		if (cached) continue;
+
+		uintptr_t frame;
+		ssize_t valid = page_fill(node, index, &frame);
+		if (valid <= 0) break;
+		page_insert(node, index, frame, valid, generation, 1);
+		if (valid < 0x1000) break;
+	}
+}
+
+/**
+ * @brief Read from a file through the cache.
+ *
+ * Called by read_fs for nodes marked FS_PAGECACHE.
+ */
+ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	if (!node->read) return -EINVAL;
+	if (offset < 0) return -EINVAL;
+
+	size_t done = 0;
+	int have_generation = 0;
+	unsigned long generation = 0;
+
+	while (done < size) {
+		off_t pos = offset + done;
+		uint64_t index = pos >> 12;
+		size_t in_page = pos & 0xFFF;
+		size_t want = MIN(size - done, 0x1000 - in_page);
+
+		size_t valid;
+		uintptr_t frame = page_lookup(node, index, &valid);
+		if (!frame) {
+			if (!have_generation) {
+				generation = file_acquire(node);
+				have_generation = 1;
+			}
+			ssize_t r = page_fill(node, index, &frame);
+			if (r < 0) return done ? (ssize_t)done : r;
+			if (r == 0) break;
+			valid = r;
+			/* Keep a reference for the copy below; the cache takes the other one */
+			if (!mmu_frame_ref(frame)) {
+				mmu_frame_unref(frame);
+				return done ? (ssize_t)done : -ENOMEM;
+			}
+			page_insert(node, index, frame, valid, generation, 0);
+		}
+
+		/* The copy can fault on the user's buffer, so it's done without the lock */
+		size_t got = valid > in_page ? MIN(want, valid - in_page) : 0;
+		memcpy(buffer + done, (uint8_t *)mmu_map_from_physical(frame << 12) + in_page, got);
+		mmu_frame_unref(frame);
+
+		done += got;
+		if (got < want) break;
+	}
+
+	pagecache_readahead(node, offset, done);
+	return done;
+}
+
+/**
+ * @brief Drop the cached pages of @p node that a write to a range could change.
+ *
+ * As well as the pages in the range, the page holding the old end of
+ * the file goes, since a write past it can extend it.
+ */
+static void pagecache_invalidate_range(fs_node_t * node, off_t offset, size_t size) {
+	uint64_t first = offset >> 12;
+	uint64_t last = (offset + size) >> 12;
+
+	spin_lock(pagecache_lock);
+	struct pagecache_file * file = file_find(node->device, node->inode);
+	if (!file) {
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	file->generation = ++pagecache_generation;
+
+	if (file->partial) page_remove(file->partial);
+
+	if (last - first < INVALIDATE_LOOKUPS) {
+		for (uint64_t index = first; index <= last; ++index) {
+			struct pagecache_page * page = page_find(node, index);
+			if (page) page_remove(page);
+		}
+	} else {
+		struct pagecache_page * page = file->pages;
+		while (page) {
+			struct pagecache_page * next = page->file_next;
+			if (page->index >= first && page->index <= last) page_remove(page);
+			page = next;
+		}
+	}
+	spin_unlock(pagecache_lock);
+
+	pagecache_free_dead();
+}
+
+/**
+ * @brief Write to a file, keeping the cache coherent.
+ *
+ * Called by write_fs for nodes marked FS_PAGECACHE. Pages are dropped
+ * both before and after the write, so that a reader that raced with
+ * it can't leave behind a page with only part of what was written.
+ */
+ssize_t pagecache_write(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	if (!node->write) return -EROFS;
+	if (offset < 0) return -EINVAL;
+
+	pagecache_invalidate_range(node, offset, size);
+	ssize_t ret = node->write(node, offset, size, buffer);
+	pagecache_invalidate_range(node, offset, size);
+	return ret;
+}
+
+/**
+ * @brief Get the frame holding a page of a file, for mapping it
+ *        or for handing it to another file without copying it first.
+ *
+ * @param valid If not NULL, set to how many bytes of the page are
+ *              part of the file.
+ * @returns a frame index with a reference taken for the caller, or 0
+ *          if the page couldn't be cached and the caller should read
+ *          it into a frame of its own.
+ */
+uintptr_t pagecache_frame(fs_node_t * node, off_t offset, size_t * valid) {
+	if (!(node->flags & FS_PAGECACHE) || !node->read) return 0;
+
+	uint64_t index = offset >> 12;
+	size_t _valid;
+	uintptr_t frame = page_lookup(node, index, &_valid);
+	if (frame) {
+		if (valid) *valid = _valid;
+		return frame;
+	}
+
+	unsigned long generation = file_acquire(node);
+	ssize_t r = page_fill(node, index, &frame);
+	if (r <= 0) return 0;
+	if (!mmu_frame_ref(frame)) {
+		mmu_frame_unref(frame);
+		return 0;
+	}
+	page_insert(node, index, frame, r, generation, 0);
+	if (valid) *valid = r;
+	return frame;
+}
+
+/**
+ * @brief Forget everything cached for a file.
+ *
+ * Called by filesystems when a file is truncated or removed.
+ */
+void pagecache_invalidate(void * device, uint64_t inode) {
+	spin_lock(pagecache_lock);
+	struct pagecache_file * file = file_find(device, inode);
+	if (!file) {
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	struct pagecache_file ** link = &file_buckets[file_bucket(device, inode)];
+	while (*link != file) link = &(*link)->chain;
+	*link = file->chain;
+
+	while (file->pages) {
+		page_remove(file->pages);
+	}
+	spin_unlock(pagecache_lock);
+
+	free(file);
+	pagecache_free_dead();
+}
+
+/**
+ * @brief Give up to @p pages of the least recently used pages back.
+ *
+ * Called by the frame allocator when it is running low. Frames
+ * that are still mapped somewhere are only freed once they are
+ * unmapped.
+ *
+ * @returns the number of pages that were dropped from the cache.
+ */
+size_t pagecache_reclaim(size_t pages) {
+	size_t dropped = 0;
+	spin_lock(pagecache_lock);
+	while (dropped < pages && lru_tail) {
+		page_remove(lru_tail);
+		pagecache_counters.evictions++;
+		dropped++;
+	}
+	spin_unlock(pagecache_lock);
+	return dropped;
+}
+
+void pagecache_get_stats(struct pagecache_stats * stats) {
+	spin_lock(pagecache_lock);
+	memcpy(stats, &pagecache_counters, sizeof(struct pagecache_stats));
+	if (!stats->max_pages) stats->max_pages = mmu_total_memory() / 4 / 4;
+	spin_unlock(pagecache_lock);
+}
@@ -29,6 +29,7 @@
 #include <kernel/time.h>
 
 #include <sys/signal_defs.h>
+#include <poll.h>
 
 #define DEBUG_PIPES 0
 
@@ -71,32 +72,38 @@ int pipe_unsize(fs_node_t * node) {
 	return out;
 }
 
-static inline void pipe_increment_read(pipe_device_t * pipe) {
+/**
+ * @brief Copy @p size bytes out of the pipe, which must have that many unread.
+ */
+static void pipe_copy_out(pipe_device_t * pipe, size_t size, uint8_t * buffer) {
+	size_t run = pipe->size - pipe->read_ptr;
+	if (run > size) run = size;
+	memcpy(buffer, pipe->buffer + pipe->read_ptr, run);
+	memcpy(buffer + run, pipe->buffer, size - run);
+
 	spin_lock(pipe->ptr_lock);
-	pipe->read_ptr++;
-	if (pipe->read_ptr == pipe->size) {
-		pipe->read_ptr = 0;
-	}
+	pipe->read_ptr = (pipe->read_ptr + size) % pipe->size;
 	spin_unlock(pipe->ptr_lock);
 }
 
-static inline void pipe_increment_write(pipe_device_t * pipe) {
+/**
+ * @brief Copy @p size bytes into the pipe, which must have room for them.
+ */
+static void pipe_copy_in(pipe_device_t * pipe, size_t size, uint8_t * buffer) {
+	size_t run = pipe->size - pipe->write_ptr;
+	if (run > size) run = size;
+	memcpy(pipe->buffer + pipe->write_ptr, buffer, run);
+	memcpy(pipe->buffer, buffer + run, size - run);
+
 	spin_lock(pipe->ptr_lock);
-	pipe->write_ptr++;
-	if (pipe->write_ptr == pipe->size) {
-		pipe->write_ptr = 0;
-	}
+	pipe->write_ptr = (pipe->write_ptr + size) % pipe->size;
 	spin_unlock(pipe->ptr_lock);
 }
 
-static inline void pipe_increment_write_by(pipe_device_t * pipe, size_t amount) {
-	pipe->write_ptr = (pipe->write_ptr + amount) % pipe->size;
-}
-
-static void pipe_alert_waiters(pipe_device_t * pipe) {
+static void pipe_alert_list(pipe_device_t * pipe, list_t * list) {
 	spin_lock(pipe->alert_lock);
-	while (pipe->alert_waiters->head) {
-		node_t * node = list_dequeue(pipe->alert_waiters);
+	while (list->head) {
+		node_t * node = list_dequeue(list);
 		process_t * p = node->value;
 		free(node);
 		spin_unlock(pipe->alert_lock);
@@ -121,14 +128,16 @@ ssize_t read_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	while (collected == 0) {
 		spin_lock(pipe->lock_read);
 		if (pipe_unread(pipe) >= size) {
-			while (pipe_unread(pipe) > 0 && collected < size) {
-				buffer[collected] = pipe->buffer[pipe->read_ptr];
-				pipe_increment_read(pipe);
-				collected++;
-			}
+			pipe_copy_out(pipe, size, buffer);
+			collected = size;
 		}
 		spin_unlock(pipe->lock_read);
-		wakeup_queue(pipe->wait_queue_writers);
+		if (collected && pipe->wait_queue_writers->length) {
+			wakeup_queue(pipe->wait_queue_writers);
+		}
+		if (collected) {
+			pipe_alert_list(pipe, pipe->space_waiters);
+		}
 		/* Deschedule and switch */
 		if (collected == 0) {
 			sleep_on(pipe->wait_queue_readers);
@@ -152,15 +161,16 @@ ssize_t write_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer)
 		spin_lock(pipe->lock_write);
 		/* These pipes enforce atomic writes, poorly. */
 		if (pipe_available(pipe) > size) {
-			while (pipe_available(pipe) > 0 && written < size) {
-				pipe->buffer[pipe->write_ptr] = buffer[written];
-				pipe_increment_write(pipe);
-				written++;
-			}
+			pipe_copy_in(pipe, size, buffer);
+			written = size;
 		}
 		spin_unlock(pipe->lock_write);
-		wakeup_queue(pipe->wait_queue_readers);
-		pipe_alert_waiters(pipe);
+		if (written) {
+			if (pipe->wait_queue_readers->length) {
+				wakeup_queue(pipe->wait_queue_readers);
+			}
+			pipe_alert_list(pipe, pipe->alert_waiters);
+		}
 		if (written < size) {
 			sleep_on(pipe->wait_queue_writers);
 		}
@@ -212,6 +222,11 @@ static int pipe_check(fs_node_t * node) {
 	return 1;
 }
 
+static int pipe_pollcheck(fs_node_t * node) {
+	pipe_device_t * pipe = (pipe_device_t *)node->device;
+	return (pipe_unread(pipe) ? POLLIN : 0) | (pipe_available(pipe) ? POLLOUT : 0);
+}
+
 static int pipe_wait(fs_node_t * node, void * process) {
 	pipe_device_t * pipe = (pipe_device_t *)node->device;
 
@@ -222,12 +237,49 @@ static int pipe_wait(fs_node_t * node, void * process) {
 	spin_unlock(pipe->alert_lock);
 
 	spin_lock(pipe->wait_lock);
-	list_insert(((process_t *)process)->node_waits, pipe);
+	process_add_node_wait(process, pipe);
+	spin_unlock(pipe->wait_lock);
+
+	return 0;
+}
+
+/* Readers go on alert_waiters as with select; writers wait for a reader to make room */
+static int pipe_pollwait(fs_node_t * node, void * waiter, int events) {
+	pipe_device_t * pipe = (pipe_device_t *)node->device;
+
+	spin_lock(pipe->alert_lock);
+	if ((events & POLLOUT) && !list_find(pipe->space_waiters, waiter)) {
+		list_insert(pipe->space_waiters, waiter);
+	}
+	if ((events & POLLIN || !(events & POLLOUT)) && !list_find(pipe->alert_waiters, waiter)) {
+		list_insert(pipe->alert_waiters, waiter);
+	}
+	spin_unlock(pipe->alert_lock);
+
+	spin_lock(pipe->wait_lock);
+	process_add_node_wait(waiter, pipe);
 	spin_unlock(pipe->wait_lock);
 
 	return 0;
 }
 
+static void pipe_pollunwait(fs_node_t * node, void * waiter) {
+	pipe_device_t * pipe = (pipe_device_t *)node->device;
+
+	spin_lock(pipe->alert_lock);
+	node_t * n = list_find(pipe->alert_waiters, waiter);
+	if (n) {
+		list_delete(pipe->alert_waiters, n);
+		free(n);
+	}
+	n = list_find(pipe->space_waiters, waiter);
+	if (n) {
+		list_delete(pipe->space_waiters, n);
+		free(n);
+	}
+	spin_unlock(pipe->alert_lock);
+}
+
 fs_node_t * make_pipe(size_t size) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	pipe_device_t * pipe = malloc(sizeof(pipe_device_t));
@@ -252,6 +304,9 @@ fs_node_t * make_pipe(size_t size) {
 
 	fnode->selectcheck = pipe_check;
 	fnode->selectwait  = pipe_wait;
+	fnode->pollcheck   = pipe_pollcheck;
+	fnode->pollwait    = pipe_pollwait;
+	fnode->pollunwait  = pipe_pollunwait;
 
 	fnode->atime = now();
 	fnode->mtime = fnode->atime;
@@ -275,6 +330,7 @@ fs_node_t * make_pipe(size_t size) {
 	pipe->wait_queue_writers = list_create("pipe writers",pipe);
 	pipe->wait_queue_readers = list_create("pip readers",pipe);
 	pipe->alert_waiters = list_create("pipe alert waiters",pipe);
+	pipe->space_waiters = list_create("pipe space waiters",pipe);
 
 	return fnode;
 }
@@ -32,6 +32,8 @@
 #include <kernel/mmu.h>
 #include <kernel/misc.h>
 #include <kernel/module.h>
+#include <kernel/kheap.h>
+#include <kernel/pagecache.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
 #define PROCFS_PROCDIR_ENTRIES  (sizeof(procdir_entries) / sizeof(struct procfs_entry))
@@ -222,6 +224,7 @@ static fs_node_t * finddir_procfs_procdir(fs_node_t * node, char * name) {
 		if (!strcmp(name, procdir_entries[i].name)) {
 			fs_node_t * out = procfs_generic_create(procdir_entries[i].name, procdir_entries[i].func);
 			out->inode = node->inode;
+			out->flags |= FS_DCACHE;
 			return out;
 		}
 	}
@@ -239,7 +242,7 @@ static fs_node_t * procfs_procdir_create(process_t * process) {
 	fnode->uid = 0;
 	fnode->gid = 0;
 	fnode->mask = 0555;
-	fnode->flags   = FS_DIRECTORY;
+	fnode->flags   = FS_DIRECTORY | FS_DCACHE; /* the entries are the same for every process */
 	fnode->read    = NULL;
 	fnode->write   = NULL;
 	fnode->open    = NULL;
@@ -291,12 +294,23 @@ static ssize_t meminfo_func(fs_node_t *node, off_t offset, size_t size, uint8_t
 	size_t total = mmu_total_memory();
 	size_t free  = total - mmu_used_memory();
 	size_t kheap = ((uintptr_t)sbrk(0) - 0xffffff0000000000UL) / 1024;
+	struct pagecache_stats cache;
+	pagecache_get_stats(&cache);
+	size_t lookups = cache.hits + cache.misses;
 
 	snprintf(buf, 1000,
 		"MemTotal: %zu kB\n"
 		"MemFree: %zu kB\n"
 		"KHeapUse: %zu kB\n"
-		, total, free, kheap);
+		"Cached: %zu kB\n"
+		"CacheHits: %zu\n"
+		"CacheMisses: %zu\n"
+		"CacheHitRatio: %zu%%\n"
+		"CacheReadahead: %zu\n"
+		"CacheEvictions: %zu\n"
+		, total, free, kheap, cache.pages * 4,
+		cache.hits, cache.misses, lookups ? cache.hits * 100 / lookups : 0,
+		cache.readahead, cache.evictions);
 
 	size_t _bsize = strlen(buf);
 	if ((size_t)offset > _bsize) return 0;
@@ -643,12 +657,96 @@ static ssize_t pci_func(fs_node_t *node, off_t offset, size_t size, uint8_t *buf
 #endif
 
 static ssize_t smp_func(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	char * buf = malloc(4096);
+	const int line_max = 160;
+	char * buf = malloc(line_max * processor_count + 1);
 	unsigned int soffset = 0;
+	buf[0] = '\0';
 
 	for (int i = 0; i < processor_count; ++i) {
-		soffset += snprintf(&buf[soffset], 100, "%d: %s [%d]\n", i, processor_local_data[i].current_process->name, processor_local_data[i].current_process->id);
+		int written = snprintf(&buf[soffset], line_max, "%d: %s [%d] queue=%zu steals=%zu balanced=%zu timer_irqs=%zu wakeup_ipis=%zu tlb_ipis=%zu\n", i,
+			processor_local_data[i].current_process->name, processor_local_data[i].current_process->id,
+			processor_local_data[i].ready_queue->length,
+			processor_local_data[i].steal_count,
+			processor_local_data[i].balance_count,
+			processor_local_data[i].timer_irqs,
+			processor_local_data[i].wakeup_ipis,
+			processor_local_data[i].tlb_ipis);
+		/* Long lines are cut off, but still end in a newline */
+		if (written >= line_max) {
+			written = line_max - 1;
+			buf[soffset + written - 1] = '\n';
+		}
+		soffset += written;
+	}
+
+	size_t _bsize = strlen(buf);
+	if ((size_t)offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+static ssize_t kheap_func(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	char * buf = malloc(4096);
+	unsigned int soffset = 0;
+	struct kheap_stats stats;
+	kheap_get_stats(&stats);
+
+	soffset += snprintf(&buf[soffset], 100, "%6s %8s %8s %8s %8s\n", "size", "pages", "used", "free", "cached");
+	for (size_t i = 0; i < stats.bins; ++i) {
+		soffset += snprintf(&buf[soffset], 100, "%6zu %8zu %8zu %8zu %8zu\n",
+			stats.bin[i].size, stats.bin[i].pages, stats.bin[i].used, stats.bin[i].free, stats.bin[i].cached);
+	}
+
+	soffset += snprintf(&buf[soffset], 1000,
+		"BigBlocks: %zu\n"
+		"BigFreeBlocks: %zu\n"
+		"BigSize: %zu kB\n"
+		"BigFree: %zu kB\n"
+		"Released: %zu kB\n"
+		"MagazineHits: %zu\n"
+		"MagazineMisses: %zu\n"
+		"LockAcquired: %zu\n"
+		"LockContended: %zu\n",
+		stats.big_blocks, stats.big_free_blocks,
+		stats.big_bytes / 1024, stats.big_free_bytes / 1024,
+		stats.released_pages * 4,
+		stats.magazine_hits, stats.magazine_misses,
+		stats.lock_acquired, stats.lock_contended);
+
+	size_t _bsize = strlen(buf);
+	if ((size_t)offset > _bsize) {
+		free(buf);
+		return 0;
 	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+static ssize_t dcache_func(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	char * buf = malloc(4096);
+	struct dcache_stats stats;
+	dcache_get_stats(&stats);
+
+	snprintf(buf, 1000,
+		"Entries: %zu\n"
+		"Capacity: %zu\n"
+		"Hits: %zu\n"
+		"NegativeHits: %zu\n"
+		"Misses: %zu\n"
+		"Evictions: %zu\n"
+		"Invalidations: %zu\n",
+		stats.entries, stats.capacity,
+		stats.hits, stats.negative_hits, stats.misses,
+		stats.evictions, stats.invalidations);
 
 	size_t _bsize = strlen(buf);
 	if ((size_t)offset > _bsize) {
@@ -674,10 +772,12 @@ static struct procfs_entry std_entries[] = {
 	{-9, "filesystems", filesystems_func},
 	{-10,"loader",   loader_func},
 	{-11,"smp",      smp_func},
+	{-12,"kheap",    kheap_func},
+	{-13,"dcache",   dcache_func},
 #ifdef __x86_64__
-	{-12,"irq",      irq_func},
-	{-13,"pat",      pat_func},
-	{-14,"pci",      pci_func},
+	{-14,"irq",      irq_func},
+	{-15,"pat",      pat_func},
+	{-16,"pci",      pci_func},
 #endif
 };
 
@@ -777,6 +877,48 @@ static struct dirent * readdir_procfs_root(fs_node_t *node, uint64_t index) {
 	return out;
 }
 
+/* Same entries as readdir_procfs_root, but only walking each list once per call. */
+static ssize_t getdents_procfs_root(fs_node_t *node, uint64_t * index, struct dirent * out, size_t count) {
+	static const char * fixed[] = { ".", "..", "self" };
+	size_t n = 0;
+
+	for (; n < count && *index < 3; ++n, ++*index) {
+		memset(&out[n], 0, sizeof(struct dirent));
+		strcpy(out[n].d_name, fixed[*index]);
+	}
+
+	for (; n < count && *index - 3 < PROCFS_STANDARD_ENTRIES; ++n, ++*index) {
+		out[n].d_ino = std_entries[*index - 3].id;
+		strcpy(out[n].d_name, std_entries[*index - 3].name);
+	}
+	if (n == count) return n;
+
+	uint64_t i = *index - 3 - PROCFS_STANDARD_ENTRIES;
+
+	if (extended_entries) {
+		node_t * e = extended_entries->head;
+		for (uint64_t skip = 0; e && skip < i; ++skip) e = e->next;
+		for (; e && n < count; e = e->next, ++n, ++*index, ++i) {
+			struct procfs_entry * entry = e->value;
+			out[n].d_ino = entry->id;
+			strcpy(out[n].d_name, entry->name);
+		}
+		if (n == count) return n;
+		i -= extended_entries->length;
+	}
+
+	node_t * p = process_list->head;
+	for (uint64_t skip = 0; p && skip < i; ++skip) p = p->next;
+	for (; p && n < count; p = p->next, ++n, ++*index) {
+		process_t * proc = p->value;
+		memset(&out[n], 0, sizeof(struct dirent));
+		out[n].d_ino = proc->id;
+		snprintf(out[n].d_name, 100, "%d", proc->id);
+	}
+
+	return n;
+}
+
 static ssize_t readlink_self(fs_node_t * node, char * buf, size_t size) {
 	char tmp[30];
 	size_t req;
@@ -867,6 +1009,7 @@ static fs_node_t * procfs_create(void) {
 	fnode->open    = NULL;
 	fnode->close   = NULL;
 	fnode->readdir = readdir_procfs_root;
+	fnode->getdents = getdents_procfs_root;
 	fnode->finddir = finddir_procfs_root;
 	fnode->nlink   = 1;
 	fnode->ctime   = now();
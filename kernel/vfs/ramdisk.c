@@ -25,6 +25,7 @@
 #include <kernel/string.h>
 #include <kernel/process.h>
 #include <kernel/mmu.h>
+#include <kernel/pagecache.h>
 
 static ssize_t read_ramdisk(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
 static ssize_t write_ramdisk(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
@@ -85,6 +86,7 @@ static int ioctl_ramdisk(fs_node_t * node, unsigned long request, void * argp) {
 						mmu_frame_clear(i);
 					}
 				}
+				pagecache_invalidate(node->device, node->inode);
 				/* Mark the file length as 0 */
 				node->length = 0;
 				((fs_node_t*)node->device)->length = 0;
@@ -106,7 +108,7 @@ static fs_node_t * ramdisk_device_create(int device_number, uintptr_t location,
 	fnode->gid = 0;
 	fnode->mask    = 0770;
 	fnode->length  = size;
-	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->flags   = FS_BLOCKDEVICE | FS_PAGECACHE;
 	fnode->read    = read_ramdisk;
 	fnode->write   = write_ramdisk;
 	fnode->open    = open_ramdisk;
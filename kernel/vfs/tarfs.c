@@ -2,11 +2,17 @@
  * @file  kernel/vfs/tarfs.c
  * @brief Read-only filesystem driver for ustar archives.
  *
+ * The archive is scanned once when it is mounted, building an index
+ * of every entry by path and by header offset, with a list of children
+ * for each directory, so lookups and directory listings don't need to
+ * walk through the archive again.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2018 K. Lange
  */
+#include <errno.h>
 #include <kernel/types.h>
 #include <kernel/vfs.h>
 #include <kernel/printf.h>
@@ -17,9 +23,26 @@
 
 #define TARFS_LOG_LEVEL WARNING
 
+/*
+ * An entry in the index built at mount time.
+ * Directories keep their children in archive order, for readdir.
+ */
+struct tarfs_entry {
+	char * path;         /* Full path, without a trailing slash */
+	char * name;         /* Last component of the path */
+	unsigned int offset; /* Offset of the ustar header */
+	struct tarfs_entry ** children;
+	size_t child_count;
+	size_t child_space;
+};
+
 struct tarfs {
 	fs_node_t * device;
 	unsigned int length;
+	hashmap_t * paths;          /* Full path -> entry */
+	hashmap_t * offsets;        /* Header offset / 512 -> entry */
+	struct tarfs_entry root;
+	size_t entries;
 };
 
 struct ustar {
@@ -103,7 +126,7 @@ static unsigned int round_to_512(unsigned int i) {
 }
 
 static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out);
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset);
+static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, struct tarfs_entry * entry);
 
 #ifndef strncat
 static char * strncat(char *dest, const char *src, size_t n) {
@@ -123,18 +146,12 @@ static char * strncat(char *dest, const char *src, size_t n) {
 }
 #endif
 
-static int count_slashes(char * string) {
-	int i = 0;
-	char * s = strstr(string, "/");
-	while (s) {
-		if (*(s+1) == '\0') return i;
-		i++;
-		s = strstr(s+1,"/");
-	}
-	return i;
+static struct tarfs_entry * entry_from_node(fs_node_t * node) {
+	struct tarfs * self = node->device;
+	return hashmap_get(self->offsets, (void *)(uintptr_t)(node->inode / 512));
 }
 
-static struct dirent * readdir_tar_root(fs_node_t *node, unsigned long index) {
+static struct dirent * readdir_entry(struct tarfs_entry * dir, unsigned long index) {
 	if (index == 0) {
 		struct dirent * out = malloc(sizeof(struct dirent));
 		memset(out, 0x00, sizeof(struct dirent));
@@ -153,189 +170,99 @@ static struct dirent * readdir_tar_root(fs_node_t *node, unsigned long index) {
 
 	index -= 2;
 
-	struct tarfs * self = node->device;
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = 0;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
+	if (!dir || index >= dir->child_count) return NULL;
 
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+	struct tarfs_entry * child = dir->children[index];
+	struct dirent * out = malloc(sizeof(struct dirent));
+	memset(out, 0x00, sizeof(struct dirent));
+	out->d_ino = child->offset;
+	strcpy(out->d_name, child->name);
+	return out;
+}
 
-		char filename_workspace[256];
+static ssize_t getdents_entry(struct tarfs_entry * dir, uint64_t * index, struct dirent * out, size_t count) {
+	size_t n = 0;
+	for (; n < count && *index < 2; ++n, ++*index) {
+		memset(&out[n], 0, sizeof(struct dirent));
+		strcpy(out[n].d_name, *index ? ".." : ".");
+	}
+	for (; dir && n < count && *index - 2 < dir->child_count; ++n, ++*index) {
+		struct tarfs_entry * child = dir->children[*index - 2];
+		out[n].d_ino = child->offset;
+		strcpy(out[n].d_name, child->name);
+	}
+	return n;
+}
 
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
+static fs_node_t * finddir_entry(struct tarfs * self, struct tarfs_entry * dir, char * name) {
+	if (!dir) return NULL;
 
-		if (!count_slashes(filename_workspace)) {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0'; /* remove trailing slash */
-			if (strlen(filename_workspace)) {
-				if (index == 0) {
-					struct dirent * out = malloc(sizeof(struct dirent));
-					memset(out, 0x00, sizeof(struct dirent));
-					out->d_ino = offset;
-					strcpy(out->d_name, filename_workspace);
-					free(file);
-					return out;
-				} else {
-					index--;
-				}
-			}
-		}
+	char path[512];
+	size_t dir_len = strlen(dir->path);
+	size_t name_len = strlen(name);
+	if (dir_len + name_len + 2 > sizeof(path)) return NULL;
 
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+	if (dir_len) {
+		memcpy(path, dir->path, dir_len);
+		path[dir_len++] = '/';
+	}
+	memcpy(path + dir_len, name, name_len + 1);
+
+	struct tarfs_entry * entry = hashmap_get(self->paths, path);
+	if (!entry) return NULL;
 
+	struct ustar * file = malloc(sizeof(struct ustar));
+	if (!ustar_from_offset(self, entry->offset, file)) {
+		free(file);
+		return NULL;
 	}
+	return file_from_ustar(self, file, entry);
+}
 
-	free(file);
-	return NULL;
+static struct dirent * readdir_tar_root(fs_node_t *node, unsigned long index) {
+	struct tarfs * self = node->device;
+	return readdir_entry(&self->root, index);
+}
+
+/**
+ * @brief Read from the archive itself.
+ *
+ * Files in the archive are cached on their own, so the archive is
+ * read without going through the page cache to avoid keeping a
+ * second copy of everything.
+ */
+static ssize_t tarfs_read_device(struct tarfs * self, off_t offset, size_t size, uint8_t * buffer) {
+	if (!self->device->read) return -EINVAL;
+	return self->device->read(self->device, offset, size, buffer);
 }
 
 static ssize_t read_tarfs(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
 	struct tarfs * self = node->device;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-	size_t file_size = interpret_size(file);
+	size_t file_size = node->length;
 
 	if ((size_t)offset > file_size) return 0;
 	if (offset + size > file_size) {
 		size = file_size - offset;
 	}
 
-	free(file);
-
-	return read_fs(self->device, offset + node->inode + 512, size, buffer);
+	return tarfs_read_device(self, offset + node->inode + 512, size, buffer);
 }
 
 static struct dirent * readdir_tarfs(fs_node_t *node, unsigned long index) {
-	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->d_ino = 0;
-		strcpy(out->d_name, ".");
-		return out;
-	}
-
-	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->d_ino = 0;
-		strcpy(out->d_name, "..");
-		return out;
-	}
-
-	index -= 2;
+	return readdir_entry(entry_from_node(node), index);
+}
 
+static ssize_t getdents_tar_root(fs_node_t *node, uint64_t * index, struct dirent * out, size_t count) {
 	struct tarfs * self = node->device;
+	return getdents_entry(&self->root, index, out, count);
+}
 
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = node->inode;
-
-	/* Read myself */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	int status = ustar_from_offset(self, node->inode, file);
-	char my_filename[256];
-
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	while (offset < self->length) {
-		ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (startswith(filename_workspace, my_filename)) {
-			if (!count_slashes(filename_workspace + strlen(my_filename))) {
-				if (strlen(filename_workspace + strlen(my_filename))) {
-					if (index == 0) {
-						char * slash = strstr(filename_workspace+strlen(my_filename),"/");
-						if (slash) *slash = '\0'; /* remove trailing slash */
-						struct dirent * out = malloc(sizeof(struct dirent));
-						memset(out, 0x00, sizeof(struct dirent));
-						out->d_ino = offset;
-						strcpy(out->d_name, filename_workspace+strlen(my_filename));
-						free(file);
-						return out;
-					} else {
-						index--;
-					}
-				}
-			}
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-	}
-
-	free(file);
-	return NULL;
+static ssize_t getdents_tarfs(fs_node_t *node, uint64_t * index, struct dirent * out, size_t count) {
+	return getdents_entry(entry_from_node(node), index, out, count);
 }
 
 static fs_node_t * finddir_tarfs(fs_node_t *node, char *name) {
-	struct tarfs * self = node->device;
-
-	/* find my own filename */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-
-	char my_filename[256];
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	/* Append name */
-	strncat(my_filename, name, strlen(name));
-	if (strlen(my_filename) > 255) {
-		printf("tarfs: critical: what?");
-	}
-
-	unsigned int offset = node->inode;
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (filename_workspace[strlen(filename_workspace)-1] == '/') {
-			filename_workspace[strlen(filename_workspace)-1] = '\0';
-		}
-		if (!strcmp(filename_workspace, my_filename)) {
-			return file_from_ustar(self, file, offset);
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-	}
-
-
-	free(file);
-	return NULL;
+	return finddir_entry(node->device, entry_from_node(node), name);
 }
 
 static ssize_t readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
@@ -358,14 +285,13 @@ static ssize_t readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
 
 }
 
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
+static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, struct tarfs_entry * entry) {
 	fs_node_t * fs = malloc(sizeof(fs_node_t));
 	memset(fs, 0, sizeof(fs_node_t));
 	fs->device = self;
-	fs->inode  = offset;
+	fs->inode  = entry->offset;
 	fs->impl   = 0;
-	char filename_workspace[256];
-	memcpy(fs->name, filename_workspace, strlen(filename_workspace)+1);
+	strcpy(fs->name, entry->name);
 
 	fs->uid = interpret_uid(file);
 	fs->gid = interpret_gid(file);
@@ -376,6 +302,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 	if (file->type[0] == '5') {
 		fs->flags = FS_DIRECTORY;
 		fs->readdir = readdir_tarfs;
+		fs->getdents = getdents_tarfs;
 		fs->finddir = finddir_tarfs;
 	} else if (file->type[0] == '1') {
 		//debug_print(ERROR, "Hardlink detected");
@@ -384,9 +311,10 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 		fs->flags = FS_SYMLINK;
 		fs->readlink = readlink_tarfs;
 	} else {
-		fs->flags = FS_FILE;
+		fs->flags = FS_FILE | FS_PAGECACHE;
 		fs->read = read_tarfs;
 	}
+	fs->flags |= FS_DCACHE; /* read-only, so nothing here ever changes */
 	free(file);
 #if 0
 	/* TODO times are also available from the file */
@@ -399,30 +327,63 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 
 static fs_node_t * finddir_tar_root(fs_node_t *node, char *name) {
 	struct tarfs * self = node->device;
+	return finddir_entry(self, &self->root, name);
+}
 
-	unsigned int offset = 0;
+static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
+	tarfs_read_device(self, offset, sizeof(struct ustar), (unsigned char*)out);
+	if (out->ustar[0] != 'u' ||
+		out->ustar[1] != 's' ||
+		out->ustar[2] != 't' ||
+		out->ustar[3] != 'a' ||
+		out->ustar[4] != 'r') {
+		return 0;
+	}
+	return 1;
+}
+
+static void add_child(struct tarfs_entry * dir, struct tarfs_entry * child) {
+	if (dir->child_count == dir->child_space) {
+		dir->child_space = dir->child_space ? dir->child_space * 2 : 4;
+		dir->children = realloc(dir->children, sizeof(struct tarfs_entry *) * dir->child_space);
+	}
+	dir->children[dir->child_count++] = child;
+}
+
+/**
+ * @brief Scan the archive and build the path index.
+ *
+ * Entries are collected first and then attached to their parent
+ * directories, as an archive doesn't have to list a directory
+ * before its contents. If a path appears more than once, the
+ * first entry for it wins. Entries whose parent directory isn't
+ * in the archive can't be reached, as before.
+ */
+static void tarfs_build_index(struct tarfs * self) {
+	list_t * found = list_create("tarfs index", self);
 	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
 
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+	unsigned int offset = 0;
+	while (offset < self->length) {
+		if (!ustar_from_offset(self, offset, file)) break;
 
 		char filename_workspace[256];
 		memset(filename_workspace, 0, 256);
 		strncat(filename_workspace, file->prefix, 155);
 		strncat(filename_workspace, file->filename, 100);
 
-		if (count_slashes(filename_workspace)) {
-			/* skip */
-		} else {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0';
-			if (!strcmp(filename_workspace, name)) {
-				return file_from_ustar(self, file, offset);
-			}
+		size_t len = strlen(filename_workspace);
+		if (len && filename_workspace[len-1] == '/') {
+			filename_workspace[--len] = '\0';
+		}
+
+		if (len) {
+			struct tarfs_entry * entry = calloc(1, sizeof(struct tarfs_entry));
+			entry->path = strdup(filename_workspace);
+			char * slash = strrchr(entry->path, '/');
+			entry->name = slash ? slash + 1 : entry->path;
+			entry->offset = offset;
+			list_insert(found, entry);
 		}
 
 		offset += 512;
@@ -430,19 +391,39 @@ static fs_node_t * finddir_tar_root(fs_node_t *node, char *name) {
 	}
 
 	free(file);
-	return NULL;
-}
 
-static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
-	read_fs(self->device, offset, sizeof(struct ustar), (unsigned char*)out);
-	if (out->ustar[0] != 'u' ||
-		out->ustar[1] != 's' ||
-		out->ustar[2] != 't' ||
-		out->ustar[3] != 'a' ||
-		out->ustar[4] != 'r') {
-		return 0;
+	self->paths   = hashmap_create(found->length + 1);
+	self->offsets = hashmap_create_int(found->length + 1);
+
+	foreach(node, found) {
+		struct tarfs_entry * entry = node->value;
+		if (hashmap_has(self->paths, entry->path)) {
+			free(entry->path);
+			free(entry);
+			node->value = NULL;
+			continue;
+		}
+		hashmap_set(self->paths, entry->path, entry);
+		hashmap_set(self->offsets, (void *)(uintptr_t)(entry->offset / 512), entry);
+		self->entries++;
 	}
-	return 1;
+
+	foreach(node, found) {
+		struct tarfs_entry * entry = node->value;
+		if (!entry) continue;
+
+		struct tarfs_entry * parent = &self->root;
+		if (entry->name != entry->path) {
+			entry->name[-1] = '\0';
+			parent = hashmap_get(self->paths, entry->path);
+			entry->name[-1] = '/';
+		}
+
+		if (parent) add_child(parent, entry);
+	}
+
+	list_free(found);
+	free(found);
 }
 
 static fs_node_t * tar_mount(const char * device, const char * mount_path) {
@@ -465,10 +446,14 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 	}
 
 	/* Create a metadata struct for this mount */
-	struct tarfs * self = malloc(sizeof(struct tarfs));
+	struct tarfs * self = calloc(1, sizeof(struct tarfs));
 
 	self->device = dev;
 	self->length = dev->length;
+	self->root.path = strdup("");
+	self->root.name = self->root.path;
+
+	tarfs_build_index(self);
 
 	fs_node_t * root = malloc(sizeof(fs_node_t));
 	memset(root, 0, sizeof(fs_node_t));
@@ -478,8 +463,9 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 	root->length  = 0;
 	root->mask    = 0555;
 	root->readdir = readdir_tar_root;
+	root->getdents = getdents_tar_root;
 	root->finddir = finddir_tar_root;
-	root->flags   = FS_DIRECTORY;
+	root->flags   = FS_DIRECTORY | FS_DCACHE;
 	root->device  = self;
 
 	return root;
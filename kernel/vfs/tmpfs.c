@@ -5,6 +5,13 @@
  * Generally provides the filesystem for "migrated" live CDs,
  * as well as /tmp and /var.
  *
+ * Directories are hash tables, resized as they grow, with their
+ * entries also kept in creation order for readdir. File contents
+ * live in physically contiguous extents that are accessed through
+ * the direct mapping. Each directory and file has its own
+ * reader/writer lock, so lookups and reads don't contend with
+ * each other and unrelated files don't contend at all.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -19,9 +26,10 @@
 #include <kernel/process.h>
 #include <kernel/tokenize.h>
 #include <kernel/tmpfs.h>
-#include <kernel/spinlock.h>
+#include <kernel/rwlock.h>
 #include <kernel/mmu.h>
 #include <kernel/time.h>
+#include <kernel/pagecache.h>
 
 /* 4KB */
 #define BLOCKSIZE 0x1000
@@ -30,52 +38,166 @@
 #define TMPFS_TYPE_DIR  2
 #define TMPFS_TYPE_LINK 3
 
-static char * buf_space = NULL;
-
-static spin_lock_t tmpfs_lock = { 0 };
-static spin_lock_t tmpfs_page_lock = { 0 };
+/* Largest extent we'll ask for in one go, in pages (2MiB) */
+#define TMPFS_EXTENT_MAX 512
+#define TMPFS_EXTENTS_INITIAL 2
+#define TMPFS_BUCKETS_INITIAL 16
 
 struct tmpfs_dir * tmpfs_root = NULL;
 
-static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d);
+/* Where an open directory got to in readdir, so the next call can carry on from there */
+struct tmpfs_cursor {
+	uint64_t index;
+	struct tmpfs_dirent * at;
+	unsigned long changes;
+};
 
-static struct tmpfs_file * tmpfs_file_new(char * name) {
+static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d);
 
-	spin_lock(tmpfs_lock);
+static uint32_t tmpfs_hash(const char * name) {
+	uint32_t hash = 2166136261u;
+	for (const char * c = name; *c; ++c) {
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+	return hash;
+}
 
+static struct tmpfs_file * tmpfs_file_new(char * name) {
 	struct tmpfs_file * t = malloc(sizeof(struct tmpfs_file));
 	t->name = strdup(name);
 	t->type = TMPFS_TYPE_FILE;
 	t->length = 0;
-	t->pointers = 2;
-	t->block_count = 0;
 	t->mask = 0;
 	t->uid = 0;
 	t->gid = 0;
 	t->atime = now();
 	t->mtime = t->atime;
 	t->ctime = t->atime;
-	t->blocks = malloc(t->pointers * sizeof(char *));
-	for (size_t i = 0; i < t->pointers; ++i) {
-		t->blocks[i] = 0;
+	t->pages = 0;
+	t->extent_count = 0;
+	t->extent_space = TMPFS_EXTENTS_INITIAL;
+	t->extents = malloc(sizeof(struct tmpfs_extent) * t->extent_space);
+	t->target = NULL;
+	rwlock_init(t->lock);
+	return t;
+}
+
+static struct tmpfs_dir * tmpfs_dir_new(char * name, struct tmpfs_dir * parent) {
+	struct tmpfs_dir * d = malloc(sizeof(struct tmpfs_dir));
+	d->name = strdup(name);
+	d->type = TMPFS_TYPE_DIR;
+	d->mask = 0;
+	d->uid = 0;
+	d->gid = 0;
+	d->atime = now();
+	d->mtime = d->atime;
+	d->ctime = d->atime;
+	d->count = 0;
+	d->bucket_count = TMPFS_BUCKETS_INITIAL;
+	d->buckets = malloc(sizeof(struct tmpfs_dirent *) * d->bucket_count);
+	memset(d->buckets, 0, sizeof(struct tmpfs_dirent *) * d->bucket_count);
+	d->first = NULL;
+	d->last = NULL;
+	d->changes = 0;
+	d->parent = parent;
+	rwlock_init(d->lock);
+	return d;
+}
+
+static void tmpfs_extents_free(struct tmpfs_extent * extents, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		mmu_free_frames(extents[i].frame, extents[i].pages);
 	}
+	free(extents);
+}
 
-	spin_unlock(tmpfs_lock);
-	return t;
+/**
+ * @brief Release a file, link, or empty directory that is no longer in any directory.
+ */
+static void tmpfs_node_free(struct tmpfs_file * t) {
+	if (t->type == TMPFS_TYPE_DIR) {
+		free(((struct tmpfs_dir *)t)->buckets);
+	} else {
+		if (t->type == TMPFS_TYPE_LINK) free(t->target);
+		tmpfs_extents_free(t->extents, t->extent_count);
+	}
+	free(t->name);
+	free(t);
 }
 
-static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
-	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
+/**
+ * @brief Find the entry for @p name in @p d.
+ *
+ * Must be called with the directory locked.
+ */
+static struct tmpfs_dirent * tmpfs_dir_find(struct tmpfs_dir * d, const char * name, uint32_t hash) {
+	for (struct tmpfs_dirent * e = d->buckets[hash & (d->bucket_count - 1)]; e; e = e->chain) {
+		if (e->hash == hash && !strcmp(e->file->name, name)) return e;
+	}
+	return NULL;
+}
 
-	spin_lock(tmpfs_lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			return -EEXIST; /* Already exists */
-		}
+/**
+ * @brief Double the number of hash buckets in @p d.
+ *
+ * Must be called with the directory locked for writing.
+ */
+static void tmpfs_dir_resize(struct tmpfs_dir * d) {
+	size_t count = d->bucket_count * 2;
+	struct tmpfs_dirent ** buckets = malloc(sizeof(struct tmpfs_dirent *) * count);
+	memset(buckets, 0, sizeof(struct tmpfs_dirent *) * count);
+
+	for (struct tmpfs_dirent * e = d->first; e; e = e->next) {
+		e->chain = buckets[e->hash & (count - 1)];
+		buckets[e->hash & (count - 1)] = e;
+	}
+
+	free(d->buckets);
+	d->buckets = buckets;
+	d->bucket_count = count;
+}
+
+/**
+ * @brief Add a new file, link, or directory to @p d.
+ *
+ * @returns 0, or -EEXIST if the name is taken, in which case
+ *          the caller still owns @p t.
+ */
+static int tmpfs_dir_add(struct tmpfs_dir * d, struct tmpfs_file * t) {
+	struct tmpfs_dirent * e = malloc(sizeof(struct tmpfs_dirent));
+	e->file = t;
+	e->hash = tmpfs_hash(t->name);
+	e->next = NULL;
+
+	rwlock_write_lock(d->lock);
+	if (tmpfs_dir_find(d, t->name, e->hash)) {
+		rwlock_write_unlock(d->lock);
+		free(e);
+		return -EEXIST;
 	}
-	spin_unlock(tmpfs_lock);
+
+	if (d->count >= d->bucket_count * 2) {
+		tmpfs_dir_resize(d);
+	}
+
+	e->chain = d->buckets[e->hash & (d->bucket_count - 1)];
+	d->buckets[e->hash & (d->bucket_count - 1)] = e;
+
+	e->prev = d->last;
+	if (d->last) d->last->next = e;
+	else d->first = e;
+	d->last = e;
+
+	d->count++;
+	d->mtime = now();
+	rwlock_write_unlock(d->lock);
+
+	dcache_invalidate();
+	return 0;
+}
+
+static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
+	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
 
 	struct tmpfs_file * t = tmpfs_file_new(name);
 	t->type = TMPFS_TYPE_LINK;
@@ -85,11 +207,9 @@ static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
 	t->uid = this_core->current_process->user;
 	t->gid = this_core->current_process->user;
 
-	spin_lock(tmpfs_lock);
-	list_insert(d->files, t);
-	spin_unlock(tmpfs_lock);
-
-	return 0;
+	int ret = tmpfs_dir_add(d, t);
+	if (ret) tmpfs_node_free(t);
+	return ret;
 }
 
 static ssize_t readlink_tmpfs(fs_node_t * node, char * buf, size_t size) {
@@ -109,158 +229,122 @@ static ssize_t readlink_tmpfs(fs_node_t * node, char * buf, size_t size) {
 	}
 }
 
-static struct tmpfs_dir * tmpfs_dir_new(char * name, struct tmpfs_dir * parent) {
-	spin_lock(tmpfs_lock);
-
-	struct tmpfs_dir * d = malloc(sizeof(struct tmpfs_dir));
-	d->name = strdup(name);
-	d->type = TMPFS_TYPE_DIR;
-	d->mask = 0;
-	d->uid = 0;
-	d->gid = 0;
-	d->atime = now();
-	d->mtime = d->atime;
-	d->ctime = d->atime;
-	d->files = list_create("tmpfs directory entries",d);
-
-	spin_unlock(tmpfs_lock);
-	return d;
-}
-
-static void tmpfs_file_free(struct tmpfs_file * t) {
-	if (t->type == TMPFS_TYPE_LINK) {
-		printf("tmpfs: bad link free?\n");
-		free(t->target);
-	}
-	for (size_t i = 0; i < t->block_count; ++i) {
-		mmu_frame_clear((uintptr_t)t->blocks[i] * 0x1000);
+/**
+ * @brief Find the extent holding page @p page of @p t.
+ *
+ * Must be called with the file locked, and the page must exist.
+ */
+static struct tmpfs_extent * tmpfs_file_extent(struct tmpfs_file * t, size_t page) {
+	size_t lo = 0, hi = t->extent_count;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (t->extents[mid].start <= page) lo = mid;
+		else hi = mid;
 	}
+	return &t->extents[lo];
 }
 
-static void tmpfs_file_blocks_embiggen(struct tmpfs_file * t) {
-	t->pointers *= 2;
-	t->blocks = realloc(t->blocks, sizeof(char *) * t->pointers);
+/**
+ * @brief Make sure @p t has at least @p pages pages.
+ *
+ * Files grow by at least as much as they already have, up to
+ * TMPFS_EXTENT_MAX pages at a time, so a file that is written a
+ * bit at a time ends up in a handful of large extents rather than
+ * lots of single pages. New pages are zeroed, so holes read back
+ * as zeroes. Must be called with the file locked for writing.
+ */
+static int tmpfs_file_grow(struct tmpfs_file * t, size_t pages) {
+	while (t->pages < pages) {
+		size_t n = pages - t->pages;
+		if (n < t->pages) n = t->pages;
+		if (n > TMPFS_EXTENT_MAX) n = TMPFS_EXTENT_MAX;
+
+		uintptr_t frame = mmu_allocate_frames_upto(&n);
+		if (frame == (uintptr_t)-1) return -ENOSPC;
+		memset(mmu_map_from_physical(frame << 12), 0, n * BLOCKSIZE);
+
+		struct tmpfs_extent * last = t->extent_count ? &t->extents[t->extent_count - 1] : NULL;
+		if (last && last->frame + last->pages == frame) {
+			last->pages += n;
+		} else {
+			if (t->extent_count == t->extent_space) {
+				t->extent_space *= 2;
+				t->extents = realloc(t->extents, sizeof(struct tmpfs_extent) * t->extent_space);
+			}
+			t->extents[t->extent_count].frame = frame;
+			t->extents[t->extent_count].start = t->pages;
+			t->extents[t->extent_count].pages = n;
+			t->extent_count++;
+		}
+		t->pages += n;
+	}
+	return 0;
 }
 
-static char * tmpfs_file_getset_block(struct tmpfs_file * t, size_t blockid, int create) {
-	spin_lock(tmpfs_page_lock);
-
-	if (create) {
-		spin_lock(tmpfs_lock);
-		while (blockid >= t->pointers) {
-			tmpfs_file_blocks_embiggen(t);
-		}
-		while (blockid >= t->block_count) {
-			uintptr_t index = mmu_allocate_a_frame();
-			t->blocks[t->block_count] = index;
-			t->block_count += 1;
-		}
-		spin_unlock(tmpfs_lock);
-	} else {
-		if (blockid >= t->block_count) {
-			printf("tmpfs: not enough blocks?\n");
-			return NULL;
+/**
+ * @brief Copy between @p buffer and the file's pages, a whole extent at a time.
+ *
+ * Must be called with the file locked, and the range must be allocated.
+ */
+static void tmpfs_file_copy(struct tmpfs_file * t, off_t offset, size_t size, uint8_t * buffer, int write) {
+	size_t done = 0;
+	while (done < size) {
+		size_t at = offset + done;
+		struct tmpfs_extent * e = tmpfs_file_extent(t, at / BLOCKSIZE);
+		size_t within = at - e->start * BLOCKSIZE;
+		size_t run = e->pages * BLOCKSIZE - within;
+		if (run > size - done) run = size - done;
+
+		uint8_t * data = (uint8_t *)mmu_map_from_physical(e->frame << 12) + within;
+		if (write) {
+			memcpy(data, buffer + done, run);
+		} else {
+			memcpy(buffer + done, data, run);
 		}
+		done += run;
 	}
-
-	union PML * page = mmu_get_page((uintptr_t)buf_space,0);
-	/* This should be map_address? */
-	page->bits.writable = 1;
-	page->bits.user = 0;
-	page->bits.page = (uintptr_t)t->blocks[blockid];
-	page->bits.present = 1;
-	page->bits.size = 0;
-	mmu_invalidate((uintptr_t)buf_space);
-
-	return (char *)buf_space;
 }
 
-
 static ssize_t read_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
 
+	rwlock_read_lock(t->lock);
 	t->atime = now();
 
-	uint64_t end;
-	if ((size_t)offset + size > t->length) {
-		end = t->length;
-	} else {
-		end = offset + size;
+	if ((size_t)offset >= t->length) {
+		rwlock_read_unlock(t->lock);
+		return 0;
 	}
-	uint64_t start_block  = offset / BLOCKSIZE;
-	uint64_t end_block    = end / BLOCKSIZE;
-	uint64_t end_size     = end - end_block * BLOCKSIZE;
-	uint64_t size_to_read = end - offset;
-	if (start_block == end_block && (size_t)offset == end) return 0;
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 0);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), size_to_read);
-		spin_unlock(tmpfs_page_lock);
-		return size_to_read;
-	} else {
-		uint64_t block_offset;
-		uint64_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer, (uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), BLOCKSIZE - (offset % BLOCKSIZE));
-				spin_unlock(tmpfs_page_lock);
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, BLOCKSIZE);
-				spin_unlock(tmpfs_page_lock);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 0);
-			memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, end_size);
-			spin_unlock(tmpfs_page_lock);
-		}
+
+	if ((size_t)offset + size > t->length) {
+		size = t->length - offset;
 	}
-	return size_to_read;
+
+	tmpfs_file_copy(t, offset, size, buffer, 0);
+	rwlock_read_unlock(t->lock);
+	return size;
 }
 
 static ssize_t write_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
+	size_t end = offset + size;
 
+	rwlock_write_lock(t->lock);
 	t->atime = now();
 	t->mtime = t->atime;
 
-	uint64_t end;
-	if ((size_t)offset + size > t->length) {
-		t->length = offset + size;
+	if (tmpfs_file_grow(t, (end + BLOCKSIZE - 1) / BLOCKSIZE)) {
+		rwlock_write_unlock(t->lock);
+		return -ENOSPC;
 	}
-	end = offset + size;
-	uint64_t start_block  = offset / BLOCKSIZE;
-	uint64_t end_block    = end / BLOCKSIZE;
-	uint64_t end_size     = end - end_block * BLOCKSIZE;
-	uint64_t size_to_read = end - offset;
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 1);
-		memcpy((uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, size_to_read);
-		spin_unlock(tmpfs_page_lock);
-		return size_to_read;
-	} else {
-		uint64_t block_offset;
-		uint64_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy((uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, BLOCKSIZE - (offset % BLOCKSIZE));
-				spin_unlock(tmpfs_page_lock);
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), BLOCKSIZE);
-				spin_unlock(tmpfs_page_lock);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 1);
-			memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), end_size);
-			spin_unlock(tmpfs_page_lock);
-		}
+
+	tmpfs_file_copy(t, offset, size, buffer, 1);
+
+	if (end > t->length) {
+		t->length = end;
 	}
-	return size_to_read;
+	rwlock_write_unlock(t->lock);
+	return size;
 }
 
 static int chmod_tmpfs(fs_node_t * node, int mode) {
@@ -269,6 +353,7 @@ static int chmod_tmpfs(fs_node_t * node, int mode) {
 	/* XXX permissions */
 	t->mask = mode;
 
+	dcache_invalidate();
 	return 0;
 }
 
@@ -278,18 +363,27 @@ static int chown_tmpfs(fs_node_t * node, int uid, int gid) {
 	t->uid = uid;
 	t->gid = gid;
 
+	dcache_invalidate();
 	return 0;
 }
 
 static int truncate_tmpfs(fs_node_t * node) {
 	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
-	for (size_t i = 0; i < t->block_count; ++i) {
-		mmu_frame_clear((uintptr_t)t->blocks[i] * 0x1000);
-		t->blocks[i] = 0;
-	}
-	t->block_count = 0;
+	struct tmpfs_extent * empty = malloc(sizeof(struct tmpfs_extent) * TMPFS_EXTENTS_INITIAL);
+
+	/* Just swap the extents out while the file is locked; they're freed afterwards */
+	rwlock_write_lock(t->lock);
+	struct tmpfs_extent * extents = t->extents;
+	size_t count = t->extent_count;
+	t->extents = empty;
+	t->extent_count = 0;
+	t->extent_space = TMPFS_EXTENTS_INITIAL;
+	t->pages = 0;
 	t->length = 0;
-	t->mtime = node->atime;
+	t->mtime = now();
+	rwlock_write_unlock(t->lock);
+
+	tmpfs_extents_free(extents, count);
 	return 0;
 }
 
@@ -311,7 +405,7 @@ static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
 	fnode->atime = t->atime;
 	fnode->ctime = t->ctime;
 	fnode->mtime = t->mtime;
-	fnode->flags   = FS_FILE;
+	fnode->flags   = FS_FILE | FS_PAGECACHE;
 	fnode->read    = read_tmpfs;
 	fnode->write   = write_tmpfs;
 	fnode->open    = open_tmpfs;
@@ -328,6 +422,7 @@ static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
 
 static fs_node_t * tmpfs_from_link(struct tmpfs_file * t) {
 	fs_node_t * fnode = tmpfs_from_file(t);
+	fnode->flags   &= ~FS_PAGECACHE;
 	fnode->flags   |= FS_SYMLINK;
 	fnode->readlink = readlink_tmpfs;
 	fnode->read     = NULL;
@@ -339,9 +434,41 @@ static fs_node_t * tmpfs_from_link(struct tmpfs_file * t) {
 	return fnode;
 }
 
+static struct tmpfs_cursor * tmpfs_cursor_for(fs_node_t * node) {
+	struct tmpfs_cursor * cursor = (struct tmpfs_cursor *)(uintptr_t)node->impl;
+	if (!cursor) {
+		cursor = malloc(sizeof(struct tmpfs_cursor));
+		cursor->at = NULL;
+		node->impl = (uintptr_t)cursor;
+	}
+	return cursor;
+}
+
+/**
+ * @brief Find entry @p index (not counting . and ..) of @p d.
+ *
+ * Reading through in order carries on from where the cursor was left,
+ * unless something was removed since. Must hold the directory lock.
+ */
+static struct tmpfs_dirent * tmpfs_cursor_find(struct tmpfs_dir * d, struct tmpfs_cursor * cursor, uint64_t index) {
+	if (cursor->at && cursor->changes == d->changes && cursor->index + 1 == index) {
+		return cursor->at->next;
+	} else if (cursor->at && cursor->changes == d->changes && cursor->index == index) {
+		return cursor->at;
+	}
+	struct tmpfs_dirent * e = d->first;
+	for (uint64_t i = 0; e && i < index; ++i) e = e->next;
+	return e;
+}
+
+static void tmpfs_cursor_set(struct tmpfs_dir * d, struct tmpfs_cursor * cursor, struct tmpfs_dirent * e, uint64_t index) {
+	cursor->at = e;
+	cursor->index = index;
+	cursor->changes = d->changes;
+}
+
 static struct dirent * readdir_tmpfs(fs_node_t *node, uint64_t index) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
-	uint64_t i = 0;
 
 	if (index == 0) {
 		struct dirent * out = malloc(sizeof(struct dirent));
@@ -361,75 +488,126 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint64_t index) {
 
 	index -= 2;
 
-	if (index >= d->files->length) return NULL;
+	struct tmpfs_cursor * cursor = tmpfs_cursor_for(node);
+	struct dirent * out = malloc(sizeof(struct dirent));
+	memset(out, 0x00, sizeof(struct dirent));
 
-	foreach(f, d->files) {
-		if (i == index) {
-			struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-			struct dirent * out = malloc(sizeof(struct dirent));
-			memset(out, 0x00, sizeof(struct dirent));
-			out->d_ino = (uint64_t)t;
-			strcpy(out->d_name, t->name);
-			return out;
-		} else {
-			++i;
-		}
+	rwlock_read_lock(d->lock);
+
+	struct tmpfs_dirent * e = tmpfs_cursor_find(d, cursor, index);
+	if (!e) {
+		cursor->at = NULL;
+		rwlock_read_unlock(d->lock);
+		free(out);
+		return NULL;
+	}
+
+	tmpfs_cursor_set(d, cursor, e, index);
+	out->d_ino = (uint64_t)e->file;
+	strcpy(out->d_name, e->file->name);
+
+	rwlock_read_unlock(d->lock);
+	return out;
+}
+
+static ssize_t getdents_tmpfs(fs_node_t * node, uint64_t * index, struct dirent * out, size_t count) {
+	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
+	size_t n = 0;
+
+	for (; n < count && *index < 2; ++n, ++*index) {
+		memset(&out[n], 0, sizeof(struct dirent));
+		strcpy(out[n].d_name, *index ? ".." : ".");
+	}
+	if (n == count) return n;
+
+	struct tmpfs_cursor * cursor = tmpfs_cursor_for(node);
+
+	rwlock_read_lock(d->lock);
+	struct tmpfs_dirent * e = tmpfs_cursor_find(d, cursor, *index - 2);
+	for (; e && n < count; e = e->next, ++n, ++*index) {
+		out[n].d_ino = (uint64_t)e->file;
+		strcpy(out[n].d_name, e->file->name);
+		tmpfs_cursor_set(d, cursor, e, *index - 2);
+	}
+	rwlock_read_unlock(d->lock);
+
+	return n;
+}
+
+static void close_tmpfs_dir(fs_node_t * node) {
+	if (node->impl) {
+		free((void *)(uintptr_t)node->impl);
+		node->impl = 0;
 	}
-	return NULL;
 }
 
 static fs_node_t * finddir_tmpfs(fs_node_t * node, char * name) {
 	if (!name) return NULL;
 
 	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
-
-	spin_lock(tmpfs_lock);
-
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			switch (t->type) {
-				case TMPFS_TYPE_FILE:
-					return tmpfs_from_file(t);
-				case TMPFS_TYPE_LINK:
-					return tmpfs_from_link(t);
-				case TMPFS_TYPE_DIR:
-					return tmpfs_from_dir((struct tmpfs_dir *)t);
-			}
-			return NULL;
+	fs_node_t * out = NULL;
+
+	rwlock_read_lock(d->lock);
+	struct tmpfs_dirent * e = tmpfs_dir_find(d, name, tmpfs_hash(name));
+	if (e) {
+		switch (e->file->type) {
+			case TMPFS_TYPE_FILE:
+				out = tmpfs_from_file(e->file);
+				break;
+			case TMPFS_TYPE_LINK:
+				out = tmpfs_from_link(e->file);
+				break;
+			case TMPFS_TYPE_DIR:
+				out = tmpfs_from_dir((struct tmpfs_dir *)e->file);
+				break;
 		}
 	}
+	rwlock_read_unlock(d->lock);
 
-	spin_unlock(tmpfs_lock);
-
-	return NULL;
+	return out;
 }
 
 static int unlink_tmpfs(fs_node_t * node, char * name) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
-	int i = -1, j = 0;
-	spin_lock(tmpfs_lock);
-
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			tmpfs_file_free(t);
-			free(t);
-			i = j;
-			break;
-		}
-		j++;
-	}
+	uint32_t hash = tmpfs_hash(name);
 
-	if (i >= 0) {
-		list_remove(d->files, i);
-	} else {
-		spin_unlock(tmpfs_lock);
+	rwlock_write_lock(d->lock);
+
+	struct tmpfs_dirent * e = tmpfs_dir_find(d, name, hash);
+	if (!e) {
+		rwlock_write_unlock(d->lock);
 		return -ENOENT;
 	}
 
-	spin_unlock(tmpfs_lock);
+	if (e->file->type == TMPFS_TYPE_DIR && ((struct tmpfs_dir *)e->file)->count) {
+		rwlock_write_unlock(d->lock);
+		return -ENOTEMPTY;
+	}
+
+	struct tmpfs_dirent ** link = &d->buckets[hash & (d->bucket_count - 1)];
+	while (*link != e) link = &(*link)->chain;
+	*link = e->chain;
+
+	if (e->prev) e->prev->next = e->next;
+	else d->first = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else d->last = e->prev;
+
+	d->count--;
+	d->changes++;
+	d->mtime = now();
+
+	rwlock_write_unlock(d->lock);
+
+	struct tmpfs_file * t = e->file;
+	free(e);
+
+	if (t->type == TMPFS_TYPE_FILE) {
+		pagecache_invalidate(t, 0);
+	}
+	tmpfs_node_free(t);
+
+	dcache_invalidate();
 	return 0;
 }
 
@@ -438,26 +616,14 @@ static int create_tmpfs(fs_node_t *parent, char *name, mode_t permission) {
 
 	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
 
-	spin_lock(tmpfs_lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			return -EEXIST; /* Already exists */
-		}
-	}
-	spin_unlock(tmpfs_lock);
-
 	struct tmpfs_file * t = tmpfs_file_new(name);
 	t->mask = permission;
 	t->uid = this_core->current_process->user;
 	t->gid = this_core->current_process->user;
 
-	spin_lock(tmpfs_lock);
-	list_insert(d->files, t);
-	spin_unlock(tmpfs_lock);
-
-	return 0;
+	int ret = tmpfs_dir_add(d, t);
+	if (ret) tmpfs_node_free(t);
+	return ret;
 }
 
 static int mkdir_tmpfs(fs_node_t * parent, char * name, mode_t permission) {
@@ -466,26 +632,14 @@ static int mkdir_tmpfs(fs_node_t * parent, char * name, mode_t permission) {
 
 	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
 
-	spin_lock(tmpfs_lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(tmpfs_lock);
-			return -EEXIST; /* Already exists */
-		}
-	}
-	spin_unlock(tmpfs_lock);
-
 	struct tmpfs_dir * out = tmpfs_dir_new(name, d);
 	out->mask = permission;
 	out->uid  = this_core->current_process->user;
 	out->gid  = this_core->current_process->user;
 
-	spin_lock(tmpfs_lock);
-	list_insert(d->files, out);
-	spin_unlock(tmpfs_lock);
-
-	return 0;
+	int ret = tmpfs_dir_add(d, (struct tmpfs_file *)out);
+	if (ret) tmpfs_node_free((struct tmpfs_file *)out);
+	return ret;
 }
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
@@ -500,12 +654,13 @@ static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
 	fnode->atime   = d->atime;
 	fnode->mtime   = d->mtime;
 	fnode->ctime   = d->ctime;
-	fnode->flags   = FS_DIRECTORY;
+	fnode->flags   = FS_DIRECTORY | FS_DCACHE; /* files aren't cached; their size and times change */
 	fnode->read    = NULL;
 	fnode->write   = NULL;
 	fnode->open    = NULL;
-	fnode->close   = NULL;
+	fnode->close   = close_tmpfs_dir;
 	fnode->readdir = readdir_tmpfs;
+	fnode->getdents = getdents_tmpfs;
 	fnode->finddir = finddir_tmpfs;
 	fnode->create  = create_tmpfs;
 	fnode->unlink  = unlink_tmpfs;
@@ -551,7 +706,6 @@ fs_node_t * tmpfs_mount(const char * device, const char * mount_path) {
 }
 
 void tmpfs_register_init(void) {
-	buf_space = (void*)valloc(BLOCKSIZE);
 	vfs_register("tmpfs", tmpfs_mount);
 }
 
@@ -21,6 +21,7 @@
 #include <kernel/time.h>
 #include <sys/ioctl.h>
 #include <sys/termios.h>
+#include <poll.h>
 #include <sys/signal_defs.h>
 
 #define TTY_BUFFER_SIZE 4096
@@ -438,6 +439,37 @@ static int wait_pty_slave(fs_node_t * node, void * process) {
 	return 0;
 }
 
+/* The master reads what the slave wrote to out, and writes into in. */
+static int pollcheck_pty_master(fs_node_t * node) {
+	pty_t * pty = (pty_t *)node->device;
+	return (ring_buffer_unread(pty->out) ? POLLIN : 0) | (ring_buffer_available(pty->in) ? POLLOUT : 0);
+}
+
+static int pollcheck_pty_slave(fs_node_t * node) {
+	pty_t * pty = (pty_t *)node->device;
+	return (ring_buffer_unread(pty->in) ? POLLIN : 0) | (ring_buffer_available(pty->out) ? POLLOUT : 0);
+}
+
+static int pollwait_pty_master(fs_node_t * node, void * waiter, int events) {
+	pty_t * pty = (pty_t *)node->device;
+	if (events & POLLIN) ring_buffer_select_wait(pty->out, waiter);
+	if (events & POLLOUT) ring_buffer_space_wait(pty->in, waiter);
+	return 0;
+}
+
+static int pollwait_pty_slave(fs_node_t * node, void * waiter, int events) {
+	pty_t * pty = (pty_t *)node->device;
+	if (events & POLLIN) ring_buffer_select_wait(pty->in, waiter);
+	if (events & POLLOUT) ring_buffer_space_wait(pty->out, waiter);
+	return 0;
+}
+
+static void pollunwait_pty(fs_node_t * node, void * waiter) {
+	pty_t * pty = (pty_t *)node->device;
+	ring_buffer_unwait(pty->in, waiter);
+	ring_buffer_unwait(pty->out, waiter);
+}
+
 fs_node_t * pty_master_create(pty_t * pty) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
@@ -454,6 +486,9 @@ fs_node_t * pty_master_create(pty_t * pty) {
 	fnode->close = close_pty_master;
 	fnode->selectcheck = check_pty_master;
 	fnode->selectwait  = wait_pty_master;
+	fnode->pollcheck   = pollcheck_pty_master;
+	fnode->pollwait    = pollwait_pty_master;
+	fnode->pollunwait  = pollunwait_pty;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
 	fnode->ioctl = ioctl_pty_master;
@@ -483,6 +518,9 @@ fs_node_t * pty_slave_create(pty_t * pty) {
 	fnode->close = close_pty_slave;
 	fnode->selectcheck = check_pty_slave;
 	fnode->selectwait  = wait_pty_slave;
+	fnode->pollcheck   = pollcheck_pty_slave;
+	fnode->pollwait    = pollwait_pty_slave;
+	fnode->pollunwait  = pollunwait_pty;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
 	fnode->ioctl = ioctl_pty_slave;
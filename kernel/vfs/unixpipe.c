@@ -19,8 +19,13 @@
 
 #include <sys/signal_defs.h>
 #include <sys/ioctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
-#define UNIX_PIPE_BUFFER 512
+#define UNIX_PIPE_BUFFER     4096
+#define UNIX_PIPE_BUFFER_MIN 512
+#define UNIX_PIPE_BUFFER_MAX (1024 * 1024)
 
 struct unix_pipe {
 	fs_node_t * read_end;
@@ -38,20 +43,17 @@ static void close_complete(struct unix_pipe * self) {
 
 static ssize_t read_unixpipe(fs_node_t * node, off_t offset, size_t size, uint8_t *buffer) {
 	struct unix_pipe * self = node->device;
-	size_t read = 0;
 
-	while (read < size) {
+	if (!size) return 0;
+
+	/* Return whatever is there as soon as there is something */
+	while (1) {
 		if (self->write_closed && !ring_buffer_unread(self->buffer)) {
-			return read;
-		}
-		size_t r = ring_buffer_read(self->buffer, 1, buffer+read);
-		if (r && *((char *)(buffer + read)) == '\n') {
-			return read+r;
+			return 0;
 		}
-		read += r;
+		size_t r = ring_buffer_read(self->buffer, size, buffer);
+		if (r) return r;
 	}
-
-	return read;
 }
 
 static ssize_t write_unixpipe(fs_node_t * node, off_t offset, size_t size, uint8_t *buffer) {
@@ -65,19 +67,43 @@ static ssize_t write_unixpipe(fs_node_t * node, off_t offset, size_t size, uint8
 
 			return written;
 		}
-		size_t w = ring_buffer_write(self->buffer, 1, buffer+written);
-		written += w;
+		written += ring_buffer_write(self->buffer, size - written, buffer + written);
 	}
 
 	return written;
 }
 
+/**
+ * @brief Get or set the capacity of a pipe, through fcntl.
+ */
+static int ioctl_unixpipe(fs_node_t * node, unsigned long request, void * argp) {
+	struct unix_pipe * self = node->device;
+
+	switch (request) {
+		case F_GETPIPE_SZ:
+			return self->buffer->size - 1;
+		case F_SETPIPE_SZ: {
+			if (!argp) return -EFAULT;
+			int requested = *(int *)argp;
+			if (requested < 0) return -EINVAL;
+			size_t size = requested;
+			if (size < UNIX_PIPE_BUFFER_MIN) size = UNIX_PIPE_BUFFER_MIN;
+			if (size > UNIX_PIPE_BUFFER_MAX) return -EINVAL;
+			int ret = ring_buffer_resize(self->buffer, size);
+			return ret ? ret : (int)size;
+		}
+		default:
+			return -EINVAL;
+	}
+}
+
 static void close_read_pipe(fs_node_t * node) {
 	struct unix_pipe * self = node->device;
 
 	self->read_closed = 1;
 	if (!self->write_closed) {
 		ring_buffer_interrupt(self->buffer);
+		ring_buffer_alert_space(self->buffer);
 	}
 }
 
@@ -108,6 +134,36 @@ static int wait_pipe(fs_node_t * node, void * process) {
 	return 0;
 }
 
+static int pollcheck_read_pipe(fs_node_t * node) {
+	struct unix_pipe * self = node->device;
+	if (ring_buffer_unread(self->buffer) > 0) return POLLIN;
+	if (self->write_closed) return POLLIN | POLLHUP;
+	return 0;
+}
+
+static int pollcheck_write_pipe(fs_node_t * node) {
+	struct unix_pipe * self = node->device;
+	if (self->read_closed) return POLLOUT | POLLERR;
+	return ring_buffer_available(self->buffer) ? POLLOUT : 0;
+}
+
+static int pollwait_read_pipe(fs_node_t * node, void * waiter, int events) {
+	struct unix_pipe * self = node->device;
+	ring_buffer_select_wait(self->buffer, waiter);
+	return 0;
+}
+
+static int pollwait_write_pipe(fs_node_t * node, void * waiter, int events) {
+	struct unix_pipe * self = node->device;
+	ring_buffer_space_wait(self->buffer, waiter);
+	return 0;
+}
+
+static void pollunwait_pipe(fs_node_t * node, void * waiter) {
+	struct unix_pipe * self = node->device;
+	ring_buffer_unwait(self->buffer, waiter);
+}
+
 
 int make_unix_pipe(fs_node_t ** pipes) {
 	size_t size = UNIX_PIPE_BUFFER;
@@ -133,16 +189,26 @@ int make_unix_pipe(fs_node_t ** pipes) {
 	pipes[0]->close = close_read_pipe;
 	pipes[1]->close = close_write_pipe;
 
+	pipes[0]->ioctl = ioctl_unixpipe;
+	pipes[1]->ioctl = ioctl_unixpipe;
+
 	/* Read end can wait */
 	pipes[0]->selectcheck = check_pipe;
 	pipes[0]->selectwait = wait_pipe;
 
+	pipes[0]->pollcheck = pollcheck_read_pipe;
+	pipes[0]->pollwait = pollwait_read_pipe;
+	pipes[1]->pollcheck = pollcheck_write_pipe;
+	pipes[1]->pollwait = pollwait_write_pipe;
+	pipes[0]->pollunwait = pollunwait_pipe;
+	pipes[1]->pollunwait = pollunwait_pipe;
+
 	struct unix_pipe * internals = malloc(sizeof(struct unix_pipe));
 	internals->read_end = pipes[0];
 	internals->write_end = pipes[1];
 	internals->read_closed = 0;
 	internals->write_closed = 0;
-	internals->buffer = ring_buffer_create(size);
+	internals->buffer = ring_buffer_create(size + 1);
 
 	pipes[0]->device = internals;
 	pipes[1]->device = internals;
@@ -19,6 +19,9 @@
 #include <kernel/vfs.h>
 #include <kernel/time.h>
 #include <kernel/process.h>
+#include <kernel/pagecache.h>
+#include <kernel/mmu.h>
+#include <kernel/eventpoll.h>
 
 #include <kernel/list.h>
 #include <kernel/hashmap.h>
@@ -136,6 +139,53 @@ int selectwait_fs(fs_node_t * node, void * process) {
 	return -EINVAL;
 }
 
+/**
+ * @brief Find out which POLL* conditions @p node is in.
+ *
+ * Nodes that only know about selectcheck are readable when it says
+ * so, and writable whenever they can be written to at all, which is
+ * also what regular files are: always both.
+ */
+int pollcheck_fs(fs_node_t * node) {
+	if (!node) return POLLNVAL;
+
+	if (node->pollcheck) {
+		return node->pollcheck(node);
+	}
+
+	int out = node->write ? POLLOUT : 0;
+	if (selectcheck_fs(node) <= 0) out |= POLLIN;
+	return out;
+}
+
+/**
+ * @brief Have @p waiter alerted when @p node may have become ready
+ *        for any of @p events.
+ *
+ * Nodes without a pollwait can only say when they become readable.
+ */
+int pollwait_fs(fs_node_t * node, void * waiter, int events) {
+	if (!node) return -ENOENT;
+
+	if (node->pollwait) {
+		return node->pollwait(node, waiter, events);
+	}
+
+	return selectwait_fs(node, waiter);
+}
+
+/**
+ * @brief Take @p waiter back off whatever list pollwait_fs put it on.
+ *
+ * For waiters that are going away without having been alerted. Nodes
+ * that can't do this leave the entry to be dropped when they next alert.
+ */
+void pollunwait_fs(fs_node_t * node, void * waiter) {
+	if (node && node->pollunwait) {
+		node->pollunwait(node, waiter);
+	}
+}
+
 /**
  * @brief Read a file system node based on its underlying type.
  *
@@ -147,6 +197,9 @@ int selectwait_fs(fs_node_t * node, void * process) {
  */
 ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
+	if (node->flags & FS_PAGECACHE) {
+		return pagecache_read(node, offset, size, buffer);
+	}
 	if (node->read) {
 		return node->read(node, offset, size, buffer);
 	} else {
@@ -165,6 +218,9 @@ ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
  */
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
+	if (node->flags & FS_PAGECACHE) {
+		return pagecache_write(node, offset, size, buffer);
+	}
 	if (node->write) {
 		return node->write(node, offset, size, buffer);
 	} else {
@@ -172,6 +228,67 @@ ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	}
 }
 
+/**
+ * @brief Move data from one file system node to another without going through userspace.
+ *
+ * When the source is in the page cache, each cached page is handed
+ * straight to the destination's write, holding a reference to it
+ * for the duration, so the data is only copied once. Anything else
+ * is read into a kernel buffer a page at a time and written from there.
+ *
+ * @param out        Node to write to
+ * @param out_offset Where to write; advanced by the amount moved
+ * @param in         Node to read from
+ * @param in_offset  Where to read from; advanced by the amount moved
+ * @param count      How much to move, at most
+ * @returns Bytes moved, or an error if nothing could be.
+ */
+ssize_t splice_fs(fs_node_t * out, off_t * out_offset, fs_node_t * in, off_t * in_offset, size_t count) {
+	if (!out || !in) return -ENOENT;
+
+	uint8_t * buffer = NULL;
+	size_t done = 0;
+	ssize_t err = 0;
+
+	while (done < count) {
+		size_t want = MIN(count - done, (size_t)(0x1000 - (*in_offset & 0xFFF)));
+		uint8_t * data;
+		size_t valid = 0;
+		uintptr_t frame = 0;
+		size_t got;
+
+		if ((in->flags & FS_PAGECACHE) && *in_offset >= 0) {
+			frame = pagecache_frame(in, *in_offset, &valid);
+		}
+
+		if (frame) {
+			size_t in_page = *in_offset & 0xFFF;
+			got = valid > in_page ? MIN(want, valid - in_page) : 0;
+			data = (uint8_t *)mmu_map_from_physical(frame << 12) + in_page;
+		} else {
+			if (!buffer) buffer = malloc(0x1000);
+			ssize_t r = read_fs(in, *in_offset, want, buffer);
+			if (r < 0) err = r;
+			got = r > 0 ? (size_t)r : 0;
+			data = buffer;
+		}
+
+		ssize_t w = got ? write_fs(out, *out_offset, got, data) : 0;
+		if (frame) mmu_frame_unref(frame);
+
+		if (w < 0) err = w;
+		if (w <= 0) break;
+
+		*in_offset += w;
+		*out_offset += w;
+		done += w;
+		if ((size_t)w < got || got < want) break;
+	}
+
+	if (buffer) free(buffer);
+	return done ? (ssize_t)done : err;
+}
+
 /**
  * @brief set the size of a file to 9
  *
@@ -181,7 +298,11 @@ int truncate_fs(fs_node_t * node) {
 	if (!node) return -ENOENT;
 
 	if (node->truncate) {
-		return node->truncate(node);
+		int ret = node->truncate(node);
+		if (node->flags & FS_PAGECACHE) {
+			pagecache_invalidate(node->device, node->inode);
+		}
+		return ret;
 	}
 
 	return -EINVAL;
@@ -234,16 +355,20 @@ void close_fs(fs_node_t *node) {
 
 	spin_lock(tmp_refcount_lock);
 	node->refcount--;
-	if (node->refcount == 0) {
+	int last = node->refcount == 0;
+	spin_unlock(tmp_refcount_lock);
+
+	/* Nobody else has it now, and close methods may close other nodes */
+	if (last) {
 		debug_print(NOTICE, "Node refcount [%s] is now 0: %ld", node->name, node->refcount);
 
 		if (node->close) {
 			node->close(node);
 		}
 
+		eventpoll_forget(node);
 		free(node);
 	}
-	spin_unlock(tmp_refcount_lock);
 }
 
 /**
@@ -286,6 +411,37 @@ struct dirent *readdir_fs(fs_node_t *node, unsigned long index) {
 	}
 }
 
+/**
+ * @brief Read up to @p count entries of a directory into @p out.
+ *
+ * @p cursor says where to start, and is moved past what was read; it
+ * starts at 0 and otherwise means whatever the driver wants it to.
+ * Drivers without a getdents get one readdir call per entry, with
+ * the cursor as the index.
+ *
+ * @returns the number of entries read, 0 at the end, or an error.
+ */
+ssize_t getdents_fs(fs_node_t *node, uint64_t * cursor, struct dirent * out, size_t count) {
+	if (!node) return -ENOENT;
+	if (!(node->flags & FS_DIRECTORY)) return -ENOTDIR;
+
+	if (node->getdents) {
+		return node->getdents(node, cursor, out, count);
+	}
+
+	if (!node->readdir) return 0;
+
+	size_t n = 0;
+	while (n < count) {
+		struct dirent * entry = node->readdir(node, *cursor);
+		if (!entry) break;
+		memcpy(&out[n++], entry, sizeof(struct dirent));
+		free(entry);
+		(*cursor)++;
+	}
+	return n;
+}
+
 /**
  * @brief Find the requested file in the directory and return an fs_node for it
  *
@@ -821,6 +977,7 @@ void * vfs_mount(const char * path, fs_node_t * local_root) {
 
 	free(p);
 	spin_unlock(tmp_vfs_lock);
+	dcache_invalidate();
 	return ret_val;
 }
 
@@ -1064,7 +1221,7 @@ fs_node_t *kopen_recur(const char *filename, uint64_t flags, uint64_t symlink_de
 		}
 		/* We are still searching... */
 		debug_print(INFO, "... Searching for %s", path_offset);
-		fs_node_t * node_next = finddir_fs(node_ptr, path_offset);
+		fs_node_t * node_next = dcache_lookup(node_ptr, path_offset);
 		free(node_ptr); /* Always a clone or an unopened thing */
 		node_ptr = node_next;
 		/* Search the active directory for the requested directory */
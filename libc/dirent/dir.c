@@ -1,12 +1,20 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 #include <syscall.h>
 #include <syscall_nums.h>
 #include <errno.h>
 #include <bits/dirent.h>
 
-DEFN_SYSCALL3(readdir, SYS_READDIR, int, int, void *);
+/* How many entries readdir asks the kernel for at a time */
+#define DIR_BUFFER_ENTRIES 32
+
+DEFN_SYSCALL3(getdents, SYS_GETDENTS, int, struct dirent *, size_t);
+
+int getdents(int fd, struct dirent * entries, size_t size) {
+	__sets_errno(syscall_getdents(fd, entries, size));
+}
 
 DIR * opendir (const char * dirname) {
 	int fd = open(dirname, O_RDONLY);
@@ -17,33 +25,34 @@ DIR * opendir (const char * dirname) {
 
 	DIR * dir = (DIR *)malloc(sizeof(DIR));
 	dir->fd = fd;
-	dir->cur_entry = -1;
+	dir->cur_entry = 0;
+	dir->entries = 0;
+	dir->buffer = malloc(sizeof(struct dirent) * DIR_BUFFER_ENTRIES);
 	return dir;
 }
 
 int closedir (DIR * dir) {
 	if (dir && (dir->fd != -1)) {
-		return close(dir->fd);
+		int ret = close(dir->fd);
+		free(dir->buffer);
+		free(dir);
+		return ret;
 	} else {
 		return -EBADF;
 	}
 }
 
 struct dirent * readdir (DIR * dirp) {
-	static struct dirent ent;
-
-	int ret = syscall_readdir(dirp->fd, ++dirp->cur_entry, &ent);
-	if (ret < 0) {
-		errno = -ret;
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
-	}
-
-	if (ret == 0) {
-		/* end of directory */
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
+	if (dirp->cur_entry == dirp->entries) {
+		int ret = getdents(dirp->fd, dirp->buffer, sizeof(struct dirent) * DIR_BUFFER_ENTRIES);
+		if (ret <= 0) {
+			/* end of directory, or errno was set by getdents */
+			dirp->cur_entry = dirp->entries = 0;
+			return NULL;
+		}
+		dirp->cur_entry = 0;
+		dirp->entries = ret / sizeof(struct dirent);
 	}
 
-	return &ent;
+	return &dirp->buffer[dirp->cur_entry++];
 }
@@ -13,6 +13,7 @@
 
 #include <sys/wait.h>
 #include <sys/sysfunc.h>
+#include <sys/futex.h>
 
 DEFN_SYSCALL3(clone, SYS_CLONE, uintptr_t, uintptr_t, void *);
 DEFN_SYSCALL0(gettid, SYS_GETTID);
@@ -87,22 +88,36 @@ void pthread_cleanup_pop(int execute) {
 	/* do nothing */
 }
 
+/*
+ * Mutexes are futexes with three states: 0 is unlocked, 1 is locked,
+ * and 2 is locked with threads that may be waiting. Uncontended
+ * locking and unlocking never enter the kernel; unlocking a mutex
+ * in state 2 wakes one waiter, which takes the lock in state 2 as
+ * it can't know whether it was the last one.
+ */
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	while (__sync_lock_test_and_set(mutex, 0x01)) {
-		syscall_yield();
-	}
+	int c = __sync_val_compare_and_swap(mutex, 0, 1);
+	if (!c) return 0;
+	do {
+		if (c == 2 || __sync_val_compare_and_swap(mutex, 1, 2) != 0) {
+			futex(mutex, FUTEX_WAIT, 2);
+		}
+	} while ((c = __sync_val_compare_and_swap(mutex, 0, 2)) != 0);
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-	if (__sync_lock_test_and_set(mutex, 0x01)) {
+	if (__sync_val_compare_and_swap(mutex, 0, 1)) {
 		return EBUSY;
 	}
 	return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-	__sync_lock_release(mutex);
+	if (__sync_fetch_and_sub(mutex, 1) != 1) {
+		__sync_lock_release(mutex);
+		futex(mutex, FUTEX_WAKE, 1);
+	}
 	return 0;
 }
 
@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <sys/futex.h>
+
+int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count) {
+	if (!count) return EINVAL;
+	barrier->lock = 0;
+	barrier->count = count;
+	barrier->waiting = 0;
+	barrier->generation = 0;
+	return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t *barrier) {
+	return 0;
+}
+
+int pthread_barrier_wait(pthread_barrier_t *barrier) {
+	pthread_mutex_lock(&barrier->lock);
+	int generation = barrier->generation;
+
+	if (++barrier->waiting == barrier->count) {
+		/* Last one in; start the next round and release everyone else. */
+		barrier->waiting = 0;
+		__sync_fetch_and_add(&barrier->generation, 1);
+		pthread_mutex_unlock(&barrier->lock);
+		futex(&barrier->generation, FUTEX_WAKE, INT32_MAX);
+		return PTHREAD_BARRIER_SERIAL_THREAD;
+	}
+
+	pthread_mutex_unlock(&barrier->lock);
+	while (barrier->generation == generation) {
+		futex(&barrier->generation, FUTEX_WAIT, generation);
+	}
+	return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <sys/futex.h>
+
+/*
+ * Condition variables are a sequence number that waiters sleep on.
+ * Signalling bumps the number before waking anyone, so a waiter that
+ * has released the mutex but not yet gone to sleep will see the
+ * change and return instead of missing the wakeup.
+ */
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+	cond->seq = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond) {
+	return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	int seq = cond->seq;
+
+	pthread_mutex_unlock(mutex);
+	futex(&cond->seq, FUTEX_WAIT, seq);
+
+	/* Other threads may have been woken with us, so take the mutex as contended. */
+	while (__sync_lock_test_and_set(mutex, 2)) {
+		futex(mutex, FUTEX_WAIT, 2);
+	}
+
+	return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	futex(&cond->seq, FUTEX_WAKE, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	futex(&cond->seq, FUTEX_WAKE, INT32_MAX);
+	return 0;
+}
@@ -8,13 +8,18 @@
 #include <errno.h>
 
 #include <sys/wait.h>
+#include <sys/futex.h>
 
-#define ACQUIRE_LOCK() do { while (__sync_lock_test_and_set(&lock->atomic_lock, 0x01)) { syscall_yield(); } } while (0)
-#define RELEASE_LOCK() do { __sync_lock_release(&lock->atomic_lock); } while (0)
+/*
+ * The reader count doubles as the futex word: it is the number of
+ * readers holding the lock, or -1 while a writer holds it. Threads
+ * that can't take the lock sleep until the count changes; unlocking
+ * only enters the kernel if someone has registered as waiting.
+ */
 
 int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 	lock->readers = 0;
-	lock->atomic_lock = 0;
+	lock->waiters = 0;
 	if (args != NULL) {
 		fprintf(stderr, "pthread: pthread_rwlock_init arg unsupported\n");
 		return 1;
@@ -22,37 +27,50 @@ int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 	return 0;
 }
 
+static void rwlock_wait(pthread_rwlock_t * lock, int readers) {
+	__sync_fetch_and_add(&lock->waiters, 1);
+	futex(&lock->readers, FUTEX_WAIT, readers);
+	__sync_fetch_and_sub(&lock->waiters, 1);
+}
+
 int pthread_rwlock_wrlock(pthread_rwlock_t * lock) {
-	ACQUIRE_LOCK();
 	while (1) {
-		if (lock->readers == 0) {
-			lock->readers = -1;
+		int readers = __sync_val_compare_and_swap(&lock->readers, 0, -1);
+		if (readers == 0) {
 			lock->writerPid = syscall_getpid();
-			RELEASE_LOCK();
 			return 0;
 		}
-		syscall_yield();
+		rwlock_wait(lock, readers);
 	}
 }
 
 int pthread_rwlock_rdlock(pthread_rwlock_t * lock) {
-	ACQUIRE_LOCK();
 	while (1) {
-		if (lock->readers >= 0) {
-			lock->readers++;
-			RELEASE_LOCK();
-			return 0;
+		int readers = lock->readers;
+		if (readers >= 0) {
+			if (__sync_bool_compare_and_swap(&lock->readers, readers, readers + 1)) {
+				return 0;
+			}
+			continue;
 		}
-		syscall_yield();
+		rwlock_wait(lock, readers);
 	}
 }
 
 int pthread_rwlock_unlock(pthread_rwlock_t * lock) {
-	ACQUIRE_LOCK();
-	if (lock->readers > 0) lock->readers--;
-	else if (lock->readers < 0) lock->readers = 0;
-	else fprintf(stderr, "pthread: bad lock state detected\n");
-	RELEASE_LOCK();
+	int readers = lock->readers;
+	if (readers > 0) {
+		if (__sync_sub_and_fetch(&lock->readers, 1) != 0) return 0;
+	} else if (readers < 0) {
+		__sync_lock_release(&lock->readers);
+	} else {
+		fprintf(stderr, "pthread: bad lock state detected\n");
+		return 0;
+	}
+
+	if (lock->waiters) {
+		futex(&lock->readers, FUTEX_WAKE, INT32_MAX);
+	}
 	return 0;
 }
 
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#include <sys/futex.h>
+
+int sem_init(sem_t * sem, int pshared, unsigned int value) {
+	if (pshared) {
+		/* Futexes are private to an address space. */
+		errno = ENOSYS;
+		return -1;
+	}
+	sem->value = value;
+	sem->waiters = 0;
+	return 0;
+}
+
+int sem_destroy(sem_t * sem) {
+	return 0;
+}
+
+int sem_trywait(sem_t * sem) {
+	int value;
+	while ((value = sem->value) > 0) {
+		if (__sync_bool_compare_and_swap(&sem->value, value, value - 1)) return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+int sem_wait(sem_t * sem) {
+	while (1) {
+		int value = sem->value;
+		if (value > 0) {
+			if (__sync_bool_compare_and_swap(&sem->value, value, value - 1)) return 0;
+			continue;
+		}
+		__sync_fetch_and_add(&sem->waiters, 1);
+		int ret = futex(&sem->value, FUTEX_WAIT, 0);
+		__sync_fetch_and_sub(&sem->waiters, 1);
+		if (ret < 0 && errno == EINTR) return -1;
+	}
+}
+
+int sem_post(sem_t * sem) {
+	__sync_fetch_and_add(&sem->value, 1);
+	if (sem->waiters) {
+		futex(&sem->value, FUTEX_WAKE, 1);
+	}
+	return 0;
+}
+
+int sem_getvalue(sem_t * sem, int * sval) {
+	*sval = sem->value;
+	return 0;
+}
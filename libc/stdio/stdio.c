@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 struct _FILE {
 	int fd;
@@ -17,6 +18,7 @@ struct _FILE {
 	int eof;
 	int bufsiz;
 	long last_read_start;
+	long read_pos; /* where the next read starts, or -1 if not known yet, or -2 if not seekable */
 	char * _name;
 
 	char * write_buf;
@@ -36,6 +38,7 @@ FILE _stdin = {
 	.ungetc = -1,
 	.eof = 0,
 	.last_read_start = 0,
+	.read_pos = -1,
 	.bufsiz = BUFSIZ,
 
 	.wbufsiz = BUFSIZ,
@@ -52,6 +55,7 @@ FILE _stdout = {
 	.ungetc = -1,
 	.eof = 0,
 	.last_read_start = 0,
+	.read_pos = -1,
 	.bufsiz = BUFSIZ,
 
 	.wbufsiz = BUFSIZ,
@@ -68,6 +72,7 @@ FILE _stderr = {
 	.ungetc = -1,
 	.eof = 0,
 	.last_read_start = 0,
+	.read_pos = -1,
 	.bufsiz = BUFSIZ,
 
 	.wbufsiz = BUFSIZ,
@@ -131,6 +136,7 @@ int fflush(FILE * stream) {
 	if (stream->written) {
 		syscall_write(stream->fd, stream->write_buf, stream->written);
 		stream->written = 0;
+		if (stream->read_pos >= 0) stream->read_pos = -1;
 	}
 	return 0;
 }
@@ -138,18 +144,31 @@ int fflush(FILE * stream) {
 static size_t write_bytes(FILE * f, char * buf, size_t len) {
 	if (!f->write_buf) return 0;
 
-	size_t newBytes = 0;
-	while (len > 0) {
-		f->write_buf[f->written++] = *buf;
-		if (f->written == (size_t)f->wbufsiz || *buf == '\n') {
-			fflush(f);
-		}
-		newBytes++;
-		buf++;
-		len--;
+	/* Everything up to the last newline goes out now, as does anything that won't fit */
+	char * newline = memrchr(buf, '\n', len);
+	size_t out = newline ? (size_t)(newline - buf) + 1 : 0;
+	if (f->written + (len - out) > f->wbufsiz) {
+		out = len;
+	}
+
+	if (out) {
+		/* Send what was already buffered along with it, in one go */
+		struct iovec iov[2] = {
+			{ f->write_buf, f->written },
+			{ buf, out },
+		};
+		writev(f->fd, iov, 2);
+		f->written = 0;
+		if (f->read_pos >= 0) f->read_pos = -1;
 	}
 
-	return newBytes;
+	memcpy(f->write_buf + f->written, buf + out, len - out);
+	f->written += len - out;
+	if (f->written == f->wbufsiz) {
+		fflush(f);
+	}
+
+	return len;
 }
 
 static size_t read_bytes(FILE * f, char * out, size_t len) {
@@ -172,8 +191,16 @@ static size_t read_bytes(FILE * f, char * out, size_t len) {
 			if (f->offset == f->bufsiz) {
 				f->offset = 0;
 			}
-			f->last_read_start = syscall_seek(f->fd, 0, SEEK_CUR);
+			/* Only ask the kernel where we are once; after that, keep count */
+			if (f->read_pos == -1) {
+				f->read_pos = syscall_seek(f->fd, 0, SEEK_CUR);
+				if (f->read_pos < 0) f->read_pos = -2;
+			}
+			f->last_read_start = f->read_pos >= 0 ? f->read_pos : 0;
 			ssize_t r = read(fileno(f), &f->read_buf[f->offset], f->bufsiz - f->offset);
+			if (r > 0 && f->read_pos >= 0) {
+				f->read_pos += r;
+			}
 			if (r < 0) {
 				//fprintf(stderr, "error condition\n");
 				return r_out;
@@ -257,6 +284,7 @@ FILE * fopen(const char *path, const char *mode) {
 	out->offset = 0;
 	out->ungetc = -1;
 	out->eof = 0;
+	out->read_pos = -1;
 	out->_name = strdup(path);
 
 	out->write_buf = malloc(BUFSIZ);
@@ -285,6 +313,7 @@ FILE * freopen(const char *path, const char *mode, FILE * stream) {
 		stream->offset = 0;
 		stream->ungetc = -1;
 		stream->eof = 0;
+		stream->read_pos = -1;
 		stream->_name = strdup(path);
 		stream->written = 0;
 		if (stream != &_stdin && stream != &_stdout && stream != &_stderr) {
@@ -319,6 +348,7 @@ FILE * fdopen(int fd, const char *mode){
 	out->offset = 0;
 	out->ungetc = -1;
 	out->eof = 0;
+	out->read_pos = -1;
 
 	char tmp[30];
 	sprintf(tmp, "fd[%d]", fd);
@@ -387,11 +417,13 @@ int fseek(FILE * stream, long offset, int whence) {
 	stream->ungetc = -1;
 	stream->eof = 0;
 
-	int resp = syscall_seek(stream->fd,offset,whence);
+	long resp = syscall_seek(stream->fd,offset,whence);
 	if (resp < 0) {
 		errno = -resp;
+		stream->read_pos = -1;
 		return -1;
 	}
+	stream->read_pos = resp;
 	return 0;
 }
 
@@ -415,6 +447,7 @@ long ftell(FILE * stream) {
 		errno = -resp;
 		return -1;
 	}
+	stream->read_pos = resp;
 	return resp;
 }
 
@@ -103,6 +103,7 @@
 
 /* Includes {{{ */
 #include <syscall.h>
+#include <sys/mman.h>
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
@@ -132,6 +133,8 @@
 #define SKIP_MAX_LEVEL 6							/* We have a maximum of 6 levels in our skip lists. */
 
 #define BIN_MAGIC 0xDEFAD00D
+#define MAP_MAGIC 0xDEFAD00E						/* Big bins with a mapping of their own. */
+#define MMAP_THRESHOLD (256 * 1024)					/* Big allocations at least this large are mapped separately. */
 
 /* }}} */
 
@@ -602,6 +605,31 @@ static inline int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_
 
 /* }}} Stack */
 
+/* Mapped bins {{{ */
+
+/*
+ * Allocate a big bin backed by an anonymous mapping.
+ * These never enter the skip list; they are unmapped
+ * as soon as they are freed. Returns NULL if the
+ * mapping failed, so the caller can fall back to sbrk.
+ */
+static void * klmalloc_map(uintptr_t size) {
+	uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
+	struct mmap_args args = {NULL, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0};
+	long addr = syscall_mmap(&args);
+	if (addr < 0) return NULL;
+
+	klmalloc_big_bin_header * bin_header = (klmalloc_big_bin_header *)addr;
+	bin_header->bin_magic = MAP_MAGIC;
+	bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
+	bin_header->head = NULL;
+	bin_header->next = NULL;
+	bin_header->prev = NULL;
+	return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
+}
+
+/* }}} */
+
 /* malloc() {{{ */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 	/*
@@ -669,6 +697,14 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 		}
 		return item;
 	} else {
+		/*
+		 * Very big allocations get a mapping of their own, so
+		 * that freeing them gives the memory back to the system.
+		 */
+		if (size >= MMAP_THRESHOLD) {
+			void * mapped = klmalloc_map(size);
+			if (mapped) return mapped;
+		}
 		/*
 		 * Big bins.
 		 */
@@ -784,6 +820,14 @@ static void klfree(void *ptr) {
 	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
 	assert((uintptr_t)header % PAGE_SIZE == 0);
 
+	if (header->bin_magic == MAP_MAGIC) {
+		/*
+		 * Mapped bins go straight back to the system.
+		 */
+		syscall_munmap(header, header->size + sizeof(klmalloc_big_bin_header));
+		return;
+	}
+
 	if (header->bin_magic != BIN_MAGIC)
 		return;
 
@@ -935,7 +979,7 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	 * by aligning it to a page.
 	 */
 	klmalloc_bin_header * header_old = (void *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
-	if (header_old->bin_magic != BIN_MAGIC) {
+	if (header_old->bin_magic != BIN_MAGIC && header_old->bin_magic != MAP_MAGIC) {
 		assert(0 && "Bad magic on realloc.");
 		return NULL;
 	}
@@ -0,0 +1,10 @@
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/futex.h>
+
+DEFN_SYSCALL3(futex, SYS_FUTEX, volatile int *, int, int);
+
+int futex(volatile int * uaddr, int op, int val) {
+	__sets_errno(syscall_futex(uaddr, op, val));
+}
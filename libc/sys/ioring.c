@@ -0,0 +1,36 @@
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/ioring.h>
+
+DEFN_SYSCALL2(ioring_setup, SYS_IORING_SETUP, unsigned int, struct ioring *);
+DEFN_SYSCALL3(ioring_enter, SYS_IORING_ENTER, int, unsigned int, unsigned int);
+
+int ioring_setup(unsigned int entries, struct ioring * ring) {
+	__sets_errno(syscall_ioring_setup(entries, ring));
+}
+
+int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete) {
+	__sets_errno(syscall_ioring_enter(fd, to_submit, min_complete));
+}
+
+/* The next free submission entry, zeroed and already queued; fill it in before the next ioring_enter. */
+struct ioring_sqe * ioring_get_sqe(struct ioring * ring) {
+	uint32_t head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_tail - head >= ring->entries) return NULL;
+	struct ioring_sqe * sqe = &IORING_SQES(ring)[ring->sq_tail & (ring->entries - 1)];
+	__builtin_memset(sqe, 0, sizeof(struct ioring_sqe));
+	__atomic_store_n(&ring->sq_tail, ring->sq_tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/* The oldest completion not yet seen, or NULL if there isn't one. */
+struct ioring_cqe * ioring_peek_cqe(struct ioring * ring) {
+	uint32_t tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (ring->cq_head == tail) return NULL;
+	return &IORING_CQES(ring)[ring->cq_head & (ring->entries * 2 - 1)];
+}
+
+void ioring_cqe_seen(struct ioring * ring) {
+	__atomic_store_n(&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+}
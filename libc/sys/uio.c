@@ -0,0 +1,16 @@
+#include <unistd.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/uio.h>
+
+DEFN_SYSCALL3(readv,  SYS_READV,  int, const struct iovec *, int);
+DEFN_SYSCALL3(writev, SYS_WRITEV, int, const struct iovec *, int);
+
+ssize_t readv(int fd, const struct iovec * iov, int iovcnt) {
+	__sets_errno(syscall_readv(fd, iov, iovcnt));
+}
+
+ssize_t writev(int fd, const struct iovec * iov, int iovcnt) {
+	__sets_errno(syscall_writev(fd, iov, iovcnt));
+}
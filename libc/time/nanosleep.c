@@ -0,0 +1,10 @@
+#include <time.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+
+DEFN_SYSCALL2(nanosleep, SYS_NANOSLEEP, const void *, void *);
+
+int nanosleep(const struct timespec * req, struct timespec * rem) {
+	__sets_errno(syscall_nanosleep(req, rem));
+}
@@ -1,4 +1,8 @@
 #include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/ioctl.h>
 
 int fcntl(int fd, int cmd, ...) {
     switch (cmd) {
@@ -6,6 +10,15 @@ int fcntl(int fd, int cmd, ...) {
             return 0;
         case F_SETFD:
             return 0;
+        case F_GETPIPE_SZ:
+        case F_SETPIPE_SZ: {
+            /* Pipes take these as ioctls, with the size behind a pointer */
+            va_list args;
+            va_start(args, cmd);
+            int arg = cmd == F_SETPIPE_SZ ? va_arg(args, int) : 0;
+            va_end(args);
+            __sets_errno(ioctl(fd, cmd, &arg));
+        }
     }
     return -1;
 }
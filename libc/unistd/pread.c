@@ -0,0 +1,10 @@
+#include <unistd.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+
+DEFN_SYSCALL4(pread, SYS_PREAD, int, char *, size_t, long);
+
+ssize_t pread(int file, void *ptr, size_t len, off_t offset) {
+	__sets_errno(syscall_pread(file,ptr,len,offset));
+}
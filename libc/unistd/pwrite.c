@@ -0,0 +1,10 @@
+#include <unistd.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+
+DEFN_SYSCALL4(pwrite, SYS_PWRITE, int, char *, size_t, long);
+
+ssize_t pwrite(int file, const void *ptr, size_t len, off_t offset) {
+	__sets_errno(syscall_pwrite(file,(char *)ptr,len,offset));
+}
@@ -6,12 +6,12 @@
  * shared library dependencies.
  *
  * As of writing, this is a simplistic and not-fully-compliant
- * implementation of ELF dynamic linking. It suffers from a number
- * of issues, including not actually sharing libraries (there
- * isn't a sufficient mechanism in the kernel at the moment for
- * doing that - we need something with copy-on-write, preferably
- * an mmap-file mechanism), as well as not handling symbol
- * resolution correctly.
+ * implementation of ELF dynamic linking. Objects loaded at startup
+ * are mapped from their files with mmap, so their read-only pages
+ * are shared with other processes using the same libraries and
+ * only the pages that get touched are ever read; objects loaded
+ * with dlopen are still copied into the heap. It also doesn't
+ * handle symbol resolution correctly.
  *
  * However, it's sufficient for our purposes, and works well enough
  * to load Python C modules.
@@ -30,6 +30,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/sysfunc.h>
+#include <sys/mman.h>
 
 #include <kernel/elf.h>
 
@@ -109,6 +110,7 @@ typedef struct elf_object {
 	list_t * dependencies;
 
 	int loaded;
+	int mapped;
 
 } elf_t;
 
@@ -272,12 +274,74 @@ static size_t object_calculate_size(elf_t * object) {
 	return end_addr - base_addr;
 }
 
+/*
+ * Check if an object can be mapped from its file at this base.
+ * Each loadable segment needs to line up with its file offset,
+ * and no two segments can share a page, as each one gets its
+ * own mapping. Read-only segments can't have a bss, as there
+ * would be no way to clear the end of their last file page.
+ */
+static int object_can_map(elf_t * object, uintptr_t base) {
+	if (base & 0xFFF) return 0;
+
+	uintptr_t last_end = 0;
+	for (size_t i = 0; i < object->header.e_phnum; ++i) {
+		Elf64_Phdr phdr;
+		fseek(object->file, object->header.e_phoff + object->header.e_phentsize * i, SEEK_SET);
+		fread(&phdr, object->header.e_phentsize, 1, object->file);
+		if (phdr.p_type != PT_LOAD || !phdr.p_memsz) continue;
+
+		uintptr_t start = base + phdr.p_vaddr;
+		if ((start & 0xFFF) != (phdr.p_offset & 0xFFF)) return 0;
+		if ((start & ~0xFFFUL) < last_end) return 0;
+		if (!(phdr.p_flags & PF_W) && phdr.p_memsz > phdr.p_filesz) return 0;
+		last_end = (start + phdr.p_memsz + 0xFFF) & ~0xFFFUL;
+	}
+
+	return 1;
+}
+
+/* Map one segment of an object from its file; returns 0 on success */
+static int object_map_segment(elf_t * object, uintptr_t base, Elf64_Phdr * phdr) {
+	uintptr_t start    = (base + phdr->p_vaddr) & ~0xFFFUL;
+	uintptr_t file_end = base + phdr->p_vaddr + phdr->p_filesz;
+	uintptr_t mem_end  = base + phdr->p_vaddr + phdr->p_memsz;
+	uintptr_t page_end = phdr->p_filesz ? (file_end + 0xFFF) & ~0xFFFUL : start;
+
+	int prot = PROT_READ;
+	if (phdr->p_flags & PF_W) prot |= PROT_WRITE;
+	if (phdr->p_flags & PF_X) prot |= PROT_EXEC;
+
+	if (phdr->p_filesz) {
+		void * addr = mmap((void *)start, file_end - start, prot, MAP_PRIVATE | MAP_FIXED,
+			fileno(object->file), phdr->p_offset & ~0xFFFUL);
+		if (addr == MAP_FAILED) return 1;
+
+		/* The rest of the last page holds whatever follows the segment in the file */
+		if (mem_end > file_end) {
+			memset((void *)file_end, 0, (mem_end < page_end ? mem_end : page_end) - file_end);
+		}
+	}
+
+	/* Anything past that is bss */
+	if (mem_end > page_end) {
+		void * addr = mmap((void *)page_end, mem_end - page_end, prot, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) {
+			munmap((void *)start, page_end - start);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 /* Load an object into memory */
-static uintptr_t object_load(elf_t * object, uintptr_t base) {
+static uintptr_t object_load(elf_t * object, uintptr_t base, int use_mmap) {
 
 	uintptr_t end_addr = 0x0;
 
 	object->base = base;
+	object->mapped = use_mmap && object_can_map(object, base);
 
 	size_t headers = 0;
 	while (headers < object->header.e_phnum) {
@@ -289,6 +353,12 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 
 		switch (phdr.p_type) {
 			case PT_LOAD:
+				if (object->mapped && !object_map_segment(object, base, &phdr)) {
+					if (end_addr < phdr.p_vaddr + base + phdr.p_memsz) {
+						end_addr = phdr.p_vaddr + base + phdr.p_memsz;
+					}
+					break;
+				}
 				{
 					/* Request memory to load this PHDR into */
 					char * args[] = {(char *)(base + phdr.p_vaddr), (char *)phdr.p_memsz};
@@ -327,6 +397,24 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 	return end_addr;
 }
 
+/*
+ * Make the read-only segments of a mapped object writable, for
+ * objects with relocations in their text. Written pages are
+ * copied, so other users of the object are not affected.
+ */
+static void object_unprotect(elf_t * object) {
+	for (size_t i = 0; i < object->header.e_phnum; ++i) {
+		Elf64_Phdr phdr;
+		fseek(object->file, object->header.e_phoff + object->header.e_phentsize * i, SEEK_SET);
+		fread(&phdr, object->header.e_phentsize, 1, object->file);
+		if (phdr.p_type != PT_LOAD || (phdr.p_flags & PF_W) || !phdr.p_memsz) continue;
+
+		uintptr_t start = (object->base + phdr.p_vaddr) & ~0xFFFUL;
+		uintptr_t end = object->base + phdr.p_vaddr + phdr.p_memsz;
+		mprotect((void *)start, end - start, PROT_READ | PROT_WRITE | PROT_EXEC);
+	}
+}
+
 /* Perform cleanup after loading */
 static int object_postload(elf_t * object) {
 
@@ -360,6 +448,9 @@ static int object_postload(elf_t * object) {
 				case DT_INIT_ARRAYSZ: /* DT_INIT_ARRAYSZ - size of the table of constructors */
 					object->init_array_size = table->d_un.d_val / sizeof(uintptr_t);
 					break;
+				case DT_TEXTREL: /* DT_TEXTREL - relocations will write to read-only segments */
+					if (object->mapped) object_unprotect(object);
+					break;
 			}
 			table++;
 		}
@@ -624,7 +715,7 @@ static void * do_actual_load(const char * filename, elf_t * lib, int flags) {
 	 * but we don't have the functionality available.
 	 */
 	uintptr_t load_addr = (uintptr_t)malloc(lib_size);
-	object_load(lib, load_addr);
+	object_load(lib, load_addr, 0);
 
 	/* Perform cleanup steps */
 	object_postload(lib);
@@ -708,7 +799,7 @@ static elf_t * preload(hashmap_t * libs, list_t * load_libs, char * lib_name) {
 	}
 
 	/* Load PHDRs */
-	end_addr = object_load(lib, end_addr);
+	end_addr = object_load(lib, end_addr, 1);
 
 	/* Extract information */
 	object_postload(lib);
@@ -854,7 +945,7 @@ int main(int argc, char * argv[]) {
 	}
 
 	/* Load the main object */
-	end_addr = object_load(main_obj, 0x0);
+	end_addr = object_load(main_obj, 0x0, 1);
 	object_postload(main_obj);
 	object_find_copy_relocations(main_obj);
 
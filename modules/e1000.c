@@ -2,6 +2,14 @@
  * @file kernel/net/e1000.c
  * @brief Intel Gigabit Ethernet device driver
  *
+ * Received frames are handed to the network stack straight out of the
+ * descriptor ring's buffers, which are allocated once and given back to
+ * the card as soon as the stack is done with them. The interrupt only
+ * wakes the receive thread; that thread masks receive interrupts and
+ * polls the ring, a bounded number of frames at a time, until it is
+ * empty. The card is also told to hold off interrupts for a while after
+ * each one, so a busy link costs far fewer than one per frame.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -18,6 +26,7 @@
 #include <kernel/spinlock.h>
 #include <kernel/time.h>
 #include <kernel/vfs.h>
+#include <kernel/procfs.h>
 #include <kernel/mod/net.h>
 #include <kernel/net/netif.h>
 #include <kernel/net/eth.h>
@@ -31,6 +40,17 @@
 #include <net/if.h>
 
 #define INTS ((1 << 2) | (1 << 6) | (1 << 7) | (1 << 1) | (1 << 0))
+#define RX_INTS (ICR_RXO | ICR_RXT0)
+
+/* Frames handled per pass over the ring before giving up the CPU */
+#define E1000_RX_BUDGET 32
+
+/* At most ~8000 interrupts a second: ITR counts in 256ns units */
+#define E1000_ITR_INTERVAL 488
+/* Hold off the receive interrupt until 32us pass without a frame,
+ * but never more than 128us after the first; both in 1.024us units */
+#define E1000_RX_DELAY     32
+#define E1000_RX_ABS_DELAY 128
 
 struct e1000_nic {
 	struct EthernetDevice eth;
@@ -44,12 +64,22 @@ struct e1000_nic {
 	int tx_index;
 	int link_status;
 
-	spin_lock_t net_queue_lock;
 	spin_lock_t alert_lock;
 	spin_lock_t tx_lock;
-	list_t * net_queue;
 	list_t * rx_wait;
 	list_t * alert_wait;
+	volatile int rx_pending;
+
+	/* Counters for /proc/e1000 */
+	volatile uint64_t rx_packets;
+	volatile uint64_t rx_bytes;
+	volatile uint64_t interrupts;
+	volatile uint64_t rx_polls;
+	uint64_t rate_time;
+	uint64_t rate_packets;
+	uint64_t rate_interrupts;
+	uint64_t packets_per_second;
+	uint64_t interrupts_per_second;
 
 	uint8_t * rx_virt[E1000_NUM_RX_DESC];
 	uint8_t * tx_virt[E1000_NUM_TX_DESC];
@@ -84,26 +114,6 @@ static void delay_yield(size_t subticks) {
 	switch_task(0);
 }
 
-static void enqueue_packet(struct e1000_nic * device, void * buffer) {
-	spin_lock(device->net_queue_lock);
-	list_insert(device->net_queue, buffer);
-	spin_unlock(device->net_queue_lock);
-}
-
-static struct ethernet_packet * dequeue_packet(struct e1000_nic * device) {
-	while (!device->net_queue->length) {
-		sleep_on(device->rx_wait);
-	}
-
-	spin_lock(device->net_queue_lock);
-	node_t * n = list_dequeue(device->net_queue);
-	void* value = n->value;
-	free(n);
-	spin_unlock(device->net_queue_lock);
-
-	return value;
-}
-
 static int eeprom_detect(struct e1000_nic * device) {
 
 	/* Definitely not */
@@ -187,33 +197,10 @@ static void e1000_handle(struct e1000_nic * nic, uint32_t status) {
 		/* transmit descriptor written */
 	}
 
-	if (status & (ICR_RXO | ICR_RXT0)) {
-		/* Packet received. */
-		do {
-			nic->rx_index = read_command(nic, E1000_REG_RXDESCTAIL);
-			if (nic->rx_index == (int)read_command(nic, E1000_REG_RXDESCHEAD)) return;
-			nic->rx_index = (nic->rx_index + 1) % E1000_NUM_RX_DESC;
-			if (nic->rx[nic->rx_index].status & 0x01) {
-				uint8_t * pbuf = (uint8_t *)nic->rx_virt[nic->rx_index];
-				uint16_t  plen = nic->rx[nic->rx_index].length;
-
-				void * packet = malloc(8192);
-				if (plen > 8192) {
-					printf("??? plen is too big\n");
-				}
-				memcpy(packet, pbuf, plen);
-
-				nic->rx[nic->rx_index].status = 0;
-
-				enqueue_packet(nic, packet);
-
-				write_command(nic, E1000_REG_RXDESCTAIL, nic->rx_index);
-			} else {
-				break;
-			}
-		} while (1);
+	if (status & RX_INTS) {
+		/* Packet received; the receive thread will collect it. */
+		nic->rx_pending = 1;
 		wakeup_queue(nic->rx_wait);
-		e1000_alert_waiters(nic);
 	}
 }
 
@@ -225,14 +212,12 @@ static int irq_handler(struct regs *r) {
 		if (devices[i]->irq_number == irq) {
 			uint32_t status = read_command(devices[i], E1000_REG_ICR);
 			if (status) {
-				write_command(devices[i], 0x00D8,INTS);
+				devices[i]->interrupts++;
 				e1000_handle(devices[i], status);
-				read_command(devices[i], E1000_REG_ICR);
 				if (!handled) {
 					handled = 1;
 					irq_ack(irq);
 				}
-				write_command(devices[i], 0x00D0,INTS);
 			}
 		}
 	}
@@ -240,6 +225,46 @@ static int irq_handler(struct regs *r) {
 	return handled;
 }
 
+static int rx_ready(struct e1000_nic * nic) {
+	return nic->rx[nic->rx_index].status & 0x01;
+}
+
+/**
+ * @brief Pass up to @p budget received frames to the network stack.
+ *
+ * Frames are handled in place in their receive buffers; nothing in the
+ * stack holds on to a frame after net_eth_handle returns, so each buffer
+ * goes back to the card as soon as that happens.
+ *
+ * @returns how many frames were handled
+ */
+static int e1000_rx_poll(struct e1000_nic * nic, int budget) {
+	int done = 0;
+	int frames = 0;
+	int last = -1;
+
+	while (done < budget && rx_ready(nic)) {
+		struct e1000_rx_desc * desc = &nic->rx[nic->rx_index];
+		if (desc->status & 0x02) {
+			/* Only whole frames fit in our buffers, so this is the end of one */
+			nic->rx_bytes += desc->length;
+			frames++;
+			net_eth_handle((struct ethernet_packet *)nic->rx_virt[nic->rx_index], nic->eth.device_node);
+		}
+		desc->status = 0;
+		last = nic->rx_index;
+		nic->rx_index = (nic->rx_index + 1) % E1000_NUM_RX_DESC;
+		done++;
+	}
+
+	if (last != -1) {
+		write_command(nic, E1000_REG_RXDESCTAIL, last);
+		nic->rx_packets += frames;
+	}
+
+	return done;
+}
+
 static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payload_size) {
 	spin_lock(device->tx_lock);
 	device->tx_index = read_command(device, E1000_REG_TXDESCTAIL);
@@ -357,7 +382,7 @@ static ssize_t write_e1000(fs_node_t *node, off_t offset, size_t size, uint8_t *
 
 static int check_e1000(fs_node_t *node) {
 	struct e1000_nic * nic = node->device;
-	return nic->net_queue->head ? 0 : 1;
+	return rx_ready(nic) ? 0 : 1;
 }
 
 static int wait_e1000(fs_node_t *node, void * process) {
@@ -366,19 +391,107 @@ static int wait_e1000(fs_node_t *node, void * process) {
 	if (!list_find(nic->alert_wait, process)) {
 		list_insert(nic->alert_wait, process);
 	}
-	list_insert(((process_t *)process)->node_waits, nic->eth.device_node);
+	process_add_node_wait(process, nic->eth.device_node);
 	spin_unlock(nic->alert_lock);
 	return 0;
 }
 
+static void unwait_e1000(fs_node_t *node, void * process) {
+	struct e1000_nic * nic = node->device;
+	spin_lock(nic->alert_lock);
+	node_t * n = list_find(nic->alert_wait, process);
+	if (n) {
+		list_delete(nic->alert_wait, n);
+		free(n);
+	}
+	spin_unlock(nic->alert_lock);
+}
+
 static void e1000_process(void * data) {
 	struct e1000_nic * nic = data;
 	while (1) {
-		struct ethernet_packet * packet = dequeue_packet(nic);
-		net_eth_handle(packet, nic->eth.device_node);
+		/* Receive interrupts stay off while there is anything to poll */
+		write_command(nic, E1000_REG_IMC, RX_INTS);
+		nic->rx_pending = 0;
+		nic->rx_polls++;
+
+		int done = e1000_rx_poll(nic, E1000_RX_BUDGET);
+		if (done) e1000_alert_waiters(nic);
+
+		if (done == E1000_RX_BUDGET) {
+			/* Probably more waiting; let everyone else have a turn first */
+			switch_task(1);
+			continue;
+		}
+
+		/* Caught up. Frames that arrive after the unmask will interrupt;
+		 * anything that slipped in just before it is checked for here. */
+		write_command(nic, E1000_REG_IMS, RX_INTS);
+		if (rx_ready(nic) || nic->rx_pending) continue;
+		sleep_on(nic->rx_wait);
+	}
+}
+
+static ssize_t e1000_proc_func(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	char * buf = malloc(512 * (device_count + 1));
+	char * o = buf;
+	*o = '\0';
+
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	uint64_t now_ms = (uint64_t)s * 1000 + ss / (SUBTICKS_PER_TICK / 1000);
+
+	for (int i = 0; i < device_count; ++i) {
+		struct e1000_nic * nic = devices[i];
+
+		/* Rates are over the time since they were last worked out, so
+		 * reading this twice a few seconds apart gives a fresh figure. */
+		uint64_t packets = nic->rx_packets;
+		uint64_t interrupts = nic->interrupts;
+		if (now_ms - nic->rate_time >= 1000) {
+			uint64_t elapsed = now_ms - nic->rate_time;
+			nic->packets_per_second = (packets - nic->rate_packets) * 1000 / elapsed;
+			nic->interrupts_per_second = (interrupts - nic->rate_interrupts) * 1000 / elapsed;
+			nic->rate_time = now_ms;
+			nic->rate_packets = packets;
+			nic->rate_interrupts = interrupts;
+		}
+
+		o += snprintf(o, 512,
+			"%s:\n"
+			"RxPackets:\t%lu\n"
+			"RxBytes:\t%lu\n"
+			"Interrupts:\t%lu\n"
+			"Polls:\t%lu\n"
+			"PacketsPerSecond:\t%lu\n"
+			"InterruptsPerSecond:\t%lu\n",
+			nic->eth.if_name,
+			(unsigned long)packets,
+			(unsigned long)nic->rx_bytes,
+			(unsigned long)interrupts,
+			(unsigned long)nic->rx_polls,
+			(unsigned long)nic->packets_per_second,
+			(unsigned long)nic->interrupts_per_second);
 	}
+
+	size_t _bsize = strlen(buf);
+	if ((size_t)offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - (size_t)offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
 }
 
+static struct procfs_entry e1000_entry = {
+	0,
+	"e1000",
+	e1000_proc_func,
+};
+
 static void e1000_init(struct e1000_nic * nic) {
 	uint32_t e1000_device_pci = nic->pci_device;
 
@@ -388,11 +501,11 @@ static void e1000_init(struct e1000_nic * nic) {
 		switch_task(0);
 	}
 	nic->rx = mmu_map_from_physical(nic->rx_phys); //mmu_map_mmio_region(nic->rx_phys, 4096);
-	nic->tx_phys = nic->rx_phys + 512;
+	nic->tx_phys = nic->rx_phys + E1000_NUM_RX_DESC * sizeof(struct e1000_rx_desc);
 	nic->tx = mmu_map_from_physical(nic->tx_phys); //mmu_map_mmio_region(nic->tx_phys, 4096);
 
+	/* Both rings share this page */
 	memset(nic->rx, 0, 4096);
-	memset(nic->tx, 0, 4096);
 
 	/* Allocate buffers */
 	for (int i = 0; i < E1000_NUM_RX_DESC; ++i) {
@@ -401,10 +514,9 @@ static void e1000_init(struct e1000_nic * nic) {
 			printf("e1000[%s]: unable to allocate memory for receive buffer\n", nic->eth.if_name);
 			switch_task(0);
 		}
-		//nic->rx_virt[i] = mmu_map_from_physical(nic->rx[i].addr);
-		nic->rx_virt[i] = mmu_map_mmio_region(nic->rx[i].addr, 8192);
-		mmu_frame_allocate(mmu_get_page((uintptr_t)nic->rx_virt[i],0),MMU_FLAG_WRITABLE|MMU_FLAG_WC);
-		mmu_frame_allocate(mmu_get_page((uintptr_t)nic->rx_virt[i]+4096,0),MMU_FLAG_WRITABLE|MMU_FLAG_WC);
+		/* The stack reads frames from here directly, so keep it cacheable;
+		 * the frames are contiguous, so the physical mapping covers both. */
+		nic->rx_virt[i] = mmu_map_from_physical(nic->rx[i].addr);
 		nic->rx[i].status = 0;
 	}
 
@@ -478,7 +590,6 @@ static void e1000_init(struct e1000_nic * nic) {
 	write_command(nic, E1000_REG_CTRL, status);
 	delay_yield(10000);
 
-	nic->net_queue = list_create("e1000 net queue", nic);
 	nic->rx_wait = list_create("e1000 rx sem", nic);
 	nic->alert_wait = list_create("e1000 select waiters", nic);
 
@@ -494,13 +605,18 @@ static void e1000_init(struct e1000_nic * nic) {
 		read_command(nic, 0x4000 + i * 4);
 	}
 
+	/* Interrupt moderation */
+	write_command(nic, E1000_REG_ITR, E1000_ITR_INTERVAL);
+	write_command(nic, E1000_REG_RDTR, E1000_RX_DELAY);
+	write_command(nic, E1000_REG_RADV, E1000_RX_ABS_DELAY);
+
 	init_rx(nic);
 	init_tx(nic);
 
 	/* Twiddle interrupts */
-	write_command(nic, 0x00D0, 0xFFFFFFFF);
-	write_command(nic, 0x00D8, 0xFFFFFFFF);
-	write_command(nic, 0x00D0, INTS);
+	write_command(nic, E1000_REG_IMS, 0xFFFFFFFF);
+	write_command(nic, E1000_REG_IMC, 0xFFFFFFFF);
+	write_command(nic, E1000_REG_IMS, INTS);
 	delay_yield(10000);
 
 	nic->link_status = (read_command(nic, E1000_REG_STATUS) & (1 << 1));
@@ -513,6 +629,7 @@ static void e1000_init(struct e1000_nic * nic) {
 	nic->eth.device_node->write = write_e1000;
 	nic->eth.device_node->selectcheck = check_e1000;
 	nic->eth.device_node->selectwait  = wait_e1000;
+	nic->eth.device_node->pollunwait  = unwait_e1000;
 	nic->eth.device_node->device = nic;
 
 	nic->eth.mtu = 1500; /* guess */
@@ -551,6 +668,7 @@ static int e1000_install(int argc, char * argv[]) {
 		return -ENODEV;
 	}
 
+	procfs_install(&e1000_entry);
 	return 0;
 }
 